@@ -9,14 +9,25 @@
  * - Result transformation
  * - Query normalization
  * - JSON parsing and generation
+ * - Worker thread pool (bounded accept queue)
+ * - Optional epoll event loop (non-blocking client + upstream sockets)
+ * - Optional io_uring backend for the same event loop (multishot accept/recv, provided buffers)
+ * - Prometheus-style /metrics (per-stage latency histograms)
+ * - SIMD text kernels (SSE2/AVX2, NEON) for escaping, URL encoding and UTF-8
+ * - Memory-mapped page title index (lkb-index) answering page-name queries
+ * - Optional multi-process mode (SO_REUSEPORT listener per process, supervisor restarts)
  */
 
+#define _GNU_SOURCE
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <unistd.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <arpa/inet.h>
 #include <netdb.h>
 #include <ctype.h>
@@ -25,10 +36,42 @@
 #include <signal.h>
 #include <sys/stat.h>
 #include <fcntl.h>
+#include <errno.h>
+#include <pthread.h>
+#include <poll.h>
+#include <sys/epoll.h>
+#include <stdint.h>
+#include <sys/resource.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <sys/prctl.h>
+#include <sys/file.h>
+#include <sys/eventfd.h>
+#include <sched.h>
+#include <stdarg.h>
+#include <stddef.h>
+#if defined(__x86_64__) && !defined(LKB_NO_SIMD)
+#include <immintrin.h>
+#elif defined(__aarch64__) && !defined(LKB_NO_SIMD)
+#include <arm_neon.h>
+#endif
+/* io_uring은 커널 헤더만 사용 (liburing 없음). multishot recv가 있는 6.0 이상 헤더에서만,
+ * 없으면 lkb.io_mode: io_uring은 epoll로 동작 */
+#if !defined(LKB_NO_IO_URING) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#endif
+#endif
+#if defined(IORING_RECV_MULTISHOT) && defined(__NR_io_uring_setup)
+#define LKB_IO_URING 1
+#endif
 
 #ifdef DEBUG
 #define LOG_FILE "02_search.log"
 #define REQUEST_LOG_FILE "01_fromrequest.log"
+#define RAW_REQUEST_LOG_FILE "00_raw_request.log"
 #endif
 
 #define BUFFER_SIZE 2097152  /* 2MB buffer for large responses */
@@ -37,22 +80,175 @@
 #define MAX_RESULTS 50
 #define MAX_CONFIG_LINE 512
 #define MAX_SNIPPET_LEN 200
+#define JSON_MAX_DEPTH 64
 #define DEFAULT_PORT 7777
 #define DEFAULT_SEARCH_COUNT 5
+#define DEFAULT_WORKERS 8
+#define DEFAULT_QUEUE_SIZE 256
+#define DEFAULT_BACKLOG 128
+#define MAX_WORKERS 256
+#define MAX_PROCESSES 64
+#define SUPERVISOR_POLL_MS 100         /* 감독 프로세스가 종료된 워커/시그널을 확인하는 간격 */
+#define SUPERVISOR_MIN_UPTIME 5        /* 이보다 빨리 죽은 워커는 재시작을 늦춤 (초) */
+#define SUPERVISOR_MAX_RESTART_DELAY 30
+#define SUPERVISOR_STOP_TIMEOUT 10     /* 종료 시 워커를 기다리는 시간, 넘으면 SIGKILL (초) */
+#define DEFAULT_MAX_CONNECTIONS 4096
+#define MAX_HEADER_SIZE 16384
+#define RESPONSE_HEADER_SIZE 512   /* 응답 헤더 버퍼 */
+#define EPOLL_MAX_EVENTS 256
+#define EPOLL_SPARE_CONNECTIONS 64  /* 버퍼째 재사용하려고 남겨두는 닫힌 연결 수 */
+#define RING_ENTRIES 1024           /* io_uring SQ 크기 (CQ는 4배) */
+#define RING_BUFFER_SIZE 16384      /* io_uring recv용 등록 버퍼 하나 (업스트림 recv chunk와 같음) */
+#define RING_BUFFER_COUNT 256       /* io_uring 등록 버퍼 수 (2의 거듭제곱) */
+#define RING_DRAIN_MS 1000          /* 종료 시 닫은 소켓에 걸린 io_uring 요청을 기다리는 최대 시간 */
+#define DEFAULT_KEEPALIVE_TIMEOUT 5
+#define DEFAULT_KEEPALIVE_MAX_REQUESTS 100
+#define DEFAULT_STREAM_MIN_COUNT 20
+#define MAX_POOL_SIZE 256
+#define DEFAULT_POOL_SIZE 32
+#define DEFAULT_POOL_IDLE_TIMEOUT 30
+#define DEFAULT_CACHE_MAX_BYTES (64 * 1024 * 1024)
+#define DEFAULT_CACHE_TTL 300
+#define DEFAULT_LINK_CACHE_BYTES (4 * 1024 * 1024)
+#define LINK_CACHE_SHARDS 16              /* link 캐시 샤드 수 (2의 거듭제곱) */
+#define LINK_CACHE_ENTRY_ESTIMATE 128     /* 버킷 수 계산용 항목 하나 평균 크기 */
+#define MAX_CACHE_KEY_LEN (MAX_QUERY_LEN + 256)
+#define FLIGHT_BUCKETS 256                /* 진행 중 검색 해시 버킷 수 (2의 거듭제곱) */
+#define ARENA_CHUNK_SIZE 65536            /* 요청 arena 기본 청크 크기 */
+#define SCRATCH_RETAIN_SIZE (4 * 1024 * 1024) /* 요청 후에도 유지할 버퍼/arena 최대 크기 */
+#define TEMPLATE_FILE "rule_manticore.txt"
+#define METRICS_BUCKET_COUNT 15           /* 지연 히스토그램 버킷 수 (+Inf 제외) */
+#define LOG_RING_SLOTS 4096               /* 로그 링 버퍼 슬롯 수 (2의 거듭제곱) */
+#define LOG_LINE_MAX 1024                 /* 로그 한 줄 최대 길이 (넘으면 잘림) */
+#define LOG_IDLE_NS 2000000               /* 링이 비었을 때 기록 스레드 대기 (2ms) */
+#define DEFAULT_LOG_PAYLOAD_MAX 512       /* 요청/응답 본문 로그 최대 바이트 */
+#define CAPTURE_MAGIC "LKBCAP01"          /* 트래픽 캡처 파일 시작 8바이트 */
+#define CAPTURE_VERSION 1
+#define CAPTURE_BUFFER_MAX (8 * 1024 * 1024) /* 기록 스레드가 쓰기 전까지 쌓아 두는 캡처 최대 바이트 (넘으면 버림) */
+#define CAPTURE_FLUSH_BYTES 65536         /* 캡처가 이만큼 쌓이면 쓰기 */
+#define CAPTURE_FLUSH_US 200000           /* 덜 쌓여도 이 간격마다 쓰기 */
+#define DEFAULT_RRF_K 60                  /* Reciprocal Rank Fusion 상수 */
+#define UPSTREAM_DRAIN_MAX 65536          /* 결과를 다 얻은 뒤 남은 바디가 이하면 읽어 버리고 연결 재사용 */
+#define DEFAULT_SNIPPET_SCAN_MAX 65536    /* 매칭 스니펫: old_text를 이만큼까지만 훑음 */
+#define SNIPPET_SCAN_CHUNK 4096           /* 매칭 스니펫: 한 번에 unescape 하는 바이트 */
+#define MAX_SNIPPET_TERMS 8               /* 매칭 스니펫: 찾아볼 쿼리 단어 수 */
+#define DEFAULT_CONNECT_TIMEOUT_MS 500    /* Manticore 연결 deadline */
+#define DEFAULT_FIRST_BYTE_TIMEOUT_MS 3000 /* 호출 시작 → 첫 응답 바이트 deadline */
+#define DEFAULT_UPSTREAM_TIMEOUT_MS 5000  /* 호출 전체 deadline */
+#define DEFAULT_CACHE_STALE_TTL 3600      /* ttl이 지난 캐시 항목을 차단기 대체 응답용으로 더 보관 (초) */
+#define DEFAULT_CACHE_NEGATIVE_TTL 30     /* 결과 0건인 검색을 캐시하는 시간 (초) */
+#define CACHE_REFRESH_QUEUE 64            /* soft_ttl이 지나 다시 검색할 캐시 항목 대기열 (MAX_BATCH_SEARCHES 이하) */
+#define DEFAULT_BREAKER_ERROR_RATE 50     /* 차단기: 창 안의 실패 비율(%)이 이상이면 열림 */
+#define DEFAULT_BREAKER_MIN_REQUESTS 10   /* 차단기: 창 안의 호출이 이보다 적으면 판단 안 함 */
+#define DEFAULT_BREAKER_WINDOW 10         /* 차단기: 실패율 집계 창 (초) */
+#define DEFAULT_BREAKER_COOLDOWN 5        /* 차단기: 열린 뒤 복구 확인까지 대기 (초) */
+#define BREAKER_PROBE_QUERY "lkb_probe"   /* 차단기 복구 확인용 검색어 */
+#define DEFAULT_ADMISSION_MAX_IN_FLIGHT 64  /* admission: 동시 Manticore 검색 상한의 최댓값 (시작값) */
+#define DEFAULT_ADMISSION_MIN_IN_FLIGHT 4   /* admission: 상한을 이보다 낮추지 않음 */
+#define DEFAULT_ADMISSION_QUEUE_TIMEOUT_MS 100 /* admission: 요청 도착부터 슬롯을 기다리는 최대 시간 */
+#define DEFAULT_ADMISSION_RETRY_AFTER 1     /* admission: 503 응답의 Retry-After (초) */
+#define ADMISSION_BACKOFF 0.9               /* admission: 실패/지연 시 상한에 곱하는 값 */
+#define ADMISSION_BACKOFF_INTERVAL_US 100000 /* admission: 상한은 이 간격에 한 번만 낮춤 (동시에 끝난 실패를 한 번으로) */
+#define MAX_BACKENDS 8                    /* engine.url에 적을 수 있는 Manticore replica 수 */
+#define DEFAULT_HEALTH_CHECK_INTERVAL 5   /* 정상인 replica도 이 간격(초)으로 확인 호출 */
+#define DEFAULT_HEDGE_MIN_MS 20           /* hedge: p95가 이보다 짧아도 이만큼은 기다림 */
+#define LATENCY_RING_SLOTS 256            /* hedge: p95를 계산하는 최근 호출 수 */
+#define HEDGE_MIN_SAMPLES 32              /* hedge: 이만큼 호출이 쌓이기 전에는 hedge 안 함 */
+#define UPSTREAM_SLOTS (MAX_QUERIES * 2)  /* 쿼리마다 첫 호출 + 다른 replica로 보내는 두 번째 호출 */
+#define DEFAULT_QUERY_MAX_TOKENS 16       /* 정규화: 쿼리에 남기는 최대 단어 수 */
+#define MAX_STOPWORDS 256                 /* query.stopwords에 적을 수 있는 단어 수 */
+#define TITLE_INDEX_MAGIC "LKBTIDX2"        /* 제목 색인 파일 시작 8바이트 (2: 항목에 스니펫) */
+#define DEFAULT_TITLE_INDEX_MIN_PREFIX 3  /* 제목 색인: 이보다 짧은 쿼리는 정확히 같은 제목만 */
+#define MAX_BATCH_SEARCHES 64             /* POST /search/batch 한 번에 처리하는 검색 수 (넘는 항목은 무시) */
+#define CONFIG_CHECK_INTERVAL 1           /* config.yaml / 템플릿 변경 확인 간격 (초) */
+#define CONFIG_GRACE_POLL_US 1000         /* 이전 설정 스냅샷을 잡은 요청이 끝났는지 확인하는 간격 */
+
+/* 로그 레벨 (log.level) */
+typedef enum {
+    LOG_LEVEL_ERROR,
+    LOG_LEVEL_WARN,
+    LOG_LEVEL_INFO,
+    LOG_LEVEL_DEBUG
+} LogLevel;
+
+/* engine.url의 replica 하나 */
+typedef struct {
+    char host[128];
+    int port;
+    char path[64];
+} UpstreamAddress;
 
 /* 설정 구조체 */
 typedef struct {
     char listen[64];
     int port;
+    int workers;        /* 요청 처리 워커 스레드 수 (프로세스마다) */
+    int processes;      /* 워커 프로세스 수 (1 = 감독 프로세스 없이 단일 프로세스) */
+    bool cpu_affinity;  /* processes > 1: 워커 프로세스마다 CPU 하나에 고정 */
+    int queue_size;     /* accept → 워커 전달 큐 크기 */
+    int backlog;        /* listen() backlog */
+    char io_mode[16];   /* "threads" (기본), "epoll" 또는 "io_uring" */
+    int max_connections; /* epoll/io_uring 모드 동시 연결 상한 */
+    int keepalive_timeout;      /* 다음 요청 대기 시간 (초), 0이면 keep-alive 끔 */
+    int keepalive_max_requests; /* 연결당 최대 요청 수 */
+    bool compact_json;          /* 응답 JSON 공백 제거 */
+    bool stream_results;        /* threads 모드: 결과를 파싱되는 대로 chunked로 보냄 */
+    int stream_min_count;       /* 이 count 이상인 검색만 스트리밍 */
     char engine_type[32];
-    char engine_url[256];
-    char manticore_host[128];
-    int manticore_port;
-    char manticore_path[64];
+    char engine_url[MAX_CONFIG_LINE]; /* replica 목록 (쉼표로 구분) */
+    UpstreamAddress backends[MAX_BACKENDS]; /* engine_url을 나눈 결과 */
+    int backend_count;
+    int health_check_interval; /* 정상인 replica 확인 간격 (초, 0 = 안 함) */
+    bool hedge;               /* 첫 호출이 p95 안에 끝나지 않으면 다른 replica에도 보냄 */
+    int hedge_min_ms;         /* hedge 전 최소 대기 */
     char index_name[128];
+    char template_file[256];  /* Manticore 요청 템플릿 경로 */
     char base_url[256];
     int search_count;
     int snippet_length;
+    char snippet_mode[16];    /* "match" (쿼리 단어 주변) 또는 "head" (본문 앞부분) */
+    size_t snippet_scan_max;  /* match 모드에서 old_text를 훑는 최대 바이트 */
+    int pool_size;          /* Manticore keep-alive 유휴 연결 상한 */
+    int pool_idle_timeout;  /* 유휴 연결 유지 시간 (초) */
+    size_t max_response_size; /* Manticore 응답 바디 상한 (바이트) */
+    int connect_timeout_ms;   /* 연결 deadline (0 = 없음) */
+    int first_byte_timeout_ms; /* 호출 시작 → 첫 응답 바이트 deadline (0 = 없음) */
+    int timeout_ms;           /* 호출 전체 deadline (0 = 없음), epoll 합치기 대기 상한 (0이면 기본값) */
+    int fanout_queries;       /* "queries" 중 동시에 검색할 개수 (1 = 첫 쿼리만) */
+    int rrf_k;                /* fan-out 결과 병합 순위 상수 */
+    bool coalesce;            /* 같은 검색이 진행 중이면 그 결과를 나눠 받음 */
+    bool cache_enabled;       /* 검색 결과 캐시 사용 */
+    size_t cache_max_bytes;   /* 캐시 용량 (바이트) */
+    int cache_ttl;            /* 캐시 유효 시간 (초) */
+    int cache_stale_ttl;      /* ttl 이후 차단기 대체 응답용으로 보관하는 시간 (초) */
+    int cache_soft_ttl;       /* 이 시간이 지난 항목은 바로 응답하고 백그라운드에서 다시 검색 (0 = 안 함) */
+    int cache_negative_ttl;   /* 결과 0건인 검색을 캐시하는 시간 (0 = 캐시 안 함) */
+    size_t link_cache_bytes;  /* page_title → link 캐시 용량 (0 = 사용 안 함) */
+    bool base_url_plain;      /* base_url에 JSON escape할 문자가 없음 (load_config에서 계산) */
+    bool breaker_enabled;     /* Manticore 실패율이 높으면 호출하지 않고 바로 응답 */
+    int breaker_error_rate;   /* 열리는 실패 비율 (%) */
+    int breaker_min_requests; /* 판단에 필요한 창 안의 최소 호출 수 */
+    int breaker_window;       /* 실패율 집계 창 (초) */
+    int breaker_cooldown;     /* 열린 뒤 복구 확인 간격 (초) */
+    bool admission_enabled;   /* Manticore를 부르는 동시 검색 수 제한, 못 받으면 503 */
+    int admission_max_in_flight; /* 적응형 상한의 최댓값 (시작값) */
+    int admission_min_in_flight; /* 적응형 상한의 최솟값 */
+    int admission_queue_timeout_ms; /* 요청 도착부터 이만큼 지나도록 슬롯을 못 받으면 거절 */
+    int admission_latency_target_ms; /* 이보다 오래 걸린 검색은 상한을 낮춤 (0 = 실패만) */
+    int admission_retry_after; /* 503 응답의 Retry-After (초) */
+    char title_index_file[256]; /* lkb-index로 만든 제목 색인 (비어 있으면 안 씀) */
+    bool title_index_prefix;  /* 쿼리로 시작하는 제목도 결과로 */
+    int title_index_min_prefix; /* 앞부분 일치에 쓰는 최소 쿼리 길이 (바이트) */
+    bool query_strip_think;   /* <think>...</think> 블록을 쿼리에서 뺌 */
+    bool query_unwrap;        /* {"queries": [...]}, ["..."], "..."로 감싼 쿼리는 안쪽만 */
+    int query_max_tokens;     /* 쿼리에 남기는 최대 단어 수 (0 = 제한 없음) */
+    char query_stopwords[1024]; /* 쿼리에서 버리는 단어, 쉼표로 구분 (ASCII 대소문자 무시) */
+    LogLevel log_level;       /* 이 레벨 이하만 기록 */
+    char log_file[256];       /* 비어 있으면 stdout/stderr */
+    int log_payload_max;      /* 요청/응답 본문 로그 최대 바이트 */
+    int log_sample_rate;      /* 본문 로그를 N건 중 1건만 (1 = 모두) */
+    char capture_file[256];   /* 검색 요청 캡처 파일 (비어 있으면 끔, bench_load -r로 재생) */
+    int capture_sample_rate;  /* 검색 요청 N건 중 1건만 캡처 (1 = 모두) */
 } Config;
 
 /* 검색 요청 구조체 */
@@ -63,17 +259,577 @@ typedef struct {
     int count;
 } SearchRequest;
 
+/* 쿼리 정규화 규칙 (query.*를 시작 시 한 번 컴파일) */
+typedef struct {
+    bool strip_think;
+    bool unwrap;
+    int max_tokens;             /* 0 = 제한 없음 */
+    char words[1024];           /* query.stopwords 사본 (소문자, stopwords가 가리킴) */
+    const char *stopwords[MAX_STOPWORDS]; /* 정렬됨 (이진 탐색) */
+    int stopword_count;
+} QueryRules;
+
 /* 검색 결과 구조체 */
 typedef struct {
     char *link;
     char *title;
     char *snippet;
+    size_t link_len;  /* link를 escape 없이 그대로 쓸 수 있으면 길이 (0 = escape 필요) */
 } SearchResult;
 
-/* 전역 변수 */
+/* 가변 길이 바이트 버퍼 */
+typedef struct {
+    char *data;
+    size_t len;
+    size_t cap;
+} ByteBuffer;
+
+/* 요청 단위 bump 할당기 - 요청이 끝나면 arena_reset()으로 한 번에 비움 */
+typedef struct ArenaChunk {
+    struct ArenaChunk *next;
+    size_t size;
+    size_t used;
+    char data[];
+} ArenaChunk;
+
+typedef struct {
+    ArenaChunk *head;   /* 현재 할당 중인 청크 (앞쪽이 최신) */
+    size_t chunk_size;  /* 다음에 새로 만들 청크 크기 */
+    size_t used;        /* 이번 요청에서 할당한 바이트 */
+} Arena;
+
+/* 메모리 재사용 통계 (종료 시 출력) */
+typedef struct {
+    unsigned long arena_chunks;  /* arena 청크 malloc 횟수 */
+    unsigned long arena_resets;  /* arena 초기화 횟수 (요청 종료마다) */
+    size_t arena_peak;           /* 요청 하나의 최대 arena 사용량 */
+    unsigned long buffer_grows;  /* ByteBuffer 확장(realloc) 횟수 */
+} MemoryStats;
+
+/* /metrics 단계별 지연 측정 구간 */
+typedef enum {
+    STAGE_REQUEST_PARSE,
+    STAGE_NORMALIZE,
+    STAGE_TEMPLATE_RENDER,
+    STAGE_UPSTREAM_CONNECT,     /* 새 연결만 (풀 재사용은 0이라 기록 안 함) */
+    STAGE_UPSTREAM_SEND,
+    STAGE_UPSTREAM_FIRST_BYTE,  /* 전송 완료 → 첫 응답 바이트 */
+    STAGE_UPSTREAM_READ,        /* 첫 바이트 → 응답 완료 */
+    STAGE_RESULT_PARSE,
+    STAGE_JSON_BUILD,
+    STAGE_SOCKET_WRITE,
+    STAGE_SEARCH_TOTAL,         /* /search 요청 수신 → 응답 생성 (took_ms와 같은 구간) */
+    STAGE_ADMISSION_WAIT,       /* 요청 수신 (threads: accept) → 검색 슬롯을 받거나 거절 */
+    STAGE_COUNT
+} MetricStage;
+
+typedef enum {
+    ROUTE_SEARCH,
+    ROUTE_BATCH,
+    ROUTE_ROOT,
+    ROUTE_METRICS,
+    ROUTE_NOT_FOUND,
+    ROUTE_TOO_LARGE,
+    ROUTE_COUNT
+} MetricRoute;
+
+/* 업스트림 오류 분류 */
+typedef enum {
+    UPSTREAM_ERR_RESOLVE,
+    UPSTREAM_ERR_CONNECT,
+    UPSTREAM_ERR_SEND,
+    UPSTREAM_ERR_RECV,
+    UPSTREAM_ERR_CLOSED,     /* 응답 도중 연결 끊김 */
+    UPSTREAM_ERR_PROTOCOL,   /* 잘못된 HTTP 응답 */
+    UPSTREAM_ERR_STATUS,     /* 4xx/5xx 응답 */
+    UPSTREAM_ERR_TRUNCATED,  /* max_response_size 초과 */
+    UPSTREAM_ERR_TIMEOUT,    /* connect / first-byte / 전체 deadline 초과 */
+    UPSTREAM_ERR_COUNT
+} UpstreamErrorClass;
+
+/* 지연 히스토그램 (마이크로초, 버킷은 비누적 - 출력 시 누적) */
+typedef struct {
+    uint64_t buckets[METRICS_BUCKET_COUNT + 1];  /* 마지막 = +Inf */
+    uint64_t count;
+    uint64_t sum_us;
+} LatencyHistogram;
+
+/* /metrics 카운터 - 모두 __atomic 연산으로 갱신 (잠금 없음) */
+typedef struct {
+    LatencyHistogram stages[STAGE_COUNT];
+    uint64_t requests[ROUTE_COUNT];
+    uint64_t upstream_errors[UPSTREAM_ERR_COUNT];
+    uint64_t upstream_retries;   /* 죽은 풀 연결을 새 연결로 재시도 */
+    uint64_t upstream_early_stop; /* 필요한 결과를 다 얻어 응답 끝까지 읽지 않음 */
+    uint64_t pool_reused;        /* 풀의 유휴 연결 사용 */
+    uint64_t pool_new;           /* 새로 연결 */
+    uint64_t pool_stale;         /* 꺼낼 때 죽어 있거나 오래되어 버림 */
+    uint64_t pool_full;          /* 반환하려 했지만 풀이 가득 차 닫음 */
+    uint64_t search_coalesced;   /* 같은 검색이 진행 중이라 결과를 나눠 받음 */
+    uint64_t search_coalesce_timeouts; /* epoll: 선두가 engine.timeout_ms 안에 끝나지 않아 직접 검색 */
+    uint64_t search_streamed;    /* 결과를 파싱되는 대로 chunked로 보냄 (lkb.stream_results) */
+    uint64_t breaker_trips;      /* 차단기가 열린 횟수 */
+    uint64_t breaker_rejected;   /* 차단기가 열려 Manticore를 부르지 않은 검색 */
+    uint64_t search_stale;       /* Manticore 결과 없이 ttl이 지난 캐시 결과로 응답한 검색 */
+    uint64_t breaker_probes;     /* 복구 확인 호출 */
+    uint64_t health_checks;      /* 정상인 replica 확인 호출 */
+    uint64_t health_failures;    /* 그중 실패해 replica를 뺀 횟수 */
+    uint64_t upstream_hedged;    /* p95 안에 끝나지 않아 다른 replica에도 보낸 호출 */
+    uint64_t upstream_hedge_wins; /* 그중 나중에 보낸 쪽이 먼저 응답 */
+    uint64_t upstream_failover;  /* 첫 호출이 실패해 다른 replica로 다시 보낸 호출 */
+    uint64_t title_index_hits;   /* 제목 색인에서 바로 응답한 검색 */
+    uint64_t title_index_added;  /* Manticore 결과 뒤에 덧붙인 제목 색인 결과 */
+    uint64_t config_reloads;     /* 새 설정 스냅샷으로 바꾼 횟수 */
+    uint64_t config_reload_failures; /* config.yaml을 읽지 못해 지금 설정을 유지한 횟수 */
+    uint64_t admission_waited;   /* 슬롯이 없어 기다린 검색 (admission) */
+    uint64_t admission_shed;     /* queue_timeout_ms 안에 슬롯을 받지 못해 거절한 검색 */
+    uint64_t ring_enters;        /* io_uring_enter 호출 (io_uring 모드) */
+    uint64_t ring_completions;   /* 그 호출들로 받은 완료 (CQE) */
+} Metrics;
+
+/* 유휴 keep-alive 연결 풀 (LIFO - 가장 최근에 쓴 연결부터 재사용) */
+typedef struct {
+    int fds[MAX_POOL_SIZE];
+    time_t last_used[MAX_POOL_SIZE];
+    int count;
+} UpstreamPool;
+
+/* 업스트림 차단기 (circuit breaker). CLOSED에서 실패율이 breaker.error_rate를 넘으면
+ * OPEN - 검색은 Manticore를 부르지 않고 바로 응답한다. 복구 확인 스레드가
+ * cooldown마다 HALF_OPEN으로 바꿔 호출 하나를 보내 보고, 성공하면 CLOSED로 */
+typedef enum {
+    BREAKER_CLOSED,
+    BREAKER_OPEN,
+    BREAKER_HALF_OPEN
+} BreakerState;
+
+typedef struct {
+    int state;             /* BreakerState - 요청 경로는 잠금 없이 읽음 */
+    pthread_mutex_t lock;  /* 아래 필드 보호 */
+    pthread_cond_t cond;   /* 열림 / 종료 알림 (복구 확인 스레드) */
+    time_t window_start;   /* 현재 집계 창 시작 */
+    int calls;             /* 창 안의 호출 수 */
+    int failures;          /* 그중 실패 */
+    bool stop;
+    bool running;          /* 복구 확인 스레드 동작 중 */
+    pthread_t thread;
+} CircuitBreaker;
+
+/* 업스트림(Manticore) replica 하나 - 주소는 시작 시 한 번 해석 */
+typedef struct {
+    char host[128];
+    int port;
+    char path[64];
+    char name[160];        /* "host:port" (로그, /metrics) */
+    struct sockaddr_storage addr;
+    socklen_t addrlen;
+    bool resolved;
+    UpstreamPool pool;
+    pthread_mutex_t lock;  /* pool과 재해석 보호 */
+    CircuitBreaker breaker;
+    int outstanding;       /* 진행 중인 호출 수 (least outstanding requests 선택용) */
+} UpstreamTarget;
+
+/* 최근 성공 호출의 소요 시간 - hedge 대기 시간(p95) 계산용. 슬롯은 잠금 없이 덮어씀 */
+typedef struct {
+    uint32_t samples_us[LATENCY_RING_SLOTS];
+    uint64_t count;        /* 지금까지 기록한 호출 수 */
+    uint32_t p95_us;       /* HEDGE_MIN_SAMPLES개 전에는 0 */
+} LatencyTracker;
+
+/* 동시 검색 제한 (admission) - Manticore를 부르는 검색 수의 상한을 AIMD로 조정 */
+typedef struct {
+    pthread_mutex_t lock;  /* 아래 필드 보호 */
+    pthread_cond_t cond;   /* 슬롯 반환 알림 (threads 모드 대기, CLOCK_MONOTONIC) */
+    double limit;          /* 지금 상한 (min_in_flight..max_in_flight) */
+    int in_flight;         /* 슬롯을 받아 진행 중인 검색 */
+    int waiting;           /* 슬롯을 기다리는 검색 (epoll 모드는 루프 대기열에 있는 연결, __atomic) */
+    uint64_t last_backoff_us; /* 마지막으로 상한을 줄인 시각 */
+} AdmissionControl;
+
+/* 증분 HTTP 응답 파서 (Content-Length / chunked / close 구분) */
+typedef enum {
+    HTTP_RESP_HEADERS,
+    HTTP_RESP_BODY_LENGTH,
+    HTTP_RESP_CHUNK_SIZE,
+    HTTP_RESP_CHUNK_DATA,
+    HTTP_RESP_CHUNK_DATA_END,
+    HTTP_RESP_CHUNK_TRAILER,
+    HTTP_RESP_BODY_UNTIL_CLOSE,
+    HTTP_RESP_COMPLETE,
+    HTTP_RESP_ERROR
+} HttpResponseState;
+
+typedef struct {
+    HttpResponseState state;
+    int status_code;
+    bool keep_alive;      /* 응답 후 연결 재사용 가능 여부 */
+    bool truncated;       /* max_body 초과로 잘림 */
+    bool discard;         /* 바디를 저장하지 않고 버림 (연결 재사용을 위해 끝까지 읽을 때) */
+    size_t remaining;     /* Content-Length 또는 현재 청크의 남은 바이트 */
+    size_t max_body;      /* body에 한 번에 쌓아둘 수 있는 최대 바이트 */
+    ByteBuffer line;      /* 헤더 블록 / 청크 크기 줄 누적 */
+    ByteBuffer body;      /* 디코딩된 바디 (sink가 있으면 아직 처리하지 않은 부분만) */
+} HttpResponseParser;
+
+/* 바디를 받는 대로 처리하는 쪽. body에 쌓인 바이트를 읽고 더 필요 없는 앞부분은
+ * buffer_consume()으로 버린다. final이면 바디 끝. false를 돌려주면 더 읽지 않는다 */
+typedef bool (*UpstreamBodySink)(void *ctx, ByteBuffer *body, bool final);
+
+/* 논블로킹 업스트림 호출 상태 머신 (블로킹 경로와 epoll 경로가 공유) */
+typedef enum {
+    UPSTREAM_CONNECTING,
+    UPSTREAM_SENDING,
+    UPSTREAM_RECEIVING,
+    UPSTREAM_DONE,
+    UPSTREAM_FAILED
+} UpstreamState;
+
+typedef struct {
+    int fd;
+    UpstreamState state;
+    UpstreamTarget *target;
+    const Config *config; /* 호출을 시작한 요청의 설정 (응답 크기 상한, deadline) */
+    ByteBuffer request;   /* 전송할 HTTP 요청 전체 */
+    size_t sent;
+    HttpResponseParser parser;
+    bool reused;          /* 풀에서 꺼낸 연결 */
+    bool received_any;
+    unsigned generation;  /* 재연결로 fd가 바뀔 때마다 증가 (epoll 재등록용) */
+    uint64_t stage_start_us;  /* 현재 단계(connect/send/...) 시작 시각, /metrics용 */
+    uint64_t start_us;        /* 호출 시작 시각 (deadline 기준) */
+    UpstreamBodySink sink;    /* NULL이면 바디 전체를 parser.body에 모음 */
+    void *sink_ctx;
+    bool sink_done;           /* sink가 더 필요 없다고 함 */
+    bool outstanding;         /* target->outstanding에 들어가 있음 (release에서 뺌) */
+} UpstreamCall;
+
+/* 제목 색인 파일 헤더 (lkb-index). 뒤에 항목 시작 위치 uint32_t[count] (키 순), 그 뒤에
+ * 항목마다 "키\0제목\0URL 인코딩된 제목\0스니펫\0" (본문이 없던 항목은 빈 스니펫).
+ * 정수는 만든 머신의 바이트 순서 */
+typedef struct {
+    char magic[8];
+    uint32_t count;
+    uint32_t reserved;
+} TitleIndexHeader;
+
+/* mmap한 제목 색인 - 읽기 전용이라 잠금 없이 여러 스레드가 조회 */
+typedef struct {
+    const char *data;        /* 파일 전체 (NULL = 색인 없음) */
+    size_t size;
+    const uint32_t *offsets;
+    uint32_t count;
+} TitleIndex;
+
+/* 요청 처리용 재사용 메모리 - 워커 스레드 또는 epoll 연결마다 하나.
+ * 요청이 끝나면 request_scratch_reset()으로 비우고 메모리는 다음 요청에 재사용 */
+typedef struct RequestScratch {
+    Arena arena;            /* 쿼리, 결과 문자열 등 요청 하나 동안의 작은 할당 */
+    ByteBuffer in;          /* 클라이언트 요청 수신 */
+    ByteBuffer body;        /* 응답 JSON 바디 */
+    ByteBuffer request[MAX_QUERIES];     /* Manticore 요청 바디 (템플릿 치환 결과), fan-out 쿼리마다 */
+    UpstreamCall upstream[UPSTREAM_SLOTS]; /* Manticore 요청/응답 버퍼, [i] 쿼리 i의 첫 호출,
+                                            * [MAX_QUERIES + i] 다른 replica로 보낸 두 번째 호출 */
+    struct RequestScratch *batch; /* threads 모드 POST /search/batch: 항목마다 하나 (필요할 때 늘림) */
+    int batch_cap;
+    uint64_t received_us;   /* 처리 중인 요청이 도착한 시각 (threads 모드 첫 요청은 accept 시각) */
+} RequestScratch;
+
+/* 컴파일된 요청 템플릿: 리터럴 구간과 치환 슬롯의 목록 */
+typedef enum {
+    TEMPLATE_LITERAL,
+    TEMPLATE_INDEX_NAME,
+    TEMPLATE_SEARCH_QUERY,
+    TEMPLATE_RESULT_LIMIT,
+    TEMPLATE_SNIPPET_LENGTH
+} TemplatePartKind;
+
+typedef struct {
+    TemplatePartKind kind;
+    size_t offset;   /* 리터럴: text 내 시작 위치 */
+    size_t len;      /* 리터럴 길이 (슬롯은 0) */
+} TemplatePart;
+
+typedef struct {
+    int refs;              /* 요청이 잡고 있는 동안 재로드되어도 해제되지 않도록 */
+    char *text;
+    TemplatePart *parts;
+    int part_count;
+    int part_cap;
+    size_t literal_len;    /* 리터럴 구간 길이 합 */
+    uint64_t hash;         /* 내용 해시 (캐시 키에 포함) */
+    time_t mtime;          /* 변경 감지용 파일 정보 */
+    off_t size;
+    ino_t ino;
+} CompiledTemplate;
+
+/* 설정 스냅샷 - config.yaml(또는 템플릿)을 다시 읽을 때마다 새로 만들어 통째로 바꾼다.
+ * 만든 뒤에는 읽기 전용이라 요청은 잠금 없이 읽고, 끝날 때까지 처음 잡은 스냅샷을 쓴다 */
+typedef struct {
+    Config config;
+    CompiledTemplate *template;   /* config.template_file을 컴파일한 것 (못 읽었으면 NULL) */
+    UpstreamTarget *upstreams[MAX_BACKENDS]; /* config.backends 순서, 주소가 같으면 이전 스냅샷과 공유 */
+    int upstream_count;
+    uint64_t result_hash;         /* 템플릿 + 결과 JSON을 바꾸는 설정의 해시 (캐시 키에 포함) */
+    unsigned generation;          /* 시작 시 1, 다시 읽을 때마다 증가 */
+    time_t mtime;                 /* config.yaml 변경 감지용 파일 정보 */
+    off_t size;
+    ino_t ino;
+} ConfigSnapshot;
+
+/* 스냅샷을 잡은 요청 수 - phase마다 따로 세어 다시 읽는 쪽이 한쪽씩 비기를 기다림 */
+typedef struct {
+    int count;
+} __attribute__((aligned(64))) ConfigReaders;
+
+typedef struct {
+    char path[256];
+    ConfigSnapshot *current;      /* 원자적으로 교체 */
+    unsigned phase;               /* 새로 잡는 요청이 세어지는 readers 쪽 (0/1) */
+    ConfigReaders readers[2];
+    bool stop;
+    bool running;                 /* 감시 스레드 동작 중 */
+    pthread_mutex_t lock;         /* stop 보호 */
+    pthread_cond_t cond;          /* 종료 알림 (감시 스레드) */
+    pthread_t thread;
+} ConfigStore;
+
+/* 캐시된 검색 결과 (results JSON 조각, 참조 카운트로 공유) */
+typedef struct {
+    int refs;
+    char *json;
+    size_t len;
+    int count;
+} CachedResult;
+
+typedef struct CacheEntry {
+    char *key;
+    size_t key_len;
+    uint64_t hash;
+    CachedResult *value;
+    size_t bytes;          /* 용량 계산용 (키 + 값 + 구조체) */
+    time_t expires;
+    time_t refresh_at;     /* 이후 적중하면 백그라운드에서 다시 검색 (0 = 안 함, cache.soft_ttl) */
+    bool refreshing;       /* 다시 검색하는 중 (항목당 한 번만, 새 결과로 바뀌거나 실패하면 해제) */
+    struct CacheEntry *hnext;  /* 해시 버킷 체인 */
+    struct CacheEntry *prev;   /* LRU 목록 (head = 최근) */
+    struct CacheEntry *next;
+} CacheEntry;
+
+typedef struct {
+    CacheEntry **buckets;
+    size_t nbuckets;           /* 2의 거듭제곱 */
+    CacheEntry *lru_head;
+    CacheEntry *lru_tail;
+    size_t entries;
+    size_t bytes;
+    size_t max_bytes;
+    int ttl;
+    int stale_ttl;             /* ttl이 지난 뒤에도 차단기 대체 응답용으로 보관하는 시간 */
+    int soft_ttl;              /* 0 = 백그라운드 갱신 안 함 */
+    int negative_ttl;          /* 결과 0건 항목의 유효 시간 */
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t evictions;
+    uint64_t expirations;
+    uint64_t refreshes;        /* soft_ttl이 지나 백그라운드 갱신을 시작한 적중 */
+    uint64_t refresh_failures; /* 그중 새 결과로 바꾸지 못한 갱신 (대기열 가득, 슬롯 없음, 실패) */
+    uint64_t negative;         /* 저장한 결과 0건 항목 */
+    pthread_mutex_t lock;
+} ResultCache;
+
+/* soft_ttl이 지난 캐시 항목을 다시 검색할 요청 */
+typedef struct {
+    char *body;                /* 원래 /search 요청 바디 (사본) */
+    char *key;                 /* 캐시 키 (사본, 갱신이 끝나면 refreshing 해제) */
+    size_t key_len;
+} CacheRefreshTask;
+
+/* 백그라운드 갱신 스레드 하나 - 쌓인 요청을 배치처럼 한 poll()로 함께 검색 */
+typedef struct {
+    CacheRefreshTask tasks[CACHE_REFRESH_QUEUE];
+    int count;
+    bool stop;
+    bool running;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;       /* 새 요청 / 종료 알림 */
+    pthread_t thread;
+} CacheRefresher;
+
+/* page_title → link 캐시 항목 (title, URL 인코딩한 title을 구조체 뒤에 이어서 저장).
+ * base_url은 붙이지 않고 둬서 engine.replace_return_url을 다시 읽어도 그대로 쓴다 */
+typedef struct LinkEntry {
+    struct LinkEntry *hnext;   /* 해시 버킷 체인 */
+    struct LinkEntry *prev;    /* LRU 목록 (head = 최근) */
+    struct LinkEntry *next;
+    uint64_t hash;
+    size_t title_len;
+    size_t encoded_len;
+    size_t bytes;              /* 용량 계산용 (구조체 + 문자열) */
+    char data[];               /* title '\0' encoded '\0' */
+} LinkEntry;
+
+/* 샤드마다 잠금을 따로 두어 워커들이 서로 기다리지 않게 함 */
+typedef struct {
+    LinkEntry **buckets;
+    size_t nbuckets;           /* 2의 거듭제곱, 용량으로 정해 두고 늘리지 않음 */
+    LinkEntry *lru_head;
+    LinkEntry *lru_tail;
+    size_t entries;
+    size_t bytes;
+    size_t max_bytes;
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t evictions;
+    pthread_mutex_t lock;
+} __attribute__((aligned(64))) LinkCacheShard;
+
+typedef struct {
+    LinkCacheShard shards[LINK_CACHE_SHARDS];
+    bool enabled;              /* link_cache_init 전이거나 용량이 0이면 false */
+} LinkCache;
+
+/* single-flight: 같은 키로 진행 중인 검색 하나에 뒤따른 요청이 결과를 기다림 */
+typedef struct FlightWaiter {
+    struct FlightWaiter *prev;
+    struct FlightWaiter *next;
+    bool linked;
+    uint64_t deadline_us;   /* 이때까지 선두가 끝나지 않으면 기다리지 않고 직접 검색 */
+} FlightWaiter;
+
+typedef struct Flight {
+    char *key;
+    size_t key_len;
+    uint64_t hash;
+    int refs;               /* 선두 + 뒤따른 요청 */
+    bool done;
+    CachedResult *result;   /* 선두가 만든 결과 (done인데 NULL이면 선두가 끝내지 못함) */
+    pthread_cond_t cond;    /* threads 모드: 뒤따른 요청이 done을 기다림 */
+    FlightWaiter *waiters;  /* epoll 모드: done이 되면 깨울 연결 */
+    struct Flight *next;    /* 해시 버킷 체인 (done이 되면 빠짐) */
+    struct Flight *remote_next; /* 루프 밖에서 끝나 FlightTable.remote 목록에 있음 */
+} Flight;
+
+typedef struct {
+    Flight *buckets[FLIGHT_BUCKETS];
+    pthread_mutex_t lock;
+    int wake_fd;            /* epoll 모드: 루프를 깨우는 eventfd (-1 = 루프 없음) */
+    pthread_t loop_thread;  /* wake_fd를 등록한 이벤트 루프 스레드 */
+    Flight *remote;         /* 루프 밖에서 끝났고 대기 목록을 루프가 가져가야 하는 검색 (참조 하나씩) */
+} FlightTable;
+
+/* 워커 전달 큐 (accept 스레드 → 워커 스레드, 고정 크기 링 버퍼) */
+typedef struct {
+    int *fds;
+    uint64_t *queued_us;  /* fds[i]를 넣은 시각 (admission 대기 시간 기준) */
+    int capacity;
+    int head;
+    int tail;
+    int count;
+    int idle;             /* pop에서 연결을 기다리는 워커 수 */
+    bool closed;
+    pthread_mutex_t lock;
+    pthread_cond_t not_empty;
+    pthread_cond_t not_full;
+} WorkQueue;
+
+/* 로그 출력 대상 (DEBUG 빌드 요청 로그 파일 포함) */
+typedef enum {
+    LOG_SINK_STDOUT,
+    LOG_SINK_STDERR,
+    LOG_SINK_SEARCH,    /* DEBUG: 02_search.log */
+    LOG_SINK_REQUEST,   /* DEBUG: 01_fromrequest.log */
+    LOG_SINK_RAW,       /* DEBUG: 00_raw_request.log */
+    LOG_SINK_COUNT
+} LogSink;
+
+/* 본문 로그 종류 (샘플링 카운터를 따로 두어 요청/응답이 같은 건끼리 남게) */
+typedef enum {
+    LOG_PAYLOAD_REQUEST,
+    LOG_PAYLOAD_RESPONSE,
+    LOG_PAYLOAD_COUNT
+} LogPayloadKind;
+
+/* 링 버퍼 슬롯 - seq가 슬롯 상태를 나타냄 (pos = 비어 있음, pos + 1 = 기록 대기) */
+typedef struct {
+    uint64_t seq;
+    struct timespec time;   /* 기록 시각 (포맷은 기록 스레드가) */
+    unsigned char level;
+    unsigned char sink;
+    unsigned short len;
+    char text[LOG_LINE_MAX];
+} LogSlot;
+
+typedef struct {
+    LogSlot *slots;
+    uint64_t enqueue_pos __attribute__((aligned(64)));  /* 생산자들이 CAS로 증가 */
+    uint64_t dequeue_pos __attribute__((aligned(64)));  /* 기록 스레드만 사용 */
+    uint64_t dropped;       /* 링이 가득 차 버린 줄 수 */
+    uint64_t payload_seq[LOG_PAYLOAD_COUNT];  /* 본문 로그 샘플링 카운터 */
+    FILE *files[LOG_SINK_COUNT];
+    pthread_t thread;
+    int running;            /* 기록 스레드 동작 중 (0이면 동기 출력) */
+    int stop;
+} Logger;
+
+/* 트래픽 캡처 (log.capture_file): CaptureFileHeader 뒤에 (CaptureRecord + 본문)이 이어짐.
+ * 정수는 little-endian 그대로. bench/bench_load.c에 같은 배치의 정의가 있음 */
+typedef struct {
+    char magic[8];          /* CAPTURE_MAGIC */
+    uint32_t version;       /* CAPTURE_VERSION */
+    uint32_t record_size;   /* sizeof(CaptureRecord) */
+} CaptureFileHeader;
+
+typedef enum {
+    CAPTURE_SEARCH = 1,     /* POST /search */
+    CAPTURE_BATCH = 2       /* POST /search/batch */
+} CaptureKind;
+
+typedef struct {
+    uint64_t time_us;       /* 요청을 받은 시각 (CLOCK_REALTIME, 마이크로초) */
+    uint32_t len;           /* 뒤따르는 요청 본문 바이트 */
+    uint16_t kind;          /* CaptureKind */
+    uint16_t reserved;
+} CaptureRecord;
+
+typedef struct {
+    int fd;                 /* -1 = 끔 */
+    pthread_mutex_t lock;   /* pending */
+    pthread_mutex_t write_lock; /* writing, fd (기록 스레드, 종료 시 main) */
+    ByteBuffer pending;     /* 요청 스레드가 레코드를 붙임 */
+    ByteBuffer writing;     /* pending과 바꿔서 잠금 밖에서 write */
+    uint64_t pending_records;
+    uint64_t last_flush_us;
+    uint64_t seq;           /* 샘플링 카운터 */
+    uint64_t records;       /* 파일에 쓴 레코드 */
+    uint64_t dropped;       /* 버퍼가 가득 찼거나 쓰기에 실패해 버린 레코드 */
+} Capture;
+
+/* 전역 변수
+ * g_config는 main()에서 워커 생성 전에 한 번만 채워지고 이후 읽기 전용 (시작 시 설정).
+ * 다시 읽을 수 있는 항목(engine.*, lkb.stream_*)은 요청마다 잡은 g_configs 스냅샷에서 읽는다 */
 static Config g_config;
 static volatile sig_atomic_t g_running = 1;
 static int g_server_fd = -1;
+static int g_process_index;  /* lkb.processes > 1: 이 워커 프로세스 번호 (0부터) */
+static WorkQueue g_work_queue;
+static unsigned g_upstream_next;  /* 부하가 같은 replica 사이 순환 시작점 */
+static LatencyTracker g_upstream_latency;
+static ResultCache g_result_cache;
+static CacheRefresher g_cache_refresher;
+static LinkCache g_link_cache;
+static FlightTable g_flights = { .lock = PTHREAD_MUTEX_INITIALIZER, .wake_fd = -1 };
+static MemoryStats g_mem_stats;
+static Metrics g_metrics;
+static ConfigStore g_configs;
+static TitleIndex g_title_index;
+static QueryRules g_query_rules;
+static AdmissionControl g_admission;
+static volatile sig_atomic_t g_reload_config = 0;    /* SIGHUP 수신 시 1 */
+static Logger g_logger;
+static Capture g_capture = { .fd = -1, .lock = PTHREAD_MUTEX_INITIALIZER,
+                             .write_lock = PTHREAD_MUTEX_INITIALIZER };
+static volatile sig_atomic_t g_reopen_logs = 0;      /* SIGHUP 수신 시 1 */
 
 /* ============================
  * 시그널 핸들러 및 정리 함수
@@ -100,6 +856,252 @@ void signal_handler(int signum) {
         if (g_server_fd >= 0) {
             shutdown(g_server_fd, SHUT_RDWR);
         }
+    } else if (signum == SIGHUP) {
+        /* 설정/템플릿 다시 읽기 (감시 스레드), 로그 파일 다시 열기 */
+        g_reload_config = 1;
+        g_reopen_logs = 1;
+    }
+}
+
+/* ============================
+ * SIMD 텍스트 커널
+ * ============================ */
+
+/*
+ * 문자열 처리의 대부분은 escape/인코딩이 필요 없는 바이트를 그대로 복사하는
+ * 일이다. 아래 커널은 앞에서부터 "그대로 둬도 되는" 바이트가 몇 개 이어지는지만
+ * 센다. 호출자는 그만큼 memcpy 하고, 걸린 바이트만 바이트 단위로 처리한다.
+ *
+ *   json_plain - 0x20 이상이고 '"', '\\'가 아닌 바이트 (JSON escaping)
+ *   url_plain  - A-Z a-z 0-9 - _ . ~ (URL 인코딩)
+ *   ascii      - 0x80 미만 바이트 (UTF-8 경계 계산)
+ *
+ * x86_64는 SSE2가 기본이고 AVX2가 있으면 text_kernels_init()에서 바꾼다.
+ * aarch64는 NEON. LKB_NO_SIMD로 빌드하면 스칼라만 쓴다.
+ */
+typedef size_t (*TextSpanFn)(const unsigned char *s, size_t n);
+
+typedef struct {
+    const char *name;
+    TextSpanFn json_plain;
+    TextSpanFn url_plain;
+    TextSpanFn ascii;
+} TextKernels;
+
+static inline bool json_is_plain(unsigned char c) {
+    return c >= 0x20 && c != '"' && c != '\\';
+}
+
+static inline bool url_is_plain(unsigned char c) {
+    return (c >= 'A' && c <= 'Z') || (c >= 'a' && c <= 'z') ||
+           (c >= '0' && c <= '9') || c == '-' || c == '_' || c == '.' || c == '~';
+}
+
+size_t text_json_plain_scalar(const unsigned char *s, size_t n) {
+    size_t i = 0;
+    while (i < n && json_is_plain(s[i])) i++;
+    return i;
+}
+
+size_t text_url_plain_scalar(const unsigned char *s, size_t n) {
+    size_t i = 0;
+    while (i < n && url_is_plain(s[i])) i++;
+    return i;
+}
+
+size_t text_ascii_scalar(const unsigned char *s, size_t n) {
+    size_t i = 0;
+    while (i < n && s[i] < 0x80) i++;
+    return i;
+}
+
+static const TextKernels TEXT_KERNELS_SCALAR = {
+    "scalar", text_json_plain_scalar, text_url_plain_scalar, text_ascii_scalar
+};
+
+#if defined(__x86_64__) && !defined(LKB_NO_SIMD)
+
+/* lo <= v <= hi (부호 없는 비교) */
+static inline __m128i sse2_in_range(__m128i v, unsigned char lo, unsigned char hi) {
+    return _mm_and_si128(_mm_cmpeq_epi8(_mm_max_epu8(v, _mm_set1_epi8((char)lo)), v),
+                         _mm_cmpeq_epi8(_mm_min_epu8(v, _mm_set1_epi8((char)hi)), v));
+}
+
+size_t text_json_plain_sse2(const unsigned char *s, size_t n) {
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(s + i));
+        __m128i special = _mm_or_si128(
+            _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('"')), _mm_cmpeq_epi8(v, _mm_set1_epi8('\\'))),
+            _mm_cmpeq_epi8(_mm_min_epu8(v, _mm_set1_epi8(0x1F)), v));
+        int mask = _mm_movemask_epi8(special);
+        if (mask) return i + __builtin_ctz(mask);
+    }
+    return i + text_json_plain_scalar(s + i, n - i);
+}
+
+size_t text_url_plain_sse2(const unsigned char *s, size_t n) {
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(s + i));
+        __m128i plain = _mm_or_si128(sse2_in_range(_mm_or_si128(v, _mm_set1_epi8(0x20)), 'a', 'z'),
+                                     sse2_in_range(v, '0', '9'));
+        plain = _mm_or_si128(plain, _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('-')),
+                                                 _mm_cmpeq_epi8(v, _mm_set1_epi8('_'))));
+        plain = _mm_or_si128(plain, _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('.')),
+                                                 _mm_cmpeq_epi8(v, _mm_set1_epi8('~'))));
+        int mask = ~_mm_movemask_epi8(plain) & 0xFFFF;
+        if (mask) return i + __builtin_ctz(mask);
+    }
+    return i + text_url_plain_scalar(s + i, n - i);
+}
+
+size_t text_ascii_sse2(const unsigned char *s, size_t n) {
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        int mask = _mm_movemask_epi8(_mm_loadu_si128((const __m128i *)(s + i)));
+        if (mask) return i + __builtin_ctz(mask);
+    }
+    return i + text_ascii_scalar(s + i, n - i);
+}
+
+#define AVX2_TARGET __attribute__((target("avx2")))
+
+AVX2_TARGET static inline __m256i avx2_in_range(__m256i v, unsigned char lo, unsigned char hi) {
+    return _mm256_and_si256(_mm256_cmpeq_epi8(_mm256_max_epu8(v, _mm256_set1_epi8((char)lo)), v),
+                            _mm256_cmpeq_epi8(_mm256_min_epu8(v, _mm256_set1_epi8((char)hi)), v));
+}
+
+AVX2_TARGET size_t text_json_plain_avx2(const unsigned char *s, size_t n) {
+    size_t i = 0;
+    for (; i + 32 <= n; i += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(s + i));
+        __m256i special = _mm256_or_si256(
+            _mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8('"')),
+                            _mm256_cmpeq_epi8(v, _mm256_set1_epi8('\\'))),
+            _mm256_cmpeq_epi8(_mm256_min_epu8(v, _mm256_set1_epi8(0x1F)), v));
+        unsigned int mask = (unsigned int)_mm256_movemask_epi8(special);
+        if (mask) return i + __builtin_ctz(mask);
+    }
+    return i + text_json_plain_sse2(s + i, n - i);
+}
+
+AVX2_TARGET size_t text_url_plain_avx2(const unsigned char *s, size_t n) {
+    size_t i = 0;
+    for (; i + 32 <= n; i += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(s + i));
+        __m256i plain = _mm256_or_si256(avx2_in_range(_mm256_or_si256(v, _mm256_set1_epi8(0x20)), 'a', 'z'),
+                                        avx2_in_range(v, '0', '9'));
+        plain = _mm256_or_si256(plain, _mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8('-')),
+                                                       _mm256_cmpeq_epi8(v, _mm256_set1_epi8('_'))));
+        plain = _mm256_or_si256(plain, _mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8('.')),
+                                                       _mm256_cmpeq_epi8(v, _mm256_set1_epi8('~'))));
+        unsigned int mask = ~(unsigned int)_mm256_movemask_epi8(plain);
+        if (mask) return i + __builtin_ctz(mask);
+    }
+    return i + text_url_plain_sse2(s + i, n - i);
+}
+
+AVX2_TARGET size_t text_ascii_avx2(const unsigned char *s, size_t n) {
+    size_t i = 0;
+    for (; i + 32 <= n; i += 32) {
+        unsigned int mask = (unsigned int)_mm256_movemask_epi8(_mm256_loadu_si256((const __m256i *)(s + i)));
+        if (mask) return i + __builtin_ctz(mask);
+    }
+    return i + text_ascii_sse2(s + i, n - i);
+}
+
+static const TextKernels TEXT_KERNELS_SSE2 = {
+    "sse2", text_json_plain_sse2, text_url_plain_sse2, text_ascii_sse2
+};
+static const TextKernels TEXT_KERNELS_AVX2 = {
+    "avx2", text_json_plain_avx2, text_url_plain_avx2, text_ascii_avx2
+};
+#define TEXT_KERNELS_BASELINE TEXT_KERNELS_SSE2
+
+#elif defined(__aarch64__) && !defined(LKB_NO_SIMD)
+
+/* 비교 결과(바이트당 0x00/0xFF)에서 처음 켜진 바이트 위치, 없으면 16 */
+static inline size_t neon_first_set(uint8x16_t cmp) {
+    uint64_t bits = vget_lane_u64(vreinterpret_u64_u8(vshrn_n_u16(vreinterpretq_u16_u8(cmp), 4)), 0);
+    return bits ? (size_t)(__builtin_ctzll(bits) >> 2) : 16;
+}
+
+static inline uint8x16_t neon_in_range(uint8x16_t v, unsigned char lo, unsigned char hi) {
+    return vandq_u8(vcgeq_u8(v, vdupq_n_u8(lo)), vcleq_u8(v, vdupq_n_u8(hi)));
+}
+
+size_t text_json_plain_neon(const unsigned char *s, size_t n) {
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        uint8x16_t v = vld1q_u8(s + i);
+        uint8x16_t special = vorrq_u8(vorrq_u8(vceqq_u8(v, vdupq_n_u8('"')), vceqq_u8(v, vdupq_n_u8('\\'))),
+                                      vcltq_u8(v, vdupq_n_u8(0x20)));
+        size_t first = neon_first_set(special);
+        if (first < 16) return i + first;
+    }
+    return i + text_json_plain_scalar(s + i, n - i);
+}
+
+size_t text_url_plain_neon(const unsigned char *s, size_t n) {
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        uint8x16_t v = vld1q_u8(s + i);
+        uint8x16_t plain = vorrq_u8(neon_in_range(vorrq_u8(v, vdupq_n_u8(0x20)), 'a', 'z'),
+                                    neon_in_range(v, '0', '9'));
+        plain = vorrq_u8(plain, vorrq_u8(vceqq_u8(v, vdupq_n_u8('-')), vceqq_u8(v, vdupq_n_u8('_'))));
+        plain = vorrq_u8(plain, vorrq_u8(vceqq_u8(v, vdupq_n_u8('.')), vceqq_u8(v, vdupq_n_u8('~'))));
+        size_t first = neon_first_set(vmvnq_u8(plain));
+        if (first < 16) return i + first;
+    }
+    return i + text_url_plain_scalar(s + i, n - i);
+}
+
+size_t text_ascii_neon(const unsigned char *s, size_t n) {
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        size_t first = neon_first_set(vcgeq_u8(vld1q_u8(s + i), vdupq_n_u8(0x80)));
+        if (first < 16) return i + first;
+    }
+    return i + text_ascii_scalar(s + i, n - i);
+}
+
+static const TextKernels TEXT_KERNELS_NEON = {
+    "neon", text_json_plain_neon, text_url_plain_neon, text_ascii_neon
+};
+#define TEXT_KERNELS_BASELINE TEXT_KERNELS_NEON
+
+#else
+#define TEXT_KERNELS_BASELINE TEXT_KERNELS_SCALAR
+#endif
+
+/* 이 빌드에 들어 있는 커널 (뒤쪽일수록 빠름) */
+static const TextKernels *const TEXT_KERNEL_SETS[] = {
+    &TEXT_KERNELS_SCALAR,
+#if defined(__x86_64__) && !defined(LKB_NO_SIMD)
+    &TEXT_KERNELS_SSE2,
+    &TEXT_KERNELS_AVX2,
+#elif defined(__aarch64__) && !defined(LKB_NO_SIMD)
+    &TEXT_KERNELS_NEON,
+#endif
+};
+#define TEXT_KERNEL_SET_COUNT (sizeof(TEXT_KERNEL_SETS) / sizeof(TEXT_KERNEL_SETS[0]))
+
+/* 아키텍처 기본 커널로 시작, main()에서 text_kernels_init()으로 CPU에 맞게 한 번 고름 */
+static TextKernels g_text = TEXT_KERNELS_BASELINE;
+
+bool text_kernels_supported(const TextKernels *kernels) {
+#if defined(__x86_64__) && !defined(LKB_NO_SIMD)
+    __builtin_cpu_init();
+    if (kernels == &TEXT_KERNELS_AVX2) return __builtin_cpu_supports("avx2");
+#endif
+    (void)kernels;
+    return true;
+}
+
+void text_kernels_init() {
+    for (size_t i = 0; i < TEXT_KERNEL_SET_COUNT; i++) {
+        if (text_kernels_supported(TEXT_KERNEL_SETS[i])) g_text = *TEXT_KERNEL_SETS[i];
     }
 }
 
@@ -143,176 +1145,906 @@ char* safe_strdup(const char *str) {
     return new_str;
 }
 
-/* 문자열 trim */
-char* trim_string(char *str) {
-    if (!str) return NULL;
-
-    while (isspace((unsigned char)*str)) str++;
-    if (*str == 0) return str;
+/* ByteBuffer: 필요할 때 두 배씩 확장 */
+void buffer_init(ByteBuffer *buf) {
+    buf->data = NULL;
+    buf->len = 0;
+    buf->cap = 0;
+}
 
-    char *end = str + strlen(str) - 1;
-    while (end > str && isspace((unsigned char)*end)) end--;
-    end[1] = '\0';
+void buffer_reserve(ByteBuffer *buf, size_t extra) {
+    size_t needed = buf->len + extra + 1;  /* 항상 NUL 종료 공간 확보 */
+    if (needed <= buf->cap) return;
 
-    return str;
+    size_t new_cap = buf->cap ? buf->cap : 4096;
+    while (new_cap < needed) new_cap *= 2;
+    buf->data = safe_realloc(buf->data, new_cap);
+    buf->cap = new_cap;
+    __atomic_add_fetch(&g_mem_stats.buffer_grows, 1, __ATOMIC_RELAXED);
 }
 
-/* URL 인코딩 (RFC 3986) */
-char* url_encode(const char *str) {
-    if (!str) return NULL;
-
-    size_t len = strlen(str);
-    /* 최악의 경우 각 문자가 %XX로 인코딩 (3배) */
-    char *encoded = safe_malloc(len * 3 + 1);
-    char *p = encoded;
+void buffer_append(ByteBuffer *buf, const char *data, size_t len) {
+    buffer_reserve(buf, len);
+    memcpy(buf->data + buf->len, data, len);
+    buf->len += len;
+    buf->data[buf->len] = '\0';
+}
 
-    for (const char *s = str; *s; s++) {
-        unsigned char c = (unsigned char)*s;
-        /* 안전한 문자: A-Z a-z 0-9 - _ . ~ */
-        if ((c >= 'A' && c <= 'Z') || (c >= 'a' && c <= 'z') ||
-            (c >= '0' && c <= '9') || c == '-' || c == '_' || c == '.' || c == '~') {
-            *p++ = c;
-        }
-        /* 공백은 _ 로 (MediaWiki 스타일) */
-        else if (c == ' ') {
-            *p++ = '_';
-        }
-        /* 나머지는 %XX로 인코딩 */
-        else {
-            sprintf(p, "%%%02X", c);
-            p += 3;
-        }
+/* printf 형식으로 덧붙임 */
+void buffer_appendf(ByteBuffer *buf, const char *fmt, ...) {
+    va_list args;
+    va_start(args, fmt);
+    int len = vsnprintf(buf->data ? buf->data + buf->len : NULL, buf->data ? buf->cap - buf->len : 0,
+                        fmt, args);
+    va_end(args);
+    if (len < 0) return;
+
+    if (!buf->data || buf->len + len >= buf->cap) {
+        buffer_reserve(buf, len);
+        va_start(args, fmt);
+        vsnprintf(buf->data + buf->len, buf->cap - buf->len, fmt, args);
+        va_end(args);
     }
-    *p = '\0';
-
-    return encoded;
+    buf->len += len;
 }
 
-#ifdef DEBUG
-/* 디버그 로그 작성 함수 */
-void write_debug_log(const char *section, const char *message) {
-    FILE *log_file = fopen(LOG_FILE, "a");
-    if (!log_file) {
-        fprintf(stderr, "[DEBUG] Failed to open log file: %s\n", LOG_FILE);
-        return;
+/* 앞쪽 n 바이트 제거 (남은 데이터는 앞으로 이동) */
+void buffer_consume(ByteBuffer *buf, size_t n) {
+    if (n >= buf->len) {
+        buf->len = 0;
+    } else {
+        memmove(buf->data, buf->data + n, buf->len - n);
+        buf->len -= n;
     }
+    if (buf->data) buf->data[buf->len] = '\0';
+}
 
-    time_t now = time(NULL);
-    struct tm *tm_info = localtime(&now);
-    char timestamp[64];
-    strftime(timestamp, sizeof(timestamp), "%Y-%m-%d %H:%M:%S", tm_info);
+void buffer_free(ByteBuffer *buf) {
+    free(buf->data);
+    buffer_init(buf);
+}
 
-    fprintf(log_file, "[%s] [%s] %s\n", timestamp, section, message);
-    fclose(log_file);
+/* 내용만 비우고 메모리는 다음 요청을 위해 유지 */
+void buffer_reset(ByteBuffer *buf) {
+    buf->len = 0;
+    if (buf->data) buf->data[0] = '\0';
 }
 
-/* 요청 로그 작성 함수 (Open WebUI로부터 받은 원본 요청) */
-void write_request_log(const char *raw_body) {
-    FILE *log_file = fopen(REQUEST_LOG_FILE, "a");
-    if (!log_file) {
-        fprintf(stderr, "[DEBUG] Failed to open request log file: %s\n", REQUEST_LOG_FILE);
-        return;
+/* 드물게 큰 요청으로 커진 버퍼는 반납 (재사용 버퍼가 상주 메모리를 붙잡지 않게) */
+void buffer_trim(ByteBuffer *buf, size_t retain) {
+    if (buf->cap > retain) {
+        buffer_free(buf);
+    } else {
+        buffer_reset(buf);
     }
+}
 
-    time_t now = time(NULL);
-    struct tm *tm_info = localtime(&now);
-    char timestamp[64];
-    strftime(timestamp, sizeof(timestamp), "%Y-%m-%d %H:%M:%S", tm_info);
+void arena_init(Arena *arena, size_t chunk_size) {
+    arena->head = NULL;
+    arena->chunk_size = chunk_size;
+    arena->used = 0;
+}
+
+/* 8바이트 정렬 할당, 현재 청크가 모자라면 새 청크 추가 */
+void* arena_alloc(Arena *arena, size_t size) {
+    size = (size + 7) & ~(size_t)7;
+    ArenaChunk *chunk = arena->head;
+
+    if (!chunk || chunk->size - chunk->used < size) {
+        size_t chunk_size = arena->chunk_size > size ? arena->chunk_size : size;
+        chunk = safe_malloc(sizeof(ArenaChunk) + chunk_size);
+        chunk->size = chunk_size;
+        chunk->used = 0;
+        chunk->next = arena->head;
+        arena->head = chunk;
+        __atomic_add_fetch(&g_mem_stats.arena_chunks, 1, __ATOMIC_RELAXED);
+    }
 
-    fprintf(log_file, "[%s] REQUEST_BODY: %s\n", timestamp, raw_body);
-    fclose(log_file);
+    void *ptr = chunk->data + chunk->used;
+    chunk->used += size;
+    arena->used += size;
+    return ptr;
 }
-#endif
 
-/* ============================
- * 설정 파일 파싱
- * ============================ */
+char* arena_strndup(Arena *arena, const char *str, size_t len) {
+    char *copy = arena_alloc(arena, len + 1);
+    memcpy(copy, str, len);
+    copy[len] = '\0';
+    return copy;
+}
 
-/* YAML 값 추출 (간단한 key: value 형식) */
-char* extract_yaml_value(const char *line) {
-    const char *colon = strchr(line, ':');
-    if (!colon) return NULL;
+char* arena_strdup(Arena *arena, const char *str) {
+    return arena_strndup(arena, str, strlen(str));
+}
 
-    const char *value = colon + 1;
-    while (*value && isspace((unsigned char)*value)) value++;
+void arena_free(Arena *arena) {
+    ArenaChunk *chunk = arena->head;
+    while (chunk) {
+        ArenaChunk *next = chunk->next;
+        free(chunk);
+        chunk = next;
+    }
+    arena->head = NULL;
+    arena->used = 0;
+}
 
-    if (*value == '"') {
-        value++;
-        const char *end = strchr(value, '"');
-        if (!end) return NULL;
-        size_t len = end - value;
-        char *result = safe_malloc(len + 1);
-        strncpy(result, value, len);
-        result[len] = '\0';
-        return result;
+/* 요청 종료: 청크 하나만 남기고 비움. 청크가 여러 개 필요했다면 합친 크기의
+ * 청크 하나로 바꿔 (SCRATCH_RETAIN_SIZE 이하) 다음 요청은 malloc 없이 처리 */
+void arena_reset(Arena *arena) {
+    size_t peak = __atomic_load_n(&g_mem_stats.arena_peak, __ATOMIC_RELAXED);
+    while (arena->used > peak &&
+           !__atomic_compare_exchange_n(&g_mem_stats.arena_peak, &peak, arena->used,
+                                        true, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
     }
+    __atomic_add_fetch(&g_mem_stats.arena_resets, 1, __ATOMIC_RELAXED);
 
-    char *result = safe_strdup(value);
-    char *newline = strchr(result, '\n');
-    if (newline) *newline = '\0';
-    char *comment = strchr(result, '#');
-    if (comment) *comment = '\0';
+    if (arena->head && (arena->head->next || arena->head->size > SCRATCH_RETAIN_SIZE)) {
+        size_t total = 0;
+        for (ArenaChunk *chunk = arena->head; chunk; chunk = chunk->next) {
+            total += chunk->size;
+        }
+        arena_free(arena);
+        if (total > arena->chunk_size) {
+            arena->chunk_size = total < SCRATCH_RETAIN_SIZE ? total : SCRATCH_RETAIN_SIZE;
+        }
+    } else if (arena->head) {
+        arena->head->used = 0;
+    }
+    arena->used = 0;
+}
 
-    return trim_string(result);
+/* 종료 시 메모리 재사용 통계 출력 - 요청 수가 늘어도 청크/확장 횟수가 그대로면 정상 */
+void memory_stats_report() {
+    struct rusage usage;
+    long max_rss_kb = (getrusage(RUSAGE_SELF, &usage) == 0) ? usage.ru_maxrss : 0;
+
+    printf("[Memory] arena_resets=%lu arena_chunks=%lu arena_peak=%zu buffer_grows=%lu max_rss=%ldKB\n",
+           __atomic_load_n(&g_mem_stats.arena_resets, __ATOMIC_RELAXED),
+           __atomic_load_n(&g_mem_stats.arena_chunks, __ATOMIC_RELAXED),
+           __atomic_load_n(&g_mem_stats.arena_peak, __ATOMIC_RELAXED),
+           __atomic_load_n(&g_mem_stats.buffer_grows, __ATOMIC_RELAXED),
+           max_rss_kb);
 }
 
-/* URL에서 host, port, path 파싱 */
-void parse_url(const char *url, char *host, int host_size, int *port, char *path, int path_size) {
-    const char *protocol = strstr(url, "://");
-    const char *start = protocol ? protocol + 3 : url;
+/* ---- /metrics 카운터 ---- */
 
-    const char *path_start = strchr(start, '/');
-    const char *port_start = strchr(start, ':');
+uint64_t metrics_now_us() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
 
-    if (port_start && (!path_start || port_start < path_start)) {
-        size_t host_len = port_start - start;
-        if (host_len >= (size_t)host_size) host_len = host_size - 1;
-        strncpy(host, start, host_len);
-        host[host_len] = '\0';
+/* 히스토그램 버킷 상한 (마이크로초) */
+static const uint64_t METRICS_BUCKET_BOUNDS_US[METRICS_BUCKET_COUNT] = {
+    50, 100, 250, 500, 1000, 2500, 5000, 10000, 25000, 50000,
+    100000, 250000, 500000, 1000000, 2500000
+};
 
-        *port = atoi(port_start + 1);
+void metrics_observe_us(MetricStage stage, uint64_t elapsed_us) {
+    LatencyHistogram *h = &g_metrics.stages[stage];
+    int bucket = 0;
+    while (bucket < METRICS_BUCKET_COUNT && elapsed_us > METRICS_BUCKET_BOUNDS_US[bucket]) bucket++;
 
-        if (path_start) {
-            safe_strncpy(path, path_start, path_size);
-        } else {
-            safe_strncpy(path, "/", path_size);
-        }
-    } else {
-        size_t host_len = path_start ? (size_t)(path_start - start) : strlen(start);
-        if (host_len >= (size_t)host_size) host_len = host_size - 1;
-        strncpy(host, start, host_len);
-        host[host_len] = '\0';
+    __atomic_add_fetch(&h->buckets[bucket], 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&h->count, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&h->sum_us, elapsed_us, __ATOMIC_RELAXED);
+}
 
-        *port = 80;
+/* start_us부터 지금까지를 기록하고 지금 시각을 반환 (다음 단계의 시작으로 이어 쓰기) */
+uint64_t metrics_observe(MetricStage stage, uint64_t start_us) {
+    uint64_t now = metrics_now_us();
+    metrics_observe_us(stage, now > start_us ? now - start_us : 0);
+    return now;
+}
 
-        if (path_start) {
-            safe_strncpy(path, path_start, path_size);
-        } else {
-            safe_strncpy(path, "/", path_size);
-        }
+void metrics_count(uint64_t *counter) {
+    __atomic_add_fetch(counter, 1, __ATOMIC_RELAXED);
+}
+
+/* FNV-1a 64비트 해시 */
+uint64_t hash_bytes(const void *data, size_t len, uint64_t seed) {
+    const unsigned char *p = data;
+    uint64_t hash = seed ? seed : 14695981039346656037ULL;
+    for (size_t i = 0; i < len; i++) {
+        hash ^= p[i];
+        hash *= 1099511628211ULL;
     }
+    return hash;
 }
 
-/* config.yaml 로드 */
-bool load_config(const char *filename, Config *config) {
-    FILE *f = fopen(filename, "r");
-    if (!f) {
-        fprintf(stderr, "[Config] Warning: %s not found, using defaults\n", filename);
-        return false;
+/* 짧은 키용 8바이트 단위 해시 (link 캐시: 결과마다 호출되어 FNV-1a로는 인코딩만큼 든다) */
+uint64_t hash_words(const void *data, size_t len) {
+    const unsigned char *p = data;
+    uint64_t hash = len * 0x9E3779B97F4A7C15ULL;
+    uint64_t word;
+    while (len >= 8) {
+        memcpy(&word, p, 8);
+        hash = (hash ^ word) * 0xBF58476D1CE4E5B9ULL;
+        hash ^= hash >> 31;
+        p += 8;
+        len -= 8;
     }
+    word = 0;
+    memcpy(&word, p, len);
+    hash = (hash ^ word) * 0x94D049BB133111EBULL;
+    return hash ^ (hash >> 29);
+}
 
-    /* 기본값 설정 */
-    safe_strncpy(config->listen, "0.0.0.0", sizeof(config->listen));
-    config->port = DEFAULT_PORT;
-    safe_strncpy(config->engine_type, "manticore", sizeof(config->engine_type));
-    safe_strncpy(config->engine_url, "http://127.0.0.1:29308/search", sizeof(config->engine_url));
-    safe_strncpy(config->index_name, "wiki_main", sizeof(config->index_name));
-    safe_strncpy(config->base_url, "http://localhost/mediawiki/index.php/", sizeof(config->base_url));
+/* 문자열 trim */
+char* trim_string(char *str) {
+    if (!str) return NULL;
+
+    while (isspace((unsigned char)*str)) str++;
+    if (*str == 0) return str;
+
+    char *end = str + strlen(str) - 1;
+    while (end > str && isspace((unsigned char)*end)) end--;
+    end[1] = '\0';
+
+    return str;
+}
+
+/* URL 인코딩 (RFC 3986), dst는 strlen(str) * 3 + 1 바이트 이상. 쓴 길이 반환 */
+size_t url_encode_into(char *dst, const char *str) {
+    static const char hex[] = "0123456789ABCDEF";
+    const unsigned char *s = (const unsigned char *)str;
+    char *p = dst;
+
+    while (*s) {
+        /* 안전한 문자: A-Z a-z 0-9 - _ . ~ 는 그대로.
+         * 제목은 짧은 구간이 대부분이라 16바이트까지는 직접 복사하고, 더 길면 커널로 */
+        size_t run = 0;
+        while (run < 16 && url_is_plain(s[run])) {
+            p[run] = s[run];
+            run++;
+        }
+        if (run == 16) {
+            size_t rest = g_text.url_plain(s + run, strlen((const char *)s + run));
+            memcpy(p + run, s + run, rest);
+            run += rest;
+        }
+        p += run;
+        s += run;
+
+        /* 인코딩할 바이트는 한글처럼 연달아 나오므로 이어서 처리 */
+        for (; *s && !url_is_plain(*s); s++) {
+            if (*s == ' ') {
+                *p++ = '_';  /* 공백은 _ 로 (MediaWiki 스타일) */
+            } else {
+                p[0] = '%';
+                p[1] = hex[*s >> 4];
+                p[2] = hex[*s & 0x0F];
+                p += 3;
+            }
+        }
+    }
+    *p = '\0';
+
+    return p - dst;
+}
+
+/* ============================
+ * 비동기 로거
+ * ============================ */
+
+/*
+ * 요청 처리 스레드는 잠금 없는 링 버퍼(Vyukov bounded queue)의 슬롯 하나를
+ * CAS로 잡아 그 자리에 문자열을 포맷하고 끝낸다. 파일 쓰기, 시각 포맷,
+ * fflush는 모두 기록 스레드가 한다. 링이 가득 차면 기다리지 않고 버린 뒤
+ * 개수만 센다 (/metrics lkb_log_dropped_total). 기록 스레드가 돌기 전
+ * (시작/종료 시점)에는 바로 stdout/stderr로 쓴다.
+ */
+
+static const char *LOG_LEVEL_NAMES[] = { "ERROR", "WARN", "INFO", "DEBUG" };
+
+bool log_level_from_name(const char *name, LogLevel *level) {
+    for (int i = 0; i <= LOG_LEVEL_DEBUG; i++) {
+        if (strcasecmp(name, LOG_LEVEL_NAMES[i]) == 0 ||
+            (i == LOG_LEVEL_WARN && strcasecmp(name, "warning") == 0)) {
+            *level = (LogLevel)i;
+            return true;
+        }
+    }
+    return false;
+}
+
+bool log_enabled(LogLevel level) {
+    return level <= g_config.log_level;
+}
+
+/* 싱크별 파일 경로 (NULL = 표준 출력 스트림 그대로) */
+const char* log_sink_path(LogSink sink) {
+    switch (sink) {
+        case LOG_SINK_STDOUT:
+        case LOG_SINK_STDERR:
+            return g_config.log_file[0] ? g_config.log_file : NULL;
+#ifdef DEBUG
+        case LOG_SINK_SEARCH:  return LOG_FILE;
+        case LOG_SINK_REQUEST: return REQUEST_LOG_FILE;
+        case LOG_SINK_RAW:     return RAW_REQUEST_LOG_FILE;
+#endif
+        default:
+            return NULL;
+    }
+}
+
+/* 로그 파일 열기 - 같은 경로는 FILE 하나를 공유 */
+void log_open_sinks() {
+    for (int sink = 0; sink < LOG_SINK_COUNT; sink++) {
+        const char *path = log_sink_path((LogSink)sink);
+        g_logger.files[sink] = NULL;
+
+        if (!path) {
+            g_logger.files[sink] = (sink == LOG_SINK_STDOUT) ? stdout : stderr;
+            continue;
+        }
+        for (int prev = 0; prev < sink; prev++) {
+            const char *prev_path = log_sink_path((LogSink)prev);
+            if (prev_path && strcmp(prev_path, path) == 0) {
+                g_logger.files[sink] = g_logger.files[prev];
+                break;
+            }
+        }
+        if (!g_logger.files[sink]) {
+            g_logger.files[sink] = fopen(path, "a");
+            if (!g_logger.files[sink]) {
+                fprintf(stderr, "[Log] Failed to open %s: %s, using stderr\n", path, strerror(errno));
+                g_logger.files[sink] = stderr;
+            }
+        }
+    }
+}
+
+void log_close_sinks() {
+    for (int sink = 0; sink < LOG_SINK_COUNT; sink++) {
+        FILE *f = g_logger.files[sink];
+        if (!f) continue;
+        fflush(f);
+        if (f != stdout && f != stderr) {
+            /* 공유된 FILE은 한 번만 닫기 */
+            for (int other = sink + 1; other < LOG_SINK_COUNT; other++) {
+                if (g_logger.files[other] == f) g_logger.files[other] = NULL;
+            }
+            fclose(f);
+        }
+        g_logger.files[sink] = NULL;
+    }
+}
+
+/* 한 줄 출력 (기록 스레드 또는 동기 모드) */
+void log_emit(FILE *out, LogSink sink, LogLevel level, const struct timespec *ts,
+              const char *text, size_t len) {
+    struct tm tm_info;
+    char timestamp[32];
+    localtime_r(&ts->tv_sec, &tm_info);
+    strftime(timestamp, sizeof(timestamp), "%Y-%m-%d %H:%M:%S", &tm_info);
+
+    if (sink == LOG_SINK_STDOUT || sink == LOG_SINK_STDERR) {
+        fprintf(out, "%s.%03ld %-5s %.*s\n", timestamp, ts->tv_nsec / 1000000,
+                LOG_LEVEL_NAMES[level], (int)len, text);
+    } else {
+        /* DEBUG 빌드 요청 로그는 기존 형식 유지 */
+        fprintf(out, "%s[%s] %.*s\n", sink == LOG_SINK_RAW ? "\n" : "", timestamp, (int)len, text);
+    }
+}
+
+void log_vwrite(LogLevel level, LogSink sink, const char *fmt, va_list args) {
+    if (!__atomic_load_n(&g_logger.running, __ATOMIC_ACQUIRE)) {
+        char line[LOG_LINE_MAX];
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        int len = vsnprintf(line, sizeof(line), fmt, args);
+        if (len < 0) return;
+        if (len >= LOG_LINE_MAX) len = LOG_LINE_MAX - 1;
+        /* 감독 프로세스는 기록 스레드 없이 log.file에 바로 씀 (열려 있으면) */
+        FILE *out = g_logger.files[sink] ? g_logger.files[sink] : (sink == LOG_SINK_STDOUT ? stdout : stderr);
+        log_emit(out, sink, level, &ts, line, len);
+        fflush(out);
+        return;
+    }
+
+    /* 빈 슬롯 예약: 순번이 pos와 같으면 비어 있음, 작으면 링이 가득 참 */
+    uint64_t pos = __atomic_load_n(&g_logger.enqueue_pos, __ATOMIC_RELAXED);
+    LogSlot *slot;
+    for (;;) {
+        slot = &g_logger.slots[pos & (LOG_RING_SLOTS - 1)];
+        uint64_t seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+        int64_t diff = (int64_t)(seq - pos);
+        if (diff == 0) {
+            if (__atomic_compare_exchange_n(&g_logger.enqueue_pos, &pos, pos + 1, true,
+                                            __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                break;
+            }
+        } else if (diff < 0) {
+            __atomic_add_fetch(&g_logger.dropped, 1, __ATOMIC_RELAXED);
+            return;
+        } else {
+            pos = __atomic_load_n(&g_logger.enqueue_pos, __ATOMIC_RELAXED);
+        }
+    }
+
+    clock_gettime(CLOCK_REALTIME, &slot->time);
+    slot->level = (unsigned char)level;
+    slot->sink = (unsigned char)sink;
+    int len = vsnprintf(slot->text, LOG_LINE_MAX, fmt, args);
+    if (len < 0) len = 0;
+    if (len >= LOG_LINE_MAX) len = LOG_LINE_MAX - 1;  /* 넘치는 부분은 잘림 */
+    slot->len = (unsigned short)len;
+    __atomic_store_n(&slot->seq, pos + 1, __ATOMIC_RELEASE);  /* 기록 스레드에 공개 */
+}
+
+/* 레벨 로그 - ERROR/WARN은 stderr, 나머지는 stdout (log.file이 있으면 둘 다 그 파일) */
+__attribute__((format(printf, 2, 3)))
+void log_write(LogLevel level, const char *fmt, ...) {
+    if (!log_enabled(level)) return;
+
+    va_list args;
+    va_start(args, fmt);
+    log_vwrite(level, level <= LOG_LEVEL_WARN ? LOG_SINK_STDERR : LOG_SINK_STDOUT, fmt, args);
+    va_end(args);
+}
+
+__attribute__((format(printf, 2, 3)))
+void log_sink_write(LogSink sink, const char *fmt, ...) {
+    va_list args;
+    va_start(args, fmt);
+    log_vwrite(LOG_LEVEL_DEBUG, sink, fmt, args);
+    va_end(args);
+}
+
+/* 로그에 남길 본문 길이 (log.payload_max까지, UTF-8 문자 중간에서 자르지 않음) */
+size_t log_payload_len(const char *data, size_t len) {
+    size_t max = (size_t)g_config.log_payload_max;
+    if (len <= max) return len;
+    while (max > 0 && ((unsigned char)data[max] & 0xC0) == 0x80) max--;
+    return max;
+}
+
+/* 요청/응답 본문 로그: 앞부분만, log.sample_rate 건 중 한 건만 */
+void log_payload(LogLevel level, LogPayloadKind kind, const char *label, const char *data, size_t len) {
+    if (!log_enabled(level)) return;
+    if (g_config.log_sample_rate > 1 &&
+        __atomic_fetch_add(&g_logger.payload_seq[kind], 1, __ATOMIC_RELAXED) % g_config.log_sample_rate != 0) {
+        return;
+    }
+
+    size_t shown = log_payload_len(data, len);
+    log_write(level, "%s (%zu bytes): %.*s%s", label, len, (int)shown, data, shown < len ? "..." : "");
+}
+
+/* ============================
+ * 트래픽 캡처 (log.capture_file)
+ * ============================ */
+
+/*
+ * 요청 스레드는 샘플링을 통과한 /search, /search/batch 본문을 레코드 헤더와 함께
+ * pending 버퍼에 복사만 한다. 파일 쓰기는 로그 기록 스레드가 64KB 또는 200ms마다
+ * 버퍼를 통째로 바꿔서 write() 한 번으로 한다. 파일은 O_APPEND라서 다중 프로세스가
+ * fork 전에 연 fd를 함께 써도 레코드 단위로만 이어진다.
+ */
+
+/* 덧붙이기로 열고 비어 있으면 파일 헤더 기록. 워커 프로세스들이 SIGHUP에 함께 다시 열어도
+ * 헤더가 한 번만 들어가도록 크기 확인과 헤더 기록은 flock 안에서 */
+bool capture_open(Capture *cap, const char *path) {
+    int fd = open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        fprintf(stderr, "[Capture] Cannot open %s: %s, capture disabled\n", path, strerror(errno));
+        return false;
+    }
+    while (flock(fd, LOCK_EX) != 0 && errno == EINTR) {}
+    struct stat st;
+    if (fstat(fd, &st) == 0 && st.st_size == 0) {
+        CaptureFileHeader header;
+        memset(&header, 0, sizeof(header));
+        memcpy(header.magic, CAPTURE_MAGIC, sizeof(header.magic));
+        header.version = CAPTURE_VERSION;
+        header.record_size = sizeof(CaptureRecord);
+        if (write(fd, &header, sizeof(header)) != (ssize_t)sizeof(header)) {
+            fprintf(stderr, "[Capture] Cannot write %s: %s, capture disabled\n", path, strerror(errno));
+            close(fd);
+            return false;
+        }
+    }
+    flock(fd, LOCK_UN);
+    cap->last_flush_us = metrics_now_us();
+    __atomic_store_n(&cap->fd, fd, __ATOMIC_RELEASE);
+    return true;
+}
+
+/* 샘플링을 통과하면 본문을 레코드로 (버퍼가 가득 차면 버리고 센다) */
+void capture_request(Capture *cap, CaptureKind kind, const char *body, size_t len) {
+    if (__atomic_load_n(&cap->fd, __ATOMIC_ACQUIRE) < 0) return;
+    if (g_config.capture_sample_rate > 1 &&
+        __atomic_fetch_add(&cap->seq, 1, __ATOMIC_RELAXED) % g_config.capture_sample_rate != 0) {
+        return;
+    }
+
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    CaptureRecord record;
+    memset(&record, 0, sizeof(record));
+    record.time_us = (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+    record.len = (uint32_t)len;
+    record.kind = (uint16_t)kind;
+
+    pthread_mutex_lock(&cap->lock);
+    if (len > UINT32_MAX || cap->pending.len + sizeof(record) + len > CAPTURE_BUFFER_MAX) {
+        cap->dropped++;
+    } else {
+        buffer_append(&cap->pending, (const char *)&record, sizeof(record));
+        buffer_append(&cap->pending, body, len);
+        cap->pending_records++;
+    }
+    pthread_mutex_unlock(&cap->lock);
+}
+
+/* 쌓인 레코드를 파일에 (force가 아니면 CAPTURE_FLUSH_BYTES / CAPTURE_FLUSH_US가 지났을 때만) */
+void capture_flush(Capture *cap, bool force) {
+    pthread_mutex_lock(&cap->write_lock);
+    if (cap->fd < 0) {
+        pthread_mutex_unlock(&cap->write_lock);
+        return;
+    }
+
+    uint64_t now = metrics_now_us();
+    pthread_mutex_lock(&cap->lock);
+    bool due = cap->pending.len > 0 &&
+               (force || cap->pending.len >= CAPTURE_FLUSH_BYTES || now - cap->last_flush_us >= CAPTURE_FLUSH_US);
+    uint64_t records = 0;
+    if (due) {
+        ByteBuffer swap = cap->writing;
+        cap->writing = cap->pending;
+        cap->pending = swap;
+        cap->pending.len = 0;
+        records = cap->pending_records;
+        cap->pending_records = 0;
+    }
+    pthread_mutex_unlock(&cap->lock);
+
+    if (due) {
+        cap->last_flush_us = now;
+        const char *p = cap->writing.data;
+        size_t left = cap->writing.len;
+        while (left > 0) {
+            ssize_t n = write(cap->fd, p, left);
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) break;
+            p += n;
+            left -= n;
+        }
+        if (left > 0) {
+            log_write(LOG_LEVEL_ERROR, "[Capture] Write failed: %s, %llu records dropped",
+                      strerror(errno), (unsigned long long)records);
+            __atomic_add_fetch(&cap->dropped, records, __ATOMIC_RELAXED);
+        } else {
+            __atomic_add_fetch(&cap->records, records, __ATOMIC_RELAXED);
+        }
+        buffer_trim(&cap->writing, CAPTURE_FLUSH_BYTES * 4);
+    }
+    pthread_mutex_unlock(&cap->write_lock);
+}
+
+/* SIGHUP: 옮겨진 캡처 파일 대신 새 파일 (기록 스레드) */
+void capture_reopen(Capture *cap) {
+    if (__atomic_load_n(&cap->fd, __ATOMIC_ACQUIRE) < 0) return;
+    capture_flush(cap, true);
+    pthread_mutex_lock(&cap->write_lock);
+    close(cap->fd);
+    cap->fd = -1;
+    capture_open(cap, g_config.capture_file);
+    pthread_mutex_unlock(&cap->write_lock);
+}
+
+/* 남은 레코드를 쓰고 닫기 (요청 처리가 끝난 뒤) */
+void capture_shutdown(Capture *cap) {
+    if (__atomic_load_n(&cap->fd, __ATOMIC_ACQUIRE) < 0) return;
+    capture_flush(cap, true);
+    pthread_mutex_lock(&cap->write_lock);
+    close(cap->fd);
+    __atomic_store_n(&cap->fd, -1, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&cap->write_lock);
+    printf("[Capture] %llu records written to %s (%llu dropped)\n", (unsigned long long)cap->records,
+           g_config.capture_file, (unsigned long long)cap->dropped);
+    buffer_free(&cap->pending);
+    buffer_free(&cap->writing);
+}
+
+/* 준비된 슬롯을 모두 출력, 출력한 줄 수 반환 */
+int log_drain() {
+    int drained = 0;
+    for (;;) {
+        LogSlot *slot = &g_logger.slots[g_logger.dequeue_pos & (LOG_RING_SLOTS - 1)];
+        if (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != g_logger.dequeue_pos + 1) break;
+
+        log_emit(g_logger.files[slot->sink], (LogSink)slot->sink, (LogLevel)slot->level,
+                 &slot->time, slot->text, slot->len);
+        /* 한 바퀴 뒤의 생산자가 쓸 수 있게 순번 갱신 */
+        __atomic_store_n(&slot->seq, g_logger.dequeue_pos + LOG_RING_SLOTS, __ATOMIC_RELEASE);
+        g_logger.dequeue_pos++;
+        drained++;
+    }
+
+    if (drained > 0) {
+        for (int sink = 0; sink < LOG_SINK_COUNT; sink++) {
+            if (g_logger.files[sink]) fflush(g_logger.files[sink]);
+        }
+    }
+    return drained;
+}
+
+void* log_writer_main(void *arg) {
+    (void)arg;
+
+    /* 시그널은 메인 스레드가 받음 */
+    sigset_t set;
+    sigemptyset(&set);
+    sigaddset(&set, SIGINT);
+    sigaddset(&set, SIGTERM);
+    sigaddset(&set, SIGHUP);
+    pthread_sigmask(SIG_BLOCK, &set, NULL);
+
+    for (;;) {
+        /* SIGHUP: logrotate 등으로 옮겨진 파일 대신 새 파일 열기 */
+        if (g_reopen_logs) {
+            g_reopen_logs = 0;
+            log_drain();
+            log_close_sinks();
+            log_open_sinks();
+            capture_reopen(&g_capture);
+        }
+        capture_flush(&g_capture, false);
+
+        if (log_drain() == 0) {
+            if (__atomic_load_n(&g_logger.stop, __ATOMIC_ACQUIRE)) break;
+            struct timespec idle = { .tv_sec = 0, .tv_nsec = LOG_IDLE_NS };
+            nanosleep(&idle, NULL);
+        }
+    }
+    return NULL;
+}
+
+/* 남은 로그를 모두 쓰고 기록 스레드 종료 (이후 로그는 동기 출력) */
+void log_shutdown() {
+    if (!__atomic_load_n(&g_logger.running, __ATOMIC_ACQUIRE)) return;
+
+    __atomic_store_n(&g_logger.stop, 1, __ATOMIC_RELEASE);
+    pthread_join(g_logger.thread, NULL);
+    __atomic_store_n(&g_logger.running, 0, __ATOMIC_RELEASE);
+    log_drain();  /* join 직전에 들어온 줄 */
+    log_close_sinks();
+    free(g_logger.slots);
+    g_logger.slots = NULL;
+
+    unsigned long long dropped = __atomic_load_n(&g_logger.dropped, __ATOMIC_RELAXED);
+    if (dropped > 0) {
+        printf("[Log] dropped=%llu lines (ring buffer full)\n", dropped);
+    }
+}
+
+void log_start() {
+    g_logger.slots = safe_malloc(sizeof(LogSlot) * LOG_RING_SLOTS);
+    for (uint64_t i = 0; i < LOG_RING_SLOTS; i++) {
+        g_logger.slots[i].seq = i;
+    }
+    g_logger.enqueue_pos = 0;
+    g_logger.dequeue_pos = 0;
+    g_logger.stop = 0;
+    log_open_sinks();
+
+    if (pthread_create(&g_logger.thread, NULL, log_writer_main, NULL) != 0) {
+        perror("[Log] pthread_create failed, logging synchronously");
+        log_close_sinks();
+        free(g_logger.slots);
+        g_logger.slots = NULL;
+        return;
+    }
+    __atomic_store_n(&g_logger.running, 1, __ATOMIC_RELEASE);
+    atexit(log_shutdown);  /* exit() 경로에서도 남은 로그 기록 */
+}
+
+#ifdef DEBUG
+/* 디버그 로그 작성 함수 */
+void write_debug_log(const char *section, const char *message) {
+    log_sink_write(LOG_SINK_SEARCH, "[%s] %s", section, message);
+}
+
+/* 요청 로그 작성 함수 (Open WebUI로부터 받은 원본 요청) */
+void write_request_log(const char *raw_body) {
+    size_t len = strlen(raw_body);
+    size_t shown = log_payload_len(raw_body, len);
+    log_sink_write(LOG_SINK_REQUEST, "REQUEST_BODY: %.*s%s", (int)shown, raw_body,
+                   shown < len ? "..." : "");
+}
+
+/* 원본 HTTP 요청 로그 (헤더 포함 전체 트래픽, log.payload_max까지) */
+void write_raw_request_log(const char *request, size_t len) {
+    size_t shown = log_payload_len(request, len);
+    log_sink_write(LOG_SINK_RAW, "=== RAW HTTP REQUEST (bytes: %zu) ===\n%.*s%s\n=== END ===",
+                   len, (int)shown, request, shown < len ? "..." : "");
+}
+#endif
+
+/* ============================
+ * 설정 파일 파싱
+ * ============================ */
+
+/* YAML 값 추출 (간단한 key: value 형식) */
+char* extract_yaml_value(const char *line) {
+    const char *colon = strchr(line, ':');
+    if (!colon) return NULL;
+
+    const char *value = colon + 1;
+    while (*value && isspace((unsigned char)*value)) value++;
+
+    if (*value == '"') {
+        value++;
+        const char *end = strchr(value, '"');
+        if (!end) return NULL;
+        size_t len = end - value;
+        char *result = safe_malloc(len + 1);
+        strncpy(result, value, len);
+        result[len] = '\0';
+        return result;
+    }
+
+    char *result = safe_strdup(value);
+    char *newline = strchr(result, '\n');
+    if (newline) *newline = '\0';
+    char *comment = strchr(result, '#');
+    if (comment) *comment = '\0';
+
+    return trim_string(result);
+}
+
+/* URL에서 host, port, path 파싱 */
+void parse_url(const char *url, char *host, int host_size, int *port, char *path, int path_size) {
+    const char *protocol = strstr(url, "://");
+    const char *start = protocol ? protocol + 3 : url;
+
+    const char *path_start = strchr(start, '/');
+    const char *port_start = strchr(start, ':');
+
+    if (port_start && (!path_start || port_start < path_start)) {
+        size_t host_len = port_start - start;
+        if (host_len >= (size_t)host_size) host_len = host_size - 1;
+        strncpy(host, start, host_len);
+        host[host_len] = '\0';
+
+        *port = atoi(port_start + 1);
+
+        if (path_start) {
+            safe_strncpy(path, path_start, path_size);
+        } else {
+            safe_strncpy(path, "/", path_size);
+        }
+    } else {
+        size_t host_len = path_start ? (size_t)(path_start - start) : strlen(start);
+        if (host_len >= (size_t)host_size) host_len = host_size - 1;
+        strncpy(host, start, host_len);
+        host[host_len] = '\0';
+
+        *port = 80;
+
+        if (path_start) {
+            safe_strncpy(path, path_start, path_size);
+        } else {
+            safe_strncpy(path, "/", path_size);
+        }
+    }
+}
+
+/* engine.url 목록을 replica 주소로 나눔. 한 줄 목록("a, b" 또는 [a, b])과 블록 목록
+ * (- a) 모두 engine_url에 쉼표로 이어져 있다. 주소가 하나도 없으면 이전 목록 유지 */
+void config_parse_backends(Config *config) {
+    char list[sizeof(config->engine_url)];
+    memcpy(list, config->engine_url, sizeof(list));
+
+    int count = 0;
+    char *saveptr = NULL;
+    for (char *item = strtok_r(list, ",", &saveptr); item; item = strtok_r(NULL, ",", &saveptr)) {
+        while (*item == '[' || *item == '"' || *item == '\'' || isspace((unsigned char)*item)) item++;
+        size_t len = strlen(item);
+        while (len > 0 && (item[len - 1] == ']' || item[len - 1] == '"' || item[len - 1] == '\'' ||
+                           isspace((unsigned char)item[len - 1]))) {
+            item[--len] = '\0';
+        }
+        if (len == 0) continue;
+        if (count == MAX_BACKENDS) {
+            fprintf(stderr, "[Config] engine.url lists more than %d backends, ignoring the rest\n",
+                    MAX_BACKENDS);
+            break;
+        }
+        UpstreamAddress *addr = &config->backends[count++];
+        parse_url(item, addr->host, sizeof(addr->host), &addr->port, addr->path, sizeof(addr->path));
+    }
+
+    if (count == 0) {
+        fprintf(stderr, "[Config] engine.url has no backend, keeping %s:%d\n",
+                config->backends[0].host, config->backends[0].port);
+        return;
+    }
+    config->backend_count = count;
+}
+
+/* 기본 설정값 (설정 파일이 없거나 키가 빠진 경우) */
+void init_default_config(Config *config) {
+    memset(config, 0, sizeof(Config));
+    safe_strncpy(config->listen, "0.0.0.0", sizeof(config->listen));
+    config->port = DEFAULT_PORT;
+    config->workers = DEFAULT_WORKERS;
+    config->processes = 1;
+    config->cpu_affinity = true;
+    config->queue_size = DEFAULT_QUEUE_SIZE;
+    config->backlog = DEFAULT_BACKLOG;
+    safe_strncpy(config->io_mode, "threads", sizeof(config->io_mode));
+    config->max_connections = DEFAULT_MAX_CONNECTIONS;
+    config->keepalive_timeout = DEFAULT_KEEPALIVE_TIMEOUT;
+    config->keepalive_max_requests = DEFAULT_KEEPALIVE_MAX_REQUESTS;
+    config->stream_min_count = DEFAULT_STREAM_MIN_COUNT;
+    safe_strncpy(config->engine_type, "manticore", sizeof(config->engine_type));
+    safe_strncpy(config->engine_url, "http://127.0.0.1:29308/search", sizeof(config->engine_url));
+    safe_strncpy(config->index_name, "wiki_main", sizeof(config->index_name));
+    safe_strncpy(config->template_file, TEMPLATE_FILE, sizeof(config->template_file));
+    safe_strncpy(config->base_url, "http://localhost/mediawiki/index.php/", sizeof(config->base_url));
     config->search_count = DEFAULT_SEARCH_COUNT;
     config->snippet_length = MAX_SNIPPET_LEN;
+    safe_strncpy(config->snippet_mode, "match", sizeof(config->snippet_mode));
+    config->snippet_scan_max = DEFAULT_SNIPPET_SCAN_MAX;
+    config->pool_size = DEFAULT_POOL_SIZE;
+    config->pool_idle_timeout = DEFAULT_POOL_IDLE_TIMEOUT;
+    config->max_response_size = BUFFER_SIZE;
+    config->connect_timeout_ms = DEFAULT_CONNECT_TIMEOUT_MS;
+    config->first_byte_timeout_ms = DEFAULT_FIRST_BYTE_TIMEOUT_MS;
+    config->timeout_ms = DEFAULT_UPSTREAM_TIMEOUT_MS;
+    config->fanout_queries = 1;
+    config->rrf_k = DEFAULT_RRF_K;
+    config->coalesce = true;
+    config->cache_enabled = true;
+    config->cache_max_bytes = DEFAULT_CACHE_MAX_BYTES;
+    config->link_cache_bytes = DEFAULT_LINK_CACHE_BYTES;
+    config->cache_ttl = DEFAULT_CACHE_TTL;
+    config->cache_stale_ttl = DEFAULT_CACHE_STALE_TTL;
+    config->cache_negative_ttl = DEFAULT_CACHE_NEGATIVE_TTL;
+    config->breaker_enabled = true;
+    config->breaker_error_rate = DEFAULT_BREAKER_ERROR_RATE;
+    config->breaker_min_requests = DEFAULT_BREAKER_MIN_REQUESTS;
+    config->breaker_window = DEFAULT_BREAKER_WINDOW;
+    config->breaker_cooldown = DEFAULT_BREAKER_COOLDOWN;
+    config->admission_max_in_flight = DEFAULT_ADMISSION_MAX_IN_FLIGHT;
+    config->admission_min_in_flight = DEFAULT_ADMISSION_MIN_IN_FLIGHT;
+    config->admission_queue_timeout_ms = DEFAULT_ADMISSION_QUEUE_TIMEOUT_MS;
+    config->admission_retry_after = DEFAULT_ADMISSION_RETRY_AFTER;
+    config->health_check_interval = DEFAULT_HEALTH_CHECK_INTERVAL;
+    config->hedge = false;
+    config->hedge_min_ms = DEFAULT_HEDGE_MIN_MS;
+    config->title_index_prefix = true;
+    config->title_index_min_prefix = DEFAULT_TITLE_INDEX_MIN_PREFIX;
+    config->query_strip_think = true;
+    config->query_unwrap = true;
+    config->query_max_tokens = DEFAULT_QUERY_MAX_TOKENS;
+    config->log_level = LOG_LEVEL_INFO;
+    config->log_payload_max = DEFAULT_LOG_PAYLOAD_MAX;
+    config->log_sample_rate = 1;
+    config->capture_sample_rate = 1;
+
+    config_parse_backends(config);
+}
+
+/* config.yaml 로드 */
+bool load_config(const char *filename, Config *config) {
+    /* 기본값 설정 */
+    init_default_config(config);
+
+    FILE *f = fopen(filename, "r");
+    if (!f) {
+        fprintf(stderr, "[Config] Warning: %s not found, using defaults\n", filename);
+        return false;
+    }
 
     char line[MAX_CONFIG_LINE];
     char current_section[64] = "";
+    bool in_url_list = false;  /* engine.url 다음 줄들이 "- 주소" 블록 목록 */
+    bool in_stopword_list = false;  /* query.stopwords 다음 줄들이 "- 단어" 블록 목록 */
 
     while (fgets(line, sizeof(line), f)) {
         char *trimmed = trim_string(line);
@@ -327,6 +2059,8 @@ bool load_config(const char *filename, Config *config) {
                 strncpy(current_section, trimmed, section_len);
                 current_section[section_len] = '\0';
             }
+            in_url_list = false;
+            in_stopword_list = false;
             continue;
         }
 
@@ -344,34 +2078,124 @@ bool load_config(const char *filename, Config *config) {
                     config->port = atoi(value);
                     free(value);
                 }
-            }
-        }
-        /* engine 섹션 */
-        else if (strcmp(current_section, "engine") == 0) {
-            if (strstr(trimmed, "type:")) {
+            } else if (strstr(trimmed, "workers:")) {
                 char *value = extract_yaml_value(trimmed);
                 if (value) {
-                    safe_strncpy(config->engine_type, value, sizeof(config->engine_type));
+                    config->workers = atoi(value);
                     free(value);
                 }
-            } else if (strstr(trimmed, "replace_return_url:")) {
+            } else if (strstr(trimmed, "processes:")) {
                 char *value = extract_yaml_value(trimmed);
                 if (value) {
-                    safe_strncpy(config->base_url, value, sizeof(config->base_url));
+                    config->processes = atoi(value);
                     free(value);
                 }
-            } else if (strstr(trimmed, "url:")) {
+            } else if (strstr(trimmed, "cpu_affinity:")) {
                 char *value = extract_yaml_value(trimmed);
                 if (value) {
-                    safe_strncpy(config->engine_url, value, sizeof(config->engine_url));
+                    config->cpu_affinity = (strcmp(value, "true") == 0 || strcmp(value, "1") == 0);
                     free(value);
                 }
-            } else if (strstr(trimmed, "index_name:")) {
+            } else if (strstr(trimmed, "queue_size:")) {
+                char *value = extract_yaml_value(trimmed);
+                if (value) {
+                    config->queue_size = atoi(value);
+                    free(value);
+                }
+            } else if (strstr(trimmed, "backlog:")) {
+                char *value = extract_yaml_value(trimmed);
+                if (value) {
+                    config->backlog = atoi(value);
+                    free(value);
+                }
+            } else if (strstr(trimmed, "io_mode:")) {
+                char *value = extract_yaml_value(trimmed);
+                if (value) {
+                    safe_strncpy(config->io_mode, value, sizeof(config->io_mode));
+                    free(value);
+                }
+            } else if (strstr(trimmed, "max_connections:")) {
+                char *value = extract_yaml_value(trimmed);
+                if (value) {
+                    config->max_connections = atoi(value);
+                    free(value);
+                }
+            } else if (strstr(trimmed, "keepalive_timeout:")) {
+                char *value = extract_yaml_value(trimmed);
+                if (value) {
+                    config->keepalive_timeout = atoi(value);
+                    free(value);
+                }
+            } else if (strstr(trimmed, "keepalive_max_requests:")) {
+                char *value = extract_yaml_value(trimmed);
+                if (value) {
+                    config->keepalive_max_requests = atoi(value);
+                    free(value);
+                }
+            } else if (strstr(trimmed, "compact_json:")) {
+                char *value = extract_yaml_value(trimmed);
+                if (value) {
+                    config->compact_json = (strcmp(value, "true") == 0 || strcmp(value, "1") == 0);
+                    free(value);
+                }
+            } else if (strstr(trimmed, "stream_results:")) {
+                char *value = extract_yaml_value(trimmed);
+                if (value) {
+                    config->stream_results = (strcmp(value, "true") == 0 || strcmp(value, "1") == 0);
+                    free(value);
+                }
+            } else if (strstr(trimmed, "stream_min_count:")) {
+                char *value = extract_yaml_value(trimmed);
+                if (value) {
+                    config->stream_min_count = atoi(value);
+                    free(value);
+                }
+            }
+        }
+        /* engine 섹션 */
+        else if (strcmp(current_section, "engine") == 0) {
+            if (in_url_list && trimmed[0] == '-') {
+                char *item = trim_string(trimmed + 1);
+                char *comment = strchr(item, '#');
+                if (comment) *comment = '\0';
+                size_t used = strlen(config->engine_url);
+                snprintf(config->engine_url + used, sizeof(config->engine_url) - used, "%s%s",
+                         used ? "," : "", item);
+                continue;
+            }
+            in_url_list = false;
+
+            if (strstr(trimmed, "type:")) {
+                char *value = extract_yaml_value(trimmed);
+                if (value) {
+                    safe_strncpy(config->engine_type, value, sizeof(config->engine_type));
+                    free(value);
+                }
+            } else if (strstr(trimmed, "replace_return_url:")) {
+                char *value = extract_yaml_value(trimmed);
+                if (value) {
+                    safe_strncpy(config->base_url, value, sizeof(config->base_url));
+                    free(value);
+                }
+            } else if (strstr(trimmed, "url:")) {
+                char *value = extract_yaml_value(trimmed);
+                if (value) {
+                    safe_strncpy(config->engine_url, value, sizeof(config->engine_url));
+                    in_url_list = (value[0] == '\0');  /* 값이 없으면 다음 줄부터 목록 */
+                    free(value);
+                }
+            } else if (strstr(trimmed, "index_name:")) {
                 char *value = extract_yaml_value(trimmed);
                 if (value) {
                     safe_strncpy(config->index_name, value, sizeof(config->index_name));
                     free(value);
                 }
+            } else if (strstr(trimmed, "template_file:")) {
+                char *value = extract_yaml_value(trimmed);
+                if (value) {
+                    safe_strncpy(config->template_file, value, sizeof(config->template_file));
+                    free(value);
+                }
             } else if (strstr(trimmed, "search_count:")) {
                 char *value = extract_yaml_value(trimmed);
                 if (value) {
@@ -384,828 +2208,7512 @@ bool load_config(const char *filename, Config *config) {
                     config->snippet_length = atoi(value);
                     free(value);
                 }
+            } else if (strstr(trimmed, "snippet_mode:")) {
+                char *value = extract_yaml_value(trimmed);
+                if (value) {
+                    safe_strncpy(config->snippet_mode, value, sizeof(config->snippet_mode));
+                    free(value);
+                }
+            } else if (strstr(trimmed, "snippet_scan_max:")) {
+                char *value = extract_yaml_value(trimmed);
+                if (value) {
+                    config->snippet_scan_max = strtoul(value, NULL, 10);
+                    free(value);
+                }
+            } else if (strstr(trimmed, "pool_size:")) {
+                char *value = extract_yaml_value(trimmed);
+                if (value) {
+                    config->pool_size = atoi(value);
+                    free(value);
+                }
+            } else if (strstr(trimmed, "pool_idle_timeout:")) {
+                char *value = extract_yaml_value(trimmed);
+                if (value) {
+                    config->pool_idle_timeout = atoi(value);
+                    free(value);
+                }
+            } else if (strstr(trimmed, "max_response_size:")) {
+                char *value = extract_yaml_value(trimmed);
+                if (value) {
+                    config->max_response_size = strtoul(value, NULL, 10);
+                    free(value);
+                }
+            } else if (strstr(trimmed, "connect_timeout_ms:")) {
+                char *value = extract_yaml_value(trimmed);
+                if (value) {
+                    config->connect_timeout_ms = atoi(value);
+                    free(value);
+                }
+            } else if (strstr(trimmed, "first_byte_timeout_ms:")) {
+                char *value = extract_yaml_value(trimmed);
+                if (value) {
+                    config->first_byte_timeout_ms = atoi(value);
+                    free(value);
+                }
+            } else if (strstr(trimmed, "timeout_ms:")) {
+                char *value = extract_yaml_value(trimmed);
+                if (value) {
+                    config->timeout_ms = atoi(value);
+                    free(value);
+                }
+            } else if (strstr(trimmed, "fanout_queries:")) {
+                char *value = extract_yaml_value(trimmed);
+                if (value) {
+                    config->fanout_queries = atoi(value);
+                    free(value);
+                }
+            } else if (strstr(trimmed, "rrf_k:")) {
+                char *value = extract_yaml_value(trimmed);
+                if (value) {
+                    config->rrf_k = atoi(value);
+                    free(value);
+                }
+            } else if (strstr(trimmed, "coalesce:")) {
+                char *value = extract_yaml_value(trimmed);
+                if (value) {
+                    config->coalesce = (strcmp(value, "true") == 0 || strcmp(value, "1") == 0);
+                    free(value);
+                }
+            } else if (strstr(trimmed, "health_check_interval:")) {
+                char *value = extract_yaml_value(trimmed);
+                if (value) {
+                    config->health_check_interval = atoi(value);
+                    free(value);
+                }
+            } else if (strstr(trimmed, "hedge_min_ms:")) {
+                char *value = extract_yaml_value(trimmed);
+                if (value) {
+                    config->hedge_min_ms = atoi(value);
+                    free(value);
+                }
+            } else if (strstr(trimmed, "hedge:")) {
+                char *value = extract_yaml_value(trimmed);
+                if (value) {
+                    config->hedge = (strcmp(value, "true") == 0 || strcmp(value, "1") == 0);
+                    free(value);
+                }
+            }
+        }
+        /* cache 섹션 */
+        else if (strcmp(current_section, "cache") == 0) {
+            if (strstr(trimmed, "enabled:")) {
+                char *value = extract_yaml_value(trimmed);
+                if (value) {
+                    config->cache_enabled = (strcmp(value, "true") == 0 || strcmp(value, "1") == 0);
+                    free(value);
+                }
+            } else if (strstr(trimmed, "link_max_bytes:")) {
+                char *value = extract_yaml_value(trimmed);
+                if (value) {
+                    config->link_cache_bytes = strtoul(value, NULL, 10);
+                    free(value);
+                }
+            } else if (strstr(trimmed, "max_bytes:")) {
+                char *value = extract_yaml_value(trimmed);
+                if (value) {
+                    config->cache_max_bytes = strtoul(value, NULL, 10);
+                    free(value);
+                }
+            } else if (strstr(trimmed, "soft_ttl:")) {
+                char *value = extract_yaml_value(trimmed);
+                if (value) {
+                    config->cache_soft_ttl = atoi(value);
+                    free(value);
+                }
+            } else if (strstr(trimmed, "negative_ttl:")) {
+                char *value = extract_yaml_value(trimmed);
+                if (value) {
+                    config->cache_negative_ttl = atoi(value);
+                    free(value);
+                }
+            } else if (strstr(trimmed, "stale_ttl:")) {
+                char *value = extract_yaml_value(trimmed);
+                if (value) {
+                    config->cache_stale_ttl = atoi(value);
+                    free(value);
+                }
+            } else if (strstr(trimmed, "ttl:")) {
+                char *value = extract_yaml_value(trimmed);
+                if (value) {
+                    config->cache_ttl = atoi(value);
+                    free(value);
+                }
+            }
+        }
+        /* title_index 섹션 */
+        else if (strcmp(current_section, "title_index") == 0) {
+            if (strstr(trimmed, "file:")) {
+                char *value = extract_yaml_value(trimmed);
+                if (value) {
+                    safe_strncpy(config->title_index_file, value, sizeof(config->title_index_file));
+                    free(value);
+                }
+            } else if (strstr(trimmed, "min_prefix:")) {
+                char *value = extract_yaml_value(trimmed);
+                if (value) {
+                    config->title_index_min_prefix = atoi(value);
+                    free(value);
+                }
+            } else if (strstr(trimmed, "prefix:")) {
+                char *value = extract_yaml_value(trimmed);
+                if (value) {
+                    config->title_index_prefix = (strcmp(value, "true") == 0 || strcmp(value, "1") == 0);
+                    free(value);
+                }
+            }
+        }
+        /* query 섹션 */
+        else if (strcmp(current_section, "query") == 0) {
+            if (in_stopword_list && trimmed[0] == '-') {
+                char *item = trim_string(trimmed + 1);
+                char *comment = strchr(item, '#');
+                if (comment) *comment = '\0';
+                size_t used = strlen(config->query_stopwords);
+                snprintf(config->query_stopwords + used, sizeof(config->query_stopwords) - used, "%s%s",
+                         used ? "," : "", item);
+                continue;
+            }
+            in_stopword_list = false;
+
+            if (strstr(trimmed, "strip_think:")) {
+                char *value = extract_yaml_value(trimmed);
+                if (value) {
+                    config->query_strip_think = (strcmp(value, "true") == 0 || strcmp(value, "1") == 0);
+                    free(value);
+                }
+            } else if (strstr(trimmed, "unwrap:")) {
+                char *value = extract_yaml_value(trimmed);
+                if (value) {
+                    config->query_unwrap = (strcmp(value, "true") == 0 || strcmp(value, "1") == 0);
+                    free(value);
+                }
+            } else if (strstr(trimmed, "max_tokens:")) {
+                char *value = extract_yaml_value(trimmed);
+                if (value) {
+                    config->query_max_tokens = atoi(value);
+                    free(value);
+                }
+            } else if (strstr(trimmed, "stopwords:")) {
+                char *value = extract_yaml_value(trimmed);
+                if (value) {
+                    safe_strncpy(config->query_stopwords, value, sizeof(config->query_stopwords));
+                    in_stopword_list = (value[0] == '\0');  /* 값이 없으면 다음 줄부터 목록 */
+                    free(value);
+                }
+            }
+        }
+        /* breaker 섹션 */
+        else if (strcmp(current_section, "breaker") == 0) {
+            if (strstr(trimmed, "enabled:")) {
+                char *value = extract_yaml_value(trimmed);
+                if (value) {
+                    config->breaker_enabled = (strcmp(value, "true") == 0 || strcmp(value, "1") == 0);
+                    free(value);
+                }
+            } else if (strstr(trimmed, "error_rate:")) {
+                char *value = extract_yaml_value(trimmed);
+                if (value) {
+                    config->breaker_error_rate = atoi(value);
+                    free(value);
+                }
+            } else if (strstr(trimmed, "min_requests:")) {
+                char *value = extract_yaml_value(trimmed);
+                if (value) {
+                    config->breaker_min_requests = atoi(value);
+                    free(value);
+                }
+            } else if (strstr(trimmed, "window:")) {
+                char *value = extract_yaml_value(trimmed);
+                if (value) {
+                    config->breaker_window = atoi(value);
+                    free(value);
+                }
+            } else if (strstr(trimmed, "cooldown:")) {
+                char *value = extract_yaml_value(trimmed);
+                if (value) {
+                    config->breaker_cooldown = atoi(value);
+                    free(value);
+                }
+            }
+        }
+        /* admission 섹션 */
+        else if (strcmp(current_section, "admission") == 0) {
+            if (strstr(trimmed, "enabled:")) {
+                char *value = extract_yaml_value(trimmed);
+                if (value) {
+                    config->admission_enabled = (strcmp(value, "true") == 0 || strcmp(value, "1") == 0);
+                    free(value);
+                }
+            } else if (strstr(trimmed, "max_in_flight:")) {
+                char *value = extract_yaml_value(trimmed);
+                if (value) {
+                    config->admission_max_in_flight = atoi(value);
+                    free(value);
+                }
+            } else if (strstr(trimmed, "min_in_flight:")) {
+                char *value = extract_yaml_value(trimmed);
+                if (value) {
+                    config->admission_min_in_flight = atoi(value);
+                    free(value);
+                }
+            } else if (strstr(trimmed, "queue_timeout_ms:")) {
+                char *value = extract_yaml_value(trimmed);
+                if (value) {
+                    config->admission_queue_timeout_ms = atoi(value);
+                    free(value);
+                }
+            } else if (strstr(trimmed, "latency_target_ms:")) {
+                char *value = extract_yaml_value(trimmed);
+                if (value) {
+                    config->admission_latency_target_ms = atoi(value);
+                    free(value);
+                }
+            } else if (strstr(trimmed, "retry_after:")) {
+                char *value = extract_yaml_value(trimmed);
+                if (value) {
+                    config->admission_retry_after = atoi(value);
+                    free(value);
+                }
             }
         }
+        /* log 섹션 */
+        else if (strcmp(current_section, "log") == 0) {
+            if (strstr(trimmed, "level:")) {
+                char *value = extract_yaml_value(trimmed);
+                if (value) {
+                    if (!log_level_from_name(value, &config->log_level)) {
+                        fprintf(stderr, "[Config] Unknown log.level \"%s\", using info\n", value);
+                        config->log_level = LOG_LEVEL_INFO;
+                    }
+                    free(value);
+                }
+            } else if (strstr(trimmed, "capture_file:")) {
+                char *value = extract_yaml_value(trimmed);
+                if (value) {
+                    safe_strncpy(config->capture_file, value, sizeof(config->capture_file));
+                    free(value);
+                }
+            } else if (strstr(trimmed, "capture_sample_rate:")) {
+                char *value = extract_yaml_value(trimmed);
+                if (value) {
+                    config->capture_sample_rate = atoi(value);
+                    free(value);
+                }
+            } else if (strstr(trimmed, "file:")) {
+                char *value = extract_yaml_value(trimmed);
+                if (value) {
+                    safe_strncpy(config->log_file, value, sizeof(config->log_file));
+                    free(value);
+                }
+            } else if (strstr(trimmed, "payload_max:")) {
+                char *value = extract_yaml_value(trimmed);
+                if (value) {
+                    config->log_payload_max = atoi(value);
+                    free(value);
+                }
+            } else if (strstr(trimmed, "sample_rate:")) {
+                char *value = extract_yaml_value(trimmed);
+                if (value) {
+                    config->log_sample_rate = atoi(value);
+                    free(value);
+                }
+            }
+        }
+    }
+
+    fclose(f);
+
+    /* 범위 보정 */
+    if (config->workers < 1) config->workers = 1;
+    if (config->workers > MAX_WORKERS) config->workers = MAX_WORKERS;
+    if (config->processes < 1) config->processes = 1;
+    if (config->processes > MAX_PROCESSES) config->processes = MAX_PROCESSES;
+    if (config->queue_size < 1) config->queue_size = DEFAULT_QUEUE_SIZE;
+    if (config->backlog < 1) config->backlog = DEFAULT_BACKLOG;
+    if (config->max_connections < 1) config->max_connections = DEFAULT_MAX_CONNECTIONS;
+    if (config->keepalive_timeout < 0) config->keepalive_timeout = 0;
+    if (config->keepalive_max_requests < 1) config->keepalive_max_requests = 1;
+    if (config->stream_min_count < 1) config->stream_min_count = 1;
+    if (config->pool_size < 0) config->pool_size = 0;
+    if (config->pool_size > MAX_POOL_SIZE) config->pool_size = MAX_POOL_SIZE;
+    if (config->max_response_size == 0) config->max_response_size = BUFFER_SIZE;
+    if (config->fanout_queries < 1) config->fanout_queries = 1;
+    if (config->fanout_queries > MAX_QUERIES) config->fanout_queries = MAX_QUERIES;
+    if (config->rrf_k < 1) config->rrf_k = DEFAULT_RRF_K;
+    if (config->cache_max_bytes == 0 || config->cache_ttl <= 0) config->cache_enabled = false;
+    if (config->cache_stale_ttl < 0) config->cache_stale_ttl = 0;
+    if (config->cache_soft_ttl < 0 || config->cache_soft_ttl >= config->cache_ttl) config->cache_soft_ttl = 0;
+    if (config->cache_negative_ttl < 0) config->cache_negative_ttl = 0;
+    config->base_url_plain = strpbrk(config->base_url, "\"\\\n\r\t") == NULL;
+    if (config->connect_timeout_ms < 0) config->connect_timeout_ms = 0;
+    if (config->first_byte_timeout_ms < 0) config->first_byte_timeout_ms = 0;
+    if (config->timeout_ms < 0) config->timeout_ms = 0;
+    if (config->breaker_error_rate < 1 || config->breaker_error_rate > 100) {
+        config->breaker_error_rate = DEFAULT_BREAKER_ERROR_RATE;
+    }
+    if (config->breaker_min_requests < 1) config->breaker_min_requests = 1;
+    if (config->breaker_window < 1) config->breaker_window = DEFAULT_BREAKER_WINDOW;
+    if (config->breaker_cooldown < 1) config->breaker_cooldown = DEFAULT_BREAKER_COOLDOWN;
+    if (config->admission_max_in_flight < 1) config->admission_max_in_flight = DEFAULT_ADMISSION_MAX_IN_FLIGHT;
+    if (config->admission_min_in_flight < 1) config->admission_min_in_flight = 1;
+    if (config->admission_min_in_flight > config->admission_max_in_flight) {
+        config->admission_min_in_flight = config->admission_max_in_flight;
+    }
+    if (config->admission_queue_timeout_ms < 0) config->admission_queue_timeout_ms = 0;
+    if (config->admission_latency_target_ms < 0) config->admission_latency_target_ms = 0;
+    if (config->admission_retry_after < 0) config->admission_retry_after = 0;
+    if (config->health_check_interval < 0) config->health_check_interval = 0;
+    if (config->hedge_min_ms < 0) config->hedge_min_ms = 0;
+    if (config->title_index_min_prefix < 1) config->title_index_min_prefix = 1;
+    if (config->query_max_tokens < 0) config->query_max_tokens = 0;
+    if (config->log_payload_max < 0) config->log_payload_max = 0;
+    if (config->log_payload_max > LOG_LINE_MAX - 128) config->log_payload_max = LOG_LINE_MAX - 128;
+    if (config->log_sample_rate < 1) config->log_sample_rate = 1;
+    if (config->capture_sample_rate < 1) config->capture_sample_rate = 1;
+    if (strcmp(config->io_mode, "threads") != 0 && strcmp(config->io_mode, "epoll") != 0 &&
+        strcmp(config->io_mode, "io_uring") != 0) {
+        fprintf(stderr, "[Config] Unknown lkb.io_mode \"%s\", using threads\n", config->io_mode);
+        safe_strncpy(config->io_mode, "threads", sizeof(config->io_mode));
+    }
+    if (strcmp(config->snippet_mode, "match") != 0 && strcmp(config->snippet_mode, "head") != 0) {
+        fprintf(stderr, "[Config] Unknown engine.snippet_mode \"%s\", using match\n", config->snippet_mode);
+        safe_strncpy(config->snippet_mode, "match", sizeof(config->snippet_mode));
+    }
+
+    /* engine_url에서 replica마다 host, port, path 파싱 */
+    config_parse_backends(config);
+
+    return true;
+}
+
+/* ============================
+ * 문자열 처리 함수 (고급)
+ * ============================ */
+
+/* ============================
+ * JSON 파싱 함수
+ * ============================ */
+
+/* UTF-8 문자 경계를 찾는 함수 - max_bytes 안에서 문자가 잘리지 않는 최대 길이.
+ * 문자열 끝(NUL)을 넘는 문자도 잘린 문자로 본다 */
+size_t utf8_safe_truncate(const char *str, size_t max_bytes) {
+    const unsigned char *s = (const unsigned char *)str;
+    size_t n = strnlen(str, max_bytes);
+    size_t pos = 0;
+
+    while (pos < n) {
+        /* ASCII 문자 (0xxxxxxx) 구간은 한 번에 */
+        pos += g_text.ascii(s + pos, n - pos);
+
+        while (pos < n && s[pos] >= 0x80) {
+            unsigned char c = s[pos];
+            size_t width;
+            if ((c & 0xE0) == 0xC0) width = 2;       /* 110xxxxx */
+            else if ((c & 0xF0) == 0xE0) width = 3;  /* 1110xxxx */
+            else if ((c & 0xF8) == 0xF0) width = 4;  /* 11110xxx */
+            else width = 1;                          /* 잘못된 UTF-8 시퀀스, 다음 바이트로 */
+            if (pos + width > n) return pos;
+            pos += width;
+        }
+    }
+
+    return pos;
+}
+
+/* \uXXXX 4자리 16진수 해석, 실패 시 -1 */
+int json_hex4(const char *p, const char *end) {
+    if (end - p < 4) return -1;
+    int value = 0;
+    for (int i = 0; i < 4; i++) {
+        char c = p[i];
+        value <<= 4;
+        if (c >= '0' && c <= '9') value |= c - '0';
+        else if (c >= 'a' && c <= 'f') value |= c - 'a' + 10;
+        else if (c >= 'A' && c <= 'F') value |= c - 'A' + 10;
+        else return -1;
+    }
+    return value;
+}
+
+/* 공통 escape 처리 함수 (\uXXXX 및 서로게이트 쌍은 UTF-8로 변환).
+ * dst가 차면 멈추고 *src_io를 다음에 이어서 풀 위치로 옮긴다 */
+size_t json_unescape_span(const char **src_io, const char *end, char *dst, size_t dst_size) {
+    const char *src = *src_io;
+    size_t written = 0;
+    while (src < end && written < dst_size - 1) {
+        if (*src != '\\' || src + 1 >= end) {
+            /* 다음 escape 전까지는 그대로 복사 */
+            size_t run = end - src;
+            if (run > dst_size - 1 - written) run = dst_size - 1 - written;
+            const char *escape = memchr(src, '\\', run);
+            if (escape == src) run = 1;  /* 끝에 걸린 '\' 하나 */
+            else if (escape) run = escape - src;
+            memcpy(dst + written, src, run);
+            written += run;
+            src += run;
+            continue;
+        }
+
+        const char *escape_start = src;
+        src++;
+        switch (*src) {
+            case 'n':  dst[written++] = '\n'; break;
+            case 'r':  dst[written++] = '\r'; break;
+            case 't':  dst[written++] = '\t'; break;
+            case 'b':  dst[written++] = '\b'; break;
+            case 'f':  dst[written++] = '\f'; break;
+            case '\\': dst[written++] = '\\'; break;
+            case '"':  dst[written++] = '"'; break;
+            case '/':  dst[written++] = '/'; break;
+            case 'u': {
+                int cp = json_hex4(src + 1, end);
+                if (cp < 0) {
+                    dst[written++] = 'u';
+                    break;
+                }
+                src += 4;
+                /* 상위 서로게이트 + \uDC00..\uDFFF 조합 */
+                if (cp >= 0xD800 && cp <= 0xDBFF && end - src >= 7 &&
+                    src[1] == '\\' && src[2] == 'u') {
+                    int low = json_hex4(src + 3, end);
+                    if (low >= 0xDC00 && low <= 0xDFFF) {
+                        cp = 0x10000 + ((cp - 0xD800) << 10) + (low - 0xDC00);
+                        src += 6;
+                    }
+                }
+                if (cp >= 0xD800 && cp <= 0xDFFF) cp = 0xFFFD;
+
+                char utf8[4];
+                size_t n;
+                if (cp < 0x80) {
+                    utf8[0] = (char)cp; n = 1;
+                } else if (cp < 0x800) {
+                    utf8[0] = (char)(0xC0 | (cp >> 6));
+                    utf8[1] = (char)(0x80 | (cp & 0x3F)); n = 2;
+                } else if (cp < 0x10000) {
+                    utf8[0] = (char)(0xE0 | (cp >> 12));
+                    utf8[1] = (char)(0x80 | ((cp >> 6) & 0x3F));
+                    utf8[2] = (char)(0x80 | (cp & 0x3F)); n = 3;
+                } else {
+                    utf8[0] = (char)(0xF0 | (cp >> 18));
+                    utf8[1] = (char)(0x80 | ((cp >> 12) & 0x3F));
+                    utf8[2] = (char)(0x80 | ((cp >> 6) & 0x3F));
+                    utf8[3] = (char)(0x80 | (cp & 0x3F)); n = 4;
+                }
+                /* 멀티바이트 문자가 버퍼에 다 들어가지 않으면 중단 */
+                if (written + n > dst_size - 1) {
+                    dst[written] = '\0';
+                    *src_io = escape_start;
+                    return written;
+                }
+                memcpy(dst + written, utf8, n);
+                written += n;
+                break;
+            }
+            default:   dst[written++] = *src; break;
+        }
+        src++;
+    }
+    dst[written] = '\0';
+    *src_io = src;
+    return written;
+}
+
+size_t unescape_json_string(const char *src, const char *end, char *dst, size_t dst_size) {
+    return json_unescape_span(&src, end, dst, dst_size);
+}
+
+/*
+ * 전진 전용 JSON 토크나이저
+ *
+ * 입력 버퍼를 한 번만 훑으며 토큰을 하나씩 돌려준다. 문자열은 복사하지 않고
+ * 버퍼 내 오프셋(start, end)만 넘기므로 필요한 값만 골라 unescape 하면 된다.
+ * final=false 로 초기화하면 버퍼 끝에서 잘린 토큰에 JSON_TOK_NEED_MORE 를
+ * 돌려주며, json_tokenizer_feed()로 늘어난 버퍼를 넘긴 뒤 다시 호출하면
+ * 그 자리부터 이어서 읽는다.
+ */
+typedef enum {
+    JSON_TOK_OBJECT_BEGIN,
+    JSON_TOK_OBJECT_END,
+    JSON_TOK_ARRAY_BEGIN,
+    JSON_TOK_ARRAY_END,
+    JSON_TOK_KEY,
+    JSON_TOK_STRING,
+    JSON_TOK_NUMBER,
+    JSON_TOK_TRUE,
+    JSON_TOK_FALSE,
+    JSON_TOK_NULL,
+    JSON_TOK_END,
+    JSON_TOK_NEED_MORE,
+    JSON_TOK_ERROR
+} JsonTokenType;
+
+typedef struct {
+    JsonTokenType type;
+    size_t start;       /* 문자열은 따옴표 안쪽 시작, 그 외는 토큰 시작 */
+    size_t end;         /* 끝 (포함하지 않음) */
+    int depth;          /* 토큰이 속한 컨테이너 깊이 (BEGIN/END는 자기 자신) */
+    bool has_escape;    /* 문자열에 escape 포함 여부 */
+} JsonToken;
+
+typedef struct {
+    const char *buf;
+    size_t len;
+    size_t pos;
+    size_t scan_pos;    /* 잘린 문자열을 다시 훑지 않기 위한 위치 */
+    bool scan_escape;
+    bool final;         /* 버퍼가 입력 전체인지 여부 */
+    bool expect_key;    /* 객체 안에서 다음 문자열이 키인지 */
+    int depth;
+    char stack[JSON_MAX_DEPTH];
+} JsonTokenizer;
+
+void json_tokenizer_init(JsonTokenizer *t, const char *buf, size_t len, bool final) {
+    memset(t, 0, sizeof(JsonTokenizer));
+    t->buf = buf;
+    t->len = len;
+    t->final = final;
+}
+
+/* 버퍼가 늘어나거나 재할당된 뒤 호출. 기존 오프셋은 그대로 유효해야 한다 */
+void json_tokenizer_feed(JsonTokenizer *t, const char *buf, size_t len, bool final) {
+    t->buf = buf;
+    t->len = len;
+    t->final = final;
+}
+
+/* 호출자가 버퍼 앞 n바이트를 버렸을 때 (n은 현재 위치 이하) 오프셋을 맞춘다.
+ * 이어서 json_tokenizer_feed()로 줄어든 버퍼를 넘긴다 */
+void json_tokenizer_discard(JsonTokenizer *t, size_t n) {
+    t->pos -= n;
+    if (t->scan_pos) t->scan_pos -= n;
+}
+
+JsonTokenType json_tokenizer_incomplete(JsonTokenizer *t, JsonToken *tok) {
+    tok->type = t->final ? JSON_TOK_ERROR : JSON_TOK_NEED_MORE;
+    return tok->type;
+}
+
+JsonTokenType json_next(JsonTokenizer *t, JsonToken *tok) {
+    tok->has_escape = false;
+
+    /* 공백, 구분자 건너뛰기 */
+    while (t->pos < t->len) {
+        char c = t->buf[t->pos];
+        if (c == ' ' || c == '\t' || c == '\n' || c == '\r') {
+            t->pos++;
+        } else if (c == ',') {
+            t->expect_key = (t->depth > 0 && t->stack[t->depth - 1] == '{');
+            t->pos++;
+        } else if (c == ':') {
+            t->expect_key = false;
+            t->pos++;
+        } else {
+            break;
+        }
+    }
+
+    if (t->pos >= t->len) {
+        if (!t->final) return json_tokenizer_incomplete(t, tok);
+        tok->type = (t->depth == 0) ? JSON_TOK_END : JSON_TOK_ERROR;
+        return tok->type;
+    }
+
+    const char *buf = t->buf;
+    char c = buf[t->pos];
+    tok->start = t->pos;
+
+    if (c == '{' || c == '[') {
+        if (t->depth >= JSON_MAX_DEPTH) {
+            tok->type = JSON_TOK_ERROR;
+            return tok->type;
+        }
+        t->stack[t->depth++] = c;
+        t->expect_key = (c == '{');
+        t->pos++;
+        tok->end = t->pos;
+        tok->depth = t->depth;
+        tok->type = (c == '{') ? JSON_TOK_OBJECT_BEGIN : JSON_TOK_ARRAY_BEGIN;
+        return tok->type;
+    }
+
+    if (c == '}' || c == ']') {
+        char open = (c == '}') ? '{' : '[';
+        if (t->depth == 0 || t->stack[t->depth - 1] != open) {
+            tok->type = JSON_TOK_ERROR;
+            return tok->type;
+        }
+        tok->depth = t->depth--;
+        t->expect_key = false;
+        t->pos++;
+        tok->end = t->pos;
+        tok->type = (c == '}') ? JSON_TOK_OBJECT_END : JSON_TOK_ARRAY_END;
+        return tok->type;
+    }
+
+    tok->depth = t->depth;
+
+    if (c == '"') {
+        size_t p = t->pos + 1;
+        bool escape = false;
+        if (t->scan_pos > p) {
+            p = t->scan_pos;
+            escape = t->scan_escape;
+        }
+
+        const char *q = NULL;
+        for (;;) {
+            /* 따옴표나 백슬래시까지 한 번에 건너뛴다 (escape된 따옴표일 때만 다시 탐색) */
+            if (!q || (size_t)(q - buf) < p) {
+                q = memchr(buf + p, '"', t->len - p);
+            }
+            size_t limit = q ? (size_t)(q - buf) : t->len;
+            const char *bs = memchr(buf + p, '\\', limit - p);
+            if (bs) {
+                escape = true;
+                p = (size_t)(bs - buf) + 2;
+                if (p > t->len) {
+                    /* 백슬래시가 버퍼 끝 - 다음 호출에서 그 자리부터 */
+                    t->scan_pos = p - 2;
+                    t->scan_escape = escape;
+                    return json_tokenizer_incomplete(t, tok);
+                }
+                continue;
+            }
+            if (!q) {
+                t->scan_pos = t->len;
+                t->scan_escape = escape;
+                return json_tokenizer_incomplete(t, tok);
+            }
+            p = limit;
+            break;
+        }
+
+        tok->start = t->pos + 1;
+        tok->end = p;
+        tok->has_escape = escape;
+        t->pos = p + 1;
+        t->scan_pos = 0;
+        t->scan_escape = false;
+
+        if (t->expect_key) {
+            t->expect_key = false;
+            tok->type = JSON_TOK_KEY;
+        } else {
+            tok->type = JSON_TOK_STRING;
+        }
+        return tok->type;
+    }
+
+    if (c == '-' || (c >= '0' && c <= '9')) {
+        size_t p = t->pos + 1;
+        while (p < t->len) {
+            char d = buf[p];
+            if ((d >= '0' && d <= '9') || d == '.' || d == 'e' || d == 'E' ||
+                d == '+' || d == '-') {
+                p++;
+            } else {
+                break;
+            }
+        }
+        if (p >= t->len && !t->final) {
+            return json_tokenizer_incomplete(t, tok);
+        }
+        tok->end = p;
+        t->pos = p;
+        tok->type = JSON_TOK_NUMBER;
+        return tok->type;
+    }
+
+    const char *word = NULL;
+    JsonTokenType word_type = JSON_TOK_ERROR;
+    if (c == 't') { word = "true"; word_type = JSON_TOK_TRUE; }
+    else if (c == 'f') { word = "false"; word_type = JSON_TOK_FALSE; }
+    else if (c == 'n') { word = "null"; word_type = JSON_TOK_NULL; }
+
+    if (word) {
+        size_t wlen = strlen(word);
+        size_t avail = t->len - t->pos;
+        if (avail < wlen) {
+            if (memcmp(buf + t->pos, word, avail) == 0) {
+                return json_tokenizer_incomplete(t, tok);
+            }
+        } else if (memcmp(buf + t->pos, word, wlen) == 0) {
+            t->pos += wlen;
+            tok->end = t->pos;
+            tok->type = word_type;
+            return tok->type;
+        }
+    }
+
+    tok->type = JSON_TOK_ERROR;
+    return tok->type;
+}
+
+/* 현재 값(객체/배열이면 닫힐 때까지)을 건너뛴다. tok는 방금 읽은 값의 첫 토큰 */
+JsonTokenType json_skip_value(JsonTokenizer *t, JsonToken *tok) {
+    if (tok->type != JSON_TOK_OBJECT_BEGIN && tok->type != JSON_TOK_ARRAY_BEGIN) {
+        return tok->type;
+    }
+    int target = tok->depth - 1;
+    while (json_next(t, tok) < JSON_TOK_END) {
+        if ((tok->type == JSON_TOK_OBJECT_END || tok->type == JSON_TOK_ARRAY_END) &&
+            tok->depth - 1 == target) {
+            return tok->type;
+        }
+    }
+    return tok->type;
+}
+
+/* 키 토큰이 name과 같은지 (escape가 있는 키는 일치하지 않는 것으로 취급) */
+bool json_key_equals(const char *buf, const JsonToken *tok, const char *name) {
+    size_t len = tok->end - tok->start;
+    return !tok->has_escape && strlen(name) == len &&
+           memcmp(buf + tok->start, name, len) == 0;
+}
+
+/* 문자열 토큰을 arena에 C 문자열로 복사 */
+char* json_token_strdup(Arena *arena, const char *buf, const JsonToken *tok) {
+    size_t len = tok->end - tok->start;
+    char *value = arena_alloc(arena, len + 1);
+    if (tok->has_escape) {
+        unescape_json_string(buf + tok->start, buf + tok->end, value, len + 1);
+    } else {
+        memcpy(value, buf + tok->start, len);
+        value[len] = '\0';
+    }
+    return value;
+}
+
+/* 배열 안의 문자열 값을 최대 max_count개 수집. tok는 ARRAY_BEGIN 토큰 */
+int json_collect_strings(Arena *arena, JsonTokenizer *t, JsonToken *tok, char **out, int max_count) {
+    int count = 0;
+    int array_depth = tok->depth;
+
+    while (json_next(t, tok) < JSON_TOK_END) {
+        if (tok->type == JSON_TOK_ARRAY_END && tok->depth == array_depth) break;
+        if (tok->type == JSON_TOK_STRING && tok->depth == array_depth && count < max_count) {
+            out[count++] = json_token_strdup(arena, t->buf, tok);
+        } else {
+            json_skip_value(t, tok);
+        }
+    }
+    return count;
+}
+
+/* 깊이에 관계없이 처음 나오는 key를 찾아 그 값의 첫 토큰을 tok에 남긴다 */
+bool json_find_key(JsonTokenizer *t, JsonToken *tok, const char *key) {
+    while (json_next(t, tok) < JSON_TOK_END) {
+        if (tok->type == JSON_TOK_KEY && json_key_equals(t->buf, tok, key)) {
+            return json_next(t, tok) < JSON_TOK_END;
+        }
+    }
+    return false;
+}
+
+/* key 배열의 문자열 값을 최대 max_count개 추출 */
+int json_extract_string_array(Arena *arena, const char *json, const char *key,
+                              char **out, int max_count) {
+    JsonTokenizer t;
+    JsonToken tok;
+    json_tokenizer_init(&t, json, strlen(json), true);
+
+    if (!json_find_key(&t, &tok, key) || tok.type != JSON_TOK_ARRAY_BEGIN) {
+        return 0;
+    }
+    return json_collect_strings(arena, &t, &tok, out, max_count);
+}
+
+char* extract_json_string_value(Arena *arena, const char *json, const char *key) {
+    JsonTokenizer t;
+    JsonToken tok;
+    json_tokenizer_init(&t, json, strlen(json), true);
+
+    if (!json_find_key(&t, &tok, key) || tok.type != JSON_TOK_STRING) {
+        return NULL;
+    }
+    return json_token_strdup(arena, json, &tok);
+}
+
+int parse_queries_array(Arena *arena, const char *json, char **queries, int max_count) {
+    return json_extract_string_array(arena, json, "queries", queries, max_count);
+}
+
+/* ============================
+ * 쿼리 정규화 (query.*)
+ * ============================ */
+
+int query_stopword_sort(const void *a, const void *b) {
+    return strcmp(*(const char *const *)a, *(const char *const *)b);
+}
+
+/* query.stopwords를 단어로 나눠 소문자로 바꾸고 정렬 (main에서 한 번) */
+void query_rules_compile(QueryRules *rules, const Config *config) {
+    memset(rules, 0, sizeof(QueryRules));
+    rules->strip_think = config->query_strip_think;
+    rules->unwrap = config->query_unwrap;
+    rules->max_tokens = config->query_max_tokens;
+    memcpy(rules->words, config->query_stopwords, sizeof(rules->words));
+
+    static const char separators[] = ", \t[]\"'";
+    char *saveptr = NULL;
+    for (char *item = strtok_r(rules->words, separators, &saveptr); item;
+         item = strtok_r(NULL, separators, &saveptr)) {
+        if (rules->stopword_count == MAX_STOPWORDS) {
+            fprintf(stderr, "[Config] query.stopwords lists more than %d words, ignoring the rest\n",
+                    MAX_STOPWORDS);
+            break;
+        }
+        for (char *c = item; *c; c++) *c = (char)tolower((unsigned char)*c);
+        rules->stopwords[rules->stopword_count++] = item;
+    }
+    qsort(rules->stopwords, rules->stopword_count, sizeof(rules->stopwords[0]), query_stopword_sort);
+}
+
+/* token[0..len)을 ASCII 소문자로 본 값과 word 비교 (strcmp와 같은 순서) */
+int query_token_compare(const char *token, size_t len, const char *word) {
+    for (size_t i = 0; i < len; i++) {
+        unsigned char a = (unsigned char)tolower((unsigned char)token[i]);
+        unsigned char b = (unsigned char)word[i];
+        if (b == '\0') return 1;
+        if (a != b) return a < b ? -1 : 1;
+    }
+    return word[len] == '\0' ? 0 : -1;
+}
+
+bool query_is_stopword(const QueryRules *rules, const char *token, size_t len) {
+    int lo = 0, hi = rules->stopword_count;
+    while (lo < hi) {
+        int mid = lo + (hi - lo) / 2;
+        int cmp = query_token_compare(token, len, rules->stopwords[mid]);
+        if (cmp == 0) return true;
+        if (cmp > 0) lo = mid + 1;
+        else hi = mid;
+    }
+    return false;
+}
+
+/* p가 닫힌 <think> 블록의 시작이면 블록 바로 뒤, 아니면 NULL.
+ * *close는 p 이후 첫 "</think>" 위치 캐시 (없으면 end) - 닫히지 않은 <think>가 많아도 한 번씩만 찾음 */
+const char* query_skip_think(const char *p, const char *end, const char **close) {
+    if (end - p < 7 || memcmp(p, "<think>", 7) != 0) return NULL;
+    if (*close < p + 7) {
+        const char *found = memmem(p + 7, end - p - 7, "</think>", 8);
+        *close = found ? found : end;
+    }
+    return *close < end ? *close + 8 : NULL;
+}
+
+/* query.unwrap: {"queries": [...]}의 첫 쿼리, [...]의 첫 "문자열", "..."의 안쪽을 [*s, *e)로.
+ * JSON 문자열에 escape가 있으면 scratch (scratch_size 바이트)에 풀어 쓰고 그 범위로 */
+void query_unwrap(const char **s, const char **e, char *scratch, size_t scratch_size) {
+    const char *p = *s;
+    const char *end = *e;
+
+    if (memchr(p, '{', end - p) && memmem(p, end - p, "queries", 7)) {
+        JsonTokenizer t;
+        JsonToken tok;
+        json_tokenizer_init(&t, p, end - p, true);
+        if (json_find_key(&t, &tok, "queries") && tok.type == JSON_TOK_ARRAY_BEGIN &&
+            json_next(&t, &tok) == JSON_TOK_STRING && tok.end > tok.start) {
+            if (tok.has_escape) {
+                size_t len = unescape_json_string(p + tok.start, p + tok.end, scratch, scratch_size);
+                *s = scratch;
+                *e = scratch + utf8_safe_truncate(scratch, len);
+            } else {
+                *s = p + tok.start;
+                *e = p + tok.end;
+            }
+            return;
+        }
+    }
+
+    const char *quote = NULL;
+    if (*p == '[') quote = memchr(p, '"', end - p);
+    else if (*p == '"') quote = p;
+    if (quote) {
+        const char *quote_end = memchr(quote + 1, '"', end - quote - 1);
+        if (quote_end) {
+            *s = quote + 1;
+            *e = quote_end;
+        }
+    }
+}
+
+/* [s, e)의 단어를 공백 하나로 이어 query에 (최대 MAX_QUERY_LEN 바이트, query.max_tokens개).
+ * drop_stopwords면 불용어를 건너뛰고 *dropped에 센다. 쓴 길이 반환 */
+size_t query_copy_tokens(const QueryRules *rules, const char *s, const char *e, char *query,
+                         bool drop_stopwords, int *dropped) {
+    const char *think_close = s;
+    const char *p = s;
+    size_t pos = 0;
+    int tokens = 0;
+
+    while (p < e && (rules->max_tokens == 0 || tokens < rules->max_tokens)) {
+        const char *after;
+        if (isspace((unsigned char)*p)) {
+            p++;
+            continue;
+        }
+        if (rules->strip_think && *p == '<' && (after = query_skip_think(p, e, &think_close))) {
+            p = after;
+            continue;
+        }
+
+        const char *start = p;
+        while (p < e && !isspace((unsigned char)*p) &&
+               !(rules->strip_think && *p == '<' && query_skip_think(p, e, &think_close))) {
+            p++;
+        }
+        size_t len = p - start;
+        if (drop_stopwords && query_is_stopword(rules, start, len)) {
+            (*dropped)++;
+            continue;
+        }
+
+        size_t need = pos ? pos + 1 + len : len;
+        if (need > MAX_QUERY_LEN) {
+            /* 첫 단어부터 너무 길면 문자 경계에서 자름, 아니면 여기까지 */
+            if (pos == 0) {
+                pos = utf8_safe_truncate(start, MAX_QUERY_LEN);
+                memcpy(query, start, pos);
+            }
+            break;
+        }
+        if (pos) query[pos++] = ' ';
+        memcpy(query + pos, start, len);
+        pos += len;
+        tokens++;
+    }
+    query[pos] = '\0';
+    return pos;
+}
+
+/* 쿼리 정규화를 한 번 훑어서: 앞쪽 <think> 블록과 공백을 건너뛰고, 감싼 JSON/배열/따옴표를 풀고,
+ * 단어로 나눠 불용어를 버리고 query.max_tokens개까지 공백 하나로 이어 query에 쓴다.
+ * key는 같은 내용의 ASCII 소문자 (캐시/합치기 키 - 매칭 스니펫도 대소문자를 무시).
+ * 모든 단어가 불용어면 불용어를 남긴다. query와 key는 각각 min(strlen(input), MAX_QUERY_LEN) + 1
+ * 바이트 이상, 할당 없음. 길이 반환 */
+size_t normalize_query_into(const QueryRules *rules, const char *input, char *query, char *key) {
+    const char *s = input;
+    const char *e = input + strlen(input);
+    const char *think_close = s;
+
+    for (;;) {
+        const char *after;
+        while (s < e && isspace((unsigned char)*s)) s++;
+        if (!rules->strip_think || !(after = query_skip_think(s, e, &think_close))) break;
+        s = after;
+    }
+
+    /* escape를 푼 쿼리는 key 버퍼에 잠시 두고 query로 옮긴 뒤 key를 다시 씀 */
+    size_t scratch_size = (size_t)(e - input) < MAX_QUERY_LEN ? (size_t)(e - input) + 1 : MAX_QUERY_LEN + 1;
+    if (rules->unwrap && s < e) query_unwrap(&s, &e, key, scratch_size);
+
+    int dropped = 0;
+    size_t len = query_copy_tokens(rules, s, e, query, true, &dropped);
+    if (len == 0 && dropped > 0) len = query_copy_tokens(rules, s, e, query, false, &dropped);
+
+    for (size_t i = 0; i <= len; i++) key[i] = (char)tolower((unsigned char)query[i]);
+    return len;
+}
+
+/* 정규화된 쿼리와 캐시 키 (arena에 할당). "queries"가 있으면 첫 번째 쿼리, 없으면 query */
+char* normalize_search_query(Arena *arena, const char *query, char **queries, int queries_count,
+                             char **key) {
+    const char *input = (queries && queries_count > 0 && queries[0] && queries[0][0]) ? queries[0] : query;
+    if (!input) input = "";
+
+    size_t size = strlen(input);
+    if (size > MAX_QUERY_LEN) size = MAX_QUERY_LEN;
+    char *result = arena_alloc(arena, (size + 1) * 2);
+    *key = result + size + 1;
+    normalize_query_into(&g_query_rules, input, result, *key);
+    return result;
+}
+
+/* 요청 바디 파싱 - 문자열은 arena에 할당, count가 없으면 default_count */
+int parse_search_request(Arena *arena, const char *body, int default_count, SearchRequest *req) {
+    memset(req, 0, sizeof(SearchRequest));
+
+    /* 최상위 객체의 query / queries / count를 한 번에 읽는다 */
+    JsonTokenizer t;
+    JsonToken tok;
+    json_tokenizer_init(&t, body, strlen(body), true);
+
+    if (json_next(&t, &tok) == JSON_TOK_OBJECT_BEGIN) {
+        while (json_next(&t, &tok) == JSON_TOK_KEY) {
+            JsonToken key = tok;
+            if (json_next(&t, &tok) >= JSON_TOK_END) break;
+
+            if (json_key_equals(body, &key, "query") && tok.type == JSON_TOK_STRING && !req->query) {
+                req->query = json_token_strdup(arena, body, &tok);
+            } else if (json_key_equals(body, &key, "queries") && tok.type == JSON_TOK_ARRAY_BEGIN &&
+                       req->queries_count == 0) {
+                req->queries_count = json_collect_strings(arena, &t, &tok, req->queries, MAX_QUERIES);
+            } else if (json_key_equals(body, &key, "count") && tok.type == JSON_TOK_NUMBER) {
+                req->count = atoi(body + tok.start);
+            } else {
+                json_skip_value(&t, &tok);
+            }
+        }
+    }
+
+    if (req->count <= 0) {
+        req->count = default_count;
+    }
+
+    return 0;
+}
+
+/* POST /search/batch 바디 - 최상위 배열 또는 {"searches": [...]}의 항목마다 객체 원문을
+ * /search 바디처럼 쓰도록 arena에 복사 (객체가 아닌 항목은 빈 요청). 전체 항목 수 반환,
+ * entries에는 최대 max_count개 */
+int parse_batch_request(Arena *arena, const char *body, char **entries, int max_count) {
+    JsonTokenizer t;
+    JsonToken tok;
+    json_tokenizer_init(&t, body, strlen(body), true);
+
+    JsonTokenType type = json_next(&t, &tok);
+    if (type == JSON_TOK_OBJECT_BEGIN) {
+        if (!json_find_key(&t, &tok, "searches")) return 0;
+        type = tok.type;
+    }
+    if (type != JSON_TOK_ARRAY_BEGIN) return 0;
+
+    int count = 0;
+    int array_depth = tok.depth;
+    while (json_next(&t, &tok) < JSON_TOK_END) {
+        if (tok.type == JSON_TOK_ARRAY_END && tok.depth == array_depth) break;
+        size_t start = tok.start;
+        bool object = (tok.type == JSON_TOK_OBJECT_BEGIN);
+        if (json_skip_value(&t, &tok) >= JSON_TOK_END) break;
+        if (count < max_count) {
+            entries[count] = object ? arena_strndup(arena, body + start, tok.end - start) :
+                                      arena_strdup(arena, "");
+        }
+        count++;
+    }
+    return count;
+}
+
+/* ============================
+ * 파일 I/O 함수
+ * ============================ */
+
+char* load_file(const char *filename) {
+    FILE *f = fopen(filename, "r");
+    if (!f) {
+        log_write(LOG_LEVEL_WARN, "[Template] Warning: %s not found", filename);
+        return NULL;
+    }
+
+    fseek(f, 0, SEEK_END);
+    long size = ftell(f);
+    if (size < 0) {
+        log_write(LOG_LEVEL_ERROR, "[Template] Error: ftell failed for %s", filename);
+        fclose(f);
+        return NULL;
+    }
+    fseek(f, 0, SEEK_SET);
+
+    char *content = safe_malloc(size + 1);
+    size_t bytes_read = fread(content, 1, size, f);
+    if (bytes_read != (size_t)size) {
+        log_write(LOG_LEVEL_WARN, "[Template] Warning: partial read of %s (%zu/%ld bytes)",
+                  filename, bytes_read, size);
+    }
+    content[bytes_read] = '\0';
+    fclose(f);
+
+    return content;
+}
+
+/* ---- 컴파일된 Manticore 요청 템플릿 ---- */
+
+/* JSON 문자열 값으로 안전하게 escape 했을 때의 길이 */
+size_t json_string_escaped_len(const char *str) {
+    const unsigned char *s = (const unsigned char *)str;
+    size_t n = strlen(str);
+    size_t len = n;
+    size_t i = 0;
+    while (i < n) {
+        i += g_text.json_plain(s + i, n - i);
+        for (; i < n && !json_is_plain(s[i]); i++) {
+            if (s[i] == '"' || s[i] == '\\' || s[i] == '\n' || s[i] == '\r' || s[i] == '\t' ||
+                s[i] == '\b' || s[i] == '\f') {
+                len += 1;
+            } else {
+                len += 5;  /* \u00XX */
+            }
+        }
+    }
+    return len;
+}
+
+/* JSON 문자열 값 escape (dst는 json_string_escaped_len() 바이트 이상) */
+char* json_string_escape_into(char *dst, const char *str) {
+    static const char hex[] = "0123456789abcdef";
+    const unsigned char *s = (const unsigned char *)str;
+    size_t n = strlen(str);
+    size_t i = 0;
+    while (i < n) {
+        size_t run = g_text.json_plain(s + i, n - i);
+        memcpy(dst, s + i, run);
+        dst += run;
+        i += run;
+        if (i >= n) break;
+
+        const unsigned char *p = s + i++;
+        switch (*p) {
+            case '"':  *dst++ = '\\'; *dst++ = '"'; break;
+            case '\\': *dst++ = '\\'; *dst++ = '\\'; break;
+            case '\n': *dst++ = '\\'; *dst++ = 'n'; break;
+            case '\r': *dst++ = '\\'; *dst++ = 'r'; break;
+            case '\t': *dst++ = '\\'; *dst++ = 't'; break;
+            case '\b': *dst++ = '\\'; *dst++ = 'b'; break;
+            case '\f': *dst++ = '\\'; *dst++ = 'f'; break;
+            default:
+                if (*p < 0x20) {
+                    memcpy(dst, "\\u00", 4);
+                    dst[4] = hex[*p >> 4];
+                    dst[5] = hex[*p & 0x0F];
+                    dst += 6;
+                } else {
+                    *dst++ = *p;
+                }
+                break;
+        }
+    }
+    return dst;
+}
+
+/* 템플릿 텍스트를 리터럴 구간과 치환 슬롯 목록으로 변환 */
+CompiledTemplate* template_compile(char *text, const struct stat *st) {
+    static const struct { const char *name; size_t len; TemplatePartKind kind; } placeholders[] = {
+        { "{INDEX_NAME}",   12, TEMPLATE_INDEX_NAME },
+        { "{SEARCH_QUERY}", 14, TEMPLATE_SEARCH_QUERY },
+        { "{RESULT_LIMIT}", 14, TEMPLATE_RESULT_LIMIT },
+        { "{SNIPPET_LENGTH}", 16, TEMPLATE_SNIPPET_LENGTH },
+    };
+
+    CompiledTemplate *tpl = safe_malloc(sizeof(CompiledTemplate));
+    memset(tpl, 0, sizeof(CompiledTemplate));
+    tpl->refs = 1;
+    tpl->text = text;
+    tpl->hash = hash_bytes(text, strlen(text), 0);
+    tpl->mtime = st->st_mtime;
+    tpl->size = st->st_size;
+    tpl->ino = st->st_ino;
+
+    size_t literal_start = 0;
+    size_t pos = 0;
+    while (text[pos]) {
+        const char *brace = strchr(text + pos, '{');
+        if (!brace) break;
+        pos = brace - text;
+
+        int match = -1;
+        for (int i = 0; i < (int)(sizeof(placeholders) / sizeof(placeholders[0])); i++) {
+            if (strncmp(text + pos, placeholders[i].name, placeholders[i].len) == 0) {
+                match = i;
+                break;
+            }
+        }
+        if (match < 0) {
+            pos++;
+            continue;
+        }
+
+        /* 리터럴 + 슬롯 2개가 더 들어갈 자리 */
+        if (tpl->part_count + 2 > tpl->part_cap) {
+            tpl->part_cap = tpl->part_cap ? tpl->part_cap * 2 : 8;
+            tpl->parts = safe_realloc(tpl->parts, sizeof(TemplatePart) * tpl->part_cap);
+        }
+        if (pos > literal_start) {
+            TemplatePart *lit = &tpl->parts[tpl->part_count++];
+            lit->kind = TEMPLATE_LITERAL;
+            lit->offset = literal_start;
+            lit->len = pos - literal_start;
+            tpl->literal_len += lit->len;
+        }
+        TemplatePart *slot = &tpl->parts[tpl->part_count++];
+        slot->kind = placeholders[match].kind;
+        slot->offset = pos;
+        slot->len = 0;
+
+        pos += placeholders[match].len;
+        literal_start = pos;
+    }
+
+    size_t text_len = strlen(text);
+    if (text_len > literal_start) {
+        if (tpl->part_count + 1 > tpl->part_cap) {
+            tpl->part_cap = tpl->part_cap ? tpl->part_cap * 2 : 8;
+            tpl->parts = safe_realloc(tpl->parts, sizeof(TemplatePart) * tpl->part_cap);
+        }
+        TemplatePart *lit = &tpl->parts[tpl->part_count++];
+        lit->kind = TEMPLATE_LITERAL;
+        lit->offset = literal_start;
+        lit->len = text_len - literal_start;
+        tpl->literal_len += lit->len;
+    }
+
+    return tpl;
+}
+
+void template_retain(CompiledTemplate *tpl) {
+    if (tpl) __atomic_add_fetch(&tpl->refs, 1, __ATOMIC_RELAXED);
+}
+
+void template_release(CompiledTemplate *tpl) {
+    if (tpl && __atomic_sub_fetch(&tpl->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+        free(tpl->parts);
+        free(tpl->text);
+        free(tpl);
+    }
+}
+
+/* 템플릿 파일을 읽어 컴파일, 없거나 못 읽으면 NULL */
+CompiledTemplate* template_load(const char *path) {
+    struct stat st;
+    if (stat(path, &st) != 0) {
+        log_write(LOG_LEVEL_WARN, "[Template] Warning: %s not found", path);
+        return NULL;
+    }
+
+    char *text = load_file(path);
+    if (!text) {
+        return NULL;
+    }
+
+    CompiledTemplate *tpl = template_compile(text, &st);
+    log_write(LOG_LEVEL_INFO, "[Template] Loaded %s (%d parts, hash %016llx)",
+              path, tpl->part_count, (unsigned long long)tpl->hash);
+    return tpl;
+}
+
+/* 템플릿 파일이 컴파일한 뒤로 바뀌었는지 (mtime/크기/inode) */
+bool template_changed(const CompiledTemplate *tpl, const char *path) {
+    struct stat st;
+    if (stat(path, &st) != 0) return false;  /* 지워졌으면 이전 템플릿 유지 */
+    return !tpl || tpl->mtime != st.st_mtime || tpl->size != st.st_size || tpl->ino != st.st_ino;
+}
+
+/* 현재 설정 스냅샷을 잡음 (잠금 없음). 요청이 끝나면 같은 phase로 config_release() -
+ * 그때까지는 다시 읽어도 해제되지 않는다. 세는 쪽을 먼저 올리고 나서 포인터를 읽어야
+ * 다시 읽는 쪽이 이 요청을 놓치지 않음 */
+ConfigSnapshot* config_acquire(ConfigStore *store, unsigned *phase) {
+    unsigned p = __atomic_load_n(&store->phase, __ATOMIC_RELAXED) & 1;
+    __atomic_add_fetch(&store->readers[p].count, 1, __ATOMIC_SEQ_CST);
+    *phase = p;
+    return __atomic_load_n(&store->current, __ATOMIC_SEQ_CST);
+}
+
+void config_release(ConfigStore *store, unsigned phase) {
+    __atomic_sub_fetch(&store->readers[phase].count, 1, __ATOMIC_RELEASE);
+}
+
+/* 템플릿 렌더링: 정확한 길이를 먼저 계산해 한 번에 확보한 뒤 memcpy.
+ * 문자열 값(인덱스명, 쿼리)은 JSON escape 하므로 따옴표가 들어가도 본문이 깨지지 않음 */
+void template_render(const CompiledTemplate *tpl, ByteBuffer *out, const Config *config,
+                     const char *query, int count) {
+    const char *index_name = config->index_name;
+    char number[16];
+    int number_len = snprintf(number, sizeof(number), "%d", count);
+    char snippet[16];
+    int snippet_len = snprintf(snippet, sizeof(snippet), "%d", config->snippet_length);
+    size_t index_len = json_string_escaped_len(index_name);
+    size_t query_len = json_string_escaped_len(query);
+
+    size_t total = tpl->literal_len;
+    for (int i = 0; i < tpl->part_count; i++) {
+        switch (tpl->parts[i].kind) {
+            case TEMPLATE_INDEX_NAME:   total += index_len; break;
+            case TEMPLATE_SEARCH_QUERY: total += query_len; break;
+            case TEMPLATE_RESULT_LIMIT: total += number_len; break;
+            case TEMPLATE_SNIPPET_LENGTH: total += snippet_len; break;
+            default: break;
+        }
+    }
+
+    buffer_reserve(out, total);
+    char *dst = out->data + out->len;
+    for (int i = 0; i < tpl->part_count; i++) {
+        const TemplatePart *part = &tpl->parts[i];
+        switch (part->kind) {
+            case TEMPLATE_LITERAL:
+                memcpy(dst, tpl->text + part->offset, part->len);
+                dst += part->len;
+                break;
+            case TEMPLATE_INDEX_NAME:
+                dst = json_string_escape_into(dst, index_name);
+                break;
+            case TEMPLATE_SEARCH_QUERY:
+                dst = json_string_escape_into(dst, query);
+                break;
+            case TEMPLATE_RESULT_LIMIT:
+                memcpy(dst, number, number_len);
+                dst += number_len;
+                break;
+            case TEMPLATE_SNIPPET_LENGTH:
+                memcpy(dst, snippet, snippet_len);
+                dst += snippet_len;
+                break;
+        }
+    }
+    out->len += total;
+    out->data[out->len] = '\0';
+}
+
+/* ============================
+ * HTTP 클라이언트 함수
+ * ============================ */
+
+/* 헤더 블록에서 이름으로 값 찾기 (대소문자 무시), 값 길이는 value_len에 */
+const char* http_find_header(const char *headers, size_t headers_len, const char *name,
+                             size_t *value_len) {
+    size_t name_len = strlen(name);
+    const char *p = headers;
+    const char *end = headers + headers_len;
+
+    while (p < end) {
+        const char *line_end = memmem(p, end - p, "\r\n", 2);
+        if (!line_end) line_end = end;
+
+        if ((size_t)(line_end - p) > name_len && p[name_len] == ':' &&
+            strncasecmp(p, name, name_len) == 0) {
+            const char *value = p + name_len + 1;
+            while (value < line_end && (*value == ' ' || *value == '\t')) value++;
+            const char *value_end = line_end;
+            while (value_end > value && (value_end[-1] == ' ' || value_end[-1] == '\t')) value_end--;
+            *value_len = value_end - value;
+            return value;
+        }
+        p = line_end + 2;
+    }
+    return NULL;
+}
+
+/* 업스트림 주소 해석 (이벤트 루프에서 DNS로 블로킹하지 않도록 시작 시 한 번) */
+bool resolve_upstream_addr(UpstreamTarget *target) {
+    struct addrinfo hints, *server;
+    char port_str[16];
+
+    /* getaddrinfo는 스레드 안전 (gethostbyname 대체) */
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    snprintf(port_str, sizeof(port_str), "%d", target->port);
+    if (getaddrinfo(target->host, port_str, &hints, &server) != 0 || !server) {
+        log_write(LOG_LEVEL_ERROR, "[Manticore] Error: No such host %s", target->host);
+        return false;
+    }
+
+    memcpy(&target->addr, server->ai_addr, server->ai_addrlen);
+    target->addrlen = server->ai_addrlen;
+    target->resolved = true;
+    freeaddrinfo(server);
+    return true;
+}
+
+bool resolve_upstream(UpstreamTarget *target, const char *host, int port, const char *path) {
+    safe_strncpy(target->host, host, sizeof(target->host));
+    target->port = port;
+    safe_strncpy(target->path, path, sizeof(target->path));
+    snprintf(target->name, sizeof(target->name), "%s:%d", host, port);
+    target->resolved = false;
+    target->pool.count = 0;
+    pthread_mutex_init(&target->lock, NULL);
+
+    return resolve_upstream_addr(target);
+}
+
+int set_nonblocking(int fd) {
+    int flags = fcntl(fd, F_GETFL, 0);
+    if (flags < 0) return -1;
+    return fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+/* 풀에서 살아 있는 유휴 연결 꺼내기, 없으면 -1 */
+int upstream_pool_acquire(UpstreamTarget *target) {
+    time_t now = time(NULL);
+    int fd = -1;
+
+    pthread_mutex_lock(&target->lock);
+    while (target->pool.count > 0) {
+        target->pool.count--;
+        int candidate = target->pool.fds[target->pool.count];
+        time_t last_used = target->pool.last_used[target->pool.count];
+
+        if (now - last_used > g_config.pool_idle_timeout) {
+            close(candidate);
+            metrics_count(&g_metrics.pool_stale);
+            continue;
+        }
+
+        /* 서버가 이미 닫았거나 예상치 못한 데이터가 있으면 폐기 */
+        char probe;
+        ssize_t n = recv(candidate, &probe, 1, MSG_PEEK | MSG_DONTWAIT);
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            fd = candidate;
+            break;
+        }
+        close(candidate);
+        metrics_count(&g_metrics.pool_stale);
+    }
+    pthread_mutex_unlock(&target->lock);
+
+    return fd;
+}
+
+void upstream_pool_release(UpstreamTarget *target, int fd) {
+    pthread_mutex_lock(&target->lock);
+    if (target->pool.count < g_config.pool_size) {
+        target->pool.fds[target->pool.count] = fd;
+        target->pool.last_used[target->pool.count] = time(NULL);
+        target->pool.count++;
+        fd = -1;
+    }
+    pthread_mutex_unlock(&target->lock);
+
+    if (fd >= 0) {
+        close(fd);
+        metrics_count(&g_metrics.pool_full);
+    }
+}
+
+void upstream_pool_close(UpstreamTarget *target) {
+    pthread_mutex_lock(&target->lock);
+    while (target->pool.count > 0) {
+        target->pool.count--;
+        close(target->pool.fds[target->pool.count]);
+    }
+    pthread_mutex_unlock(&target->lock);
+}
+
+/* ---- 증분 HTTP 응답 파서 ---- */
+
+void http_response_parser_init(HttpResponseParser *p) {
+    buffer_init(&p->line);
+    buffer_init(&p->body);
+}
+
+/* 새 응답을 받기 전 상태 초기화 (버퍼 메모리는 유지) */
+void http_response_parser_reset(HttpResponseParser *p, size_t max_body) {
+    p->state = HTTP_RESP_HEADERS;
+    p->status_code = 0;
+    p->keep_alive = false;
+    p->truncated = false;
+    p->discard = false;
+    p->remaining = 0;
+    p->max_body = max_body;
+    buffer_reset(&p->line);
+    buffer_reset(&p->body);
+}
+
+void http_response_parser_free(HttpResponseParser *p) {
+    buffer_free(&p->line);
+    buffer_free(&p->body);
+}
+
+/* 바디 바이트 저장 (max_body 초과분은 버리고 잘림 표시) */
+void http_response_append_body(HttpResponseParser *p, const char *data, size_t len) {
+    if (p->discard) return;
+    if (p->body.len + len > p->max_body) {
+        len = p->max_body - p->body.len;
+        p->truncated = true;
+    }
+    if (len > 0) buffer_append(&p->body, data, len);
+}
+
+/* 헤더 블록 해석 후 바디 모드 결정 */
+bool http_response_parse_headers(HttpResponseParser *p, const char *headers, size_t len) {
+    int minor = 0;
+    if (sscanf(headers, "HTTP/1.%d %d", &minor, &p->status_code) != 2) {
+        return false;
+    }
+
+    size_t value_len;
+    const char *value;
+    p->keep_alive = (minor >= 1);
+    value = http_find_header(headers, len, "Connection", &value_len);
+    if (value) {
+        if (value_len == 5 && strncasecmp(value, "close", 5) == 0) p->keep_alive = false;
+        if (value_len == 10 && strncasecmp(value, "keep-alive", 10) == 0) p->keep_alive = true;
+    }
+
+    if (p->status_code == 204 || p->status_code == 304) {
+        p->state = HTTP_RESP_COMPLETE;
+        return true;
+    }
+
+    value = http_find_header(headers, len, "Transfer-Encoding", &value_len);
+    if (value && value_len >= 7 && strncasecmp(value + value_len - 7, "chunked", 7) == 0) {
+        p->state = HTTP_RESP_CHUNK_SIZE;
+        return true;
+    }
+
+    value = http_find_header(headers, len, "Content-Length", &value_len);
+    if (value) {
+        p->remaining = strtoul(value, NULL, 10);
+        p->state = (p->remaining > 0) ? HTTP_RESP_BODY_LENGTH : HTTP_RESP_COMPLETE;
+        return true;
+    }
+
+    /* 길이 정보 없음 → 연결 종료가 응답 끝 */
+    p->keep_alive = false;
+    p->state = HTTP_RESP_BODY_UNTIL_CLOSE;
+    return true;
+}
+
+/* 받은 바이트를 파서에 공급, 진행 후 상태 반환 */
+HttpResponseState http_response_parser_feed(HttpResponseParser *p, const char *data, size_t len) {
+    while (len > 0) {
+        switch (p->state) {
+            case HTTP_RESP_HEADERS: {
+                size_t prev = p->line.len;
+                buffer_append(&p->line, data, len);
+                size_t search_from = prev > 3 ? prev - 3 : 0;
+                char *end = memmem(p->line.data + search_from, p->line.len - search_from,
+                                   "\r\n\r\n", 4);
+                if (!end) {
+                    if (p->line.len > MAX_HEADER_SIZE) p->state = HTTP_RESP_ERROR;
+                    return p->state;
+                }
+
+                size_t header_len = end - p->line.data + 4;
+                size_t used = header_len - prev;  /* 이번 data에서 헤더에 쓰인 바이트 */
+                if (!http_response_parse_headers(p, p->line.data, header_len)) {
+                    p->state = HTTP_RESP_ERROR;
+                    return p->state;
+                }
+                data += used;
+                len -= used;
+
+                /* 100 Continue 등 중간 응답은 건너뜀 */
+                if (p->status_code >= 100 && p->status_code < 200) {
+                    p->state = HTTP_RESP_HEADERS;
+                }
+                buffer_consume(&p->line, p->line.len);
+                break;
+            }
+
+            case HTTP_RESP_BODY_LENGTH:
+            case HTTP_RESP_CHUNK_DATA: {
+                size_t n = len < p->remaining ? len : p->remaining;
+                http_response_append_body(p, data, n);
+                data += n;
+                len -= n;
+                p->remaining -= n;
+                if (p->remaining == 0) {
+                    p->state = (p->state == HTTP_RESP_CHUNK_DATA) ? HTTP_RESP_CHUNK_DATA_END
+                                                                 : HTTP_RESP_COMPLETE;
+                }
+                break;
+            }
+
+            case HTTP_RESP_CHUNK_SIZE:
+            case HTTP_RESP_CHUNK_DATA_END:
+            case HTTP_RESP_CHUNK_TRAILER: {
+                /* 줄 단위 처리: CRLF까지 누적 */
+                const char *nl = memchr(data, '\n', len);
+                size_t take = nl ? (size_t)(nl - data) + 1 : len;
+                buffer_append(&p->line, data, take);
+                data += take;
+                len -= take;
+                if (!nl) {
+                    if (p->line.len > MAX_HEADER_SIZE) p->state = HTTP_RESP_ERROR;
+                    break;
+                }
+
+                bool empty_line = (p->line.len <= 2);
+                if (p->state == HTTP_RESP_CHUNK_DATA_END) {
+                    p->state = empty_line ? HTTP_RESP_CHUNK_SIZE : HTTP_RESP_ERROR;
+                } else if (p->state == HTTP_RESP_CHUNK_SIZE) {
+                    char *hex_end;
+                    unsigned long size = strtoul(p->line.data, &hex_end, 16);
+                    if (hex_end == p->line.data) {
+                        p->state = HTTP_RESP_ERROR;
+                    } else if (size == 0) {
+                        p->state = HTTP_RESP_CHUNK_TRAILER;
+                    } else {
+                        p->remaining = size;
+                        p->state = HTTP_RESP_CHUNK_DATA;
+                    }
+                } else if (empty_line) {
+                    p->state = HTTP_RESP_COMPLETE;  /* 트레일러 끝 */
+                }
+                buffer_consume(&p->line, p->line.len);
+                break;
+            }
+
+            case HTTP_RESP_BODY_UNTIL_CLOSE:
+                http_response_append_body(p, data, len);
+                len = 0;
+                break;
+
+            case HTTP_RESP_COMPLETE:
+                /* 응답 뒤에 남은 바이트 - 프레이밍이 어긋났으므로 재사용 금지 */
+                p->keep_alive = false;
+                return p->state;
+
+            case HTTP_RESP_ERROR:
+                return p->state;
+        }
+
+        if (p->truncated) {
+            /* 상한 도달 - 지금까지 받은 데이터로 처리하고 연결은 버림 */
+            p->keep_alive = false;
+            p->state = HTTP_RESP_COMPLETE;
+            return p->state;
+        }
+    }
+
+    return p->state;
+}
+
+/* 서버가 연결을 닫음 */
+HttpResponseState http_response_parser_eof(HttpResponseParser *p) {
+    if (p->state == HTTP_RESP_BODY_UNTIL_CLOSE) {
+        p->state = HTTP_RESP_COMPLETE;
+    } else if (p->state != HTTP_RESP_COMPLETE) {
+        p->state = HTTP_RESP_ERROR;
+    }
+    p->keep_alive = false;
+    return p->state;
+}
+
+/* ---- 업스트림 호출 상태 머신 ---- */
+
+/* 새 소켓으로 논블로킹 connect 시작 */
+bool upstream_call_connect(UpstreamCall *call) {
+    UpstreamTarget *target = call->target;
+
+    call->fd = socket(target->addr.ss_family, SOCK_STREAM, 0);
+    if (call->fd < 0) {
+        log_write(LOG_LEVEL_ERROR, "[Manticore] socket creation failed: %s", strerror(errno));
+        metrics_count(&g_metrics.upstream_errors[UPSTREAM_ERR_CONNECT]);
+        return false;
+    }
+    set_nonblocking(call->fd);
+    call->generation++;
+    call->reused = false;
+    call->stage_start_us = metrics_now_us();
+    metrics_count(&g_metrics.pool_new);
+
+    if (connect(call->fd, (struct sockaddr*)&target->addr, target->addrlen) < 0) {
+        if (errno != EINPROGRESS) {
+            log_write(LOG_LEVEL_ERROR, "[Manticore] connection failed: %s", strerror(errno));
+            metrics_count(&g_metrics.upstream_errors[UPSTREAM_ERR_CONNECT]);
+            close(call->fd);
+            call->fd = -1;
+            return false;
+        }
+        call->state = UPSTREAM_CONNECTING;
+    } else {
+        call->stage_start_us = metrics_observe(STAGE_UPSTREAM_CONNECT, call->stage_start_us);
+        call->state = UPSTREAM_SENDING;
+    }
+    return true;
+}
+
+/* 풀에서 꺼낸 연결이 이미 죽어 있었던 경우 새 연결로 한 번 재시도 */
+bool upstream_call_retry_fresh(UpstreamCall *call) {
+    if (!call->reused || call->received_any) return false;
+
+    metrics_count(&g_metrics.upstream_retries);
+    close(call->fd);
+    call->fd = -1;
+    call->sent = 0;
+    http_response_parser_reset(&call->parser, call->config->max_response_size);
+
+    if (!upstream_call_connect(call)) {
+        call->state = UPSTREAM_FAILED;
+        return false;
+    }
+    return true;
+}
+
+/* 버퍼 초기화 - 한 번 만든 호출 구조체는 요청마다 재사용 */
+void upstream_call_init(UpstreamCall *call) {
+    call->fd = -1;
+    call->state = UPSTREAM_FAILED;
+    call->target = NULL;
+    call->config = NULL;
+    call->generation = 0;
+    call->sink = NULL;
+    call->sink_ctx = NULL;
+    call->outstanding = false;
+    buffer_init(&call->request);
+    http_response_parser_init(&call->parser);
+}
+
+/* 요청 준비 후 풀의 유휴 연결 또는 새 연결로 시작.
+ * sink가 있으면 응답 바디를 받는 대로 넘기고, 없으면 parser.body에 전부 모은다 */
+bool upstream_call_start(UpstreamCall *call, const Config *config, UpstreamTarget *target,
+                         const char *body, size_t body_len, UpstreamBodySink sink, void *sink_ctx) {
+    call->fd = -1;
+    call->state = UPSTREAM_FAILED;
+    call->target = target;
+    call->config = config;
+    call->sent = 0;
+    call->reused = false;
+    call->received_any = false;
+    call->generation = 0;
+    call->sink = sink;
+    call->sink_ctx = sink_ctx;
+    call->sink_done = false;
+    call->start_us = metrics_now_us();
+    buffer_reset(&call->request);
+    http_response_parser_reset(&call->parser, config->max_response_size);
+
+    /* 시작 시 해석에 실패했다면 한 번 더 시도 */
+    pthread_mutex_lock(&target->lock);
+    bool resolved = target->resolved || resolve_upstream_addr(target);
+    pthread_mutex_unlock(&target->lock);
+    if (!resolved) {
+        metrics_count(&g_metrics.upstream_errors[UPSTREAM_ERR_RESOLVE]);
+        return false;
+    }
+
+    /* HTTP 요청 생성 (HTTP/1.1 기본 keep-alive) */
+    char header[512];
+    int header_len = snprintf(header, sizeof(header),
+             "POST %s HTTP/1.1\r\n"
+             "Host: %s:%d\r\n"
+             "Content-Type: application/json\r\n"
+             "Content-Length: %zu\r\n"
+             "\r\n",
+             target->path, target->host, target->port, body_len);
+    buffer_reserve(&call->request, header_len + body_len);
+    buffer_append(&call->request, header, header_len);
+    buffer_append(&call->request, body, body_len);
+    log_write(LOG_LEVEL_DEBUG, "[Manticore] Connecting to: %s%s", target->name, target->path);
+
+    call->fd = upstream_pool_acquire(target);
+    if (call->fd >= 0) {
+        call->reused = true;
+        call->generation++;
+        call->state = UPSTREAM_SENDING;
+        call->stage_start_us = metrics_now_us();
+        metrics_count(&g_metrics.pool_reused);
+    } else if (!upstream_call_connect(call)) {
+        return false;
+    }
+
+    __atomic_add_fetch(&target->outstanding, 1, __ATOMIC_RELAXED);
+    call->outstanding = true;
+    return true;
+}
+
+/* 현재 상태에서 기다려야 하는 이벤트 (poll 플래그) */
+short upstream_call_events(const UpstreamCall *call) {
+    return (call->state == UPSTREAM_RECEIVING) ? POLLIN : POLLOUT;
+}
+
+/* 새로 받은 바디를 sink에 넘긴다. sink가 더 필요 없다고 하면 남은 바디가 작을 때만
+ * 읽어 버려 연결을 풀에 돌려주고, 아니면 연결을 버린다. 더 읽어야 하면 true */
+bool upstream_call_deliver(UpstreamCall *call) {
+    HttpResponseParser *p = &call->parser;
+    bool complete = (p->state == HTTP_RESP_COMPLETE);
+    if (!call->sink || call->sink_done) return !complete;
+    if (p->body.len == 0 && !complete) return true;
+
+    if (call->sink(call->sink_ctx, &p->body, complete)) return !complete;
+
+    call->sink_done = true;
+    buffer_reset(&p->body);
+    if (complete) return false;
+
+    metrics_count(&g_metrics.upstream_early_stop);
+    if (p->state == HTTP_RESP_BODY_LENGTH && p->remaining <= UPSTREAM_DRAIN_MAX) {
+        p->discard = true;
+        return true;
+    }
+    p->keep_alive = false;
+    return false;
+}
+
+/* 소켓 오류로 호출 실패 - 진행 중이던 단계의 오류로 기록 */
+void upstream_call_fail(UpstreamCall *call, int err) {
+    if (call->state == UPSTREAM_CONNECTING) {
+        log_write(LOG_LEVEL_ERROR, "[Manticore] connection failed: %s", strerror(err));
+        metrics_count(&g_metrics.upstream_errors[UPSTREAM_ERR_CONNECT]);
+    } else if (call->state == UPSTREAM_SENDING) {
+        log_write(LOG_LEVEL_ERROR, "[Manticore] write failed: %s", strerror(err));
+        metrics_count(&g_metrics.upstream_errors[UPSTREAM_ERR_SEND]);
+    } else {
+        log_write(LOG_LEVEL_ERROR, "[Manticore] read failed: %s", strerror(err));
+        metrics_count(&g_metrics.upstream_errors[UPSTREAM_ERR_RECV]);
+    }
+    call->state = UPSTREAM_FAILED;
+}
+
+/* 응답을 다 받음 (UPSTREAM_DONE) */
+void upstream_call_read_done(UpstreamCall *call) {
+    metrics_observe(STAGE_UPSTREAM_READ, call->stage_start_us);
+    if (call->parser.status_code >= 400) {
+        metrics_count(&g_metrics.upstream_errors[UPSTREAM_ERR_STATUS]);
+    }
+}
+
+/* 받은 바이트를 파서와 sink에 넘김. 응답이 끝났거나 (DONE) 잘못됐으면 (FAILED) false */
+bool upstream_call_receive(UpstreamCall *call, const char *data, size_t len) {
+    if (!call->received_any) {
+        call->stage_start_us = metrics_observe(STAGE_UPSTREAM_FIRST_BYTE, call->stage_start_us);
+    }
+    call->received_any = true;
+    HttpResponseState st = http_response_parser_feed(&call->parser, data, len);
+    if (st != HTTP_RESP_ERROR && !upstream_call_deliver(call)) {
+        if (call->parser.truncated) {
+            log_write(LOG_LEVEL_WARN, "[Manticore] Warning: response truncated at %zu bytes",
+                      call->parser.max_body);
+            metrics_count(&g_metrics.upstream_errors[UPSTREAM_ERR_TRUNCATED]);
+        }
+        call->state = UPSTREAM_DONE;
+        upstream_call_read_done(call);
+        return false;
+    }
+    if (st == HTTP_RESP_ERROR) {
+        log_write(LOG_LEVEL_ERROR, "[Manticore] Error: malformed HTTP response");
+        metrics_count(&g_metrics.upstream_errors[UPSTREAM_ERR_PROTOCOL]);
+        call->state = UPSTREAM_FAILED;
+        return false;
+    }
+    return true;
+}
+
+/* 응답 도중 서버가 연결을 닫음 (풀 연결 재시도는 부른 쪽에서) */
+void upstream_call_receive_eof(UpstreamCall *call) {
+    call->state = (http_response_parser_eof(&call->parser) == HTTP_RESP_COMPLETE ||
+                   call->sink_done) ? UPSTREAM_DONE : UPSTREAM_FAILED;
+    if (call->state == UPSTREAM_DONE) {
+        upstream_call_deliver(call);
+        upstream_call_read_done(call);
+    } else {
+        log_write(LOG_LEVEL_ERROR, "[Manticore] Error: connection closed mid-response");
+        metrics_count(&g_metrics.upstream_errors[UPSTREAM_ERR_CLOSED]);
+    }
+}
+
+/* 소켓이 허용하는 만큼 진행 (EAGAIN까지) 후 현재 상태 반환 */
+UpstreamState upstream_call_advance(UpstreamCall *call) {
+    if (call->state == UPSTREAM_CONNECTING) {
+        struct pollfd pfd = { .fd = call->fd, .events = POLLOUT };
+        if (poll(&pfd, 1, 0) <= 0) return call->state;  /* 아직 연결 중 */
+
+        int err = 0;
+        socklen_t len = sizeof(err);
+        getsockopt(call->fd, SOL_SOCKET, SO_ERROR, &err, &len);
+        if (err != 0) {
+            upstream_call_fail(call, err);
+            return call->state;
+        }
+        call->stage_start_us = metrics_observe(STAGE_UPSTREAM_CONNECT, call->stage_start_us);
+        call->state = UPSTREAM_SENDING;
+    }
+
+    if (call->state == UPSTREAM_SENDING) {
+        while (call->sent < call->request.len) {
+            ssize_t n = send(call->fd, call->request.data + call->sent,
+                             call->request.len - call->sent, MSG_NOSIGNAL);
+            if (n < 0) {
+                if (errno == EAGAIN || errno == EWOULDBLOCK) return call->state;
+                if (errno == EINTR) continue;
+                if (upstream_call_retry_fresh(call)) return upstream_call_advance(call);
+                upstream_call_fail(call, errno);
+                return call->state;
+            }
+            call->sent += n;
+        }
+        call->stage_start_us = metrics_observe(STAGE_UPSTREAM_SEND, call->stage_start_us);
+        call->state = UPSTREAM_RECEIVING;
+    }
+
+    if (call->state == UPSTREAM_RECEIVING) {
+        char chunk[16384];
+        for (;;) {
+            ssize_t n = recv(call->fd, chunk, sizeof(chunk), 0);
+            if (n > 0) {
+                if (!upstream_call_receive(call, chunk, n)) break;
+            } else if (n == 0) {
+                if (upstream_call_retry_fresh(call)) return upstream_call_advance(call);
+                upstream_call_receive_eof(call);
+                break;
+            } else {
+                if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+                if (errno == EINTR) continue;
+                if (upstream_call_retry_fresh(call)) return upstream_call_advance(call);
+                upstream_call_fail(call, errno);
+                break;
+            }
+        }
+    }
+
+    return call->state;
+}
+
+/* 요청 종료 - 응답을 온전히 받았고 keep-alive면 연결을 풀로 반환.
+ * 버퍼는 다음 요청을 위해 남겨두되 지나치게 커졌으면 반납 */
+void upstream_call_release(UpstreamCall *call) {
+    if (call->fd >= 0) {
+        if (call->state == UPSTREAM_DONE && call->parser.keep_alive &&
+            call->parser.state == HTTP_RESP_COMPLETE) {
+            upstream_pool_release(call->target, call->fd);
+        } else {
+            close(call->fd);
+        }
+        call->fd = -1;
+    }
+    if (call->outstanding) {
+        __atomic_sub_fetch(&call->target->outstanding, 1, __ATOMIC_RELAXED);
+        call->outstanding = false;
+    }
+    buffer_trim(&call->request, SCRATCH_RETAIN_SIZE);
+    buffer_trim(&call->parser.line, SCRATCH_RETAIN_SIZE);
+    buffer_trim(&call->parser.body, SCRATCH_RETAIN_SIZE);
+}
+
+void upstream_call_free(UpstreamCall *call) {
+    upstream_call_release(call);
+    buffer_free(&call->request);
+    http_response_parser_free(&call->parser);
+}
+
+/* 지금 상태에 걸리는 가장 이른 deadline (metrics_now_us 기준, 0 = 없음).
+ * 모두 호출 시작부터 잰다: 연결 중이면 connect, 첫 바이트 전이면 first-byte, 항상 전체 */
+uint64_t upstream_call_deadline(const UpstreamCall *call, const char **stage) {
+    const Config *config = call->config;
+    uint64_t deadline = 0;
+    const char *name = "total";
+    if (config->timeout_ms > 0) {
+        deadline = call->start_us + (uint64_t)config->timeout_ms * 1000;
+    }
+    if (!call->received_any && config->first_byte_timeout_ms > 0) {
+        uint64_t first_byte = call->start_us + (uint64_t)config->first_byte_timeout_ms * 1000;
+        if (deadline == 0 || first_byte < deadline) {
+            deadline = first_byte;
+            name = "first-byte";
+        }
+    }
+    if (call->state == UPSTREAM_CONNECTING && config->connect_timeout_ms > 0) {
+        uint64_t connect = call->start_us + (uint64_t)config->connect_timeout_ms * 1000;
+        if (deadline == 0 || connect < deadline) {
+            deadline = connect;
+            name = "connect";
+        }
+    }
+    if (stage) *stage = name;
+    return deadline;
+}
+
+/* deadline이 지났으면 호출을 끝내고 true. 결과를 이미 다 얻고 남은 바디를
+ * 버리던 중이었다면 성공으로 두고 연결만 버린다 (release에서 닫힘) */
+bool upstream_call_expire(UpstreamCall *call, uint64_t now_us) {
+    if (call->state == UPSTREAM_DONE || call->state == UPSTREAM_FAILED) return false;
+
+    const char *stage;
+    uint64_t deadline = upstream_call_deadline(call, &stage);
+    if (deadline == 0 || now_us < deadline) return false;
+
+    if (call->sink_done) {
+        call->parser.keep_alive = false;
+        call->state = UPSTREAM_DONE;
+        return true;
+    }
+    log_write(LOG_LEVEL_ERROR, "[Manticore] Error: %s timeout after %llu ms", stage,
+              (unsigned long long)(now_us - call->start_us) / 1000);
+    metrics_count(&g_metrics.upstream_errors[UPSTREAM_ERR_TIMEOUT]);
+    call->state = UPSTREAM_FAILED;
+    return true;
+}
+
+/* 시작된 호출 여러 개(MAX_QUERIES개까지)를 한 poll()로 함께 구동.
+ * 모두 UPSTREAM_DONE 또는 UPSTREAM_FAILED가 되면 반환 (deadline이 지난 호출은 FAILED) */
+void upstream_calls_run(UpstreamCall *calls, int count) {
+    struct pollfd pfds[MAX_QUERIES];
+
+    for (;;) {
+        int nfds = 0;
+        uint64_t next_deadline = 0;
+        uint64_t now = 0;
+        for (int i = 0; i < count; i++) {
+            UpstreamCall *call = &calls[i];
+            if (call->state == UPSTREAM_DONE || call->state == UPSTREAM_FAILED) continue;
+            if (upstream_call_advance(call) == UPSTREAM_DONE || call->state == UPSTREAM_FAILED) continue;
+            now = metrics_now_us();
+            if (upstream_call_expire(call, now)) continue;
+
+            uint64_t deadline = upstream_call_deadline(call, NULL);
+            if (deadline && (next_deadline == 0 || deadline < next_deadline)) next_deadline = deadline;
+            pfds[nfds].fd = call->fd;
+            pfds[nfds].events = upstream_call_events(call);
+            nfds++;
+        }
+        if (nfds == 0) return;
+
+        /* 가장 이른 deadline까지만 대기 (ms 올림 - 깨어났을 때 확실히 지나 있도록) */
+        int timeout = -1;
+        if (next_deadline) timeout = next_deadline > now ? (int)((next_deadline - now + 999) / 1000) : 0;
+
+        if (poll(pfds, nfds, timeout) < 0 && errno != EINTR) {
+            log_write(LOG_LEVEL_ERROR, "[Manticore] poll failed: %s", strerror(errno));
+            for (int i = 0; i < count; i++) {
+                if (calls[i].state != UPSTREAM_DONE) calls[i].state = UPSTREAM_FAILED;
+            }
+            return;
+        }
+    }
+}
+
+/* ============================
+ * 링크 캐시 (page_title → link)
+ * ============================ */
+
+/* 인기 문서는 같은 제목이 응답마다 다시 나오므로 URL 인코딩 결과를 공유한다.
+ * 샤드마다 LRU, 용량은 cache.link_max_bytes를 샤드 수로 나눈 값 */
+void link_cache_init(LinkCache *cache, size_t max_bytes) {
+    memset(cache, 0, sizeof(LinkCache));
+    size_t shard_bytes = max_bytes / LINK_CACHE_SHARDS;
+    if (shard_bytes < LINK_CACHE_ENTRY_ESTIMATE) return;
+
+    size_t nbuckets = 16;
+    while (nbuckets < shard_bytes / LINK_CACHE_ENTRY_ESTIMATE) nbuckets *= 2;
+    for (int i = 0; i < LINK_CACHE_SHARDS; i++) {
+        LinkCacheShard *shard = &cache->shards[i];
+        shard->buckets = calloc(nbuckets, sizeof(LinkEntry*));
+        if (!shard->buckets) {
+            fprintf(stderr, "[ERROR] Memory allocation failed for link cache buckets\n");
+            exit(EXIT_FAILURE);
+        }
+        shard->nbuckets = nbuckets;
+        shard->max_bytes = shard_bytes;
+        pthread_mutex_init(&shard->lock, NULL);
+    }
+    cache->enabled = true;
+}
+
+LinkCacheShard* link_cache_shard(LinkCache *cache, uint64_t hash) {
+    return &cache->shards[(hash >> 40) & (LINK_CACHE_SHARDS - 1)];
+}
+
+/* LRU 목록에서 분리 (lock 보유 상태) */
+void link_lru_unlink(LinkCacheShard *shard, LinkEntry *entry) {
+    if (entry->prev) entry->prev->next = entry->next;
+    else shard->lru_head = entry->next;
+    if (entry->next) entry->next->prev = entry->prev;
+    else shard->lru_tail = entry->prev;
+    entry->prev = entry->next = NULL;
+}
+
+void link_lru_push_front(LinkCacheShard *shard, LinkEntry *entry) {
+    entry->prev = NULL;
+    entry->next = shard->lru_head;
+    if (shard->lru_head) shard->lru_head->prev = entry;
+    shard->lru_head = entry;
+    if (!shard->lru_tail) shard->lru_tail = entry;
+}
+
+/* 항목 제거 (lock 보유 상태) */
+void link_remove_entry(LinkCacheShard *shard, LinkEntry *entry) {
+    LinkEntry **slot = &shard->buckets[entry->hash & (shard->nbuckets - 1)];
+    while (*slot && *slot != entry) slot = &(*slot)->hnext;
+    if (*slot) *slot = entry->hnext;
+
+    link_lru_unlink(shard, entry);
+    shard->bytes -= entry->bytes;
+    shard->entries--;
+    free(entry);
+}
+
+/* lock 보유 상태에서 찾기 */
+LinkEntry* link_shard_find(LinkCacheShard *shard, const char *title, size_t title_len, uint64_t hash) {
+    LinkEntry *entry = shard->buckets[hash & (shard->nbuckets - 1)];
+    while (entry && !(entry->hash == hash && entry->title_len == title_len &&
+                      memcmp(entry->data, title, title_len) == 0)) {
+        entry = entry->hnext;
+    }
+    return entry;
+}
+
+/* 조회 - 적중하면 base_url + 인코딩 결과를 arena에 복사해 반환
+ * (잠금을 놓은 뒤 항목이 밀려나도 안전) */
+char* link_cache_get(LinkCache *cache, Arena *arena, const char *base_url, size_t base_len,
+                     const char *title, size_t title_len, uint64_t hash, size_t *link_len) {
+    LinkCacheShard *shard = link_cache_shard(cache, hash);
+    char *link = NULL;
+
+    pthread_mutex_lock(&shard->lock);
+    LinkEntry *entry = link_shard_find(shard, title, title_len, hash);
+    if (entry) {
+        if (entry != shard->lru_head) {
+            link_lru_unlink(shard, entry);
+            link_lru_push_front(shard, entry);
+        }
+        link = arena_alloc(arena, base_len + entry->encoded_len + 1);
+        memcpy(link, base_url, base_len);
+        memcpy(link + base_len, entry->data + title_len + 1, entry->encoded_len + 1);
+        *link_len = base_len + entry->encoded_len;
+        shard->hits++;
+    } else {
+        shard->misses++;
+    }
+    pthread_mutex_unlock(&shard->lock);
+
+    return link;
+}
+
+/* 저장 - 다른 워커가 먼저 넣었으면 그대로 두고, 용량을 넘으면 LRU 꼬리부터 제거 */
+void link_cache_put(LinkCache *cache, const char *title, size_t title_len, uint64_t hash,
+                    const char *encoded, size_t encoded_len) {
+    LinkCacheShard *shard = link_cache_shard(cache, hash);
+    size_t bytes = sizeof(LinkEntry) + title_len + 1 + encoded_len + 1;
+    if (bytes > shard->max_bytes) return;
+
+    LinkEntry *entry = safe_malloc(bytes);
+    entry->hash = hash;
+    entry->title_len = title_len;
+    entry->encoded_len = encoded_len;
+    entry->bytes = bytes;
+    memcpy(entry->data, title, title_len);
+    entry->data[title_len] = '\0';
+    memcpy(entry->data + title_len + 1, encoded, encoded_len + 1);
+
+    pthread_mutex_lock(&shard->lock);
+    if (link_shard_find(shard, title, title_len, hash)) {
+        pthread_mutex_unlock(&shard->lock);
+        free(entry);
+        return;
+    }
+
+    while (shard->lru_tail && shard->bytes + bytes > shard->max_bytes) {
+        link_remove_entry(shard, shard->lru_tail);
+        shard->evictions++;
+    }
+
+    size_t idx = hash & (shard->nbuckets - 1);
+    entry->hnext = shard->buckets[idx];
+    shard->buckets[idx] = entry;
+    link_lru_push_front(shard, entry);
+    shard->bytes += bytes;
+    shard->entries++;
+    pthread_mutex_unlock(&shard->lock);
+}
+
+/* 결과 하나의 link (base_url + URL 인코딩 제목, arena). 캐시가 켜져 있으면 먼저 찾아보고
+ * 없을 때만 인코딩해 넣는다. URL 인코딩 결과에는 JSON escape할 문자가 없으므로
+ * base_url도 그렇다면 *link_len에 길이를 돌려 create_json_results가 그대로 복사하게 한다 */
+char* search_result_link(Arena *arena, const Config *config, const char *title, size_t *link_len) {
+    size_t title_len = strlen(title);
+    size_t base_len = strlen(config->base_url);
+    uint64_t hash = 0;
+    char *link;
+    size_t len;
+
+    if (g_link_cache.enabled) {
+        hash = hash_words(title, title_len);
+        link = link_cache_get(&g_link_cache, arena, config->base_url, base_len, title, title_len, hash, &len);
+        if (link) {
+            *link_len = config->base_url_plain ? len : 0;
+            return link;
+        }
+    }
+
+    link = arena_alloc(arena, base_len + title_len * 3 + 1);
+    memcpy(link, config->base_url, base_len);
+    size_t encoded_len = url_encode_into(link + base_len, title);
+    len = base_len + encoded_len;
+
+    if (g_link_cache.enabled) link_cache_put(&g_link_cache, title, title_len, hash, link + base_len, encoded_len);
+    *link_len = config->base_url_plain ? len : 0;
+    return link;
+}
+
+/* 샤드 합계 (metrics) */
+void link_cache_stats(LinkCache *cache, uint64_t *hits, uint64_t *misses, uint64_t *evictions,
+                      size_t *entries, size_t *bytes) {
+    *hits = *misses = *evictions = 0;
+    *entries = *bytes = 0;
+    if (!cache->enabled) return;
+
+    for (int i = 0; i < LINK_CACHE_SHARDS; i++) {
+        LinkCacheShard *shard = &cache->shards[i];
+        pthread_mutex_lock(&shard->lock);
+        *hits += shard->hits;
+        *misses += shard->misses;
+        *evictions += shard->evictions;
+        *entries += shard->entries;
+        *bytes += shard->bytes;
+        pthread_mutex_unlock(&shard->lock);
+    }
+}
+
+void link_cache_destroy(LinkCache *cache) {
+    if (!cache->enabled) return;
+
+    uint64_t hits, misses, evictions;
+    size_t entries, bytes;
+    link_cache_stats(cache, &hits, &misses, &evictions, &entries, &bytes);
+    printf("[LinkCache] hits=%llu misses=%llu evictions=%llu entries=%zu\n",
+           (unsigned long long)hits, (unsigned long long)misses,
+           (unsigned long long)evictions, entries);
+
+    for (int i = 0; i < LINK_CACHE_SHARDS; i++) {
+        LinkCacheShard *shard = &cache->shards[i];
+        pthread_mutex_lock(&shard->lock);
+        while (shard->lru_head) {
+            link_remove_entry(shard, shard->lru_head);
+        }
+        pthread_mutex_unlock(&shard->lock);
+        free(shard->buckets);
+        pthread_mutex_destroy(&shard->lock);
+    }
+    cache->enabled = false;
+}
+
+/* ============================
+ * Manticore Search 통합
+ * ============================ */
+
+/*
+ * hits.hits[]._source 워커
+ *
+ * 토크나이저가 돌려주는 토큰을 하나씩 받아 각 컨테이너를 연 키를 깊이별로
+ * 기록하고, hits.hits[] 원소 안의 _source.page_title / _source.old_text
+ * 문자열 위치만 잡아둔다. 본문에 "_source" 같은 글자가 있어도 문자열 값이라
+ * 키로 오인하지 않는다. 원소 하나가 닫힐 때 결과 하나를 만든다.
+ *
+ * 템플릿이 "highlight"를 요청했으면 hits.hits[].highlight.old_text의 첫 조각을
+ * 스니펫으로 쓴다. 아니면 old_text에서 쿼리 단어 주변만 풀어 스니펫을 만든다.
+ */
+typedef enum {
+    HIT_KEY_OTHER = 0,
+    HIT_KEY_HITS,
+    HIT_KEY_SOURCE,
+    HIT_KEY_HIGHLIGHT,
+    HIT_KEY_PAGE_TITLE,
+    HIT_KEY_OLD_TEXT
+} HitKey;
+
+/* 스니펫 위치를 찾을 쿼리 단어 (쿼리 문자열을 가리킴) */
+typedef struct {
+    const char *start;
+    size_t len;
+    unsigned char first;    /* 소문자로 바꾼 첫 바이트 (빠른 비교용) */
+} SnippetTerm;
+
+typedef struct {
+    const Config *config;   /* 스니펫 길이/모드, base_url */
+    Arena *arena;           /* 결과 문자열 할당 */
+    SearchResult *results;
+    int max_results;
+    int result_count;
+    unsigned char path[JSON_MAX_DEPTH + 1];  /* 깊이별로 그 컨테이너를 연 키 */
+    HitKey pending_key;
+    bool in_hit;
+    bool has_source;
+    size_t hit_start;       /* 현재 hits.hits[] 원소가 시작한 오프셋 (스트리밍 시 이 앞은 버려도 됨) */
+    JsonToken title;
+    JsonToken text;
+    JsonToken highlight;    /* highlight.old_text 첫 조각 */
+    SnippetTerm terms[MAX_SNIPPET_TERMS];
+    int term_count;
+    bool term_first[256];   /* 단어 첫 바이트 (대소문자 모두) - 나머지 바이트는 바로 건너뜀 */
+    size_t term_max_len;
+    char *window;           /* 매칭 스니펫용 unescape 창 (처음 쓸 때 arena에서 할당) */
+} HitWalker;
+
+/* 스니펫 단어 구분자: ASCII 공백과 구두점 (UTF-8 바이트는 단어의 일부) */
+bool snippet_is_separator(unsigned char c) {
+    return c < 0x80 && (isspace(c) || ispunct(c));
+}
+
+/* match 모드용으로 쿼리를 단어로 나눠 둔다 (2바이트 미만과 중복 제외) */
+void hit_walker_set_terms(HitWalker *w, const char *query) {
+    const char *p = query;
+    while (*p && w->term_count < MAX_SNIPPET_TERMS) {
+        while (*p && snippet_is_separator((unsigned char)*p)) p++;
+        const char *start = p;
+        while (*p && !snippet_is_separator((unsigned char)*p)) p++;
+        size_t len = p - start;
+        if (len < 2) continue;
+
+        bool duplicate = false;
+        for (int i = 0; i < w->term_count && !duplicate; i++) {
+            duplicate = w->terms[i].len == len && strncasecmp(w->terms[i].start, start, len) == 0;
+        }
+        if (duplicate) continue;
+
+        SnippetTerm *term = &w->terms[w->term_count++];
+        term->start = start;
+        term->len = len;
+        term->first = (unsigned char)tolower((unsigned char)*start);
+        w->term_first[term->first] = true;
+        w->term_first[(unsigned char)toupper(term->first)] = true;
+        if (len > w->term_max_len) w->term_max_len = len;
+    }
+}
+
+/* query가 NULL이거나 snippet_mode가 head면 본문 앞부분을 스니펫으로 쓴다 */
+void hit_walker_init(HitWalker *w, const Config *config, Arena *arena, SearchResult *results,
+                     int max_results, const char *query) {
+    memset(w, 0, sizeof(HitWalker));
+    w->config = config;
+    w->arena = arena;
+    w->results = results;
+    w->max_results = max_results < MAX_RESULTS ? max_results : MAX_RESULTS;
+    w->title.type = JSON_TOK_ERROR;
+    w->text.type = JSON_TOK_ERROR;
+    w->highlight.type = JSON_TOK_ERROR;
+    if (query && strcmp(config->snippet_mode, "match") == 0 && config->snippet_length > 0) {
+        hit_walker_set_terms(w, query);
+    }
+}
+
+HitKey hit_walker_classify(const char *buf, const JsonToken *tok) {
+    if (json_key_equals(buf, tok, "hits")) return HIT_KEY_HITS;
+    if (json_key_equals(buf, tok, "_source")) return HIT_KEY_SOURCE;
+    if (json_key_equals(buf, tok, "highlight")) return HIT_KEY_HIGHLIGHT;
+    if (json_key_equals(buf, tok, "page_title")) return HIT_KEY_PAGE_TITLE;
+    if (json_key_equals(buf, tok, "old_text")) return HIT_KEY_OLD_TEXT;
+    return HIT_KEY_OTHER;
+}
+
+/* depth가 hits.hits[] 원소 객체인지 (루트=1, hits=2, hits[]=3, 원소=4) */
+bool hit_walker_is_hit(const HitWalker *w, int depth) {
+    return depth == 4 && w->path[2] == HIT_KEY_HITS && w->path[3] == HIT_KEY_HITS;
+}
+
+/* 문자열 앞부분으로 스니펫 생성 - snippet 길이만큼만 unescape */
+char* hit_walker_head_snippet(HitWalker *w, const char *buf, const JsonToken *tok) {
+    /* 최대 snippet_length 제한 (UTF-8 안전), 여유분까지 풀어 잘렸는지 판단 */
+    size_t limit = (size_t)w->config->snippet_length;
+    size_t raw_len = tok->end - tok->start;
+    size_t size = (raw_len < limit ? raw_len : limit) + 8;
+    char *snippet = arena_alloc(w->arena, size);
+    size_t len = unescape_json_string(buf + tok->start, buf + tok->end, snippet, size);
+    if (len > limit) {
+        size_t safe_len = utf8_safe_truncate(snippet, limit);
+        memcpy(snippet + safe_len, "...", 4);
+    }
+    return snippet;
+}
+
+/* text[from, len)에서 쿼리 단어가 처음 나오는 위치, 없으면 -1 (ASCII 대소문자 무시) */
+long snippet_find_term(const HitWalker *w, const char *text, size_t from, size_t len) {
+    for (size_t i = from; i < len; i++) {
+        if (!w->term_first[(unsigned char)text[i]]) continue;
+        unsigned char c = (unsigned char)tolower((unsigned char)text[i]);
+        for (int t = 0; t < w->term_count; t++) {
+            const SnippetTerm *term = &w->terms[t];
+            if (term->first != c || term->len > len - i) continue;
+            if (strncasecmp(text + i, term->start, term->len) == 0) return (long)i;
+        }
+    }
+    return -1;
+}
+
+/*
+ * 쿼리 단어가 처음 나오는 곳 주변으로 스니펫 생성 (snippet_mode: match)
+ *
+ * old_text를 SNIPPET_SCAN_CHUNK씩 창에 풀면서 단어를 찾고, 창에는 앞 문맥
+ * (snippet 길이의 1/4)과 단어 길이만큼만 남긴다. 찾으면 스니펫을 채울 만큼만 더
+ * 풀고 멈추므로 긴 본문도 전부 unescape 하지 않는다. 단어가 없거나
+ * snippet_scan_max 바이트까지 못 찾으면 NULL (호출자가 앞부분 스니펫으로).
+ */
+char* hit_walker_match_snippet(HitWalker *w, const char *buf, const JsonToken *tok) {
+    size_t limit = (size_t)w->config->snippet_length;
+    size_t before = limit / 4;
+    size_t keep = before + w->term_max_len;
+    size_t capacity = keep + SNIPPET_SCAN_CHUNK + limit + 8;
+    if (!w->window) w->window = arena_alloc(w->arena, capacity);
+
+    char *win = w->window;
+    const char *begin = buf + tok->start;
+    const char *src = begin;
+    const char *end = buf + tok->end;
+    size_t len = 0;
+    size_t search_from = 0;
+    bool dropped = false;
+    long match = -1;
+
+    while (src < end) {
+        len += json_unescape_span(&src, end, win + len, SNIPPET_SCAN_CHUNK + 1);
+        match = snippet_find_term(w, win, search_from, len);
+        if (match >= 0) break;
+        if ((size_t)(src - begin) >= w->config->snippet_scan_max) return NULL;
+
+        /* 다음 청크와 걸친 단어와 앞 문맥을 위해 끝부분만 남김 */
+        if (len > keep) {
+            memmove(win, win + len - keep, keep);
+            len = keep;
+            dropped = true;
+        }
+        search_from = len >= w->term_max_len ? len - w->term_max_len + 1 : 0;
+    }
+    if (match < 0) return NULL;
+
+    /* 앞부분 스니펫에 단어와 뒤 문맥이 다 들어가면 처음부터 */
+    size_t start = (size_t)match > before ? (size_t)match - before : 0;
+    if (!dropped && (size_t)match + before <= limit) start = 0;
+
+    /* 스니펫 길이 + 잘렸는지 판단할 1바이트까지만 더 푼다 */
+    while (len < start + limit + 1 && src < end) {
+        size_t n = json_unescape_span(&src, end, win + len, start + limit + 9 - len);
+        if (n == 0) break;
+        len += n;
+    }
+    /* 본문 끝이 가까우면 창을 앞으로 당겨 스니펫 길이를 채움 */
+    if (src >= end && len - start < limit) start = len > limit ? len - limit : 0;
+
+    /* 앞을 잘랐으면 UTF-8 문자 경계, 가능하면 단어 경계에서 시작 */
+    bool cut_front = start > 0 || dropped;
+    if (cut_front) {
+        while (start < (size_t)match && ((unsigned char)win[start] & 0xC0) == 0x80) start++;
+        for (size_t i = start; i < (size_t)match; i++) {
+            if (isspace((unsigned char)win[i])) {
+                start = i + 1;
+                break;
+            }
+        }
+    }
+
+    size_t body = len - start;
+    bool cut_back = body > limit;
+    if (cut_back) body = utf8_safe_truncate(win + start, limit);
+
+    char *snippet = arena_alloc(w->arena, body + 7);
+    char *dst = snippet;
+    if (cut_front) {
+        memcpy(dst, "...", 3);
+        dst += 3;
+    }
+    memcpy(dst, win + start, body);
+    dst += body;
+    if (cut_back) {
+        memcpy(dst, "...", 3);
+        dst += 3;
+    }
+    *dst = '\0';
+    return snippet;
+}
+
+/* 잡아둔 위치로 SearchResult 하나 생성. 우선순위: highlight > 쿼리 단어 주변 > 앞부분 */
+void hit_walker_emit(HitWalker *w, const char *buf) {
+    SearchResult *result = &w->results[w->result_count++];
+
+    char *title;
+    if (w->title.type == JSON_TOK_STRING) {
+        title = json_token_strdup(w->arena, buf, &w->title);
+    } else {
+        title = "Unknown Document";
+    }
+
+    size_t link_len;
+    char *link = search_result_link(w->arena, w->config, title, &link_len);
+
+    char *snippet = NULL;
+    if (w->highlight.type == JSON_TOK_STRING) {
+        snippet = hit_walker_head_snippet(w, buf, &w->highlight);
+    } else if (w->text.type == JSON_TOK_STRING) {
+        if (w->term_count > 0) snippet = hit_walker_match_snippet(w, buf, &w->text);
+        if (!snippet) snippet = hit_walker_head_snippet(w, buf, &w->text);
+    } else {
+        snippet = "No content available";
+    }
+
+    result->link = link;
+    result->title = title;
+    result->snippet = snippet;
+    result->link_len = link_len;
+}
+
+/* 토큰 하나 처리. 결과가 다 차면 false를 돌려 호출자가 읽기를 멈출 수 있게 한다 */
+bool hit_walker_token(HitWalker *w, const char *buf, const JsonToken *tok) {
+    switch (tok->type) {
+        case JSON_TOK_KEY:
+            w->pending_key = hit_walker_classify(buf, tok);
+            return true;
+
+        case JSON_TOK_OBJECT_BEGIN:
+        case JSON_TOK_ARRAY_BEGIN:
+            if (tok->depth <= JSON_MAX_DEPTH) {
+                w->path[tok->depth] = (unsigned char)w->pending_key;
+            }
+            if (tok->type == JSON_TOK_OBJECT_BEGIN && hit_walker_is_hit(w, tok->depth)) {
+                w->in_hit = true;
+                w->hit_start = tok->start;
+                w->has_source = false;
+                w->title.type = JSON_TOK_ERROR;
+                w->text.type = JSON_TOK_ERROR;
+                w->highlight.type = JSON_TOK_ERROR;
+            } else if (w->in_hit && tok->depth == 5 && w->pending_key == HIT_KEY_SOURCE) {
+                w->has_source = true;
+            }
+            break;
+
+        case JSON_TOK_OBJECT_END:
+            if (w->in_hit && hit_walker_is_hit(w, tok->depth)) {
+                w->in_hit = false;
+                if (w->has_source) {
+                    hit_walker_emit(w, buf);
+                }
+            }
+            break;
+
+        case JSON_TOK_STRING:
+            if (!w->in_hit) break;
+            if (tok->depth == 5 && w->path[5] == HIT_KEY_SOURCE) {
+                if (w->pending_key == HIT_KEY_PAGE_TITLE) w->title = *tok;
+                else if (w->pending_key == HIT_KEY_OLD_TEXT) w->text = *tok;
+            } else if (w->path[5] == HIT_KEY_HIGHLIGHT && w->highlight.type != JSON_TOK_STRING) {
+                /* "old_text": ["조각", ...] 또는 "old_text": "조각" */
+                if ((tok->depth == 6 && w->path[6] == HIT_KEY_OLD_TEXT) ||
+                    (tok->depth == 5 && w->pending_key == HIT_KEY_OLD_TEXT)) {
+                    w->highlight = *tok;
+                }
+            }
+            break;
+
+        default:
+            break;
+    }
+
+    w->pending_key = HIT_KEY_OTHER;
+    return w->result_count < w->max_results;
+}
+
+/* 버퍼 앞 n바이트를 버렸을 때 잡아둔 위치를 맞춘다 (n은 hit_start 이하) */
+void hit_walker_discard(HitWalker *w, size_t n) {
+    JsonToken *tokens[] = { &w->title, &w->text, &w->highlight };
+    for (size_t i = 0; i < sizeof(tokens) / sizeof(tokens[0]); i++) {
+        if (tokens[i]->type != JSON_TOK_STRING) continue;
+        tokens[i]->start -= n;
+        tokens[i]->end -= n;
+    }
+    if (w->in_hit) w->hit_start -= n;
+}
+
+/*
+ * 스트리밍 Manticore 응답 파서
+ *
+ * 업스트림 바디가 도착하는 대로 (upstream_call의 sink로) 토크나이저와 워커에
+ * 넣는다. 파싱이 네트워크 수신과 겹치고, 결과가 count개 차면 false를 돌려 남은
+ * 바디를 읽지 않게 한다. 이미 결과로 만든 원소까지의 바이트는 버퍼에서 버리므로
+ * 응답 전체를 한 번에 들고 있지 않는다 (남겨두는 건 처리 중인 원소 하나 정도).
+ */
+typedef void (*ManticoreResultsFn)(void *ctx, const SearchResult *results, int count);
+
+typedef struct {
+    JsonTokenizer tokenizer;
+    HitWalker walker;
+    size_t received;        /* 지금까지 넘겨받은 바디 바이트 */
+    uint64_t parse_us;      /* 토큰화/결과 생성에 쓴 시간 합계 */
+    bool done;              /* 결과가 다 찼거나 JSON 끝 (또는 오류) */
+    ManticoreResultsFn on_results; /* 받은 바디를 처리할 때마다 새로 생긴 결과로 호출 (NULL = 안 함) */
+    void *on_results_ctx;
+    int reported;           /* on_results로 넘긴 결과 수 */
+} ManticoreStream;
+
+void manticore_stream_init(ManticoreStream *s, const Config *config, Arena *arena, SearchResult *results,
+                           int max_results, const char *query) {
+    memset(s, 0, sizeof(ManticoreStream));
+    json_tokenizer_init(&s->tokenizer, "", 0, false);
+    hit_walker_init(&s->walker, config, arena, results, max_results, query);
+    s->done = (s->walker.max_results <= 0);
+}
+
+/* buf[0, len)을 이어서 토큰화. 더 읽어야 하면 true */
+bool manticore_stream_scan(ManticoreStream *s, const char *buf, size_t len, bool final) {
+    if (s->done) return false;
+
+    JsonToken tok;
+    JsonTokenType type;
+    json_tokenizer_feed(&s->tokenizer, buf, len, final);
+    while ((type = json_next(&s->tokenizer, &tok)) < JSON_TOK_END) {
+        if (!hit_walker_token(&s->walker, buf, &tok)) {
+            s->done = true;
+            return false;
+        }
+    }
+    if (type != JSON_TOK_NEED_MORE) s->done = true;
+    return !s->done;
+}
+
+/* UpstreamBodySink - body에 새로 쌓인 바이트를 처리하고 다 쓴 앞부분은 버린다 */
+bool manticore_stream_sink(void *ctx, ByteBuffer *body, bool final) {
+    ManticoreStream *s = ctx;
+    uint64_t start = metrics_now_us();
+
+    if (s->received == 0 && body->len > 0) {
+        log_payload(LOG_LEVEL_DEBUG, LOG_PAYLOAD_RESPONSE, "[Manticore] Response", body->data, body->len);
+#ifdef DEBUG
+        char log_msg[2048];
+        snprintf(log_msg, sizeof(log_msg), "MANTICORE_RESPONSE | first=%zu bytes | data=%.500s%s",
+                 body->len, body->data, body->len > 500 ? "..." : "");
+        write_debug_log("RESPONSE", log_msg);
+#endif
+    }
+    s->received += body->len - s->tokenizer.len;
+
+    bool more = manticore_stream_scan(s, body->data, body->len, final);
+
+    /* 처리 중인 원소 앞까지는 더 필요 없음. 복사가 잦지 않게 절반 이상일 때만 당김 */
+    size_t keep_from = s->walker.in_hit ? s->walker.hit_start : s->tokenizer.pos;
+    if (more && keep_from > 0 && keep_from >= body->len / 2) {
+        buffer_consume(body, keep_from);
+        json_tokenizer_discard(&s->tokenizer, keep_from);
+        json_tokenizer_feed(&s->tokenizer, body->data, body->len, final);
+        hit_walker_discard(&s->walker, keep_from);
+    }
+
+    s->parse_us += metrics_now_us() - start;
+
+    if (s->on_results && s->walker.result_count > s->reported) {
+        s->on_results(s->on_results_ctx, s->walker.results + s->reported,
+                      s->walker.result_count - s->reported);
+        s->reported = s->walker.result_count;
+    }
+    return more;
+}
+
+/* Manticore 응답 파싱 - 응답 전체가 메모리에 있을 때. 결과 문자열은 arena에 할당.
+ * query는 스니펫 위치를 잡는 데 쓴다 (NULL이면 본문 앞부분) */
+int parse_manticore_response(Arena *arena, const Config *config, const char *response, int max_results,
+                             const char *query, SearchResult *results) {
+    ManticoreStream s;
+    manticore_stream_init(&s, config, arena, results, max_results, query);
+    manticore_stream_scan(&s, response, strlen(response), true);
+    return s.walker.result_count;
+}
+
+/* Manticore 요청 바디 생성 (컴파일된 템플릿 렌더링), 결과는 out에 */
+bool build_manticore_request(ByteBuffer *out, const Config *config, const CompiledTemplate *tpl,
+                             const char *query, int count) {
+    if (!tpl) {
+        log_write(LOG_LEVEL_ERROR, "[Template] Error: no request template loaded (%s)", config->template_file);
+        return false;
+    }
+
+    uint64_t render_start = metrics_now_us();
+    buffer_reset(out);
+    template_render(tpl, out, config, query, count);
+    metrics_observe(STAGE_TEMPLATE_RENDER, render_start);
+    const char *request_body = out->data;
+
+    log_payload(LOG_LEVEL_DEBUG, LOG_PAYLOAD_REQUEST, "[Manticore] Request", request_body, out->len);
+
+#ifdef DEBUG
+    /* 디버그 로그: 검색 요청 */
+    char log_msg[2048];
+    snprintf(log_msg, sizeof(log_msg), "SEARCH_REQUEST | query=\"%s\" | count=%d | index=%s",
+             query, count, config->index_name);
+    write_debug_log("REQUEST", log_msg);
+
+    snprintf(log_msg, sizeof(log_msg), "MANTICORE_QUERY | %s", request_body);
+    write_debug_log("REQUEST", log_msg);
+#endif
+
+    return true;
+}
+
+/* 스트리밍 파싱이 끝난 응답 정리 (로그 + 결과 수), 업스트림 호출이 실패했으면 -1 */
+int manticore_stream_finish(ManticoreStream *stream, bool ok) {
+    if (!ok) {
+        log_write(LOG_LEVEL_ERROR, "[Manticore] Error: No response");
+#ifdef DEBUG
+        write_debug_log("ERROR", "MANTICORE_NO_RESPONSE");
+#endif
+        return -1;
+    }
+
+    int result_count = stream->walker.result_count;
+    metrics_observe_us(STAGE_RESULT_PARSE, stream->parse_us);
+    log_write(LOG_LEVEL_INFO, "[Manticore] Found %d results (%zu bytes read)", result_count, stream->received);
+
+#ifdef DEBUG
+    /* 디버그 로그: 검색 결과 요약 */
+    char log_msg[2048];
+    SearchResult *results = stream->walker.results;
+    snprintf(log_msg, sizeof(log_msg), "SEARCH_RESULT | found=%d results", result_count);
+    write_debug_log("RESULT", log_msg);
+
+    for (int i = 0; i < result_count; i++) {
+        snprintf(log_msg, sizeof(log_msg), "RESULT_%d | title=\"%s\" | link=\"%s\"",
+                 i + 1, results[i].title, results[i].link);
+        write_debug_log("RESULT", log_msg);
+    }
+#endif
+
+    return result_count;
+}
+
+/* ============================
+ * JSON 응답 생성
+ * ============================ */
+
+/* json_append_escaped()가 쓸 바이트 수 */
+size_t json_escaped_len(const char *str) {
+    if (!str) return 0;
+
+    const unsigned char *s = (const unsigned char *)str;
+    size_t n = strlen(str);
+    size_t len = n;
+    size_t i = 0;
+    while (i < n) {
+        i += g_text.json_plain(s + i, n - i);
+        for (; i < n && !json_is_plain(s[i]); i++) {
+            if (s[i] == '"' || s[i] == '\\') len++;
+        }
+    }
+    return len;
+}
+
+/* JSON 문자열 이스케이프 후 out 뒤에 덧붙임, escaped_len은 json_escaped_len(str) */
+void json_append_escaped(ByteBuffer *out, const char *str, size_t escaped_len) {
+    if (!str) return;
+
+    buffer_reserve(out, escaped_len);
+    char *dst = out->data + out->len;
+    const unsigned char *s = (const unsigned char *)str;
+    size_t n = strlen(str);
+    size_t i = 0;
+
+    while (i < n) {
+        size_t run = g_text.json_plain(s + i, n - i);
+        memcpy(dst, s + i, run);
+        dst += run;
+        i += run;
+
+        for (; i < n && !json_is_plain(s[i]); i++) {
+            switch (s[i]) {
+                case '\n': *dst++ = ' '; break;  /* 개행 → 공백 */
+                case '\r': *dst++ = ' '; break;  /* 캐리지 리턴 → 공백 */
+                case '\t': *dst++ = ' '; break;  /* 탭 → 공백 */
+                case '"':  *dst++ = '\\'; *dst++ = '"'; break;   /* " → \" */
+                case '\\': *dst++ = '\\'; *dst++ = '\\'; break;  /* \ → \\ */
+                default:   *dst++ = s[i]; break;
+            }
+        }
+    }
+    *dst = '\0';
+    out->len = dst - out->data;
+}
+
+/* 응답 JSON의 고정 조각 (pretty / compact) */
+typedef struct {
+    const char *open;       /* {"results": [ */
+    const char *link;       /* 결과 시작 ~ link 값 앞 */
+    const char *title;      /* link 값 뒤 ~ title 값 앞 */
+    const char *snippet;    /* title 값 뒤 ~ snippet 값 앞 */
+    const char *item_end;   /* snippet 값 뒤 ~ 결과 끝 */
+    const char *item_sep;   /* 결과 사이 */
+    const char *newline;    /* 결과 뒤 줄바꿈 */
+    const char *close;      /* ], */
+    const char *tail;       /* took_ms, total, engine (printf 형식) */
+    const char *batch_open; /* {"responses": [ (POST /search/batch) */
+    const char *batch_sep;  /* 항목 응답 사이 */
+    const char *batch_tail; /* ], took_ms, count (printf 형식) */
+} JsonLayout;
+
+static const JsonLayout JSON_LAYOUT_PRETTY = {
+    "{\n  \"results\": [\n",
+    "    {\n      \"link\": \"",
+    "\",\n      \"title\": \"",
+    "\",\n      \"snippet\": \"",
+    "\"\n    }",
+    ",",
+    "\n",
+    "  ],\n",
+    "  \"took_ms\": %d,\n  \"total\": %d,\n  \"engine\": \"manticore\"\n}",
+    "{\n  \"responses\": [\n",
+    ",\n",
+    "\n  ],\n  \"took_ms\": %d,\n  \"count\": %d\n}"
+};
+
+static const JsonLayout JSON_LAYOUT_COMPACT = {
+    "{\"results\":[",
+    "{\"link\":\"",
+    "\",\"title\":\"",
+    "\",\"snippet\":\"",
+    "\"}",
+    ",",
+    "",
+    "],",
+    "\"took_ms\":%d,\"total\":%d,\"engine\":\"manticore\"}",
+    "{\"responses\":[",
+    ",",
+    "],\"took_ms\":%d,\"count\":%d}"
+};
+
+#define JSON_TAIL_MAX 128
+
+const JsonLayout* json_layout() {
+    return g_config.compact_json ? &JSON_LAYOUT_COMPACT : &JSON_LAYOUT_PRETTY;
+}
+
+void buffer_append_str(ByteBuffer *out, const char *str) {
+    buffer_append(out, str, strlen(str));
+}
+
+/* 결과 객체 하나 (lens = link/title/snippet의 escape 후 길이, 공간은 확보된 상태) */
+void json_append_result(ByteBuffer *out, const JsonLayout *layout, const SearchResult *result,
+                        const size_t lens[3]) {
+    buffer_append_str(out, layout->link);
+    if (result->link_len) buffer_append(out, result->link, result->link_len);
+    else json_append_escaped(out, result->link, lens[0]);
+    buffer_append_str(out, layout->title);
+    json_append_escaped(out, result->title, lens[1]);
+    buffer_append_str(out, layout->snippet);
+    json_append_escaped(out, result->snippet, lens[2]);
+    buffer_append_str(out, layout->item_end);
+}
+
+void json_result_lens(const SearchResult *result, size_t lens[3]) {
+    lens[0] = result->link_len ? result->link_len : json_escaped_len(result->link);
+    lens[1] = json_escaped_len(result->title);
+    lens[2] = json_escaped_len(result->snippet);
+}
+
+/* results 배열 부분만 out에 덧붙임 ("{ "results": [ ... ]," 까지) - 캐시 가능한 부분.
+ * 전체 길이(꼬리 포함)를 먼저 계산해 한 번만 확보 */
+void create_json_results(ByteBuffer *out, SearchResult *results, int count) {
+    const JsonLayout *layout = json_layout();
+    size_t item_fixed = strlen(layout->link) + strlen(layout->title) + strlen(layout->snippet) +
+                        strlen(layout->item_end) + strlen(layout->item_sep) + strlen(layout->newline);
+
+    size_t lens[MAX_RESULTS][3];
+    size_t total = strlen(layout->open) + strlen(layout->close) + JSON_TAIL_MAX;
+    for (int i = 0; i < count; i++) {
+        json_result_lens(&results[i], lens[i]);
+        total += item_fixed + lens[i][0] + lens[i][1] + lens[i][2];
+    }
+    buffer_reserve(out, total);
+
+    buffer_append_str(out, layout->open);
+    for (int i = 0; i < count; i++) {
+        json_append_result(out, layout, &results[i], lens[i]);
+        if (i < count - 1) buffer_append_str(out, layout->item_sep);
+        buffer_append_str(out, layout->newline);
+    }
+    buffer_append_str(out, layout->close);
+}
+
+/* 스트리밍용으로 나눈 create_json_results - open, 결과마다 item, close 순서로 부르면
+ * create_json_results와 같은 바이트가 된다 (구분자는 다음 결과가 올 때 앞에 붙임) */
+void create_json_results_open(ByteBuffer *out) {
+    buffer_append_str(out, json_layout()->open);
+}
+
+void create_json_results_item(ByteBuffer *out, const SearchResult *result, bool first) {
+    const JsonLayout *layout = json_layout();
+    size_t lens[3];
+    json_result_lens(result, lens);
+    buffer_reserve(out, strlen(layout->item_sep) + strlen(layout->newline) + strlen(layout->link) +
+                        strlen(layout->title) + strlen(layout->snippet) + strlen(layout->item_end) +
+                        lens[0] + lens[1] + lens[2]);
+    if (!first) {
+        buffer_append_str(out, layout->item_sep);
+        buffer_append_str(out, layout->newline);
+    }
+    json_append_result(out, layout, result, lens);
+}
+
+void create_json_results_close(ByteBuffer *out, int count) {
+    const JsonLayout *layout = json_layout();
+    if (count > 0) buffer_append_str(out, layout->newline);
+    buffer_append_str(out, layout->close);
+}
+
+/* took_ms/total/engine 꼬리를 out에 덧붙임 */
+void create_json_response_tail(ByteBuffer *out, int count, int took_ms) {
+    char tail[JSON_TAIL_MAX];
+    int tail_len = snprintf(tail, sizeof(tail), json_layout()->tail, took_ms, count);
+    buffer_append(out, tail, tail_len);
+}
+
+/* POST /search/batch 응답: 항목마다 /search와 같은 응답을 요청 순서대로 responses 배열에 */
+void create_json_batch_response(ByteBuffer *out, const ByteBuffer *const *entries, int count, int took_ms) {
+    const JsonLayout *layout = json_layout();
+    size_t total = strlen(layout->batch_open) + JSON_TAIL_MAX;
+    for (int i = 0; i < count; i++) total += entries[i]->len + strlen(layout->batch_sep);
+    buffer_reserve(out, total);
+
+    buffer_append_str(out, layout->batch_open);
+    for (int i = 0; i < count; i++) {
+        if (i > 0) buffer_append_str(out, layout->batch_sep);
+        buffer_append(out, entries[i]->data, entries[i]->len);
+    }
+    char tail[JSON_TAIL_MAX];
+    int tail_len = snprintf(tail, sizeof(tail), layout->batch_tail, took_ms, count);
+    buffer_append(out, tail, tail_len);
+}
+
+/* ============================
+ * 업스트림 차단기 (circuit breaker)
+ * ============================ */
+
+/* 집계 창 새로 시작 (lock 보유 상태) */
+void circuit_breaker_reset_window(CircuitBreaker *b, time_t now) {
+    b->window_start = now;
+    b->calls = 0;
+    b->failures = 0;
+}
+
+BreakerState circuit_breaker_state(CircuitBreaker *b) {
+    return (BreakerState)__atomic_load_n(&b->state, __ATOMIC_ACQUIRE);
+}
+
+/* 검색이 Manticore를 불러도 되는지 - 요청마다 불리므로 잠금 없이 상태만 봄 */
+bool circuit_breaker_allow(CircuitBreaker *b) {
+    return !b->running || circuit_breaker_state(b) == BREAKER_CLOSED;
+}
+
+/* replica 하나에 대한 검색 호출 결과 기록 (연결/시간 초과/5xx 등은 실패). 창 안의 호출이
+ * breaker.min_requests 이상이고 실패 비율이 breaker.error_rate 이상이면 열고 복구 확인 스레드를 깨움 */
+void circuit_breaker_record(UpstreamTarget *target, bool ok) {
+    CircuitBreaker *b = &target->breaker;
+    if (!b->running) return;
+    time_t now = time(NULL);
+
+    pthread_mutex_lock(&b->lock);
+    if (circuit_breaker_state(b) != BREAKER_CLOSED) {
+        pthread_mutex_unlock(&b->lock);  /* 열린 동안은 확인 호출로만 판단 */
+        return;
+    }
+    if (now - b->window_start >= g_config.breaker_window) circuit_breaker_reset_window(b, now);
+    b->calls++;
+    if (!ok) b->failures++;
+
+    if (!ok && b->calls >= g_config.breaker_min_requests &&
+        b->failures * 100 >= b->calls * g_config.breaker_error_rate) {
+        __atomic_store_n(&b->state, BREAKER_OPEN, __ATOMIC_RELEASE);
+        metrics_count(&g_metrics.breaker_trips);
+        log_write(LOG_LEVEL_WARN, "[Breaker] Open: %s: %d/%d Manticore calls failed in %lds, "
+                  "taking it out of rotation and probing every %ds", target->name, b->failures, b->calls,
+                  (long)(now - b->window_start) + 1, g_config.breaker_cooldown);
+        pthread_cond_signal(&b->cond);
+    }
+    pthread_mutex_unlock(&b->lock);
+}
+
+/* 복구 확인 - 요청 템플릿으로 검색 하나를 보내 5xx가 아닌 응답이 오면 true.
+ * 일반 호출과 같은 deadline이 걸리므로 멈춘 Manticore에도 오래 붙잡히지 않음 */
+bool circuit_breaker_probe(UpstreamTarget *target) {
+    unsigned phase;
+    const ConfigSnapshot *snapshot = config_acquire(&g_configs, &phase);
+    ByteBuffer body;
+    UpstreamCall call;
+    buffer_init(&body);
+    upstream_call_init(&call);
+
+    bool ok = false;
+    if (build_manticore_request(&body, &snapshot->config, snapshot->template, BREAKER_PROBE_QUERY, 1) &&
+        upstream_call_start(&call, &snapshot->config, target, body.data, body.len, NULL, NULL)) {
+        upstream_calls_run(&call, 1);
+        ok = (call.state == UPSTREAM_DONE && call.parser.status_code < 500);
+    }
+
+    upstream_call_free(&call);
+    buffer_free(&body);
+    config_release(&g_configs, phase);
+    return ok;
+}
+
+/* 정상인 replica 확인 - engine.health_check_interval마다 확인 호출, 실패하면 검색 실패를
+ * 기다리지 않고 바로 연다 (lock 보유 상태로 불리고, 호출하는 동안은 풂) */
+void circuit_breaker_health_check(UpstreamTarget *target) {
+    CircuitBreaker *b = &target->breaker;
+    struct timespec until;
+    clock_gettime(CLOCK_MONOTONIC, &until);
+    until.tv_sec += g_config.health_check_interval;
+    while (!b->stop && circuit_breaker_state(b) == BREAKER_CLOSED &&
+           pthread_cond_timedwait(&b->cond, &b->lock, &until) != ETIMEDOUT) {}
+    if (b->stop || circuit_breaker_state(b) != BREAKER_CLOSED) return;
+
+    pthread_mutex_unlock(&b->lock);
+    metrics_count(&g_metrics.health_checks);
+    bool ok = circuit_breaker_probe(target);
+    pthread_mutex_lock(&b->lock);
+
+    if (!ok && circuit_breaker_state(b) == BREAKER_CLOSED) {
+        __atomic_store_n(&b->state, BREAKER_OPEN, __ATOMIC_RELEASE);
+        metrics_count(&g_metrics.health_failures);
+        log_write(LOG_LEVEL_WARN, "[Health] %s failed the health check, taking it out of rotation",
+                  target->name);
+    }
+}
+
+/* 복구 확인 스레드 (replica마다): 닫혀 있으면 health_check_interval마다 확인 호출,
+ * 열려 있으면 breaker.cooldown마다 HALF_OPEN으로 바꿔 확인 호출, 성공하면 CLOSED로
+ * (그동안 검색은 다른 replica로 가거나, 남은 게 없으면 바로 응답) */
+void* circuit_breaker_main(void *arg) {
+    UpstreamTarget *target = arg;
+    CircuitBreaker *b = &target->breaker;
+
+    /* 시그널은 메인 스레드가 받음 */
+    sigset_t set;
+    sigemptyset(&set);
+    sigaddset(&set, SIGINT);
+    sigaddset(&set, SIGTERM);
+    sigaddset(&set, SIGHUP);
+    pthread_sigmask(SIG_BLOCK, &set, NULL);
+
+    pthread_mutex_lock(&b->lock);
+    while (!b->stop) {
+        if (circuit_breaker_state(b) == BREAKER_CLOSED) {
+            if (g_config.health_check_interval > 0) circuit_breaker_health_check(target);
+            else pthread_cond_wait(&b->cond, &b->lock);
+            continue;
+        }
+
+        struct timespec until;
+        clock_gettime(CLOCK_MONOTONIC, &until);
+        until.tv_sec += g_config.breaker_cooldown;
+        while (!b->stop && pthread_cond_timedwait(&b->cond, &b->lock, &until) != ETIMEDOUT) {}
+        if (b->stop) break;
+
+        __atomic_store_n(&b->state, BREAKER_HALF_OPEN, __ATOMIC_RELEASE);
+        pthread_mutex_unlock(&b->lock);
+        metrics_count(&g_metrics.breaker_probes);
+        bool ok = circuit_breaker_probe(target);
+        pthread_mutex_lock(&b->lock);
+
+        if (ok) {
+            circuit_breaker_reset_window(b, time(NULL));
+            __atomic_store_n(&b->state, BREAKER_CLOSED, __ATOMIC_RELEASE);
+            log_write(LOG_LEVEL_INFO, "[Breaker] Closed: %s answered the probe, back in rotation", target->name);
+        } else {
+            __atomic_store_n(&b->state, BREAKER_OPEN, __ATOMIC_RELEASE);
+            log_write(LOG_LEVEL_WARN, "[Breaker] Probe failed: %s, staying open for %ds", target->name,
+                      g_config.breaker_cooldown);
+        }
+    }
+    pthread_mutex_unlock(&b->lock);
+    return NULL;
+}
+
+/* breaker.enabled면 복구 확인 스레드 시작 (시작하지 않으면 차단기는 항상 CLOSED) */
+void circuit_breaker_start(UpstreamTarget *target) {
+    CircuitBreaker *b = &target->breaker;
+    if (!g_config.breaker_enabled) return;
+
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&b->cond, &attr);
+    pthread_condattr_destroy(&attr);
+    pthread_mutex_init(&b->lock, NULL);
+    b->state = BREAKER_CLOSED;
+    b->stop = false;
+    circuit_breaker_reset_window(b, time(NULL));
+
+    if (pthread_create(&b->thread, NULL, circuit_breaker_main, target) != 0) {
+        perror("[Breaker] pthread_create failed, circuit breaker disabled");
+        pthread_cond_destroy(&b->cond);
+        pthread_mutex_destroy(&b->lock);
+        return;
+    }
+    b->running = true;
+}
+
+void circuit_breaker_stop(UpstreamTarget *target) {
+    CircuitBreaker *b = &target->breaker;
+    if (!b->running) return;
+
+    pthread_mutex_lock(&b->lock);
+    b->stop = true;
+    pthread_cond_broadcast(&b->cond);
+    pthread_mutex_unlock(&b->lock);
+    pthread_join(b->thread, NULL);
+
+    b->running = false;
+    pthread_cond_destroy(&b->cond);
+    pthread_mutex_destroy(&b->lock);
+}
+
+/* ============================
+ * 업스트림 replica 선택
+ * ============================ */
+
+/* 차단기가 닫힌 replica 중 진행 중인 호출이 가장 적은 것 (같으면 돌아가며), 없으면 NULL.
+ * exclude는 같은 쿼리의 첫 호출이 간 replica (hedge / 장애 전환) */
+UpstreamTarget* upstream_select(const ConfigSnapshot *snapshot, const UpstreamTarget *exclude) {
+    unsigned start = __atomic_fetch_add(&g_upstream_next, 1, __ATOMIC_RELAXED);
+    UpstreamTarget *best = NULL;
+    int best_load = 0;
+    for (int k = 0; k < snapshot->upstream_count; k++) {
+        UpstreamTarget *target = snapshot->upstreams[(start + k) % snapshot->upstream_count];
+        if (target == exclude || !circuit_breaker_allow(&target->breaker)) continue;
+        int load = __atomic_load_n(&target->outstanding, __ATOMIC_RELAXED);
+        if (!best || load < best_load) {
+            best = target;
+            best_load = load;
+        }
+    }
+    return best;
+}
+
+/* 검색을 받을 수 있는 replica가 하나라도 있는지 */
+bool upstream_available(const ConfigSnapshot *snapshot) {
+    for (int i = 0; i < snapshot->upstream_count; i++) {
+        if (circuit_breaker_allow(&snapshot->upstreams[i]->breaker)) return true;
+    }
+    return false;
+}
+
+int latency_sample_compare(const void *a, const void *b) {
+    uint32_t x = *(const uint32_t *)a;
+    uint32_t y = *(const uint32_t *)b;
+    return (x > y) - (x < y);
+}
+
+/* 성공한 호출의 소요 시간 기록. HEDGE_MIN_SAMPLES개마다 최근 LATENCY_RING_SLOTS개의
+ * p95를 다시 계산 (슬롯을 동시에 덮어쓰면 그 값이 섞일 뿐, 대략값이면 충분) */
+void upstream_latency_record(uint64_t elapsed_us) {
+    LatencyTracker *t = &g_upstream_latency;
+    uint64_t n = __atomic_fetch_add(&t->count, 1, __ATOMIC_RELAXED);
+    uint32_t sample = elapsed_us < UINT32_MAX ? (uint32_t)elapsed_us : UINT32_MAX;
+    __atomic_store_n(&t->samples_us[n % LATENCY_RING_SLOTS], sample, __ATOMIC_RELAXED);
+    if ((n + 1) % HEDGE_MIN_SAMPLES != 0) return;
+
+    uint32_t sorted[LATENCY_RING_SLOTS];
+    size_t count = (n + 1 < LATENCY_RING_SLOTS) ? (size_t)(n + 1) : LATENCY_RING_SLOTS;
+    for (size_t i = 0; i < count; i++) {
+        sorted[i] = __atomic_load_n(&t->samples_us[i], __ATOMIC_RELAXED);
+    }
+    qsort(sorted, count, sizeof(uint32_t), latency_sample_compare);
+    __atomic_store_n(&t->p95_us, sorted[count * 95 / 100], __ATOMIC_RELAXED);
+}
+
+/* 두 번째 호출을 보내기 전 기다릴 시간 (us, 0 = hedge 안 함) - 최근 p95, 최소 engine.hedge_min_ms.
+ * replica가 하나거나 아직 호출이 충분히 쌓이지 않았으면 0 */
+uint64_t upstream_hedge_delay_us(const ConfigSnapshot *snapshot) {
+    if (!snapshot->config.hedge || snapshot->upstream_count < 2) return 0;
+    uint64_t p95 = __atomic_load_n(&g_upstream_latency.p95_us, __ATOMIC_RELAXED);
+    if (p95 == 0) return 0;
+    uint64_t min_delay = (uint64_t)snapshot->config.hedge_min_ms * 1000;
+    return p95 > min_delay ? p95 : min_delay;
+}
+
+/* ============================
+ * 설정 다시 읽기 (SIGHUP / 파일 변경)
+ * ============================ */
+
+/*
+ * 감시 스레드가 CONFIG_CHECK_INTERVAL마다 config.yaml과 요청 템플릿을 stat()으로
+ * 확인해 (SIGHUP을 받았으면 바로) 바뀌었으면 새 ConfigSnapshot을 만들고 포인터 하나만
+ * 바꿔 끼운다. 리스너와 진행 중인 연결은 그대로 두고, 요청은 시작할 때 잡은 스냅샷을
+ * 끝까지 쓰므로 한 요청 안에서 인덱스명, 템플릿, base_url이 섞이지 않는다. 이전 스냅샷은
+ * 그것을 잡은 요청이 모두 끝난 뒤 (grace period) 해제한다.
+ *
+ * 다시 읽는 항목은 engine.* (pool_size, pool_idle_timeout, health_check_interval 제외)와
+ * lkb.stream_results / stream_min_count. 나머지는 시작할 때만 적용되므로 바뀌면 로그만 남긴다.
+ */
+
+#define CONFIG_FIELD(key, field) { key, offsetof(Config, field), sizeof(((Config *)0)->field) }
+
+static const struct {
+    const char *key;
+    size_t offset;
+    size_t size;
+} CONFIG_RESTART_FIELDS[] = {
+    CONFIG_FIELD("lkb.listen", listen),
+    CONFIG_FIELD("lkb.port", port),
+    CONFIG_FIELD("lkb.workers", workers),
+    CONFIG_FIELD("lkb.processes", processes),
+    CONFIG_FIELD("lkb.cpu_affinity", cpu_affinity),
+    CONFIG_FIELD("lkb.queue_size", queue_size),
+    CONFIG_FIELD("lkb.backlog", backlog),
+    CONFIG_FIELD("lkb.io_mode", io_mode),
+    CONFIG_FIELD("lkb.max_connections", max_connections),
+    CONFIG_FIELD("lkb.keepalive_timeout", keepalive_timeout),
+    CONFIG_FIELD("lkb.keepalive_max_requests", keepalive_max_requests),
+    CONFIG_FIELD("lkb.compact_json", compact_json),
+    CONFIG_FIELD("engine.pool_size", pool_size),
+    CONFIG_FIELD("engine.pool_idle_timeout", pool_idle_timeout),
+    CONFIG_FIELD("engine.health_check_interval", health_check_interval),
+    CONFIG_FIELD("cache.enabled", cache_enabled),
+    CONFIG_FIELD("cache.max_bytes", cache_max_bytes),
+    CONFIG_FIELD("cache.ttl", cache_ttl),
+    CONFIG_FIELD("cache.stale_ttl", cache_stale_ttl),
+    CONFIG_FIELD("cache.soft_ttl", cache_soft_ttl),
+    CONFIG_FIELD("cache.negative_ttl", cache_negative_ttl),
+    CONFIG_FIELD("cache.link_max_bytes", link_cache_bytes),
+    CONFIG_FIELD("breaker.enabled", breaker_enabled),
+    CONFIG_FIELD("breaker.error_rate", breaker_error_rate),
+    CONFIG_FIELD("breaker.min_requests", breaker_min_requests),
+    CONFIG_FIELD("breaker.window", breaker_window),
+    CONFIG_FIELD("breaker.cooldown", breaker_cooldown),
+    CONFIG_FIELD("admission.enabled", admission_enabled),
+    CONFIG_FIELD("admission.max_in_flight", admission_max_in_flight),
+    CONFIG_FIELD("admission.min_in_flight", admission_min_in_flight),
+    CONFIG_FIELD("admission.queue_timeout_ms", admission_queue_timeout_ms),
+    CONFIG_FIELD("admission.latency_target_ms", admission_latency_target_ms),
+    CONFIG_FIELD("admission.retry_after", admission_retry_after),
+    CONFIG_FIELD("title_index.file", title_index_file),
+    CONFIG_FIELD("query.strip_think", query_strip_think),
+    CONFIG_FIELD("query.unwrap", query_unwrap),
+    CONFIG_FIELD("query.max_tokens", query_max_tokens),
+    CONFIG_FIELD("query.stopwords", query_stopwords),
+    CONFIG_FIELD("log.level", log_level),
+    CONFIG_FIELD("log.file", log_file),
+    CONFIG_FIELD("log.payload_max", log_payload_max),
+    CONFIG_FIELD("log.sample_rate", log_sample_rate),
+    CONFIG_FIELD("log.capture_file", capture_file),
+    CONFIG_FIELD("log.capture_sample_rate", capture_sample_rate),
+};
+
+/* replica 하나 생성 (확인 스레드는 스냅샷을 넣은 뒤 config_store_publish에서 시작) */
+UpstreamTarget* upstream_target_new(const UpstreamAddress *addr) {
+    UpstreamTarget *target = safe_malloc(sizeof(UpstreamTarget));
+    memset(target, 0, sizeof(UpstreamTarget));
+    if (!resolve_upstream(target, addr->host, addr->port, addr->path)) {
+        log_write(LOG_LEVEL_WARN, "[Manticore] Warning: could not resolve %s, will retry per request",
+                  addr->host);
+    }
+    return target;
+}
+
+/* 확인 스레드를 멈추고 keep-alive 연결을 닫은 뒤 해제 (잡고 있는 요청이 없을 때만) */
+void upstream_target_free(UpstreamTarget *target) {
+    circuit_breaker_stop(target);
+    upstream_pool_close(target);
+    pthread_mutex_destroy(&target->lock);
+    free(target);
+}
+
+/* snapshot->upstreams[0, limit)에 target이 있는지 */
+bool config_snapshot_has_upstream(const ConfigSnapshot *snapshot, const UpstreamTarget *target, int limit) {
+    for (int i = 0; i < limit; i++) {
+        if (snapshot->upstreams[i] == target) return true;
+    }
+    return false;
+}
+
+/* 주소(host, port, path)가 같은 replica */
+UpstreamTarget* config_snapshot_find_upstream(const ConfigSnapshot *snapshot, const UpstreamAddress *addr) {
+    for (int i = 0; i < snapshot->upstream_count; i++) {
+        UpstreamTarget *target = snapshot->upstreams[i];
+        if (target->port == addr->port && strcmp(target->host, addr->host) == 0 &&
+            strcmp(target->path, addr->path) == 0) {
+            return target;
+        }
+    }
+    return NULL;
+}
+
+/* config로 새 스냅샷 생성 (st = config.yaml 파일 정보, 없으면 NULL). prev가 있으면 같은 주소의
+ * replica(연결 풀, 차단기 상태 포함)와 바뀌지 않은 템플릿을 이어받는다. reload_template이면
+ * 템플릿 파일이 그대로여도 다시 읽고, 읽지 못하면 prev의 같은 파일 템플릿을 그대로 쓴다 */
+ConfigSnapshot* config_snapshot_create(const Config *config, const struct stat *st,
+                                       const ConfigSnapshot *prev, bool reload_template) {
+    ConfigSnapshot *snapshot = safe_malloc(sizeof(ConfigSnapshot));
+    memset(snapshot, 0, sizeof(ConfigSnapshot));
+    snapshot->config = *config;
+    snapshot->generation = prev ? prev->generation + 1 : 1;
+    if (st) {
+        snapshot->mtime = st->st_mtime;
+        snapshot->size = st->st_size;
+        snapshot->ino = st->st_ino;
+    }
+
+    const char *path = config->template_file;
+    bool same_file = prev && prev->template && strcmp(prev->config.template_file, path) == 0;
+    if (same_file && !reload_template && !template_changed(prev->template, path)) {
+        snapshot->template = prev->template;
+    } else {
+        snapshot->template = template_load(path);
+        if (!snapshot->template && same_file) {
+            log_write(LOG_LEVEL_WARN, "[Template] Keeping the previously loaded %s", path);
+            snapshot->template = prev->template;
+        }
+    }
+    if (snapshot->template && snapshot->template == (prev ? prev->template : NULL)) {
+        template_retain(snapshot->template);
+    }
+
+    for (int i = 0; i < config->backend_count; i++) {
+        const UpstreamAddress *addr = &config->backends[i];
+        UpstreamTarget *target = prev ? config_snapshot_find_upstream(prev, addr) : NULL;
+        snapshot->upstreams[snapshot->upstream_count++] = target ? target : upstream_target_new(addr);
+    }
+
+    /* 같은 검색이라도 이 설정들이 다르면 결과 JSON이 다르므로 캐시 키를 나눈다 */
+    char shape[512];
+    snprintf(shape, sizeof(shape), "%016llx\x1f%s\x1f%d\x1f%s\x1f%zu\x1f%d\x1f%d",
+             (unsigned long long)(snapshot->template ? snapshot->template->hash : 0),
+             config->base_url, config->snippet_length, config->snippet_mode, config->snippet_scan_max,
+             config->title_index_prefix, config->title_index_min_prefix);
+    snapshot->result_hash = hash_bytes(shape, strlen(shape), 0);
+    return snapshot;
+}
+
+/* 스냅샷 해제. next에 남지 않은 replica는 확인 스레드를 멈추고 닫는다 (next = NULL이면 모두) */
+void config_snapshot_free(ConfigSnapshot *snapshot, const ConfigSnapshot *next) {
+    for (int i = 0; i < snapshot->upstream_count; i++) {
+        UpstreamTarget *target = snapshot->upstreams[i];
+        if (config_snapshot_has_upstream(snapshot, target, i)) continue;  /* 같은 주소가 두 번 */
+        if (next && config_snapshot_has_upstream(next, target, next->upstream_count)) continue;
+        if (next) log_write(LOG_LEVEL_INFO, "[Config] Backend %s removed", target->name);
+        upstream_target_free(target);
+    }
+    template_release(snapshot->template);
+    free(snapshot);
+}
+
+/* 시작할 때만 적용되는 항목 중 바뀐 것 (재시작 전까지는 이전 값 그대로) */
+void config_warn_restart(const Config *old, const Config *config) {
+    char changed[1024] = "";
+    size_t len = 0;
+    for (size_t i = 0; i < sizeof(CONFIG_RESTART_FIELDS) / sizeof(CONFIG_RESTART_FIELDS[0]); i++) {
+        size_t offset = CONFIG_RESTART_FIELDS[i].offset;
+        if (memcmp((const char *)old + offset, (const char *)config + offset,
+                   CONFIG_RESTART_FIELDS[i].size) == 0) {
+            continue;
+        }
+        len += snprintf(changed + len, sizeof(changed) - len, "%s%s", len ? ", " : "",
+                        CONFIG_RESTART_FIELDS[i].key);
+        if (len >= sizeof(changed)) break;
+    }
+    if (changed[0]) {
+        log_write(LOG_LEVEL_WARN, "[Config] Only applied at startup, restart to use the new value: %s", changed);
+    }
+}
+
+/* 새 스냅샷을 넣고 (이후 잡는 요청부터 사용) 새로 생긴 replica의 확인 스레드 시작 */
+void config_store_publish(ConfigStore *store, ConfigSnapshot *snapshot, const ConfigSnapshot *old) {
+    __atomic_store_n(&store->current, snapshot, __ATOMIC_SEQ_CST);
+    for (int i = 0; i < snapshot->upstream_count; i++) {
+        UpstreamTarget *target = snapshot->upstreams[i];
+        if (config_snapshot_has_upstream(snapshot, target, i)) continue;
+        if (old && config_snapshot_has_upstream(old, target, old->upstream_count)) continue;
+        if (old) log_write(LOG_LEVEL_INFO, "[Config] Backend %s added", target->name);
+        circuit_breaker_start(target);
+    }
+}
+
+/* grace period - phase를 바꿔 새 요청은 다른 쪽에서 세게 하고 이전 쪽이 0이 되기를
+ * 기다리기를 두 번. 바꾸기 전에 예전 phase를 읽은 요청도 있으므로 양쪽 모두 비워야
+ * 교체 전 스냅샷을 잡은 요청이 하나도 남지 않는다 */
+void config_store_synchronize(ConfigStore *store) {
+    for (int flip = 0; flip < 2; flip++) {
+        unsigned old = __atomic_load_n(&store->phase, __ATOMIC_RELAXED);
+        __atomic_store_n(&store->phase, old ^ 1, __ATOMIC_SEQ_CST);
+        while (__atomic_load_n(&store->readers[old].count, __ATOMIC_SEQ_CST) > 0) {
+            usleep(CONFIG_GRACE_POLL_US);
+        }
+    }
+}
+
+/* config.yaml을 다시 읽어 새 스냅샷으로 교체, 이전 스냅샷은 grace period 뒤 해제 (감시 스레드).
+ * 파일이 없으면 지금 설정으로 템플릿만 다시 읽는다 */
+void config_store_reload(ConfigStore *store, const char *reason, bool reload_template) {
+    ConfigSnapshot *old = store->current;
+    Config *config = safe_malloc(sizeof(Config));
+    struct stat st;
+    bool have_file = stat(store->path, &st) == 0 && load_config(store->path, config);
+    if (!have_file) {
+        metrics_count(&g_metrics.config_reload_failures);
+        log_write(LOG_LEVEL_ERROR, "[Config] Cannot read %s, keeping the settings of generation %u",
+                  store->path, old->generation);
+        *config = old->config;
+    } else {
+        config_warn_restart(&old->config, config);
+    }
+
+    ConfigSnapshot *snapshot = config_snapshot_create(config, have_file ? &st : NULL, old, reload_template);
+    free(config);
+    if (!have_file) {
+        snapshot->mtime = old->mtime;
+        snapshot->size = old->size;
+        snapshot->ino = old->ino;
+    }
+    config_store_publish(store, snapshot, old);
+    metrics_count(&g_metrics.config_reloads);
+    log_write(LOG_LEVEL_INFO, "[Config] %s: generation %u live (index %s, %d backend%s, template %016llx)",
+              reason, snapshot->generation, snapshot->config.index_name, snapshot->upstream_count,
+              snapshot->upstream_count == 1 ? "" : "s",
+              (unsigned long long)(snapshot->template ? snapshot->template->hash : 0));
+
+    config_store_synchronize(store);
+    config_snapshot_free(old, snapshot);
+}
+
+/* config.yaml 또는 지금 쓰는 템플릿 파일이 바뀌었는지 (mtime/크기/inode) */
+bool config_store_changed(const ConfigStore *store) {
+    const ConfigSnapshot *snapshot = store->current;
+    struct stat st;
+    if (stat(store->path, &st) == 0 &&
+        (st.st_mtime != snapshot->mtime || st.st_size != snapshot->size || st.st_ino != snapshot->ino)) {
+        return true;
+    }
+    return template_changed(snapshot->template, snapshot->config.template_file);
+}
+
+/* 감시 스레드: SIGHUP이면 템플릿까지 무조건, 아니면 파일이 바뀌었을 때만 다시 읽기 */
+void* config_watch_main(void *arg) {
+    ConfigStore *store = arg;
+
+    /* 시그널은 메인 스레드가 받음 (SIGHUP은 g_reload_config로 전달) */
+    sigset_t set;
+    sigemptyset(&set);
+    sigaddset(&set, SIGINT);
+    sigaddset(&set, SIGTERM);
+    sigaddset(&set, SIGHUP);
+    pthread_sigmask(SIG_BLOCK, &set, NULL);
+
+    pthread_mutex_lock(&store->lock);
+    while (!store->stop) {
+        struct timespec until;
+        clock_gettime(CLOCK_MONOTONIC, &until);
+        until.tv_sec += CONFIG_CHECK_INTERVAL;
+        pthread_cond_timedwait(&store->cond, &store->lock, &until);
+        if (store->stop) break;
+        pthread_mutex_unlock(&store->lock);
+
+        if (g_reload_config) {
+            g_reload_config = 0;
+            config_store_reload(store, "SIGHUP received", true);
+        } else if (config_store_changed(store)) {
+            config_store_reload(store, "Config or template file changed", false);
+        }
+
+        pthread_mutex_lock(&store->lock);
+    }
+    pthread_mutex_unlock(&store->lock);
+    return NULL;
+}
+
+/* 시작 설정(g_config와 같은 값, 명령행 재정의 전)으로 첫 스냅샷을 만들고 감시 스레드 시작 */
+void config_store_init(ConfigStore *store, const char *path, const Config *config) {
+    memset(store, 0, sizeof(ConfigStore));
+    safe_strncpy(store->path, path, sizeof(store->path));
+    pthread_mutex_init(&store->lock, NULL);
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&store->cond, &attr);
+    pthread_condattr_destroy(&attr);
+
+    struct stat st;
+    bool have_file = stat(path, &st) == 0;
+    config_store_publish(store, config_snapshot_create(config, have_file ? &st : NULL, NULL, true), NULL);
+
+    if (pthread_create(&store->thread, NULL, config_watch_main, store) != 0) {
+        perror("[Config] pthread_create failed, config reload disabled");
+        return;
+    }
+    store->running = true;
+}
+
+/* 감시 스레드를 멈추고 지금 스냅샷과 replica 해제 (요청 처리가 모두 끝난 뒤) */
+void config_store_destroy(ConfigStore *store) {
+    if (store->running) {
+        pthread_mutex_lock(&store->lock);
+        store->stop = true;
+        pthread_cond_broadcast(&store->cond);
+        pthread_mutex_unlock(&store->lock);
+        pthread_join(store->thread, NULL);
+        store->running = false;
+    }
+    if (store->current) {
+        config_snapshot_free(store->current, NULL);
+        store->current = NULL;
+    }
+    pthread_cond_destroy(&store->cond);
+    pthread_mutex_destroy(&store->lock);
+}
+
+/* ============================
+ * 제목 색인 (lkb-index, mmap)
+ * ============================ */
+
+/* 색인 키: ASCII는 소문자로, '_'는 공백으로 (위키 제목 표기와 쿼리 표기 차이 흡수).
+ * 비ASCII 바이트는 그대로. dst는 strlen(src) + 1 이상, 키 길이 반환 */
+size_t title_index_key(char *dst, const char *src) {
+    char *p = dst;
+    for (const unsigned char *s = (const unsigned char *)src; *s; s++) {
+        *p++ = (*s == '_') ? ' ' : (char)tolower(*s);
+    }
+    *p = '\0';
+    return p - dst;
+}
+
+/* lkb-index 파일을 mmap, 헤더와 항목 위치를 확인해 쓸 수 있으면 true */
+bool title_index_open(TitleIndex *idx, const char *path) {
+    memset(idx, 0, sizeof(TitleIndex));
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        log_write(LOG_LEVEL_ERROR, "[Index] Cannot open %s: %s", path, strerror(errno));
+        return false;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(TitleIndexHeader)) {
+        log_write(LOG_LEVEL_ERROR, "[Index] %s is not a title index (too short)", path);
+        close(fd);
+        return false;
+    }
+    void *map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);  /* 매핑은 fd를 닫아도 유지 */
+    if (map == MAP_FAILED) {
+        log_write(LOG_LEVEL_ERROR, "[Index] mmap %s failed: %s", path, strerror(errno));
+        return false;
+    }
+
+    const char *data = map;
+    size_t size = st.st_size;
+    const TitleIndexHeader *header = map;
+    size_t table_end = sizeof(TitleIndexHeader) + (size_t)header->count * sizeof(uint32_t);
+    bool valid = memcmp(header->magic, TITLE_INDEX_MAGIC, sizeof(header->magic)) == 0 &&
+                 table_end <= size;
+    const uint32_t *offsets = (const uint32_t *)(data + sizeof(TitleIndexHeader));
+    for (uint32_t i = 0; valid && i < header->count; i++) {
+        /* 항목의 네 문자열이 모두 파일 안에서 끝나야 조회 때 strlen이 넘어가지 않음 */
+        size_t pos = offsets[i];
+        for (int field = 0; valid && field < 4; field++) {
+            const char *nul = pos >= table_end && pos < size ? memchr(data + pos, '\0', size - pos) : NULL;
+            valid = (nul != NULL);
+            if (nul) pos = nul - data + 1;
+        }
+    }
+    if (!valid) {
+        log_write(LOG_LEVEL_ERROR, "[Index] %s is not a valid title index (rebuild it with lkb-index)", path);
+        munmap(map, size);
+        return false;
+    }
+
+    /* 조회는 이진 탐색이라 임의 접근, 처음 몇 번의 조회가 디스크를 기다리지 않게 미리 읽음 */
+    madvise(map, size, MADV_WILLNEED);
+    idx->data = data;
+    idx->size = size;
+    idx->offsets = offsets;
+    idx->count = header->count;
+    log_write(LOG_LEVEL_INFO, "[Index] Loaded %s (%u titles, %zu bytes)", path, idx->count, size);
+    return true;
+}
+
+void title_index_close(TitleIndex *idx) {
+    if (idx->data) munmap((void *)idx->data, idx->size);
+    memset(idx, 0, sizeof(TitleIndex));
+}
+
+/* i번째 항목 (키 순): 키, 제목, URL 인코딩된 제목, 스니펫이 NUL로 이어짐 */
+const char* title_index_entry(const TitleIndex *idx, uint32_t i) {
+    return idx->data + idx->offsets[i];
+}
+
+/* 키가 key 이상인 첫 항목 */
+uint32_t title_index_lower_bound(const TitleIndex *idx, const char *key) {
+    uint32_t lo = 0, hi = idx->count;
+    while (lo < hi) {
+        uint32_t mid = lo + (hi - lo) / 2;
+        if (strcmp(title_index_entry(idx, mid), key) < 0) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo;
+}
+
+#define TITLE_INDEX_NONE UINT32_MAX
+
+/* 키가 정확히 key인 항목, 없으면 TITLE_INDEX_NONE */
+uint32_t title_index_find(const TitleIndex *idx, const char *key) {
+    if (!idx->data) return TITLE_INDEX_NONE;
+    uint32_t i = title_index_lower_bound(idx, key);
+    return (i < idx->count && strcmp(title_index_entry(idx, i), key) == 0) ? i : TITLE_INDEX_NONE;
+}
+
+/* i번째 항목의 스니펫 (lkb-index 입력에 본문이 없었으면 "") */
+const char* title_index_snippet(const TitleIndex *idx, uint32_t i) {
+    const char *p = title_index_entry(idx, i);
+    for (int field = 0; field < 3; field++) p += strlen(p) + 1;
+    return p;
+}
+
+/* 항목을 결과 하나로 (제목, 스니펫은 mmap을 그대로 가리키고 link와 잘린 스니펫만 arena에) */
+void title_index_result(const TitleIndex *idx, uint32_t i, const Config *config, Arena *arena,
+                        SearchResult *result) {
+    const char *key = title_index_entry(idx, i);
+    const char *title = key + strlen(key) + 1;
+    const char *encoded = title + strlen(title) + 1;
+    const char *snippet = encoded + strlen(encoded) + 1;
+
+    size_t base_len = strlen(config->base_url);
+    size_t encoded_len = strlen(encoded);
+    char *link = arena_alloc(arena, base_len + encoded_len + 1);
+    memcpy(link, config->base_url, base_len);
+    memcpy(link + base_len, encoded, encoded_len + 1);
+
+    /* Manticore 스니펫처럼 snippet_length로 자르고 "..." */
+    size_t limit = config->snippet_length > 0 ? (size_t)config->snippet_length : 0;
+    if (strlen(snippet) > limit) {
+        size_t safe_len = utf8_safe_truncate(snippet, limit);
+        char *cut = arena_alloc(arena, safe_len + 4);
+        memcpy(cut, snippet, safe_len);
+        memcpy(cut + safe_len, "...", 4);
+        snippet = cut;
+    }
+
+    result->link = link;
+    result->title = (char *)title;
+    result->snippet = (char *)snippet;
+    result->link_len = config->base_url_plain ? base_len + encoded_len : 0;
+}
+
+/* ============================
+ * 검색 결과 캐시 (LRU)
+ * ============================ */
+
+/* 캐시 키: index \x1f count \x1f 템플릿과 결과 설정 해시 (ConfigSnapshot.result_hash) \x1f query */
+size_t build_cache_key(char *key, size_t key_size, const char *query, int count,
+                       const char *index_name, uint64_t result_hash) {
+    int len = snprintf(key, key_size, "%s\x1f%d\x1f%016llx\x1f%s",
+                       index_name, count, (unsigned long long)result_hash, query);
+    /* 잘린 키는 다른 쿼리와 충돌할 수 있으므로 캐시하지 않음 */
+    if (len < 0 || (size_t)len >= key_size) return 0;
+    return (size_t)len;
+}
+
+/* json 버퍼의 소유권을 넘겨받아 생성 (참조 1) */
+CachedResult* cached_result_wrap(char *json, size_t len, int count) {
+    CachedResult *value = safe_malloc(sizeof(CachedResult));
+    value->refs = 1;
+    value->json = json;
+    value->len = len;
+    value->count = count;
+    return value;
+}
+
+void cached_result_retain(CachedResult *value) {
+    __atomic_add_fetch(&value->refs, 1, __ATOMIC_RELAXED);
+}
+
+void cached_result_release(CachedResult *value) {
+    if (value && __atomic_sub_fetch(&value->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+        free(value->json);
+        free(value);
+    }
+}
+
+void result_cache_init(ResultCache *cache, size_t max_bytes, int ttl, int stale_ttl, int soft_ttl,
+                       int negative_ttl) {
+    memset(cache, 0, sizeof(ResultCache));
+    cache->nbuckets = 1024;
+    cache->buckets = calloc(cache->nbuckets, sizeof(CacheEntry*));
+    if (!cache->buckets) {
+        fprintf(stderr, "[ERROR] Memory allocation failed for cache buckets\n");
+        exit(EXIT_FAILURE);
+    }
+    cache->max_bytes = max_bytes;
+    cache->ttl = ttl;
+    cache->stale_ttl = stale_ttl;
+    cache->soft_ttl = soft_ttl;
+    cache->negative_ttl = negative_ttl;
+    pthread_mutex_init(&cache->lock, NULL);
+}
+
+/* LRU 목록에서 분리 (lock 보유 상태) */
+void cache_lru_unlink(ResultCache *cache, CacheEntry *entry) {
+    if (entry->prev) entry->prev->next = entry->next;
+    else cache->lru_head = entry->next;
+    if (entry->next) entry->next->prev = entry->prev;
+    else cache->lru_tail = entry->prev;
+    entry->prev = entry->next = NULL;
+}
+
+void cache_lru_push_front(ResultCache *cache, CacheEntry *entry) {
+    entry->prev = NULL;
+    entry->next = cache->lru_head;
+    if (cache->lru_head) cache->lru_head->prev = entry;
+    cache->lru_head = entry;
+    if (!cache->lru_tail) cache->lru_tail = entry;
+}
+
+/* 항목 제거 (lock 보유 상태) */
+void cache_remove_entry(ResultCache *cache, CacheEntry *entry) {
+    CacheEntry **slot = &cache->buckets[entry->hash & (cache->nbuckets - 1)];
+    while (*slot && *slot != entry) slot = &(*slot)->hnext;
+    if (*slot) *slot = entry->hnext;
+
+    cache_lru_unlink(cache, entry);
+    cache->bytes -= entry->bytes;
+    cache->entries--;
+    cached_result_release(entry->value);
+    free(entry->key);
+    free(entry);
+}
+
+/* 항목 수가 버킷 수를 넘으면 두 배로 재해시 (lock 보유 상태) */
+void cache_maybe_grow(ResultCache *cache) {
+    if (cache->entries <= cache->nbuckets) return;
+
+    size_t new_n = cache->nbuckets * 2;
+    CacheEntry **new_buckets = calloc(new_n, sizeof(CacheEntry*));
+    if (!new_buckets) return;  /* 체인이 길어질 뿐 동작에는 문제 없음 */
+
+    for (size_t i = 0; i < cache->nbuckets; i++) {
+        CacheEntry *entry = cache->buckets[i];
+        while (entry) {
+            CacheEntry *next = entry->hnext;
+            size_t idx = entry->hash & (new_n - 1);
+            entry->hnext = new_buckets[idx];
+            new_buckets[idx] = entry;
+            entry = next;
+        }
+    }
+    free(cache->buckets);
+    cache->buckets = new_buckets;
+    cache->nbuckets = new_n;
+}
+
+/* 조회 - 적중 시 참조를 하나 더해 반환 (호출자가 release).
+ * ttl이 지난 항목은 stale_ttl 동안 남겨 두고 allow_stale일 때만 돌려줌 (적중률 집계 제외).
+ * soft_ttl이 지난 항목에 처음 적중하면 *refresh = true - 호출자가 다시 검색하고 끝나면
+ * result_cache_refresh_done() */
+CachedResult* result_cache_get(ResultCache *cache, const char *key, size_t key_len, bool allow_stale,
+                               bool *refresh) {
+    uint64_t hash = hash_bytes(key, key_len, 0);
+    time_t now = time(NULL);
+    CachedResult *value = NULL;
+
+    pthread_mutex_lock(&cache->lock);
+    CacheEntry *entry = cache->buckets[hash & (cache->nbuckets - 1)];
+    while (entry && !(entry->hash == hash && entry->key_len == key_len &&
+                      memcmp(entry->key, key, key_len) == 0)) {
+        entry = entry->hnext;
+    }
+
+    if (entry && now >= entry->expires) {
+        if (now >= entry->expires + cache->stale_ttl) {
+            cache_remove_entry(cache, entry);
+            cache->expirations++;
+            entry = NULL;
+        } else if (!allow_stale) {
+            entry = NULL;
+        }
+    }
+
+    if (entry) {
+        cache_lru_unlink(cache, entry);
+        cache_lru_push_front(cache, entry);
+        value = entry->value;
+        cached_result_retain(value);
+        if (!allow_stale) cache->hits++;
+        if (refresh && !allow_stale && entry->refresh_at && now >= entry->refresh_at && !entry->refreshing) {
+            entry->refreshing = true;
+            cache->refreshes++;
+            *refresh = true;
+        }
+    } else if (!allow_stale) {
+        cache->misses++;
+    }
+    pthread_mutex_unlock(&cache->lock);
+
+    return value;
+}
+
+/* 저장 - 같은 키가 있으면 교체, 용량을 넘으면 LRU 꼬리부터 제거.
+ * 결과 0건(value->count == 0)은 negative_ttl 동안만 두고 다시 검색하지 않음 */
+void result_cache_put(ResultCache *cache, const char *key, size_t key_len, CachedResult *value) {
+    size_t bytes = sizeof(CacheEntry) + key_len + sizeof(CachedResult) + value->len;
+    if (bytes > cache->max_bytes) return;
+
+    uint64_t hash = hash_bytes(key, key_len, 0);
+    CacheEntry *entry = safe_malloc(sizeof(CacheEntry));
+    entry->key = safe_malloc(key_len + 1);
+    memcpy(entry->key, key, key_len);
+    entry->key[key_len] = '\0';
+    entry->key_len = key_len;
+    entry->hash = hash;
+    entry->value = value;
+    entry->bytes = bytes;
+    time_t now = time(NULL);
+    bool negative = (value->count == 0);
+    entry->expires = now + (negative ? cache->negative_ttl : cache->ttl);
+    entry->refresh_at = (!negative && cache->soft_ttl > 0) ? now + cache->soft_ttl : 0;
+    entry->refreshing = false;
+    cached_result_retain(value);
+
+    pthread_mutex_lock(&cache->lock);
+    if (negative) cache->negative++;
+    CacheEntry *old = cache->buckets[hash & (cache->nbuckets - 1)];
+    while (old && !(old->hash == hash && old->key_len == key_len &&
+                    memcmp(old->key, key, key_len) == 0)) {
+        old = old->hnext;
+    }
+    if (old) cache_remove_entry(cache, old);
+
+    while (cache->lru_tail && cache->bytes + bytes > cache->max_bytes) {
+        cache_remove_entry(cache, cache->lru_tail);
+        cache->evictions++;
+    }
+
+    size_t idx = hash & (cache->nbuckets - 1);
+    entry->hnext = cache->buckets[idx];
+    cache->buckets[idx] = entry;
+    cache_lru_push_front(cache, entry);
+    cache->bytes += bytes;
+    cache->entries++;
+    cache_maybe_grow(cache);
+    pthread_mutex_unlock(&cache->lock);
+}
+
+/* 다시 검색이 끝남 - 새 결과로 바뀌었으면 (새 항목은 refreshing이 아님) 할 일 없음,
+ * 아직 그 항목이면 실패로 세고 다음 적중에 다시 시도하게 함 */
+void result_cache_refresh_done(ResultCache *cache, const char *key, size_t key_len) {
+    uint64_t hash = hash_bytes(key, key_len, 0);
+    pthread_mutex_lock(&cache->lock);
+    CacheEntry *entry = cache->buckets[hash & (cache->nbuckets - 1)];
+    while (entry && !(entry->hash == hash && entry->key_len == key_len &&
+                      memcmp(entry->key, key, key_len) == 0)) {
+        entry = entry->hnext;
+    }
+    if (entry && entry->refreshing) {
+        entry->refreshing = false;
+        cache->refresh_failures++;
+    }
+    pthread_mutex_unlock(&cache->lock);
+}
+
+void result_cache_destroy(ResultCache *cache) {
+    if (!cache->buckets) return;
+
+    pthread_mutex_lock(&cache->lock);
+    while (cache->lru_head) {
+        cache_remove_entry(cache, cache->lru_head);
+    }
+    pthread_mutex_unlock(&cache->lock);
+
+    printf("[Cache] hits=%llu misses=%llu evictions=%llu expirations=%llu refreshes=%llu negative=%llu\n",
+           (unsigned long long)cache->hits, (unsigned long long)cache->misses,
+           (unsigned long long)cache->evictions, (unsigned long long)cache->expirations,
+           (unsigned long long)cache->refreshes, (unsigned long long)cache->negative);
+
+    free(cache->buckets);
+    cache->buckets = NULL;
+    pthread_mutex_destroy(&cache->lock);
+}
+
+/* ---- stale-while-revalidate (cache.soft_ttl) ---- */
+
+/* soft_ttl이 지난 항목을 적중한 요청이 body로 다시 검색해 달라고 넣음 (바로 돌아옴).
+ * 갱신 스레드가 없거나 대기열이 가득 차면 넣지 않고 항목의 refreshing을 해제 */
+void cache_refresh_enqueue(CacheRefresher *r, const char *body, const char *key, size_t key_len) {
+    bool queued = false;
+    pthread_mutex_lock(&r->lock);
+    if (r->running && !r->stop && r->count < CACHE_REFRESH_QUEUE) {
+        CacheRefreshTask *task = &r->tasks[r->count++];
+        task->body = safe_strdup(body);
+        task->key = safe_malloc(key_len + 1);
+        memcpy(task->key, key, key_len);
+        task->key[key_len] = '\0';
+        task->key_len = key_len;
+        pthread_cond_signal(&r->cond);
+        queued = true;
+    }
+    pthread_mutex_unlock(&r->lock);
+    if (!queued) result_cache_refresh_done(&g_result_cache, key, key_len);
+}
+
+/* ============================
+ * 동시 검색 합치기 (single-flight)
+ * ============================ */
+
+/* 키로 진행 중인 검색 (lock 보유 상태로), 없으면 NULL */
+Flight* flight_find_locked(FlightTable *table, uint64_t hash, const char *key, size_t key_len) {
+    for (Flight *flight = table->buckets[hash & (FLIGHT_BUCKETS - 1)]; flight; flight = flight->next) {
+        if (flight->hash == hash && flight->key_len == key_len && memcmp(flight->key, key, key_len) == 0) {
+            return flight;
+        }
+    }
+    return NULL;
+}
+
+/* 같은 키로 진행 중인 검색이 있는지 (합류하지 않음) */
+bool flight_active(FlightTable *table, const char *key, size_t key_len) {
+    uint64_t hash = hash_bytes(key, key_len, 0);
+    pthread_mutex_lock(&table->lock);
+    bool active = flight_find_locked(table, hash, key, key_len) != NULL;
+    pthread_mutex_unlock(&table->lock);
+    return active;
+}
+
+/* 키로 진행 중인 검색에 합류하거나 새로 시작. 새로 시작했으면 *leader = true */
+Flight* flight_join(FlightTable *table, const char *key, size_t key_len, bool *leader) {
+    uint64_t hash = hash_bytes(key, key_len, 0);
+    Flight **bucket = &table->buckets[hash & (FLIGHT_BUCKETS - 1)];
+
+    pthread_mutex_lock(&table->lock);
+    Flight *found = flight_find_locked(table, hash, key, key_len);
+    if (found) {
+        found->refs++;
+        pthread_mutex_unlock(&table->lock);
+        *leader = false;
+        return found;
+    }
+
+    Flight *flight = safe_malloc(sizeof(Flight));
+    memset(flight, 0, sizeof(Flight));
+    flight->key = safe_malloc(key_len);
+    memcpy(flight->key, key, key_len);
+    flight->key_len = key_len;
+    flight->hash = hash;
+    flight->refs = 1;
+    pthread_cond_init(&flight->cond, NULL);
+    flight->next = *bucket;
+    *bucket = flight;
+    pthread_mutex_unlock(&table->lock);
+
+    *leader = true;
+    return flight;
+}
+
+/* 선두가 결과를 알림 (result NULL = 결과 없이 포기). 이후 같은 키는 새 검색을 시작 */
+void flight_complete(FlightTable *table, Flight *flight, CachedResult *result) {
+    bool wake = false;
+    pthread_mutex_lock(&table->lock);
+    if (!flight->done) {
+        flight->done = true;
+        if (result) cached_result_retain(result);
+        flight->result = result;
+
+        Flight **link = &table->buckets[flight->hash & (FLIGHT_BUCKETS - 1)];
+        while (*link && *link != flight) link = &(*link)->next;
+        if (*link) *link = flight->next;
+        flight->next = NULL;
+
+        pthread_cond_broadcast(&flight->cond);
+
+        /* 루프 밖에서 끝났으면 (캐시 갱신 등) 대기 목록은 루프가 가져가도록 넘기고 깨움 */
+        if (flight->waiters && table->wake_fd >= 0 && !pthread_equal(pthread_self(), table->loop_thread)) {
+            flight->refs++;
+            flight->remote_next = table->remote;
+            table->remote = flight;
+            wake = true;
+        }
+    }
+    pthread_mutex_unlock(&table->lock);
+
+    if (wake) {
+        uint64_t one = 1;
+        if (write(table->wake_fd, &one, sizeof(one)) < 0 && errno != EAGAIN) {
+            log_write(LOG_LEVEL_ERROR, "[Event] Coalesced wake-up failed: %s", strerror(errno));
+        }
+    }
+}
+
+/* 블로킹 대기 - 선두의 결과 (참조 하나 추가) 또는 NULL */
+CachedResult* flight_wait(FlightTable *table, Flight *flight) {
+    pthread_mutex_lock(&table->lock);
+    while (!flight->done) {
+        pthread_cond_wait(&flight->cond, &table->lock);
+    }
+    CachedResult *result = flight->result;
+    if (result) cached_result_retain(result);
+    pthread_mutex_unlock(&table->lock);
+    return result;
+}
+
+/* epoll 대기 목록에 추가, 이미 끝났으면 false */
+bool flight_add_waiter(FlightTable *table, Flight *flight, FlightWaiter *waiter) {
+    pthread_mutex_lock(&table->lock);
+    bool added = !flight->done;
+    if (added) {
+        waiter->prev = NULL;
+        waiter->next = flight->waiters;
+        if (flight->waiters) flight->waiters->prev = waiter;
+        flight->waiters = waiter;
+        waiter->linked = true;
+    }
+    pthread_mutex_unlock(&table->lock);
+    return added;
+}
+
+/* 끝난 검색의 대기 목록을 떼어 반환 (next로 순회) */
+FlightWaiter* flight_take_waiters(FlightTable *table, Flight *flight) {
+    pthread_mutex_lock(&table->lock);
+    FlightWaiter *waiters = flight->waiters;
+    flight->waiters = NULL;
+    for (FlightWaiter *w = waiters; w; w = w->next) {
+        w->linked = false;
+    }
+    pthread_mutex_unlock(&table->lock);
+    return waiters;
+}
+
+/* 이벤트 루프를 등록 (wake_fd = eventfd) 또는 해제 (-1). 루프 스레드에서 */
+void flight_set_loop(FlightTable *table, int wake_fd) {
+    pthread_mutex_lock(&table->lock);
+    table->wake_fd = wake_fd;
+    table->loop_thread = pthread_self();
+    pthread_mutex_unlock(&table->lock);
+}
+
+/* 참조 반환 (대기 목록에 남아 있으면 빼고), 마지막 참조면 해제 */
+void flight_release(FlightTable *table, Flight *flight, FlightWaiter *waiter) {
+    pthread_mutex_lock(&table->lock);
+    if (waiter && waiter->linked) {
+        if (waiter->prev) waiter->prev->next = waiter->next;
+        else flight->waiters = waiter->next;
+        if (waiter->next) waiter->next->prev = waiter->prev;
+        waiter->linked = false;
+    }
+    bool last = (--flight->refs == 0);
+    pthread_mutex_unlock(&table->lock);
+
+    if (last) {
+        cached_result_release(flight->result);
+        pthread_cond_destroy(&flight->cond);
+        free(flight->key);
+        free(flight);
+    }
+}
+
+/* 루프 밖에서 끝난 검색들의 대기 목록을 모두 떼어 반환 (next로 순회) - 루프 스레드에서 */
+FlightWaiter* flight_take_remote(FlightTable *table) {
+    FlightWaiter *woken = NULL;
+    pthread_mutex_lock(&table->lock);
+    Flight *flights = table->remote;
+    table->remote = NULL;
+    for (Flight *flight = flights; flight; flight = flight->remote_next) {
+        while (flight->waiters) {
+            FlightWaiter *w = flight->waiters;
+            flight->waiters = w->next;
+            w->linked = false;
+            w->next = woken;
+            woken = w;
+        }
+    }
+    pthread_mutex_unlock(&table->lock);
+
+    while (flights) {
+        Flight *next = flights->remote_next;
+        flight_release(table, flights, NULL);
+        flights = next;
+    }
+    return woken;
+}
+
+/* ============================
+ * 동시 검색 제한 (admission)
+ * ============================ */
+
+/*
+ * Manticore를 부르는 검색은 시작하기 전에 슬롯을 하나 받는다 (캐시 적중, 제목 색인,
+ * 합치기로 결과를 기다리는 요청은 슬롯 없이). 슬롯 수 상한은 AIMD로 움직인다: 상한까지
+ * 쓰고 있을 때 검색이 정상으로 끝나면 1/limit씩 올리고, 실패하거나 latency_target_ms보다
+ * 오래 걸리면 ADMISSION_BACKOFF를 곱해 내린다 (ADMISSION_BACKOFF_INTERVAL_US에 한 번까지).
+ * 슬롯이 없으면 기다리되 요청이 도착한 지 (threads 모드는 accept 시각부터) queue_timeout_ms가
+ * 지나면 거절해서, 밀린 요청이 Manticore를 더 느리게 만드는 대신 바로 503을 받게 한다.
+ * threads 모드는 조건 변수에서, epoll 모드는 루프의 대기열에서 기다린다.
+ */
+
+void admission_init(AdmissionControl *ac) {
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&ac->cond, &attr);
+    pthread_condattr_destroy(&attr);
+    pthread_mutex_init(&ac->lock, NULL);
+    ac->limit = g_config.admission_max_in_flight;
+    ac->in_flight = 0;
+    ac->waiting = 0;
+    ac->last_backoff_us = 0;
+}
+
+/* 요청이 received_us(CLOCK_MONOTONIC)에 도착했을 때 슬롯을 기다릴 수 있는 마지막 시각 */
+uint64_t admission_deadline_us(uint64_t received_us) {
+    return received_us + (uint64_t)g_config.admission_queue_timeout_ms * 1000;
+}
+
+/* lock 보유 상태에서 */
+bool admission_take_locked(AdmissionControl *ac) {
+    if (ac->in_flight >= (int)ac->limit) return false;
+    ac->in_flight++;
+    return true;
+}
+
+/* 슬롯이 남아 있으면 바로 받고 true (epoll 모드) */
+bool admission_try_acquire(AdmissionControl *ac) {
+    pthread_mutex_lock(&ac->lock);
+    bool ok = admission_take_locked(ac);
+    pthread_mutex_unlock(&ac->lock);
+    return ok;
+}
+
+/* threads 모드: deadline_us까지 슬롯을 기다림, 받지 못하면 false */
+bool admission_acquire(AdmissionControl *ac, uint64_t deadline_us) {
+    pthread_mutex_lock(&ac->lock);
+    bool ok = admission_take_locked(ac);
+    if (!ok) {
+        struct timespec until = { .tv_sec = deadline_us / 1000000,
+                                  .tv_nsec = (long)(deadline_us % 1000000) * 1000 };
+        int rc = 0;
+        __atomic_add_fetch(&ac->waiting, 1, __ATOMIC_RELAXED);
+        while (!(ok = admission_take_locked(ac)) && rc != ETIMEDOUT && g_running) {
+            rc = pthread_cond_timedwait(&ac->cond, &ac->lock, &until);
+        }
+        __atomic_sub_fetch(&ac->waiting, 1, __ATOMIC_RELAXED);
+    }
+    pthread_mutex_unlock(&ac->lock);
+    return ok;
+}
+
+/* 검색이 끝나 슬롯 반환 - 걸린 시간(elapsed_us)과 결과(ok)로 상한 조정 */
+void admission_release(AdmissionControl *ac, uint64_t elapsed_us, bool ok) {
+    uint64_t now = metrics_now_us();
+    bool slow = g_config.admission_latency_target_ms > 0 &&
+                elapsed_us > (uint64_t)g_config.admission_latency_target_ms * 1000;
+
+    pthread_mutex_lock(&ac->lock);
+    bool saturated = ac->in_flight >= (int)ac->limit;
+    ac->in_flight--;
+    if (!ok || slow) {
+        if (now - ac->last_backoff_us >= ADMISSION_BACKOFF_INTERVAL_US) {
+            ac->limit *= ADMISSION_BACKOFF;
+            if (ac->limit < g_config.admission_min_in_flight) ac->limit = g_config.admission_min_in_flight;
+            ac->last_backoff_us = now;
+        }
+    } else if (saturated) {
+        /* 상한까지 쓰고 있을 때만 올림 (한가할 때 상한이 의미 없이 커지지 않게) */
+        ac->limit += 1.0 / ac->limit;
+        if (ac->limit > g_config.admission_max_in_flight) ac->limit = g_config.admission_max_in_flight;
+    }
+    if (ac->waiting > 0) pthread_cond_signal(&ac->cond);
+    pthread_mutex_unlock(&ac->lock);
+}
+
+/* /metrics, 로그용 (limit, in_flight, waiting) */
+void admission_snapshot(AdmissionControl *ac, double *limit, int *in_flight, int *waiting) {
+    pthread_mutex_lock(&ac->lock);
+    *limit = ac->limit;
+    *in_flight = ac->in_flight;
+    *waiting = ac->waiting;
+    pthread_mutex_unlock(&ac->lock);
+}
+
+/* 종료 시 슬롯을 기다리는 스레드를 깨움 (g_running이 0이면 거절로 끝남) */
+void admission_wake_all(AdmissionControl *ac) {
+    pthread_mutex_lock(&ac->lock);
+    pthread_cond_broadcast(&ac->cond);
+    pthread_mutex_unlock(&ac->lock);
+}
+
+/* ============================
+ * HTTP 서버 함수
+ * ============================ */
+
+/* 워커를 기다리는 연결 수 (/metrics) */
+int work_queue_pending(WorkQueue *q) {
+    pthread_mutex_lock(&q->lock);
+    int count = q->count;
+    pthread_mutex_unlock(&q->lock);
+    return count;
+}
+
+/* 쉬는 워커가 받아 가지 못할 연결이 큐에 있는지 (있으면 keep-alive로 워커를 붙잡지 않음).
+ * 큐 길이만 보면 재접속 하나하나가 다른 워커의 keep-alive를 끊어 재접속이 더 늘어남 */
+bool work_queue_starved(WorkQueue *q) {
+    pthread_mutex_lock(&q->lock);
+    bool starved = q->count > q->idle;
+    pthread_mutex_unlock(&q->lock);
+    return starved;
+}
+
+#define ROOT_STATUS_BODY "{\"status\": \"running\", \"service\": \"LocalKnowledgeBase\", \"version\": \"1.0\"}"
+#define NOT_FOUND_BODY "{\"error\": \"Not Found\"}"
+#define TOO_LARGE_BODY "{\"error\": \"Payload Too Large\"}"
+#define OVERLOADED_BODY "{\"error\": \"Service Unavailable\", \"reason\": \"overloaded\"}"
+#define METRICS_CONTENT_TYPE "text/plain; version=0.0.4"
+
+/* HTTP 응답 헤더 생성, 헤더 길이 반환 */
+int build_http_header(char *header, size_t header_size, int status_code, const char *status_text,
+                      const char *content_type, size_t content_length, bool keep_alive) {
+    int len = snprintf(header, header_size,
+             "HTTP/1.1 %d %s\r\n"
+             "Content-Type: %s\r\n"
+             "Content-Length: %zu\r\n"
+             "Access-Control-Allow-Origin: *\r\n"
+             "Connection: %s\r\n"
+             "\r\n",
+             status_code, status_text, content_type, content_length,
+             keep_alive ? "keep-alive" : "close");
+    if (len < 0) return 0;
+    return ((size_t)len < header_size) ? len : (int)header_size - 1;
+}
+
+/* Transfer-Encoding: chunked 응답 헤더 (바디 길이를 미리 모를 때) */
+int build_http_chunked_header(char *header, size_t header_size, int status_code, const char *status_text,
+                              const char *content_type, bool keep_alive) {
+    int len = snprintf(header, header_size,
+             "HTTP/1.1 %d %s\r\n"
+             "Content-Type: %s\r\n"
+             "Transfer-Encoding: chunked\r\n"
+             "Access-Control-Allow-Origin: *\r\n"
+             "Connection: %s\r\n"
+             "\r\n",
+             status_code, status_text, content_type, keep_alive ? "keep-alive" : "close");
+    if (len < 0) return 0;
+    return ((size_t)len < header_size) ? len : (int)header_size - 1;
+}
+
+/* admission으로 거절한 검색 - 503 + Retry-After (admission.retry_after 초, 0이면 빼고) */
+int build_http_overloaded_header(char *header, size_t header_size, bool keep_alive) {
+    char retry_after[48] = "";
+    if (g_config.admission_retry_after > 0) {
+        snprintf(retry_after, sizeof(retry_after), "Retry-After: %d\r\n", g_config.admission_retry_after);
+    }
+    int len = snprintf(header, header_size,
+             "HTTP/1.1 503 Service Unavailable\r\n"
+             "Content-Type: application/json\r\n"
+             "Content-Length: %zu\r\n"
+             "%s"
+             "Access-Control-Allow-Origin: *\r\n"
+             "Connection: %s\r\n"
+             "\r\n",
+             sizeof(OVERLOADED_BODY) - 1, retry_after, keep_alive ? "keep-alive" : "close");
+    if (len < 0) return 0;
+    return ((size_t)len < header_size) ? len : (int)header_size - 1;
+}
+
+/* iovec 전체 전송 - 부분 전송이면 남은 부분부터 이어서 writev() */
+bool write_iov_all(int fd, struct iovec *iov, int iovcnt) {
+    while (iovcnt > 0) {
+        ssize_t n = writev(fd, iov, iovcnt);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return false;
+        }
+        while (iovcnt > 0 && (size_t)n >= iov->iov_len) {
+            n -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if (iovcnt > 0) {
+            iov->iov_base = (char *)iov->iov_base + n;
+            iov->iov_len -= n;
+        }
+    }
+    return true;
+}
+
+/* 헤더와 바디를 writev() 한 번으로 전송 (바디 복사 없음) */
+void send_http_response(int client_fd, int status_code, const char *status_text,
+                       const char *content_type, const char *body, size_t body_len,
+                       bool keep_alive) {
+    char header[RESPONSE_HEADER_SIZE];
+    int header_len = build_http_header(header, sizeof(header), status_code, status_text,
+                                       content_type, body_len, keep_alive);
+
+    struct iovec iov[2] = {
+        { .iov_base = header, .iov_len = header_len },
+        { .iov_base = (void *)body, .iov_len = body_len },
+    };
+    uint64_t write_start = metrics_now_us();
+    if (!write_iov_all(client_fd, iov, 2)) {
+        log_write(LOG_LEVEL_WARN, "[HTTP] writev response failed: %s", strerror(errno));
+    }
+    metrics_observe(STAGE_SOCKET_WRITE, write_start);
+}
+
+/* 503 과부하 응답 (admission으로 거절한 /search) */
+void send_overloaded_response(int client_fd, bool keep_alive) {
+    char header[RESPONSE_HEADER_SIZE];
+    int header_len = build_http_overloaded_header(header, sizeof(header), keep_alive);
+
+    struct iovec iov[2] = {
+        { .iov_base = header, .iov_len = header_len },
+        { .iov_base = (void *)OVERLOADED_BODY, .iov_len = sizeof(OVERLOADED_BODY) - 1 },
+    };
+    if (!write_iov_all(client_fd, iov, 2)) {
+        log_write(LOG_LEVEL_WARN, "[HTTP] writev response failed: %s", strerror(errno));
+    }
+}
+
+/*
+ * 결과 스트리밍 (lkb.stream_results, threads 모드 /search)
+ *
+ * Manticore 응답을 파싱하다 결과가 생기면 그 결과의 JSON을 바로 chunk로 보낸다.
+ * 헤더는 첫 결과와 함께 나가므로 결과가 하나도 없이 끝나면 (오류, 0건) 평소처럼
+ * Content-Length 응답을 보낸다. 보내는 바이트는 버퍼링 응답과 같다.
+ * 캐시나 합치기에 results JSON 전체가 필요하면 body에 남기고, 아니면 보낸 부분은
+ * 바로 비워서 요청당 메모리가 한 번에 받은 결과만큼으로 유지된다.
+ */
+typedef struct {
+    int fd;
+    ByteBuffer *body;     /* 보낼 JSON을 쌓는 곳 (scratch->body) */
+    size_t sent;          /* body 중 이미 보낸 바이트 */
+    bool keep_body;       /* 보낸 뒤에도 body를 비우지 않음 (캐시 / 합치기 선두) */
+    bool keep_alive;
+    bool started;         /* 헤더와 첫 chunk를 보냄 */
+    bool failed;          /* 클라이언트 쓰기 실패 - 이후로는 보내지 않음 */
+    int result_count;     /* 보낸 결과 수 */
+} ChunkedResponse;
+
+void chunked_response_init(ChunkedResponse *c, int fd, ByteBuffer *body, bool keep_alive, bool keep_body) {
+    memset(c, 0, sizeof(ChunkedResponse));
+    c->fd = fd;
+    c->body = body;
+    c->keep_alive = keep_alive;
+    c->keep_body = keep_body;
+    buffer_reset(body);
+}
+
+/* body에 새로 쌓인 부분을 chunk 하나로 (처음이면 헤더 먼저, last면 끝 chunk까지) */
+void chunked_response_flush(ChunkedResponse *c, bool last) {
+    char header[RESPONSE_HEADER_SIZE];
+    char size_line[32];
+    struct iovec iov[5];
+    int iovcnt = 0;
+
+    if (!c->started) {
+        /* 결과마다 작은 write가 이어지므로 Nagle에 묶이지 않게 */
+        int one = 1;
+        setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        int header_len = build_http_chunked_header(header, sizeof(header), 200, "OK", "application/json",
+                                                   c->keep_alive);
+        iov[iovcnt++] = (struct iovec){ .iov_base = header, .iov_len = header_len };
+        c->started = true;
+        metrics_count(&g_metrics.search_streamed);
+    }
+
+    size_t len = c->body->len - c->sent;
+    if (len > 0) {
+        int size_len = snprintf(size_line, sizeof(size_line), "%zx\r\n", len);
+        iov[iovcnt++] = (struct iovec){ .iov_base = size_line, .iov_len = size_len };
+        iov[iovcnt++] = (struct iovec){ .iov_base = c->body->data + c->sent, .iov_len = len };
+        iov[iovcnt++] = (struct iovec){ .iov_base = "\r\n", .iov_len = 2 };
+    }
+    if (last) iov[iovcnt++] = (struct iovec){ .iov_base = "0\r\n\r\n", .iov_len = 5 };
+
+    if (!c->failed && !write_iov_all(c->fd, iov, iovcnt)) {
+        log_write(LOG_LEVEL_WARN, "[HTTP] writev chunk failed: %s", strerror(errno));
+        c->failed = true;
+    }
+
+    if (c->keep_body) {
+        c->sent = c->body->len;
+    } else {
+        buffer_reset(c->body);
+        c->sent = 0;
+    }
+}
+
+/* ManticoreResultsFn - 새 결과를 JSON으로 이어 붙여 바로 보냄 */
+void chunked_response_results(void *ctx, const SearchResult *results, int count) {
+    ChunkedResponse *c = ctx;
+    if (c->result_count == 0) create_json_results_open(c->body);
+    for (int i = 0; i < count; i++) {
+        create_json_results_item(c->body, &results[i], c->result_count == 0);
+        c->result_count++;
+    }
+    chunked_response_flush(c, false);
+}
+
+/* body의 나머지 (results 닫기 + 꼬리)와 끝 chunk를 보냄 */
+void chunked_response_finish(ChunkedResponse *c) {
+    uint64_t write_start = metrics_now_us();
+    chunked_response_flush(c, true);
+    metrics_observe(STAGE_SOCKET_WRITE, write_start);
+}
+
+/* 버퍼 안의 완성된 HTTP 요청 길이 (헤더 + Content-Length)
+ * 0: 아직 덜 도착함, -1: 잘못되었거나 너무 큰 요청 */
+long http_request_length(const char *data, size_t len) {
+    const char *header_end = memmem(data, len, "\r\n\r\n", 4);
+    if (!header_end) {
+        return (len >= MAX_HEADER_SIZE) ? -1 : 0;
+    }
+
+    size_t header_len = header_end - data + 4;
+    size_t content_length = 0;
+    size_t value_len;
+    const char *value = http_find_header(data, header_len, "Content-Length", &value_len);
+    if (value) {
+        char number[32];
+        if (value_len == 0 || value_len >= sizeof(number)) return -1;
+        memcpy(number, value, value_len);
+        number[value_len] = '\0';
+        char *num_end;
+        unsigned long long parsed = strtoull(number, &num_end, 10);
+        if (*num_end != '\0') return -1;
+        content_length = parsed;
+    }
+
+    if (content_length > BUFFER_SIZE || header_len + content_length > BUFFER_SIZE) return -1;
+    if (len < header_len + content_length) return 0;
+    return (long)(header_len + content_length);
+}
+
+/* 요청 줄이 HTTP/1.1인지 (chunked 응답과 기본 keep-alive 조건) */
+bool http_request_is_http11(const char *request, size_t request_len) {
+    const char *line_end = memmem(request, request_len, "\r\n", 2);
+    return line_end && line_end - request >= 8 && memcmp(line_end - 8, "HTTP/1.1", 8) == 0;
+}
+
+/* 클라이언트가 연결 유지를 원하는지 (HTTP/1.1 기본 유지, 1.0은 명시 요청 시만) */
+bool http_request_keep_alive(const char *request, size_t request_len) {
+    if (g_config.keepalive_timeout <= 0 || !g_running) return false;
+
+    const char *line_end = memmem(request, request_len, "\r\n", 2);
+    if (!line_end) return false;
+    bool keep_alive = http_request_is_http11(request, request_len);
+
+    const char *header_end = memmem(request, request_len, "\r\n\r\n", 4);
+    size_t header_len = header_end ? (size_t)(header_end - request) + 2 : request_len;
+    size_t value_len;
+    const char *value = http_find_header(line_end + 2, header_len - (line_end + 2 - request),
+                                         "Connection", &value_len);
+    if (value) {
+        if (value_len == 5 && strncasecmp(value, "close", 5) == 0) keep_alive = false;
+        if (value_len == 10 && strncasecmp(value, "keep-alive", 10) == 0) keep_alive = true;
+    }
+    return keep_alive;
+}
+
+void request_scratch_init(RequestScratch *scratch) {
+    arena_init(&scratch->arena, ARENA_CHUNK_SIZE);
+    buffer_init(&scratch->in);
+    buffer_init(&scratch->body);
+    for (int i = 0; i < MAX_QUERIES; i++) {
+        buffer_init(&scratch->request[i]);
+    }
+    for (int i = 0; i < UPSTREAM_SLOTS; i++) {
+        upstream_call_init(&scratch->upstream[i]);
+    }
+    scratch->batch = NULL;
+    scratch->batch_cap = 0;
+}
+
+/* 요청 하나가 끝난 뒤 호출 (in 버퍼는 파이프라인된 다음 요청이 있을 수 있어 유지) */
+void request_scratch_reset(RequestScratch *scratch) {
+    arena_reset(&scratch->arena);
+    buffer_trim(&scratch->body, SCRATCH_RETAIN_SIZE);
+    for (int i = 0; i < MAX_QUERIES; i++) {
+        buffer_trim(&scratch->request[i], SCRATCH_RETAIN_SIZE);
+    }
+    for (int i = 0; i < scratch->batch_cap; i++) {
+        request_scratch_reset(&scratch->batch[i]);
+    }
+}
+
+void request_scratch_free(RequestScratch *scratch) {
+    arena_free(&scratch->arena);
+    buffer_free(&scratch->in);
+    buffer_free(&scratch->body);
+    for (int i = 0; i < MAX_QUERIES; i++) {
+        buffer_free(&scratch->request[i]);
+    }
+    for (int i = 0; i < UPSTREAM_SLOTS; i++) {
+        upstream_call_free(&scratch->upstream[i]);
+    }
+    for (int i = 0; i < scratch->batch_cap; i++) {
+        request_scratch_free(&scratch->batch[i]);
+    }
+    free(scratch->batch);
+    scratch->batch = NULL;
+    scratch->batch_cap = 0;
+}
+
+/* 배치 항목용 scratch count개 (처음 쓸 때 만들어 워커가 끝날 때까지 재사용) */
+RequestScratch* request_scratch_batch(RequestScratch *scratch, int count) {
+    if (count > scratch->batch_cap) {
+        scratch->batch = safe_realloc(scratch->batch, sizeof(RequestScratch) * count);
+        for (int i = scratch->batch_cap; i < count; i++) {
+            request_scratch_init(&scratch->batch[i]);
+        }
+        scratch->batch_cap = count;
+    }
+    return scratch->batch;
+}
+
+/* fan-out 쿼리 하나 - i번째는 scratch->request[i]를 보내고 호출은 scratch->upstream[i]
+ * (첫 호출)과 scratch->upstream[MAX_QUERIES + i] (다른 replica로 보낸 두 번째 호출) */
+typedef struct {
+    char *query;
+    char *key;               /* 정규화 키 (query의 ASCII 소문자, 캐시 키에 씀) */
+    SearchResult *results;   /* 쿼리가 하나면 job->results, 여럿이면 arena */
+    int result_count;        /* -1 = 업스트림 오류 */
+    ManticoreStream *streams[2]; /* 호출마다 응답을 받는 대로 파싱 (arena) */
+    SearchResult *backup_results; /* 두 번째 호출의 결과 (이기면 results로 복사) */
+    UpstreamTarget *targets[2];   /* 호출마다 보낸 replica */
+    bool backup_started;     /* 두 번째 호출은 쿼리당 한 번만 */
+    bool done;               /* 결과 확정 (먼저 끝난 쪽) */
+    uint64_t hedge_at_us;    /* 이때까지 첫 호출이 끝나지 않으면 두 번째 호출 (0 = 안 함) */
+} SearchBranch;
+
+/* 검색 한 건의 처리 상태 (블로킹 경로와 epoll 경로가 공유) */
+typedef struct {
+    RequestScratch *scratch; /* 문자열은 scratch->arena, 응답은 scratch->body */
+    const ConfigSnapshot *snapshot; /* begin에서 잡은 설정 (free까지 유지, 요청 내내 같은 버전) */
+    const Config *config;    /* &snapshot->config */
+    const CompiledTemplate *template; /* snapshot->template (캐시 키와 요청 본문이 같은 버전) */
+    unsigned snapshot_phase;
+    struct timespec start;
+    SearchRequest req;
+    char *clean_query;
+    char *clean_key;         /* clean_query의 정규화 키 */
+    char *title_key;         /* 제목 색인 키 (NULL = 색인 없음, Manticore 결과에 덧붙이지 않음) */
+    uint32_t title_exact;    /* 키가 같은 색인 항목 (TITLE_INDEX_NONE = 없음) */
+    SearchBranch branches[MAX_QUERIES];  /* branches[0].query == clean_query */
+    int branch_count;
+    int branches_pending;    /* 아직 응답을 기다리는 쿼리 수 */
+    bool call_active[UPSTREAM_SLOTS]; /* 진행 중인 호출 (끝나거나 취소되면 false, 정리는 부른 쪽) */
+    SearchResult results[MAX_RESULTS];   /* 최종 결과 (여러 쿼리면 병합 결과) */
+    int result_count;
+    bool upstream_ok;        /* Manticore가 정상 응답함 (캐시 저장 조건) */
+    char cache_key[MAX_CACHE_KEY_LEN];
+    size_t cache_key_len;    /* 0이면 캐시/합치기 사용 안 함 */
+    CachedResult *cached;    /* 캐시 적중 결과 (또는 선두 요청에게 받은 결과) */
+    Flight *flight;          /* 같은 키로 진행 중인 검색 (engine.coalesce) */
+    bool flight_leader;      /* 이 요청이 Manticore를 호출하고 결과를 나눠 줌 */
+    FlightWaiter waiter;     /* epoll: 선두를 기다리는 동안 flight 대기 목록에 */
+    ChunkedResponse *chunked; /* threads 모드 lkb.stream_results: 결과를 파싱되는 대로 보냄 */
+    bool admitted;           /* admission 슬롯을 받음 (Manticore 호출이 끝나면 반환) */
+    uint64_t admitted_us;    /* 슬롯을 받은 시각 (상한 조정에 쓰는 소요 시간 기준) */
+} SearchJob;
+
+/* 결과를 이미 클라이언트로 보내기 시작함 - 응답은 보낸 결과로 마무리해야 함 */
+bool search_job_streamed(const SearchJob *job) {
+    return job->chunked && job->chunked->started;
+}
+
+/* Manticore 호출 결과 기록 (음수 = 업스트림 오류) */
+void search_job_set_results(SearchJob *job, int result_count) {
+    job->upstream_ok = (result_count >= 0);
+    job->result_count = (result_count > 0) ? result_count : 0;
+}
+
+/* engine.fanout_queries > 1이면 "queries"의 나머지 쿼리도 함께 검색 (같은 규칙으로 정규화, 키가 같으면 제외) */
+void search_job_collect_queries(SearchJob *job) {
+    job->branches[0].query = job->clean_query;
+    job->branches[0].key = job->clean_key;
+    job->branch_count = 1;
+
+    for (int i = 0; i < job->req.queries_count && job->branch_count < job->config->fanout_queries; i++) {
+        char *key;
+        char *query = normalize_search_query(&job->scratch->arena, job->req.queries[i], NULL, 0, &key);
+        if (query[0] == '\0') continue;
+
+        bool seen = false;
+        for (int j = 0; j < job->branch_count && !seen; j++) {
+            seen = (strcmp(job->branches[j].key, key) == 0);
+        }
+        if (!seen) {
+            job->branches[job->branch_count].query = query;
+            job->branches[job->branch_count++].key = key;
+        }
+    }
+}
+
+/* 캐시 키용 쿼리 문자열 - 정규화 키, 여러 쿼리면 순서대로 이어 붙임 (arena) */
+const char* search_job_key_query(SearchJob *job) {
+    if (job->branch_count == 1) return job->clean_key;
+
+    size_t total = 0;
+    for (int i = 0; i < job->branch_count; i++) total += strlen(job->branches[i].key) + 1;
+    char *joined = arena_alloc(&job->scratch->arena, total);
+    char *p = joined;
+    for (int i = 0; i < job->branch_count; i++) {
+        size_t len = strlen(job->branches[i].key);
+        memcpy(p, job->branches[i].key, len);
+        p += len;
+        *p++ = '\x1e';
+    }
+    p[-1] = '\0';
+    return joined;
+}
+
+/* Manticore 결과를 얻지 못했을 때 ttl이 지난 캐시 결과가 남아 있으면 그것으로 응답 */
+bool search_job_use_stale(SearchJob *job) {
+    if (!g_config.cache_enabled || job->cache_key_len == 0 || job->cached) return false;
+
+    job->cached = result_cache_get(&g_result_cache, job->cache_key, job->cache_key_len, true, NULL);
+    if (!job->cached) return false;
+    metrics_count(&g_metrics.search_stale);
+    log_write(LOG_LEVEL_WARN, "[Cache] Serving stale: \"%s\" (%d results, Manticore unavailable)",
+              job->clean_query, job->cached->count);
+    return true;
+}
+
+/* 모든 replica의 차단기가 열려 있으면 Manticore를 부르지 않기로 하고 true
+ * (지난 캐시 결과 또는 빈 결과) */
+bool search_job_fail_fast(SearchJob *job) {
+    if (upstream_available(job->snapshot)) return false;
+
+    metrics_count(&g_metrics.breaker_rejected);
+    log_write(LOG_LEVEL_INFO, "[Search] Breaker open on every backend: answering \"%s\" without Manticore",
+              job->clean_query);
+    search_job_use_stale(job);
+    return true;
+}
+
+/* 제목 색인에 쿼리와 같은 제목이 있고 스니펫도 있으면 그 한 건으로 응답하기로 하고 true.
+ * upstream_ok가 false라 캐시하지 않음 (색인 조회가 캐시보다 빠름). 그 밖에는 Manticore로 가고
+ * 결과가 오면 search_job_add_titles가 색인 결과를 합침 */
+bool search_job_title_lookup(SearchJob *job, bool refresh) {
+    if (!g_title_index.data || job->branch_count != 1 || job->req.count <= 0) return false;
+
+    job->title_key = arena_alloc(&job->scratch->arena, strlen(job->clean_query) + 1);
+    if (title_index_key(job->title_key, job->clean_query) == 0) {
+        job->title_key = NULL;
+        return false;
+    }
+    job->title_exact = title_index_find(&g_title_index, job->title_key);
+    if (refresh || job->title_exact == TITLE_INDEX_NONE ||
+        title_index_snippet(&g_title_index, job->title_exact)[0] == '\0') {
+        return false;
+    }
+
+    title_index_result(&g_title_index, job->title_exact, job->config, &job->scratch->arena, &job->results[0]);
+    job->result_count = 1;
+    metrics_count(&g_metrics.title_index_hits);
+    log_write(LOG_LEVEL_INFO, "[Index] Hit: \"%s\"", job->clean_query);
+    return true;
+}
+
+/* Manticore 결과에 제목 색인 결과를 합침: 쿼리와 같은 제목의 결과를 맨 앞으로 옮기고,
+ * title_index.prefix면 쿼리로 시작하는 제목 (스니펫이 있는 것)을 남은 자리에 키 순으로 */
+void search_job_add_titles(SearchJob *job) {
+    const TitleIndex *idx = &g_title_index;
+    Arena *arena = &job->scratch->arena;
+    int max_count = job->req.count < MAX_RESULTS ? job->req.count : MAX_RESULTS;
+    char *keys[MAX_RESULTS];
+
+    for (int r = 0; r < job->result_count; r++) {
+        keys[r] = arena_alloc(arena, strlen(job->results[r].title) + 1);
+        title_index_key(keys[r], job->results[r].title);
+        if (r > 0 && strcmp(keys[r], job->title_key) == 0) {
+            SearchResult exact = job->results[r];
+            memmove(&job->results[1], &job->results[0], sizeof(SearchResult) * r);
+            memmove(&keys[1], &keys[0], sizeof(char *) * r);
+            job->results[0] = exact;
+            keys[0] = job->title_key;
+        }
+    }
+
+    size_t key_len = strlen(job->title_key);
+    if (!job->config->title_index_prefix || key_len < (size_t)job->config->title_index_min_prefix) return;
+
+    int added = 0;
+    for (uint32_t i = title_index_lower_bound(idx, job->title_key);
+         i < idx->count && job->result_count < max_count; i++) {
+        const char *entry = title_index_entry(idx, i);
+        if (strncmp(entry, job->title_key, key_len) != 0) break;
+        if (title_index_snippet(idx, i)[0] == '\0') continue;
+
+        bool seen = false;
+        for (int r = 0; r < job->result_count && !seen; r++) seen = (strcmp(keys[r], entry) == 0);
+        if (seen) continue;
+        keys[job->result_count] = (char *)entry;
+        title_index_result(idx, i, job->config, arena, &job->results[job->result_count++]);
+        added++;
+    }
+    if (added > 0) {
+        __atomic_add_fetch(&g_metrics.title_index_added, added, __ATOMIC_RELAXED);
+        log_write(LOG_LEVEL_INFO, "[Index] Added %d titles to \"%s\"", added, job->clean_query);
+    }
+}
+
+/* 요청 파싱 + 쿼리 정규화, Manticore 호출이 필요하면 true.
+ * refresh면 (캐시 갱신 스레드) 제목 색인으로 답하지 않고 캐시도 보지 않고 Manticore로 (색인 결과는 합침) */
+bool search_job_prepare(SearchJob *job, RequestScratch *scratch, const char *body, bool refresh) {
+    memset(job, 0, sizeof(SearchJob));
+    job->scratch = scratch;
+    job->snapshot = config_acquire(&g_configs, &job->snapshot_phase);
+    job->config = &job->snapshot->config;
+    job->template = job->snapshot->template;
+    clock_gettime(CLOCK_MONOTONIC, &job->start);
+
+    /* 빈 요청 체크 */
+    if (!body || strlen(body) == 0) {
+        log_write(LOG_LEVEL_WARN, "[Search] Warning: Empty request body, ignoring");
+        return false;
+    }
+
+#ifdef DEBUG
+    /* Open WebUI로부터 받은 원본 요청 로그 기록 */
+    write_request_log(body);
+#endif
+
+    uint64_t stage_start = metrics_now_us();
+    parse_search_request(&scratch->arena, body, job->config->search_count, &job->req);
+    stage_start = metrics_observe(STAGE_REQUEST_PARSE, stage_start);
+
+    job->clean_query = normalize_search_query(&scratch->arena, job->req.query,
+                                              job->req.queries, job->req.queries_count, &job->clean_key);
+    metrics_observe(STAGE_NORMALIZE, stage_start);
+
+    log_write(LOG_LEVEL_INFO, "[Search] Query: \"%s\" | Count: %d | Engine: manticore",
+              job->clean_query, job->req.count);
+
+    /* 빈 쿼리 처리 */
+    if (strlen(job->clean_query) == 0) {
+        log_write(LOG_LEVEL_WARN, "[Search] Warning: Empty query after normalization");
+        return false;
+    }
+
+    search_job_collect_queries(job);
+    if (job->branch_count > 1) {
+        log_write(LOG_LEVEL_INFO, "[Search] Fan-out: %d queries", job->branch_count);
+    }
+
+    /* 쿼리가 스니펫까지 색인된 문서 제목이면 Manticore도 캐시도 거치지 않고 제목 색인에서 */
+    if (search_job_title_lookup(job, refresh)) return false;
+
+    if ((g_config.cache_enabled || job->config->coalesce) && job->template) {
+        job->cache_key_len = build_cache_key(job->cache_key, sizeof(job->cache_key),
+                                             search_job_key_query(job), job->req.count,
+                                             job->config->index_name, job->snapshot->result_hash);
+    }
+
+    /* 캐시 적중 시 Manticore 호출과 JSON 생성을 모두 건너뜀 (soft_ttl이 지났으면 갱신은 백그라운드에서) */
+    if (g_config.cache_enabled && job->cache_key_len > 0 && !refresh) {
+        bool stale_soon = false;
+        job->cached = result_cache_get(&g_result_cache, job->cache_key, job->cache_key_len, false, &stale_soon);
+        if (job->cached) {
+            log_write(LOG_LEVEL_INFO, "[Cache] Hit: \"%s\" (%d results%s)", job->clean_query,
+                      job->cached->count, stale_soon ? ", refreshing" : "");
+            if (stale_soon) cache_refresh_enqueue(&g_cache_refresher, body, job->cache_key, job->cache_key_len);
+            return false;
+        }
+    }
+
+    if (refresh && !upstream_available(job->snapshot)) return false;  /* 갱신은 차단기가 닫힌 뒤에 */
+    if (search_job_fail_fast(job)) return false;
+
+    int per_query = job->req.count < MAX_RESULTS ? job->req.count : MAX_RESULTS;
+    for (int i = 0; i < job->branch_count; i++) {
+        job->branches[i].results = (job->branch_count == 1) ? job->results :
+            arena_alloc(&scratch->arena, sizeof(SearchResult) * per_query);
+    }
+    job->branches_pending = job->branch_count;
+
+    /* 갱신은 합치기에 선두로 들어가지 않음: 뒤따른 epoll 연결은 이벤트 루프가 깨우는데 갱신
+     * 스레드는 루프 밖이라 깨울 수 없음. 같은 검색이 진행 중이면 그쪽 결과가 캐시에 들어가므로
+     * 건너뛰고, 아니면 합류하지 않고 검색해 캐시에만 넣음 */
+    if (refresh) {
+        return !(job->config->coalesce && job->cache_key_len > 0 &&
+                 flight_active(&g_flights, job->cache_key, job->cache_key_len));
+    }
+
+    /* 같은 검색이 이미 진행 중이면 Manticore를 부르지 않고 그 결과를 기다림 */
+    if (job->config->coalesce && job->cache_key_len > 0) {
+        job->flight = flight_join(&g_flights, job->cache_key, job->cache_key_len, &job->flight_leader);
+        if (!job->flight_leader) {
+            metrics_count(&g_metrics.search_coalesced);
+            log_write(LOG_LEVEL_INFO, "[Search] Coalesced: \"%s\" (same search in flight)",
+                      job->clean_query);
+            return false;
+        }
+    }
+    return true;
+}
+
+bool search_job_begin(SearchJob *job, RequestScratch *scratch, const char *body) {
+    return search_job_prepare(job, scratch, body, false);
+}
+
+/* begin이 false를 돌려줬지만 선두 요청의 결과를 기다려야 하는 경우 */
+bool search_job_is_follower(const SearchJob *job) {
+    return job->flight && !job->flight_leader && !job->cached;
+}
+
+/* 합치기에서 빠짐 - 선두가 결과 없이 빠지면 기다리던 요청은 각자 검색 */
+void search_job_leave_flight(SearchJob *job) {
+    if (!job->flight) return;
+    if (job->flight_leader) flight_complete(&g_flights, job->flight, NULL);
+    flight_release(&g_flights, job->flight, &job->waiter);
+    job->flight = NULL;
+    job->flight_leader = false;
+}
+
+/* 선두의 결과를 기다려 캐시 적중처럼 사용, 선두가 결과 없이 끝났으면 false (직접 검색).
+ * 그 사이 차단기가 열렸으면 직접 검색하지 않고 true */
+bool search_job_await_flight(SearchJob *job) {
+    job->cached = flight_wait(&g_flights, job->flight);
+    if (job->cached) return true;
+    search_job_leave_flight(job);
+    return search_job_fail_fast(job);
+}
+
+/* 슬롯을 받음 - 요청 도착부터 여기까지를 admission_wait로 기록 */
+void search_job_admitted(SearchJob *job, uint64_t received_us) {
+    job->admitted = true;
+    job->admitted_us = metrics_observe(STAGE_ADMISSION_WAIT, received_us);
+}
+
+/* Manticore 호출 전에 슬롯을 받음 (꺼져 있으면 항상 true). wait면 (threads 모드) 요청이
+ * 도착한 지 queue_timeout_ms가 될 때까지 기다리고, 아니면 (epoll 모드) 남은 슬롯만 봄 */
+bool search_job_admit(SearchJob *job, uint64_t received_us, bool wait) {
+    if (!g_config.admission_enabled) return true;
+
+    bool ok = admission_try_acquire(&g_admission);
+    if (!ok && wait) {
+        metrics_count(&g_metrics.admission_waited);
+        ok = admission_acquire(&g_admission, admission_deadline_us(received_us));
+    }
+    if (ok) search_job_admitted(job, received_us);
+    return ok;
+}
+
+/* Manticore 호출이 끝남 - 슬롯 반환 (merge 뒤라 upstream_ok가 결과) */
+void search_job_release_slot(SearchJob *job) {
+    if (!job->admitted) return;
+    admission_release(&g_admission, metrics_now_us() - job->admitted_us, job->upstream_ok);
+    job->admitted = false;
+}
+
+/* 슬롯을 받지 못한 검색 - 합치기에서 빠지고 (기다리던 요청은 각자 슬롯을 구함) ttl이 지난
+ * 캐시 결과가 있으면 그것으로 응답하기로 하고 true. 없으면 false (/search는 503, 배치 항목은 빈 결과) */
+bool search_job_shed(SearchJob *job, uint64_t received_us) {
+    uint64_t now = metrics_observe(STAGE_ADMISSION_WAIT, received_us);
+    double limit;
+    int in_flight, waiting;
+    admission_snapshot(&g_admission, &limit, &in_flight, &waiting);
+
+    metrics_count(&g_metrics.admission_shed);
+    log_write(LOG_LEVEL_WARN, "[Admission] Overloaded: shedding \"%s\" after %llums (%d/%d searches in flight)",
+              job->clean_query, (unsigned long long)(now > received_us ? now - received_us : 0) / 1000,
+              in_flight, (int)limit);
+    search_job_leave_flight(job);
+    return search_job_use_stale(job);
+}
+
+/* 쿼리 i의 결과 확정 - which번째 호출의 응답으로 (ok가 false면 업스트림 오류).
+ * 남은 호출은 취소로 표시만 하고 정리는 부른 쪽에서 */
+void search_job_branch_finish(SearchJob *job, int i, int which, bool ok) {
+    SearchBranch *branch = &job->branches[i];
+    branch->result_count = manticore_stream_finish(branch->streams[which], ok);
+    if (which == 1 && branch->result_count > 0) {
+        memcpy(branch->results, branch->backup_results, sizeof(SearchResult) * branch->result_count);
+    }
+    branch->done = true;
+    job->call_active[i] = false;
+    job->call_active[MAX_QUERIES + i] = false;
+    job->branches_pending--;
+}
+
+/* 쿼리 i의 which번째 호출(0 = 첫 호출, 1 = 첫 호출과 다른 replica)을 시작, 시작했으면 true */
+bool search_job_start_call(SearchJob *job, int i, int which) {
+    RequestScratch *scratch = job->scratch;
+    SearchBranch *branch = &job->branches[i];
+    UpstreamTarget *target = upstream_select(job->snapshot, which ? branch->targets[0] : NULL);
+    if (!target) return false;
+
+    SearchResult *results = branch->results;
+    if (which == 1) {
+        int per_query = job->req.count < MAX_RESULTS ? job->req.count : MAX_RESULTS;
+        branch->backup_started = true;
+        branch->backup_results = arena_alloc(&scratch->arena, sizeof(SearchResult) * per_query);
+        results = branch->backup_results;
+    }
+    branch->targets[which] = target;
+    branch->streams[which] = arena_alloc(&scratch->arena, sizeof(ManticoreStream));
+    manticore_stream_init(branch->streams[which], job->config, &scratch->arena, results, job->req.count,
+                          branch->query);
+    if (job->chunked) {
+        branch->streams[which]->on_results = chunked_response_results;
+        branch->streams[which]->on_results_ctx = job->chunked;
+    }
+
+    int slot = which * MAX_QUERIES + i;
+    if (!upstream_call_start(&scratch->upstream[slot], job->config, target, scratch->request[i].data,
+                             scratch->request[i].len, manticore_stream_sink, branch->streams[which])) {
+        circuit_breaker_record(target, false);
+        return false;
+    }
+    job->call_active[slot] = true;
+    return true;
+}
+
+/* 첫 호출이 실패했을 때 다른 replica로 한 번 더 (쿼리당 한 번), 보냈으면 true */
+bool search_job_failover(SearchJob *job, int i) {
+    SearchBranch *branch = &job->branches[i];
+    /* 이미 보낸 결과가 있으면 다른 replica의 결과로 바꿀 수 없음 */
+    if (branch->backup_started || search_job_streamed(job) || !search_job_start_call(job, i, 1)) return false;
+    metrics_count(&g_metrics.upstream_failover);
+    log_write(LOG_LEVEL_WARN, "[Search] Failover: retrying \"%s\" on %s", branch->query,
+              branch->targets[1]->name);
+    return true;
+}
+
+/* 쿼리 i의 Manticore 요청을 만들어 replica 하나로 시작 (못 보내면 다른 replica로).
+ * 어디로도 보내지 못하면 업스트림 오류로 결과 확정 */
+void search_job_start_branch(SearchJob *job, int i) {
+    RequestScratch *scratch = job->scratch;
+    SearchBranch *branch = &job->branches[i];
+
+    if (!build_manticore_request(&scratch->request[i], job->config, job->template, branch->query,
+                                 job->req.count)) {
+        search_job_branch_finish(job, i, 0, false);
+        return;
+    }
+    if (search_job_start_call(job, i, 0)) {
+        /* 스트리밍은 첫 호출의 결과를 바로 보내므로 hedge하지 않음 */
+        uint64_t delay = job->chunked ? 0 : upstream_hedge_delay_us(job->snapshot);
+        if (delay) branch->hedge_at_us = scratch->upstream[i].start_us + delay;
+        return;
+    }
+    if (!branch->targets[0] || !search_job_failover(job, i)) search_job_branch_finish(job, i, 0, false);
+}
+
+/* slot의 호출이 끝남 (ok가 false면 업스트림 오류), 호출 정리는 부른 쪽에서.
+ * 5xx가 아닌 응답이 먼저 온 쪽으로 결과를 확정하고 다른 쪽은 취소. 실패했으면 다른 쪽을
+ * 기다리거나 다른 replica로 다시 보내고, 더 할 게 없으면 이 응답(또는 오류)으로 확정 */
+void search_job_call_done(SearchJob *job, int slot, bool ok) {
+    int i = slot % MAX_QUERIES;
+    int which = slot / MAX_QUERIES;
+    SearchBranch *branch = &job->branches[i];
+    UpstreamCall *call = &job->scratch->upstream[slot];
+    int other = which ? i : MAX_QUERIES + i;
+
+    job->call_active[slot] = false;
+    bool good = ok && call->parser.status_code < 500;
+    circuit_breaker_record(branch->targets[which], good);
+
+    if (good) {
+        upstream_latency_record(metrics_now_us() - call->start_us);
+        if (which == 1 && job->call_active[other]) {
+            metrics_count(&g_metrics.upstream_hedge_wins);
+        }
+        search_job_branch_finish(job, i, which, true);
+        return;
+    }
+    if (job->call_active[other]) return;  /* 다른 replica의 응답을 기다림 */
+    if (which == 0 && search_job_failover(job, i)) return;
+    search_job_branch_finish(job, i, which, ok);
+}
+
+/* now가 지난 hedge 시각의 쿼리마다 다른 replica로 두 번째 호출을 보내고, 남은 가장 이른
+ * hedge 시각 반환 (0 = 없음). now가 0이면 보내지 않고 시각만 */
+uint64_t search_job_hedge(SearchJob *job, uint64_t now) {
+    uint64_t next = 0;
+    for (int i = 0; i < job->branch_count; i++) {
+        SearchBranch *branch = &job->branches[i];
+        if (branch->done || branch->backup_started || branch->hedge_at_us == 0) continue;
+
+        if (now == 0 || now < branch->hedge_at_us) {
+            if (next == 0 || branch->hedge_at_us < next) next = branch->hedge_at_us;
+            continue;
+        }
+        branch->hedge_at_us = 0;
+        if (!search_job_start_call(job, i, 1)) continue;
+        metrics_count(&g_metrics.upstream_hedged);
+        log_write(LOG_LEVEL_INFO, "[Search] Hedged: \"%s\" also sent to %s after %llu ms", branch->query,
+                  branch->targets[1]->name,
+                  (unsigned long long)(now - job->scratch->upstream[i].start_us) / 1000);
+    }
+    return next;
+}
+
+typedef struct {
+    const SearchResult *result;
+    uint64_t title_hash;
+    double score;
+    int first_seen;  /* (순위, 쿼리) 순으로 처음 나온 차례 - 동점이면 먼저 나온 쪽이 앞 */
+} FusedResult;
+
+int fused_result_compare(const void *a, const void *b) {
+    const FusedResult *x = a;
+    const FusedResult *y = b;
+    if (x->score != y->score) return x->score > y->score ? -1 : 1;
+    return x->first_seen - y->first_seen;
+}
+
+/* Reciprocal Rank Fusion: 쿼리마다 순위 r(1부터)인 결과에 1/(rrf_k + r)을 더하고
+ * page_title이 같은 결과는 하나로 합친다 (링크/스니펫은 가장 높은 순위의 것).
+ * 상위 count개를 job->results에 넣고 개수 반환 */
+int search_job_fuse_results(SearchJob *job) {
+    int capacity = 0;
+    int max_rank = 0;
+    for (int i = 0; i < job->branch_count; i++) {
+        int n = job->branches[i].result_count;
+        if (n <= 0) continue;
+        capacity += n;
+        if (n > max_rank) max_rank = n;
+    }
+    if (capacity == 0) return 0;
+
+    FusedResult *fused = arena_alloc(&job->scratch->arena, sizeof(FusedResult) * capacity);
+    int fused_count = 0;
+    for (int rank = 0; rank < max_rank; rank++) {
+        for (int i = 0; i < job->branch_count; i++) {
+            const SearchBranch *branch = &job->branches[i];
+            if (rank >= branch->result_count) continue;
+
+            const SearchResult *result = &branch->results[rank];
+            uint64_t title_hash = hash_bytes(result->title, strlen(result->title), 0);
+            double score = 1.0 / (job->config->rrf_k + rank + 1);
+
+            int j = 0;
+            while (j < fused_count && (fused[j].title_hash != title_hash ||
+                                       strcmp(fused[j].result->title, result->title) != 0)) {
+                j++;
+            }
+            if (j < fused_count) {
+                fused[j].score += score;
+                continue;
+            }
+            fused[fused_count] = (FusedResult){ result, title_hash, score, fused_count };
+            fused_count++;
+        }
+    }
+
+    qsort(fused, fused_count, sizeof(FusedResult), fused_result_compare);
+
+    int limit = job->req.count < MAX_RESULTS ? job->req.count : MAX_RESULTS;
+    if (fused_count < limit) limit = fused_count;
+    for (int i = 0; i < limit; i++) {
+        job->results[i] = *fused[i].result;
+    }
+    return limit;
+}
+
+/* 모든 쿼리가 끝난 뒤 결과 확정. 일부 쿼리만 실패했으면 나머지로 응답하되 캐시하지 않음.
+ * 모두 실패했으면 ttl이 지난 캐시 결과라도 있으면 그것으로 */
+void search_job_merge(SearchJob *job) {
+    if (job->branch_count == 1) {
+        search_job_set_results(job, job->branches[0].result_count);
+        if (!job->upstream_ok && !search_job_streamed(job)) search_job_use_stale(job);
+        if (job->upstream_ok && job->title_key && !search_job_streamed(job)) search_job_add_titles(job);
+        return;
+    }
+
+    int failed = 0;
+    for (int i = 0; i < job->branch_count; i++) {
+        if (job->branches[i].result_count < 0) failed++;
+    }
+    if (failed == job->branch_count) {
+        search_job_set_results(job, -1);
+        search_job_use_stale(job);
+        return;
+    }
+
+    search_job_set_results(job, search_job_fuse_results(job));
+    if (failed > 0) job->upstream_ok = false;
+    log_write(LOG_LEVEL_INFO, "[Search] Merged %d/%d queries into %d results",
+              job->branch_count - failed, job->branch_count, job->result_count);
+}
+
+/* 블로킹 경로: job의 진행 중인 호출을 한 번씩 진행해 끝난 호출을 정리하고, 기다릴 호출은
+ * pfds에 넣고 가장 이른 deadline / hedge 시각을 next_wake에 반영. 끝난 호출이 있었으면 true */
+bool search_job_poll_prepare(SearchJob *job, struct pollfd *pfds, int *nfds, uint64_t *next_wake) {
+    UpstreamCall *calls = job->scratch->upstream;
+    uint64_t now = metrics_now_us();
+    uint64_t hedge_at = search_job_hedge(job, now);
+    if (hedge_at && (*next_wake == 0 || hedge_at < *next_wake)) *next_wake = hedge_at;
+
+    bool changed = false;
+    for (int slot = 0; slot < UPSTREAM_SLOTS; slot++) {
+        if (!job->call_active[slot]) continue;
+        UpstreamCall *call = &calls[slot];
+        UpstreamState state = upstream_call_advance(call);
+        now = metrics_now_us();
+        if (state == UPSTREAM_DONE || state == UPSTREAM_FAILED || upstream_call_expire(call, now)) {
+            search_job_call_done(job, slot, call->state == UPSTREAM_DONE);
+            changed = true;
+            continue;
+        }
+
+        uint64_t deadline = upstream_call_deadline(call, NULL);
+        if (deadline && (*next_wake == 0 || deadline < *next_wake)) *next_wake = deadline;
+        pfds[*nfds].fd = call->fd;
+        pfds[*nfds].events = upstream_call_events(call);
+        (*nfds)++;
+    }
+    return changed;
+}
+
+/* 블로킹 경로: 검색마다(배치면 여러 검색) 쿼리별 요청을 시작해 한 poll()로 함께 기다림
+ * (가장 느린 쿼리만큼 걸림). hedge 시각이 되면 두 번째 호출도 같은 poll()에 넣는다.
+ * count는 MAX_BATCH_SEARCHES 이하 */
+void search_jobs_run(SearchJob **jobs, int count) {
+    struct pollfd pfds[MAX_BATCH_SEARCHES * UPSTREAM_SLOTS];
+
+    for (int j = 0; j < count; j++) {
+        for (int i = 0; i < jobs[j]->branch_count; i++) {
+            search_job_start_branch(jobs[j], i);
+        }
+    }
+
+    for (;;) {
+        uint64_t next_wake = 0;
+        bool pending = false;
+        bool changed = false;
+        int nfds = 0;
+        for (int j = 0; j < count; j++) {
+            if (jobs[j]->branches_pending == 0) continue;
+            pending = true;
+            if (search_job_poll_prepare(jobs[j], pfds, &nfds, &next_wake)) changed = true;
+        }
+        if (!pending) break;
+        /* 끝난 호출이 다른 호출을 시작/취소했을 수 있으므로 poll 전에 다시 훑음 */
+        if (changed) continue;
+        if (nfds == 0) break;
+
+        /* 가장 이른 deadline / hedge 시각까지만 대기 (ms 올림) */
+        uint64_t now = metrics_now_us();
+        int timeout = -1;
+        if (next_wake) timeout = next_wake > now ? (int)((next_wake - now + 999) / 1000) : 0;
+
+        if (poll(pfds, nfds, timeout) < 0 && errno != EINTR) {
+            log_write(LOG_LEVEL_ERROR, "[Manticore] poll failed: %s", strerror(errno));
+            for (int j = 0; j < count; j++) {
+                for (int slot = 0; slot < UPSTREAM_SLOTS; slot++) {
+                    if (jobs[j]->call_active[slot]) jobs[j]->scratch->upstream[slot].state = UPSTREAM_FAILED;
+                }
+            }
+        }
+    }
+
+    for (int j = 0; j < count; j++) {
+        UpstreamCall *calls = jobs[j]->scratch->upstream;
+        for (int i = 0; i < jobs[j]->branch_count; i++) {
+            upstream_call_release(&calls[i]);
+            upstream_call_release(&calls[MAX_QUERIES + i]);
+        }
+        search_job_merge(jobs[j]);
+        search_job_release_slot(jobs[j]);
+    }
+}
+
+void search_job_run(SearchJob *job) {
+    search_jobs_run(&job, 1);
+}
+
+/* body(results JSON)를 캐시에 넣고 기다리는 요청에 나눠 줌.
+ * 정상 응답일 때만 캐시, 결과 0건은 cache.negative_ttl이 있을 때만 (캐시는 자기 사본을 가짐).
+ * 기다리는 요청에는 결과와 관계없이 같은 사본을 나눠 줌 */
+void search_job_share_results(SearchJob *job, const ByteBuffer *body) {
+    bool cacheable = g_config.cache_enabled && job->cache_key_len > 0 && job->upstream_ok &&
+                     (job->result_count > 0 || g_config.cache_negative_ttl > 0);
+    if (!cacheable && !job->flight_leader) return;
+
+    char *results_json = safe_malloc(body->len + 1);
+    memcpy(results_json, body->data, body->len + 1);
+    CachedResult *value = cached_result_wrap(results_json, body->len, job->result_count);
+    if (cacheable) result_cache_put(&g_result_cache, job->cache_key, job->cache_key_len, value);
+    if (job->flight_leader) flight_complete(&g_flights, job->flight, value);
+    cached_result_release(value);
+}
+
+/* 응답 JSON을 scratch->body에 생성 (took_ms는 begin 시점부터) */
+const ByteBuffer* search_job_finish(SearchJob *job) {
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    int took_ms = (end.tv_sec - job->start.tv_sec) * 1000 +
+                  (end.tv_nsec - job->start.tv_nsec) / 1000000;
+    int64_t took_us = (int64_t)(end.tv_sec - job->start.tv_sec) * 1000000 +
+                      (end.tv_nsec - job->start.tv_nsec) / 1000;
+    metrics_observe_us(STAGE_SEARCH_TOTAL, took_us > 0 ? (uint64_t)took_us : 0);
+
+    ByteBuffer *body = &job->scratch->body;
+    if (search_job_streamed(job)) {
+        /* 보낸 결과로 마무리 (중간에 업스트림이 끊겼으면 그때까지의 결과, 캐시하지 않음) */
+        job->result_count = job->chunked->result_count;
+        create_json_results_close(body, job->result_count);
+        search_job_share_results(job, body);
+        create_json_response_tail(body, job->result_count, took_ms);
+        return body;
+    }
+    buffer_reset(body);
+
+    if (job->cached) {
+        /* 선두가 지난 캐시 결과로 응답하는 경우 기다리던 요청에도 같은 결과 */
+        if (job->flight_leader) flight_complete(&g_flights, job->flight, job->cached);
+        buffer_append(body, job->cached->json, job->cached->len);
+        create_json_response_tail(body, job->cached->count, took_ms);
+        return body;
+    }
+
+    uint64_t build_start = metrics_now_us();
+    create_json_results(body, job->results, job->result_count);
+    metrics_observe(STAGE_JSON_BUILD, build_start);
+
+    search_job_share_results(job, body);
+    create_json_response_tail(body, job->result_count, took_ms);
+    return body;
+}
+
+/* 작업 정리 - 문자열은 scratch arena 소유라 request_scratch_reset()에서 한꺼번에 해제 */
+void search_job_free(SearchJob *job) {
+    search_job_release_slot(job);
+    search_job_leave_flight(job);
+    job->clean_query = NULL;
+    job->clean_key = NULL;
+    job->result_count = 0;
+    cached_result_release(job->cached);
+    job->cached = NULL;
+    if (job->snapshot) config_release(&g_configs, job->snapshot_phase);
+    job->snapshot = NULL;
+    job->config = NULL;
+    job->template = NULL;
+}
+
+/* 캐시 갱신 스레드: 쌓인 요청을 모두 꺼내 배치처럼 함께 검색하고 결과를 캐시에 넣음.
+ * 같은 검색이 진행 중이면 (합치기) 그쪽 결과가 들어가므로 건너뛰고 (갱신 자신은 합치기에
+ * 들어가지 않으므로 그동안 온 같은 검색은 각자 Manticore로), admission 슬롯이
+ * 없으면 기다리지 않고 건너뜀 (hard ttl까지는 지금 결과로 응답) */
+void* cache_refresh_main(void *arg) {
+    CacheRefresher *r = arg;
+    RequestScratch scratch;
+    request_scratch_init(&scratch);
+    CacheRefreshTask tasks[CACHE_REFRESH_QUEUE];
+    SearchJob *jobs = safe_malloc(sizeof(SearchJob) * CACHE_REFRESH_QUEUE);
+    SearchJob *run[CACHE_REFRESH_QUEUE];
+
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGINT);
+    sigaddset(&mask, SIGTERM);
+    sigaddset(&mask, SIGHUP);
+    pthread_sigmask(SIG_BLOCK, &mask, NULL);
+
+    pthread_mutex_lock(&r->lock);
+    while (!r->stop) {
+        if (r->count == 0) {
+            pthread_cond_wait(&r->cond, &r->lock);
+            continue;
+        }
+        int count = r->count;
+        memcpy(tasks, r->tasks, sizeof(CacheRefreshTask) * count);
+        r->count = 0;
+        pthread_mutex_unlock(&r->lock);
+
+        RequestScratch *entry_scratch = request_scratch_batch(&scratch, count);
+        uint64_t now = metrics_now_us();
+        int run_count = 0;
+        for (int k = 0; k < count; k++) {
+            if (search_job_prepare(&jobs[k], &entry_scratch[k], tasks[k].body, true) &&
+                search_job_admit(&jobs[k], now, false)) {
+                log_write(LOG_LEVEL_INFO, "[Cache] Refreshing: \"%s\"", jobs[k].clean_query);
+                run[run_count++] = &jobs[k];
+            }
+        }
+        search_jobs_run(run, run_count);
+        for (int k = 0; k < run_count; k++) {
+            search_job_finish(run[k]);
+        }
+        for (int k = 0; k < count; k++) {
+            search_job_free(&jobs[k]);
+            request_scratch_reset(&entry_scratch[k]);
+            result_cache_refresh_done(&g_result_cache, tasks[k].key, tasks[k].key_len);
+            free(tasks[k].body);
+            free(tasks[k].key);
+        }
+        pthread_mutex_lock(&r->lock);
+    }
+    pthread_mutex_unlock(&r->lock);
+
+    free(jobs);
+    request_scratch_free(&scratch);
+    return NULL;
+}
+
+/* cache.soft_ttl이 있으면 갱신 스레드 시작 (못 띄우면 soft_ttl이 지나도 ttl까지 그대로 응답) */
+void cache_refresher_start(CacheRefresher *r) {
+    memset(r, 0, sizeof(CacheRefresher));
+    pthread_mutex_init(&r->lock, NULL);
+    pthread_cond_init(&r->cond, NULL);
+    if (!g_config.cache_enabled || g_config.cache_soft_ttl <= 0) return;
+
+    r->running = true;
+    if (pthread_create(&r->thread, NULL, cache_refresh_main, r) != 0) {
+        log_write(LOG_LEVEL_WARN, "[Cache] Could not start the refresh thread: %s", strerror(errno));
+        r->running = false;
+    }
+}
+
+/* 스레드 종료 - 진행 중인 갱신은 끝까지, 대기열에 남은 요청은 버림 */
+void cache_refresher_stop(CacheRefresher *r) {
+    pthread_mutex_lock(&r->lock);
+    bool running = r->running;
+    r->stop = true;
+    pthread_cond_signal(&r->cond);
+    pthread_mutex_unlock(&r->lock);
+    if (running) pthread_join(r->thread, NULL);
+
+    for (int k = 0; k < r->count; k++) {
+        free(r->tasks[k].body);
+        free(r->tasks[k].key);
+    }
+    r->count = 0;
+    r->running = false;
+}
+
+/* POST /search/batch 바디를 항목별 /search 바디로 나눔 (MAX_BATCH_SEARCHES개까지) */
+int search_batch_entries(Arena *arena, const char *body, char **entries) {
+    int count = parse_batch_request(arena, body ? body : "", entries, MAX_BATCH_SEARCHES);
+    if (count > MAX_BATCH_SEARCHES) {
+        log_write(LOG_LEVEL_WARN, "[Batch] %d searches in one request, answering the first %d",
+                  count, MAX_BATCH_SEARCHES);
+        count = MAX_BATCH_SEARCHES;
+    }
+    log_write(LOG_LEVEL_INFO, "[Batch] %d searches", count);
+    return count;
+}
+
+int search_batch_took_ms(const struct timespec *start) {
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    return (end.tv_sec - start->tv_sec) * 1000 + (end.tv_nsec - start->tv_nsec) / 1000000;
+}
+
+/* ---- GET /metrics (Prometheus 텍스트 형식) ---- */
+
+void metrics_render_counter(ByteBuffer *out, const char *name, const char *help, uint64_t *value) {
+    buffer_appendf(out, "# HELP %s %s\n# TYPE %s counter\n%s %llu\n", name, help, name, name,
+                   (unsigned long long)__atomic_load_n(value, __ATOMIC_RELAXED));
+}
+
+void metrics_render_gauge(ByteBuffer *out, const char *name, const char *help, double value) {
+    buffer_appendf(out, "# HELP %s %s\n# TYPE %s gauge\n%s %g\n", name, help, name, name, value);
+}
+
+void metrics_render(ByteBuffer *out) {
+    static const char *stage_names[STAGE_COUNT] = {
+        "request_parse", "normalize", "template_render", "upstream_connect", "upstream_send",
+        "upstream_first_byte", "upstream_read", "result_parse", "json_build", "socket_write",
+        "search_total", "admission_wait"
+    };
+    static const char *route_names[ROUTE_COUNT] = {
+        "search", "batch", "root", "metrics", "not_found", "too_large"
+    };
+    static const char *error_names[UPSTREAM_ERR_COUNT] = {
+        "resolve", "connect", "send", "recv", "closed", "protocol", "status", "truncated", "timeout"
+    };
+
+    buffer_reset(out);
+
+    /* 단계별 지연 */
+    buffer_appendf(out, "# HELP lkb_stage_duration_seconds Time spent in each request stage\n"
+                        "# TYPE lkb_stage_duration_seconds histogram\n");
+    for (int stage = 0; stage < STAGE_COUNT; stage++) {
+        LatencyHistogram *h = &g_metrics.stages[stage];
+        uint64_t cumulative = 0;
+        for (int b = 0; b <= METRICS_BUCKET_COUNT; b++) {
+            cumulative += __atomic_load_n(&h->buckets[b], __ATOMIC_RELAXED);
+            if (b < METRICS_BUCKET_COUNT) {
+                buffer_appendf(out, "lkb_stage_duration_seconds_bucket{stage=\"%s\",le=\"%g\"} %llu\n",
+                               stage_names[stage], METRICS_BUCKET_BOUNDS_US[b] / 1e6,
+                               (unsigned long long)cumulative);
+            } else {
+                buffer_appendf(out, "lkb_stage_duration_seconds_bucket{stage=\"%s\",le=\"+Inf\"} %llu\n",
+                               stage_names[stage], (unsigned long long)cumulative);
+            }
+        }
+        buffer_appendf(out, "lkb_stage_duration_seconds_sum{stage=\"%s\"} %.6f\n"
+                            "lkb_stage_duration_seconds_count{stage=\"%s\"} %llu\n",
+                       stage_names[stage], __atomic_load_n(&h->sum_us, __ATOMIC_RELAXED) / 1e6,
+                       stage_names[stage], (unsigned long long)__atomic_load_n(&h->count, __ATOMIC_RELAXED));
+    }
+
+    /* 요청 수 */
+    buffer_appendf(out, "# HELP lkb_requests_total Requests handled by route\n"
+                        "# TYPE lkb_requests_total counter\n");
+    for (int route = 0; route < ROUTE_COUNT; route++) {
+        buffer_appendf(out, "lkb_requests_total{route=\"%s\"} %llu\n", route_names[route],
+                       (unsigned long long)__atomic_load_n(&g_metrics.requests[route], __ATOMIC_RELAXED));
+    }
+
+    /* 업스트림 오류 */
+    buffer_appendf(out, "# HELP lkb_upstream_errors_total Manticore request failures by class\n"
+                        "# TYPE lkb_upstream_errors_total counter\n");
+    for (int err = 0; err < UPSTREAM_ERR_COUNT; err++) {
+        buffer_appendf(out, "lkb_upstream_errors_total{class=\"%s\"} %llu\n", error_names[err],
+                       (unsigned long long)__atomic_load_n(&g_metrics.upstream_errors[err], __ATOMIC_RELAXED));
+    }
+    metrics_render_counter(out, "lkb_search_streamed_total",
+                           "Searches whose results were sent chunked while Manticore was still replying",
+                           &g_metrics.search_streamed);
+    metrics_render_counter(out, "lkb_search_coalesced_total",
+                           "Searches that waited for an identical in-flight search instead of calling Manticore",
+                           &g_metrics.search_coalesced);
+    metrics_render_counter(out, "lkb_search_coalesce_timeouts_total",
+                           "Coalesced searches that stopped waiting after engine.timeout_ms and called Manticore",
+                           &g_metrics.search_coalesce_timeouts);
+    metrics_render_counter(out, "lkb_log_dropped_total", "Log lines dropped because the ring buffer was full",
+                           &g_logger.dropped);
+    if (g_config.capture_file[0]) {
+        metrics_render_counter(out, "lkb_capture_records_total", "Search requests written to log.capture_file",
+                               &g_capture.records);
+        metrics_render_counter(out, "lkb_capture_dropped_total",
+                               "Sampled search requests not captured (buffer full or write failed)",
+                               &g_capture.dropped);
+    }
+    metrics_render_counter(out, "lkb_upstream_retries_total",
+                           "Stale pooled connections retried on a fresh connection", &g_metrics.upstream_retries);
+    metrics_render_counter(out, "lkb_upstream_early_stop_total",
+                           "Manticore replies not read to the end because enough hits were parsed",
+                           &g_metrics.upstream_early_stop);
+
+    if (g_config.processes > 1) {
+        metrics_render_gauge(out, "lkb_process_index",
+                             "Worker process that answered this scrape (each process has its own counters)",
+                             g_process_index);
+    }
+
+    /* 설정 다시 읽기 */
+    unsigned phase;
+    const ConfigSnapshot *snapshot = config_acquire(&g_configs, &phase);
+    metrics_render_gauge(out, "lkb_config_generation", "Config snapshot in use (1 at startup, +1 per reload)",
+                         snapshot->generation);
+    metrics_render_counter(out, "lkb_config_reloads_total", "Config snapshots published after SIGHUP or a file change",
+                           &g_metrics.config_reloads);
+    metrics_render_counter(out, "lkb_config_reload_failures_total",
+                           "Reloads that could not read config.yaml and kept the current settings",
+                           &g_metrics.config_reload_failures);
+
+    /* replica별 차단기 / 부하 */
+    buffer_appendf(out, "# HELP lkb_breaker_state Circuit breaker state per backend (0 closed, 1 open, 2 half-open)\n"
+                        "# TYPE lkb_breaker_state gauge\n");
+    for (int i = 0; i < snapshot->upstream_count; i++) {
+        buffer_appendf(out, "lkb_breaker_state{backend=\"%s\"} %d\n", snapshot->upstreams[i]->name,
+                       (int)circuit_breaker_state(&snapshot->upstreams[i]->breaker));
+    }
+    buffer_appendf(out, "# HELP lkb_backend_outstanding Manticore calls in flight per backend\n"
+                        "# TYPE lkb_backend_outstanding gauge\n");
+    for (int i = 0; i < snapshot->upstream_count; i++) {
+        buffer_appendf(out, "lkb_backend_outstanding{backend=\"%s\"} %d\n", snapshot->upstreams[i]->name,
+                       __atomic_load_n(&snapshot->upstreams[i]->outstanding, __ATOMIC_RELAXED));
+    }
+    metrics_render_counter(out, "lkb_breaker_trips_total", "Times the breaker opened on a high Manticore error rate",
+                           &g_metrics.breaker_trips);
+    metrics_render_counter(out, "lkb_breaker_rejected_total",
+                           "Searches answered without calling Manticore because the breaker was open",
+                           &g_metrics.breaker_rejected);
+    metrics_render_counter(out, "lkb_breaker_probes_total", "Background recovery probes sent while open",
+                           &g_metrics.breaker_probes);
+    metrics_render_counter(out, "lkb_search_stale_total",
+                           "Searches answered from an expired cache entry because Manticore was unavailable",
+                           &g_metrics.search_stale);
+    metrics_render_counter(out, "lkb_health_checks_total", "Background health checks sent to closed backends",
+                           &g_metrics.health_checks);
+    metrics_render_counter(out, "lkb_health_failures_total",
+                           "Health checks that failed and took a backend out of rotation", &g_metrics.health_failures);
+
+    /* hedge / 장애 전환 */
+    metrics_render_counter(out, "lkb_upstream_hedged_total",
+                           "Calls also sent to a second backend after the first ran past the p95 latency",
+                           &g_metrics.upstream_hedged);
+    metrics_render_counter(out, "lkb_upstream_hedge_wins_total",
+                           "Hedged calls where the second backend answered first", &g_metrics.upstream_hedge_wins);
+    metrics_render_counter(out, "lkb_upstream_failover_total",
+                           "Calls retried on another backend after the first failed", &g_metrics.upstream_failover);
+    metrics_render_gauge(out, "lkb_upstream_latency_p95_seconds",
+                         "p95 of recent successful Manticore calls (hedge delay before engine.hedge_min_ms)",
+                         __atomic_load_n(&g_upstream_latency.p95_us, __ATOMIC_RELAXED) / 1e6);
+
+    /* 동시 검색 제한 */
+    if (g_config.admission_enabled) {
+        double limit;
+        int in_flight, waiting;
+        admission_snapshot(&g_admission, &limit, &in_flight, &waiting);
+        metrics_render_gauge(out, "lkb_admission_limit", "Current adaptive limit on concurrent Manticore searches",
+                             limit);
+        metrics_render_gauge(out, "lkb_admission_in_flight", "Searches holding an admission slot", in_flight);
+        metrics_render_gauge(out, "lkb_admission_waiting", "Searches waiting for an admission slot", waiting);
+        metrics_render_counter(out, "lkb_admission_waited_total", "Searches that had to wait for an admission slot",
+                               &g_metrics.admission_waited);
+        metrics_render_counter(out, "lkb_admission_shed_total",
+                               "Searches refused (503 or stale cache) after admission.queue_timeout_ms without a slot",
+                               &g_metrics.admission_shed);
+    }
+
+    /* 제목 색인 */
+    if (g_title_index.data) {
+        metrics_render_counter(out, "lkb_title_index_hits_total",
+                               "Searches answered from the title index without Manticore",
+                               &g_metrics.title_index_hits);
+        metrics_render_counter(out, "lkb_title_index_added_total",
+                               "Title index results added after Manticore results (prefix matches)",
+                               &g_metrics.title_index_added);
+        metrics_render_gauge(out, "lkb_title_index_entries", "Titles in the loaded title index",
+                             g_title_index.count);
+    }
+
+    /* 연결 풀 (모든 replica 합계) */
+    int pool_idle = 0;
+    for (int i = 0; i < snapshot->upstream_count; i++) {
+        pthread_mutex_lock(&snapshot->upstreams[i]->lock);
+        pool_idle += snapshot->upstreams[i]->pool.count;
+        pthread_mutex_unlock(&snapshot->upstreams[i]->lock);
+    }
+    config_release(&g_configs, phase);
+    metrics_render_counter(out, "lkb_upstream_pool_reused_total", "Requests sent on a pooled connection",
+                           &g_metrics.pool_reused);
+    metrics_render_counter(out, "lkb_upstream_pool_new_total", "New connections opened to Manticore",
+                           &g_metrics.pool_new);
+    metrics_render_counter(out, "lkb_upstream_pool_stale_total", "Pooled connections discarded as dead or idle too long",
+                           &g_metrics.pool_stale);
+    metrics_render_counter(out, "lkb_upstream_pool_full_total", "Connections closed because the pool was full",
+                           &g_metrics.pool_full);
+    metrics_render_gauge(out, "lkb_upstream_pool_idle", "Idle keep-alive connections in the pool", pool_idle);
+    metrics_render_gauge(out, "lkb_upstream_pool_size", "Configured pool capacity per backend (engine.pool_size)",
+                         g_config.pool_size);
+
+    /* 결과 캐시 */
+    if (g_config.cache_enabled && g_result_cache.buckets) {
+        pthread_mutex_lock(&g_result_cache.lock);
+        uint64_t hits = g_result_cache.hits;
+        uint64_t misses = g_result_cache.misses;
+        uint64_t evictions = g_result_cache.evictions;
+        uint64_t expirations = g_result_cache.expirations;
+        uint64_t refreshes = g_result_cache.refreshes;
+        uint64_t refresh_failures = g_result_cache.refresh_failures;
+        uint64_t negative = g_result_cache.negative;
+        size_t entries = g_result_cache.entries;
+        size_t bytes = g_result_cache.bytes;
+        pthread_mutex_unlock(&g_result_cache.lock);
+
+        metrics_render_counter(out, "lkb_cache_hits_total", "Result cache hits", &hits);
+        metrics_render_counter(out, "lkb_cache_misses_total", "Result cache misses", &misses);
+        metrics_render_counter(out, "lkb_cache_evictions_total", "Entries evicted to stay under cache.max_bytes",
+                               &evictions);
+        metrics_render_counter(out, "lkb_cache_expirations_total", "Entries dropped after cache.ttl + cache.stale_ttl",
+                               &expirations);
+        metrics_render_counter(out, "lkb_cache_negative_total",
+                               "Zero-hit results cached for cache.negative_ttl", &negative);
+        if (g_config.cache_soft_ttl > 0) {
+            metrics_render_counter(out, "lkb_cache_refreshes_total",
+                                   "Hits past cache.soft_ttl that started a background refresh", &refreshes);
+            metrics_render_counter(out, "lkb_cache_refresh_failures_total",
+                                   "Background refreshes that did not replace the entry (queue full, no slot, failed)",
+                                   &refresh_failures);
+        }
+        metrics_render_gauge(out, "lkb_cache_hit_ratio", "Cache hits / lookups since start",
+                             hits + misses ? (double)hits / (hits + misses) : 0);
+        metrics_render_gauge(out, "lkb_cache_entries", "Entries in the result cache", entries);
+        metrics_render_gauge(out, "lkb_cache_bytes", "Bytes held by the result cache", bytes);
+    }
+
+    /* 링크 캐시 */
+    if (g_link_cache.enabled) {
+        uint64_t hits, misses, evictions;
+        size_t entries, bytes;
+        link_cache_stats(&g_link_cache, &hits, &misses, &evictions, &entries, &bytes);
+        metrics_render_counter(out, "lkb_link_cache_hits_total", "Result links taken from the link cache", &hits);
+        metrics_render_counter(out, "lkb_link_cache_misses_total", "Result links URL-encoded and added to the link cache",
+                               &misses);
+        metrics_render_counter(out, "lkb_link_cache_evictions_total",
+                               "Links evicted to stay under cache.link_max_bytes", &evictions);
+        metrics_render_gauge(out, "lkb_link_cache_entries", "Titles in the link cache", entries);
+        metrics_render_gauge(out, "lkb_link_cache_bytes", "Bytes held by the link cache", bytes);
+    }
+
+    /* 워커 큐 (threads 모드) */
+    if (strcmp(g_config.io_mode, "threads") == 0) {
+        metrics_render_gauge(out, "lkb_work_queue_depth", "Accepted connections waiting for a worker",
+                             work_queue_pending(&g_work_queue));
+        metrics_render_gauge(out, "lkb_work_queue_capacity", "Configured queue size (lkb.queue_size)",
+                             g_config.queue_size);
+    }
+
+    /* io_uring: 요청당 시스템 호출 수 = enter / 요청 수 */
+    if (strcmp(g_config.io_mode, "io_uring") == 0) {
+        metrics_render_counter(out, "lkb_io_uring_enters_total",
+                               "io_uring_enter system calls made by the event loop (submit and wait)",
+                               &g_metrics.ring_enters);
+        metrics_render_counter(out, "lkb_io_uring_completions_total",
+                               "Completions (CQEs) handled by the event loop", &g_metrics.ring_completions);
+    }
+}
+
+/* lkb.stream_results: 결과가 많은 단일 쿼리 검색은 파싱되는 대로 보냄
+ * (fan-out은 병합 순서가 끝나야 정해지므로 제외, 클라이언트가 HTTP/1.1일 때만) */
+bool search_job_can_stream(const SearchJob *job, bool chunked_ok) {
+    return chunked_ok && job->config->stream_results && job->branch_count == 1 &&
+           job->req.count >= job->config->stream_min_count;
+}
+
+void handle_search_request(RequestScratch *scratch, int client_fd, const char *body, bool keep_alive,
+                           bool chunked_ok) {
+    SearchJob job;
+    ChunkedResponse chunked;
+
+    bool upstream = search_job_begin(&job, scratch, body);
+    /* 같은 검색을 먼저 시작한 요청이 있으면 그 결과를 기다림 */
+    if (!upstream && search_job_is_follower(&job)) {
+        upstream = !search_job_await_flight(&job);
+    }
+    /* 슬롯이 나지 않으면 ttl이 지난 캐시 결과로, 그것도 없으면 503 */
+    if (upstream && !search_job_admit(&job, scratch->received_us, true)) {
+        upstream = false;
+        if (!search_job_shed(&job, scratch->received_us)) {
+            send_overloaded_response(client_fd, keep_alive);
+            search_job_free(&job);
+            return;
+        }
+    }
+    if (upstream) {
+        if (search_job_can_stream(&job, chunked_ok)) {
+            bool keep_body = (g_config.cache_enabled && job.cache_key_len > 0) || job.flight_leader;
+            chunked_response_init(&chunked, client_fd, &scratch->body, keep_alive, keep_body);
+            job.chunked = &chunked;
+        }
+        /* Manticore Search 호출 */
+        search_job_run(&job);
+    }
+
+    const ByteBuffer *json_response = search_job_finish(&job);
+    if (search_job_streamed(&job)) {
+        chunked_response_finish(&chunked);
+    } else {
+        send_http_response(client_fd, 200, "OK", "application/json", json_response->data,
+                           json_response->len, keep_alive);
+    }
+
+    search_job_free(&job);
+}
+
+/* threads 모드 배치: 항목마다 슬롯을 받고 (모두 요청 도착 시각 기준으로 기다림) 받은 항목만
+ * 남겨 개수 반환. 받지 못한 항목은 ttl이 지난 캐시 결과나 빈 결과로 응답 */
+int search_jobs_admit(SearchJob **jobs, int count, uint64_t received_us) {
+    int admitted = 0;
+    for (int k = 0; k < count; k++) {
+        if (search_job_admit(jobs[k], received_us, true)) {
+            jobs[admitted++] = jobs[k];
+        } else {
+            search_job_shed(jobs[k], received_us);
+        }
+    }
+    return admitted;
+}
+
+/* 항목마다 자기 scratch로 검색 작업을 만들어 Manticore 호출을 한 poll()로 함께 진행.
+ * 선두/캐시 적중 항목의 응답을 먼저 만들어야 같은 배치 안에서 그 결과를 기다리는 항목이
+ * 결과를 받으므로 합치기 대기 항목은 그 다음에 */
+void handle_batch_request(RequestScratch *scratch, int client_fd, const char *body, bool keep_alive) {
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    char *entries[MAX_BATCH_SEARCHES];
+    int count = search_batch_entries(&scratch->arena, body, entries);
+    RequestScratch *entry_scratch = request_scratch_batch(scratch, count);
+    SearchJob *jobs = arena_alloc(&scratch->arena, sizeof(SearchJob) * (count > 0 ? count : 1));
+    SearchJob *run[MAX_BATCH_SEARCHES];
+    bool follower[MAX_BATCH_SEARCHES];
+    const ByteBuffer *responses[MAX_BATCH_SEARCHES];
+    int run_count = 0;
+
+    for (int k = 0; k < count; k++) {
+        if (search_job_begin(&jobs[k], &entry_scratch[k], entries[k])) run[run_count++] = &jobs[k];
+        follower[k] = search_job_is_follower(&jobs[k]);
+    }
+    run_count = search_jobs_admit(run, run_count, scratch->received_us);
+    search_jobs_run(run, run_count);
+    for (int k = 0; k < count; k++) {
+        if (!follower[k]) responses[k] = search_job_finish(&jobs[k]);
+    }
+
+    run_count = 0;
+    for (int k = 0; k < count; k++) {
+        if (follower[k] && !search_job_await_flight(&jobs[k])) run[run_count++] = &jobs[k];
+    }
+    run_count = search_jobs_admit(run, run_count, scratch->received_us);
+    search_jobs_run(run, run_count);
+    for (int k = 0; k < count; k++) {
+        if (follower[k]) responses[k] = search_job_finish(&jobs[k]);
+    }
+
+    buffer_reset(&scratch->body);
+    create_json_batch_response(&scratch->body, responses, count, search_batch_took_ms(&start));
+    send_http_response(client_fd, 200, "OK", "application/json", scratch->body.data,
+                       scratch->body.len, keep_alive);
+
+    for (int k = 0; k < count; k++) {
+        search_job_free(&jobs[k]);
+    }
+}
+
+void handle_root_request(int client_fd, bool keep_alive) {
+    send_http_response(client_fd, 200, "OK", "application/json", ROOT_STATUS_BODY,
+                       sizeof(ROOT_STATUS_BODY) - 1, keep_alive);
+}
+
+void handle_metrics_request(RequestScratch *scratch, int client_fd, bool keep_alive) {
+    metrics_render(&scratch->body);
+    send_http_response(client_fd, 200, "OK", METRICS_CONTENT_TYPE, scratch->body.data,
+                       scratch->body.len, keep_alive);
+}
+
+void handle_not_found(int client_fd, bool keep_alive) {
+    send_http_response(client_fd, 404, "Not Found", "application/json", NOT_FOUND_BODY,
+                       sizeof(NOT_FOUND_BODY) - 1, keep_alive);
+}
+
+/* 요청 하나 처리 (request는 NUL 종료된 완성 요청) */
+void handle_request(RequestScratch *scratch, int client_fd, char *request, size_t request_len,
+                    bool keep_alive) {
+#ifdef DEBUG
+    /* 전체 HTTP 요청 로그 (디버깅용) */
+    write_raw_request_log(request, request_len);
+#endif
+
+    char method[16], path[256];
+    int parsed = sscanf(request, "%15s %255s", method, path);
+    if (parsed != 2) {
+        log_write(LOG_LEVEL_WARN, "[HTTP] Invalid request format");
+        metrics_count(&g_metrics.requests[ROUTE_NOT_FOUND]);
+        handle_not_found(client_fd, keep_alive);
+        return;
+    }
+
+    if (strcmp(method, "POST") == 0 && strcmp(path, "/search") == 0) {
+        metrics_count(&g_metrics.requests[ROUTE_SEARCH]);
+        char *body = strstr(request, "\r\n\r\n");
+        capture_request(&g_capture, CAPTURE_SEARCH, body + 4, request + request_len - (body + 4));
+        handle_search_request(scratch, client_fd, body + 4, keep_alive,
+                              http_request_is_http11(request, request_len));
+    } else if (strcmp(method, "POST") == 0 && strcmp(path, "/search/batch") == 0) {
+        metrics_count(&g_metrics.requests[ROUTE_BATCH]);
+        char *body = strstr(request, "\r\n\r\n");
+        capture_request(&g_capture, CAPTURE_BATCH, body + 4, request + request_len - (body + 4));
+        handle_batch_request(scratch, client_fd, body + 4, keep_alive);
+    } else if (strcmp(method, "GET") == 0 && strcmp(path, "/") == 0) {
+        metrics_count(&g_metrics.requests[ROUTE_ROOT]);
+        handle_root_request(client_fd, keep_alive);
+    } else if (strcmp(method, "GET") == 0 && strcmp(path, "/metrics") == 0) {
+        metrics_count(&g_metrics.requests[ROUTE_METRICS]);
+        handle_metrics_request(scratch, client_fd, keep_alive);
+    } else {
+        metrics_count(&g_metrics.requests[ROUTE_NOT_FOUND]);
+        handle_not_found(client_fd, keep_alive);
+    }
+}
+
+/* 연결 하나를 keep-alive로 처리: 완성된 요청을 순서대로 (파이프라이닝 포함).
+ * 버퍼는 워커의 scratch를 연결마다 재사용. 첫 요청은 워커를 기다린 시간도 포함하도록
+ * accept 시각(queued_us)에 도착한 것으로, 다음 요청부터는 첫 바이트를 읽은 시각 */
+void handle_client(RequestScratch *scratch, int client_fd, uint64_t queued_us) {
+    ByteBuffer *in = &scratch->in;
+    int served = 0;
+    scratch->received_us = queued_us;
+
+    /* 다음 요청을 기다리는 시간 제한 */
+    if (g_config.keepalive_timeout > 0) {
+        struct timeval tv = { .tv_sec = g_config.keepalive_timeout, .tv_usec = 0 };
+        setsockopt(client_fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    }
+
+    while (g_running) {
+        long request_len = in->len ? http_request_length(in->data, in->len) : 0;
+
+        if (request_len == 0) {
+            /* 헤더 끝 + Content-Length만큼 올 때까지 읽기 */
+            buffer_reserve(in, 4096);
+            ssize_t bytes_read = read(client_fd, in->data + in->len, in->cap - in->len - 1);
+            if (bytes_read < 0 && errno == EINTR) continue;
+            if (bytes_read <= 0) break;  /* EOF, 오류 또는 유휴 시간 초과 */
+            if (in->len == 0 && served > 0) scratch->received_us = metrics_now_us();
+            in->len += bytes_read;
+            in->data[in->len] = '\0';
+            continue;
+        }
+
+        if (request_len < 0) {
+            metrics_count(&g_metrics.requests[ROUTE_TOO_LARGE]);
+            send_http_response(client_fd, 413, "Payload Too Large", "application/json",
+                               TOO_LARGE_BODY, sizeof(TOO_LARGE_BODY) - 1, false);
+            break;
+        }
+
+        served++;
+        bool keep_alive = http_request_keep_alive(in->data, request_len) &&
+                          served < g_config.keepalive_max_requests &&
+                          !work_queue_starved(&g_work_queue);
+
+        /* 파이프라인된 다음 요청과 분리하기 위해 잠시 NUL 종료 */
+        char saved = in->data[request_len];
+        in->data[request_len] = '\0';
+        handle_request(scratch, client_fd, in->data, request_len, keep_alive);
+        request_scratch_reset(scratch);
+        in->data[request_len] = saved;
+
+        buffer_consume(in, request_len);
+        scratch->received_us = metrics_now_us();  /* 파이프라인된 다음 요청 (없으면 읽을 때 다시) */
+        if (!keep_alive) break;
+    }
+
+    buffer_trim(in, SCRATCH_RETAIN_SIZE);
+}
+
+/* ============================
+ * 워커 스레드 풀
+ * ============================ */
+
+void work_queue_init(WorkQueue *q, int capacity) {
+    q->fds = safe_malloc(sizeof(int) * capacity);
+    q->queued_us = safe_malloc(sizeof(uint64_t) * capacity);
+    q->capacity = capacity;
+    q->head = 0;
+    q->tail = 0;
+    q->count = 0;
+    q->idle = 0;
+    q->closed = false;
+    pthread_mutex_init(&q->lock, NULL);
+    pthread_cond_init(&q->not_empty, NULL);
+    pthread_cond_init(&q->not_full, NULL);
+}
+
+void work_queue_destroy(WorkQueue *q) {
+    /* 처리되지 못한 연결 정리 */
+    while (q->count > 0) {
+        close(q->fds[q->head]);
+        q->head = (q->head + 1) % q->capacity;
+        q->count--;
+    }
+    free(q->fds);
+    free(q->queued_us);
+    q->fds = NULL;
+    q->queued_us = NULL;
+    pthread_mutex_destroy(&q->lock);
+    pthread_cond_destroy(&q->not_empty);
+    pthread_cond_destroy(&q->not_full);
+}
+
+/* 큐가 가득 차면 빈 자리가 생길 때까지 대기 (커널 backlog로 역압) */
+bool work_queue_push(WorkQueue *q, int fd) {
+    pthread_mutex_lock(&q->lock);
+    while (q->count == q->capacity && !q->closed) {
+        pthread_cond_wait(&q->not_full, &q->lock);
+    }
+    if (q->closed) {
+        pthread_mutex_unlock(&q->lock);
+        return false;
     }
+    q->fds[q->tail] = fd;
+    q->queued_us[q->tail] = metrics_now_us();
+    q->tail = (q->tail + 1) % q->capacity;
+    q->count++;
+    pthread_cond_signal(&q->not_empty);
+    pthread_mutex_unlock(&q->lock);
+    return true;
+}
 
-    fclose(f);
-
-    /* engine_url에서 host, port, path 파싱 */
-    parse_url(config->engine_url, config->manticore_host, sizeof(config->manticore_host),
-              &config->manticore_port, config->manticore_path, sizeof(config->manticore_path));
+/* 큐가 닫히고 비어 있으면 -1 반환, queued_us에 넣은 시각 */
+int work_queue_pop(WorkQueue *q, uint64_t *queued_us) {
+    pthread_mutex_lock(&q->lock);
+    q->idle++;
+    while (q->count == 0 && !q->closed) {
+        pthread_cond_wait(&q->not_empty, &q->lock);
+    }
+    q->idle--;
+    if (q->count == 0) {
+        pthread_mutex_unlock(&q->lock);
+        return -1;
+    }
+    int fd = q->fds[q->head];
+    *queued_us = q->queued_us[q->head];
+    q->head = (q->head + 1) % q->capacity;
+    q->count--;
+    pthread_cond_signal(&q->not_full);
+    pthread_mutex_unlock(&q->lock);
+    return fd;
+}
 
-    return true;
+void work_queue_close(WorkQueue *q) {
+    pthread_mutex_lock(&q->lock);
+    q->closed = true;
+    pthread_cond_broadcast(&q->not_empty);
+    pthread_cond_broadcast(&q->not_full);
+    pthread_mutex_unlock(&q->lock);
 }
 
-/* ============================
- * 문자열 처리 함수 (고급)
- * ============================ */
+void* worker_main(void *arg) {
+    (void)arg;
+    RequestScratch scratch;
+    request_scratch_init(&scratch);
 
-char* remove_think_tags(const char *input) {
-    char *result = safe_strdup(input);
-    char *src = result;
-    char *dst = result;
+    /* 시그널은 accept 스레드(main)에서만 처리 */
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGINT);
+    sigaddset(&mask, SIGTERM);
+    sigaddset(&mask, SIGHUP);
+    pthread_sigmask(SIG_BLOCK, &mask, NULL);
 
-    while (*src) {
-        if (strncmp(src, "<think>", 7) == 0) {
-            char *end = strstr(src, "</think>");
-            if (end) {
-                src = end + 8;
-                continue;
-            }
-        }
-        *dst++ = *src++;
+    int client_fd;
+    uint64_t queued_us;
+    while ((client_fd = work_queue_pop(&g_work_queue, &queued_us)) >= 0) {
+        handle_client(&scratch, client_fd, queued_us);
+        close(client_fd);
     }
-    *dst = '\0';
 
-    return result;
+    request_scratch_free(&scratch);
+    return NULL;
 }
 
 /* ============================
- * JSON 파싱 함수
+ * io_uring (lkb.io_mode: "io_uring")
  * ============================ */
 
-/* UTF-8 문자 경계를 찾는 함수 */
-size_t utf8_safe_truncate(const char *str, size_t max_bytes) {
-    size_t pos = 0;
-
-    while (pos < max_bytes && str[pos] != '\0') {
-        unsigned char c = (unsigned char)str[pos];
-
-        /* ASCII 문자 (0xxxxxxx) */
-        if (c < 0x80) {
-            pos++;
-        }
-        /* 2바이트 UTF-8 (110xxxxx) */
-        else if ((c & 0xE0) == 0xC0) {
-            if (pos + 2 <= max_bytes) pos += 2;
-            else break;
-        }
-        /* 3바이트 UTF-8 (1110xxxx) */
-        else if ((c & 0xF0) == 0xE0) {
-            if (pos + 3 <= max_bytes) pos += 3;
-            else break;
-        }
-        /* 4바이트 UTF-8 (11110xxx) */
-        else if ((c & 0xF8) == 0xF0) {
-            if (pos + 4 <= max_bytes) pos += 4;
-            else break;
-        }
-        /* 잘못된 UTF-8 시퀀스, 다음 문자로 */
-        else {
-            pos++;
-        }
-    }
-
-    return pos;
+#ifdef LKB_IO_URING
+
+/* user_data 아래 2비트: 같은 EventTag의 어떤 요청인지 (태그는 포인터를 담아 4바이트 이상 정렬) */
+#define RING_OP_IN 0       /* accept / recv */
+#define RING_OP_OUT 1      /* send */
+#define RING_OP_CONNECT 2  /* 업스트림 connect 완료 대기 (POLLOUT) */
+#define RING_OP_MASK 3
+#define RING_BUFFER_GROUP 0
+
+/* 이벤트 루프 스레드 하나만 쓰는 링. SQ/CQ는 커널과 공유하는 mmap 영역이고, recv는 등록 버퍼
+ * 링(provided buffers)에서 커널이 버퍼를 골라 쓰므로 걸려 있는 recv가 연결의 메모리를 잡지 않음 */
+typedef struct IoRing {
+    int fd;
+    unsigned sq_entries;
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned sq_mask;
+    unsigned sq_pending;   /* 채웠지만 아직 io_uring_enter로 넘기지 않은 SQE */
+    struct io_uring_sqe *sqes;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned cq_mask;
+    struct io_uring_cqe *cqes;
+    void *ring_mem;
+    size_t ring_size;
+    size_t sqes_size;
+    struct io_uring_buf_ring *buf_ring;
+    char *buffers;         /* RING_BUFFER_COUNT * RING_BUFFER_SIZE */
+    unsigned short buf_tail;
+    bool recv_multishot;   /* false면 (multishot recv를 거부하는 커널) recv를 한 번씩 */
+} IoRing;
+
+int ring_enter(IoRing *ring, unsigned to_submit, unsigned min_complete, unsigned flags, void *arg, size_t arg_size) {
+    metrics_count(&g_metrics.ring_enters);
+    int ret = (int)syscall(__NR_io_uring_enter, ring->fd, to_submit, min_complete, flags, arg, arg_size);
+    return ret < 0 ? -errno : ret;
 }
 
-/* 공통 escape 처리 함수 */
-size_t unescape_json_string(const char *src, const char *end, char *dst, size_t dst_size) {
-    size_t written = 0;
-    while (src < end && written < dst_size - 1) {
-        if (*src == '\\' && src + 1 < end) {
-            src++;
-            switch (*src) {
-                case 'n':  dst[written++] = '\n'; break;
-                case 'r':  dst[written++] = '\r'; break;
-                case 't':  dst[written++] = '\t'; break;
-                case '\\': dst[written++] = '\\'; break;
-                case '"':  dst[written++] = '"'; break;
-                default:   dst[written++] = *src; break;
-            }
-            src++;
-        } else {
-            dst[written++] = *src++;
+/* 채워 둔 SQE를 커널에 넘김 (기다리지 않음) */
+void ring_submit(IoRing *ring) {
+    while (ring->sq_pending > 0) {
+        int ret = ring_enter(ring, ring->sq_pending, 0, 0, NULL, 0);
+        if (ret == -EINTR) continue;
+        if (ret < 0) {
+            log_write(LOG_LEVEL_ERROR, "[Event] io_uring submit failed: %s", strerror(-ret));
+            return;
         }
+        ring->sq_pending -= (unsigned)ret < ring->sq_pending ? (unsigned)ret : ring->sq_pending;
+        if (ret == 0) return;
     }
-    dst[written] = '\0';
-    return written;
 }
 
-/* JSON에서 quote로 감싸진 문자열 찾기 (공통 함수) */
-const char* find_quoted_string(const char *start, const char **out_start, const char **out_end) {
-    const char *quote_start = strchr(start, '"');
-    if (!quote_start) return NULL;
-    quote_start++;
-
-    const char *quote_end = quote_start;
-    while (*quote_end && *quote_end != '"') {
-        if (*quote_end == '\\') quote_end++;
-        quote_end++;
+/* 채워 둔 SQE를 넘기고 완료가 하나 이상 오거나 timeout_ms가 지날 때까지 대기 */
+int ring_wait(IoRing *ring, int timeout_ms) {
+    struct __kernel_timespec ts = { .tv_sec = timeout_ms / 1000, .tv_nsec = (long long)(timeout_ms % 1000) * 1000000 };
+    struct io_uring_getevents_arg arg = { .sigmask = 0, .sigmask_sz = _NSIG / 8, .ts = (uint64_t)(uintptr_t)&ts };
+    int ret = ring_enter(ring, ring->sq_pending, 1, IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG, &arg, sizeof(arg));
+    if (ret >= 0) {
+        ring->sq_pending -= (unsigned)ret < ring->sq_pending ? (unsigned)ret : ring->sq_pending;
+        return 0;
     }
+    /* EBUSY: CQ가 넘쳐 커널에 쌓인 완료가 있음 - 꺼내고 나서 다시 */
+    return (ret == -ETIME || ret == -EINTR || ret == -EBUSY) ? 0 : ret;
+}
 
-    if (!*quote_end) return NULL;
+/* 연결된 요청(IOSQE_IO_LINK)이 두 번의 submit으로 갈라지지 않도록 count개 자리를 먼저 확보 */
+void ring_reserve(IoRing *ring, unsigned count) {
+    unsigned head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+    if (*ring->sq_tail - head + count > ring->sq_entries) ring_submit(ring);
+}
 
-    *out_start = quote_start;
-    *out_end = quote_end;
-    return quote_start;
+/* 빈 SQE 하나 (ring_reserve로 자리를 확보한 뒤) - 커널에는 다음 ring_submit / ring_wait에서 */
+struct io_uring_sqe* ring_get_sqe(IoRing *ring, uint8_t opcode, int fd, const void *addr, unsigned len,
+                                  uint64_t user_data) {
+    unsigned tail = *ring->sq_tail;
+    struct io_uring_sqe *sqe = &ring->sqes[tail & ring->sq_mask];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = opcode;
+    sqe->fd = fd;
+    sqe->addr = (uint64_t)(uintptr_t)addr;
+    sqe->len = len;
+    sqe->user_data = user_data;
+    __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    ring->sq_pending++;
+    return sqe;
 }
 
-char* extract_json_string_value(const char *json, const char *key) {
-    char search_pattern[128];
-    snprintf(search_pattern, sizeof(search_pattern), "\"%s\"", key);
+/* 다 읽은 등록 버퍼를 커널에 돌려줌 */
+void ring_buffer_recycle(IoRing *ring, unsigned short bid) {
+    struct io_uring_buf *buf = &ring->buf_ring->bufs[ring->buf_tail & (RING_BUFFER_COUNT - 1)];
+    buf->addr = (uint64_t)(uintptr_t)(ring->buffers + (size_t)bid * RING_BUFFER_SIZE);
+    buf->len = RING_BUFFER_SIZE;
+    buf->bid = bid;
+    ring->buf_tail++;
+    __atomic_store_n(&ring->buf_ring->tail, ring->buf_tail, __ATOMIC_RELEASE);
+}
 
-    const char *key_pos = strstr(json, search_pattern);
-    if (!key_pos) return NULL;
+/* 완료된 CQE를 max개까지 꺼냄 (처리 중에 새 SQE를 채워도 되도록 복사해 둠) */
+unsigned ring_reap(IoRing *ring, struct io_uring_cqe *out, unsigned max) {
+    unsigned head = *ring->cq_head;
+    unsigned tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+    unsigned n = 0;
+    while (head != tail && n < max) {
+        out[n++] = ring->cqes[head & ring->cq_mask];
+        head++;
+    }
+    __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+    if (n) __atomic_add_fetch(&g_metrics.ring_completions, n, __ATOMIC_RELAXED);
+    return n;
+}
 
-    const char *colon = strchr(key_pos, ':');
-    if (!colon) return NULL;
+void ring_destroy(IoRing *ring) {
+    if (ring->fd >= 0) close(ring->fd);
+    if (ring->sqes) munmap(ring->sqes, ring->sqes_size);
+    if (ring->ring_mem) munmap(ring->ring_mem, ring->ring_size);
+    if (ring->buf_ring) munmap(ring->buf_ring, sizeof(struct io_uring_buf) * RING_BUFFER_COUNT);
+    if (ring->buffers) munmap(ring->buffers, (size_t)RING_BUFFER_COUNT * RING_BUFFER_SIZE);
+    memset(ring, 0, sizeof(*ring));
+    ring->fd = -1;
+}
 
-    const char *quote_start, *quote_end;
-    if (!find_quoted_string(colon, &quote_start, &quote_end)) {
-        return NULL;
+/* 링 생성, SQ/CQ mmap, recv용 버퍼 링 등록. 커널이 지원하지 않으면 이유를 남기고 false (epoll로) */
+bool ring_init(IoRing *ring) {
+    memset(ring, 0, sizeof(*ring));
+    ring->fd = -1;
+    ring->recv_multishot = true;
+
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    params.flags = IORING_SETUP_CQSIZE | IORING_SETUP_CLAMP;
+    params.cq_entries = RING_ENTRIES * 4;
+#if defined(IORING_SETUP_SINGLE_ISSUER) && defined(IORING_SETUP_DEFER_TASKRUN)
+    /* 제출도 완료 처리도 루프 스레드에서만 - 커널 작업을 io_uring_enter 안에서 몰아서 */
+    params.flags |= IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_DEFER_TASKRUN;
+#endif
+    ring->fd = (int)syscall(__NR_io_uring_setup, RING_ENTRIES, &params);
+    if (ring->fd < 0 && errno == EINVAL && (params.flags & ~(IORING_SETUP_CQSIZE | IORING_SETUP_CLAMP))) {
+        memset(&params, 0, sizeof(params));
+        params.flags = IORING_SETUP_CQSIZE | IORING_SETUP_CLAMP;
+        params.cq_entries = RING_ENTRIES * 4;
+        ring->fd = (int)syscall(__NR_io_uring_setup, RING_ENTRIES, &params);
+    }
+    if (ring->fd < 0) {
+        log_write(LOG_LEVEL_WARN, "[Event] io_uring_setup failed: %s", strerror(errno));
+        return false;
+    }
+    unsigned needed = IORING_FEAT_SINGLE_MMAP | IORING_FEAT_NODROP | IORING_FEAT_EXT_ARG;
+    if ((params.features & needed) != needed) {
+        log_write(LOG_LEVEL_WARN, "[Event] io_uring: kernel is too old (features 0x%x)", params.features);
+        ring_destroy(ring);
+        return false;
     }
 
-    size_t len = quote_end - quote_start;
-    char *value = safe_malloc(len + 1);
-    unescape_json_string(quote_start, quote_end, value, len + 1);
+    size_t sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    size_t cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    ring->ring_size = sq_size > cq_size ? sq_size : cq_size;
+    ring->ring_mem = mmap(NULL, ring->ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                          ring->fd, IORING_OFF_SQ_RING);
+    ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                      ring->fd, IORING_OFF_SQES);
+    if (ring->ring_mem == MAP_FAILED || ring->sqes == MAP_FAILED) {
+        log_write(LOG_LEVEL_WARN, "[Event] io_uring mmap failed: %s", strerror(errno));
+        if (ring->ring_mem == MAP_FAILED) ring->ring_mem = NULL;
+        if (ring->sqes == MAP_FAILED) ring->sqes = NULL;
+        ring_destroy(ring);
+        return false;
+    }
 
-    return value;
+    char *base = ring->ring_mem;
+    ring->sq_entries = params.sq_entries;
+    ring->sq_head = (unsigned *)(base + params.sq_off.head);
+    ring->sq_tail = (unsigned *)(base + params.sq_off.tail);
+    ring->sq_mask = *(unsigned *)(base + params.sq_off.ring_mask);
+    ring->cq_head = (unsigned *)(base + params.cq_off.head);
+    ring->cq_tail = (unsigned *)(base + params.cq_off.tail);
+    ring->cq_mask = *(unsigned *)(base + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)(base + params.cq_off.cqes);
+    /* SQE는 항상 tail 순서로 채우므로 인덱스 배열은 고정 */
+    unsigned *sq_array = (unsigned *)(base + params.sq_off.array);
+    for (unsigned i = 0; i < params.sq_entries; i++) sq_array[i] = i;
+
+    ring->buf_ring = mmap(NULL, sizeof(struct io_uring_buf) * RING_BUFFER_COUNT, PROT_READ | PROT_WRITE,
+                          MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    ring->buffers = mmap(NULL, (size_t)RING_BUFFER_COUNT * RING_BUFFER_SIZE, PROT_READ | PROT_WRITE,
+                         MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (ring->buf_ring == MAP_FAILED || ring->buffers == MAP_FAILED) {
+        log_write(LOG_LEVEL_WARN, "[Event] io_uring buffer allocation failed: %s", strerror(errno));
+        if (ring->buf_ring == MAP_FAILED) ring->buf_ring = NULL;
+        if (ring->buffers == MAP_FAILED) ring->buffers = NULL;
+        ring_destroy(ring);
+        return false;
+    }
+    struct io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (uint64_t)(uintptr_t)ring->buf_ring;
+    reg.ring_entries = RING_BUFFER_COUNT;
+    reg.bgid = RING_BUFFER_GROUP;
+    if (syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+        log_write(LOG_LEVEL_WARN, "[Event] io_uring buffer ring registration failed: %s", strerror(errno));
+        ring_destroy(ring);
+        return false;
+    }
+    for (unsigned bid = 0; bid < RING_BUFFER_COUNT; bid++) {
+        ring_buffer_recycle(ring, (unsigned short)bid);
+    }
+    return true;
 }
 
-char* extract_first_array_string(const char *json, const char *key) {
-    char search_pattern[128];
-    snprintf(search_pattern, sizeof(search_pattern), "\"%s\"", key);
+#else
+typedef struct IoRing IoRing;  /* io_uring 없이 빌드: EventLoop.ring은 항상 NULL */
+#endif /* LKB_IO_URING */
 
-    const char *key_pos = strstr(json, search_pattern);
-    if (!key_pos) return NULL;
+/* ============================
+ * 이벤트 루프 (epoll, edge-triggered)
+ * ============================ */
 
-    const char *bracket = strchr(key_pos, '[');
-    if (!bracket) return NULL;
+typedef enum {
+    EVENT_LISTENER,
+    EVENT_CLIENT,
+    EVENT_UPSTREAM,
+    EVENT_WAKE      /* 다른 스레드가 끝낸 합치기 검색 (flight_complete → eventfd) */
+} EventKind;
 
-    const char *quote_start, *quote_end;
-    if (!find_quoted_string(bracket, &quote_start, &quote_end)) {
-        return NULL;
-    }
+typedef struct Connection Connection;
 
-    size_t len = quote_end - quote_start;
-    char *value = safe_malloc(len + 1);
-    unescape_json_string(quote_start, quote_end, value, len + 1);
+/* epoll_event.data.ptr (io_uring: user_data)에 넣는 태그 - 같은 연결의 클라이언트/업스트림 소켓 구분 */
+typedef struct {
+    EventKind kind;
+    Connection *conn;
+    int slot;  /* EVENT_UPSTREAM: 호출 번호 (scratch.upstream[slot]) */
+} EventTag;
+
+typedef enum {
+    CONN_READING,           /* 요청 수신 중 */
+    CONN_WAITING_UPSTREAM,  /* Manticore 응답 대기 중 */
+    CONN_WRITING            /* 응답 전송 중 */
+} ConnState;
+
+struct Connection {
+    int fd;
+    ConnState state;
+    bool closed;
+    EventTag client_tag;
+    EventTag upstream_tags[UPSTREAM_SLOTS];
+    RequestScratch scratch;  /* 요청 수신/업스트림 버퍼와 arena (keep-alive 동안 재사용) */
+    char header[RESPONSE_HEADER_SIZE];  /* 전송 중인 응답 헤더 */
+    size_t header_len;
+    const char *body;     /* 응답 바디 (정적 문자열 또는 scratch.body, 전송 끝까지 유지) */
+    size_t body_len;
+    uint64_t write_start_us;  /* 응답을 대기열에 넣은 시각 (/metrics socket_write) */
+    size_t out_sent;      /* header + body 중 보낸 바이트 */
+    SearchJob job;
+    bool job_active;
+    bool upstream_active[UPSTREAM_SLOTS];      /* epoll에 등록된 호출 (job.call_active를 따라감) */
+    unsigned upstream_generation[UPSTREAM_SLOTS];  /* epoll에 등록된 업스트림 fd의 세대 */
+    size_t request_len;   /* 처리 중인 요청의 길이 (in 버퍼 앞부분) */
+    bool keep_alive;      /* 응답 후 연결 유지 */
+    int served;           /* 이 연결에서 처리한 요청 수 */
+    time_t last_active;
+    Connection *batch[MAX_BATCH_SEARCHES]; /* POST /search/batch: 항목마다 소켓 없는 자식 연결 */
+    int batch_count;
+    int batch_pending;    /* 아직 응답이 안 나온 항목 수 */
+    struct timespec batch_start;
+    Connection *batch_parent; /* 배치 항목이면 요청을 받은 연결 (연결 목록에는 없음) */
+    bool admission_queued;    /* admission 슬롯을 기다리는 중 (loop->admission_head 목록) */
+    Connection *admission_next;
+    /* io_uring 모드 */
+    int ring_ops;             /* 이 연결(태그, 버퍼)을 가리키는 걸린 요청 - 0이 될 때까지 해제/재사용 안 함 */
+    int upstream_ops[UPSTREAM_SLOTS];   /* slot 호출에 걸린 요청 */
+    int upstream_error[UPSTREAM_SLOTS]; /* 걸린 요청이 돌려준 첫 오류 (errno), 모두 끝나면 처리 */
+    bool upstream_eof[UPSTREAM_SLOTS];  /* recv가 0을 돌려줌 (모두 끝나면 처리) */
+    bool recv_armed;          /* 클라이언트 recv가 걸려 있음 */
+    bool recv_cancel;         /* 받은 요청이 상한을 넘어 recv 취소를 요청함 */
+    bool peer_eof;            /* 클라이언트가 보내기를 끝냄 */
+    bool send_pending;        /* 응답 sendmsg가 걸려 있음 */
+    struct msghdr out_msg;    /* 걸린 sendmsg의 인자 (완료까지 유지) */
+    struct iovec out_iov[2];
+    ByteBuffer held;          /* 요청을 처리하는 동안 받은 다음 요청 바이트 (scratch.in은 그동안 그대로) */
+    Connection *prev;
+    Connection *next;
+};
 
-    return value;
+typedef struct {
+    int epoll_fd;
+    IoRing *ring;             /* io_uring 모드 (NULL = epoll) */
+    bool accept_armed;        /* io_uring: multishot accept가 걸려 있음 */
+    int listen_fd;
+    EventTag listener_tag;
+    int wake_fd;              /* g_flights가 루프 밖에서 끝난 검색을 알리는 eventfd (-1 = 없음) */
+    EventTag wake_tag;
+    uint64_t wake_value;      /* io_uring: 걸어 둔 eventfd read의 버퍼 */
+    Connection *connections;  /* 열린 연결 목록 */
+    Connection *graveyard;    /* 이번 이벤트 배치가 끝나면 해제할 연결 */
+    Connection *spare;        /* 다음 accept에서 재사용할 연결 (버퍼/arena 유지) */
+    int spare_count;
+    FlightWaiter *woken;      /* 선두 검색이 끝나 이번 배치 끝에 이어서 처리할 연결 */
+    Connection *admission_head; /* 슬롯을 기다리는 연결 (먼저 온 순서) */
+    Connection *admission_tail;
+    uint64_t admission_expire_us; /* 대기열에서 가장 이른 거절 시각 이하 (0 = 없음) */
+    int connection_count;
+    uint64_t next_deadline_us; /* 가장 이른 업스트림 deadline / hedge 시각 이하 (0 = 없음), 지나면 전체 검사 */
+} EventLoop;
+
+/* 남은 응답 헤더 + 바디를 iovec으로, 개수 반환 */
+int conn_out_iov(Connection *conn, struct iovec iov[2]) {
+    int iovcnt = 0;
+    if (conn->out_sent < conn->header_len) {
+        iov[iovcnt].iov_base = conn->header + conn->out_sent;
+        iov[iovcnt].iov_len = conn->header_len - conn->out_sent;
+        iovcnt++;
+    }
+    size_t body_sent = conn->out_sent > conn->header_len ? conn->out_sent - conn->header_len : 0;
+    if (body_sent < conn->body_len) {
+        iov[iovcnt].iov_base = (void *)(conn->body + body_sent);
+        iov[iovcnt].iov_len = conn->body_len - body_sent;
+        iovcnt++;
+    }
+    return iovcnt;
 }
 
-int parse_queries_array(const char *json, char **queries, int max_count) {
-    const char *queries_start = strstr(json, "\"queries\"");
-    if (!queries_start) return 0;
+/* io_uring: 지난 요청에서 끊은 업스트림 호출의 완료가 아직 오지 않음 (그 slot을 다시 쓰기 전에 기다림) */
+bool conn_ring_draining(const Connection *conn) {
+    for (int slot = 0; slot < UPSTREAM_SLOTS; slot++) {
+        if (conn->upstream_ops[slot] > 0) return true;
+    }
+    return false;
+}
 
-    const char *bracket_start = strchr(queries_start, '[');
-    if (!bracket_start) return 0;
+#ifdef LKB_IO_URING
+uint64_t ring_tag(EventTag *tag, int op) {
+    return (uint64_t)(uintptr_t)tag | (uint64_t)op;
+}
 
-    const char *bracket_end = strchr(bracket_start, ']');
-    if (!bracket_end) return 0;
+/* 걸린 요청이 있는 소켓을 닫기 전에: 채워 둔 SQE를 먼저 넘겨 (닫은 fd 번호가 재사용되기 전에
+ * 파일에 묶이도록) shutdown으로 걸린 recv/send를 바로 끝냄. close만으로는 끝나지 않음 */
+void ring_abort_fd(IoRing *ring, int fd) {
+    ring_submit(ring);
+    shutdown(fd, SHUT_RDWR);
+}
 
-    int count = 0;
-    const char *p = bracket_start + 1;
+/* 클라이언트 소켓에 multishot recv - 받는 대로 등록 버퍼에 담긴 완료가 이어서 옴 */
+void conn_ring_recv(EventLoop *loop, Connection *conn) {
+    IoRing *ring = loop->ring;
+    ring_reserve(ring, 1);
+    struct io_uring_sqe *sqe = ring_get_sqe(ring, IORING_OP_RECV, conn->fd, NULL, 0,
+                                            ring_tag(&conn->client_tag, RING_OP_IN));
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = RING_BUFFER_GROUP;
+    if (ring->recv_multishot) sqe->ioprio = IORING_RECV_MULTISHOT;
+    conn->recv_armed = true;
+    conn->ring_ops++;
+}
 
-    while (p < bracket_end && count < max_count) {
-        const char *quote_start, *quote_end;
+/* 남은 응답을 sendmsg 하나로 링에 (다음 io_uring_enter에서 대기와 함께 제출), 다 보냈으면 true */
+bool conn_ring_flush(EventLoop *loop, Connection *conn) {
+    if (conn->out_sent >= conn->header_len + conn->body_len) return true;
+    if (conn->send_pending) return false;
+
+    memset(&conn->out_msg, 0, sizeof(conn->out_msg));
+    conn->out_msg.msg_iov = conn->out_iov;
+    conn->out_msg.msg_iovlen = conn_out_iov(conn, conn->out_iov);
+    ring_reserve(loop->ring, 1);
+    struct io_uring_sqe *sqe = ring_get_sqe(loop->ring, IORING_OP_SENDMSG, conn->fd, &conn->out_msg, 1,
+                                            ring_tag(&conn->client_tag, RING_OP_OUT));
+    sqe->msg_flags = MSG_NOSIGNAL | MSG_WAITALL;
+    conn->send_pending = true;
+    conn->ring_ops++;
+    return false;
+}
 
-        /* find_quoted_string 사용 */
-        if (!find_quoted_string(p, &quote_start, &quote_end) || quote_end > bracket_end) {
-            break;
+/* slot 호출의 남은 단계를 연결된 요청(IOSQE_IO_LINK)으로 링에: 연결 중이면 POLLOUT → send → recv,
+ * 보내는 중이면 send → recv, 받는 중이면 recv. 앞 요청이 실패하면 뒤 요청은 취소되어 끝남 */
+void conn_ring_upstream(EventLoop *loop, Connection *conn, int slot) {
+    IoRing *ring = loop->ring;
+    UpstreamCall *call = &conn->scratch.upstream[slot];
+    EventTag *tag = &conn->upstream_tags[slot];
+    int count = call->state == UPSTREAM_CONNECTING ? 3 : call->state == UPSTREAM_SENDING ? 2 : 1;
+    struct io_uring_sqe *sqe;
+
+    ring_reserve(ring, count);
+    if (call->state == UPSTREAM_CONNECTING) {
+        sqe = ring_get_sqe(ring, IORING_OP_POLL_ADD, call->fd, NULL, 0, ring_tag(tag, RING_OP_CONNECT));
+        uint32_t events = POLLOUT;
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+        events = (events << 16) | (events >> 16);  /* poll32_events는 16비트씩 뒤바뀐 순서 */
+#endif
+        sqe->poll32_events = events;
+        sqe->flags = IOSQE_IO_LINK;
+    }
+    if (call->state != UPSTREAM_RECEIVING) {
+        sqe = ring_get_sqe(ring, IORING_OP_SEND, call->fd, call->request.data + call->sent,
+                           (unsigned)(call->request.len - call->sent), ring_tag(tag, RING_OP_OUT));
+        sqe->msg_flags = MSG_NOSIGNAL | MSG_WAITALL;
+        sqe->flags = IOSQE_IO_LINK;
+    }
+    sqe = ring_get_sqe(ring, IORING_OP_RECV, call->fd, NULL, 0, ring_tag(tag, RING_OP_IN));
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = RING_BUFFER_GROUP;
+    conn->upstream_ops[slot] += count;
+    conn->ring_ops += count;
+}
+#else
+void ring_abort_fd(IoRing *ring, int fd) { (void)ring; (void)fd; }
+void conn_ring_recv(EventLoop *loop, Connection *conn) { (void)loop; (void)conn; }
+bool conn_ring_flush(EventLoop *loop, Connection *conn) { (void)loop; (void)conn; return true; }
+void conn_ring_upstream(EventLoop *loop, Connection *conn, int slot) { (void)loop; (void)conn; (void)slot; }
+#endif /* LKB_IO_URING */
+
+void conn_release_upstream(EventLoop *loop, Connection *conn, int slot) {
+    if (conn->upstream_active[slot]) {
+        UpstreamCall *call = &conn->scratch.upstream[slot];
+        if (loop->ring) {
+            /* 끝나지 않은 호출(취소, deadline)은 걸린 요청을 끊고 연결을 버림. 남은 완료는
+             * 나중에 와서 무시되고, 그때까지 이 slot은 다시 쓰지 않음 (conn_drive) */
+            if (conn->upstream_ops[slot] > 0 && call->fd >= 0) {
+                ring_abort_fd(loop->ring, call->fd);
+                call->parser.keep_alive = false;
+            }
+        } else if (call->fd >= 0) {
+            /* 풀로 돌아갈 수 있으므로 epoll 등록을 먼저 해제 */
+            epoll_ctl(loop->epoll_fd, EPOLL_CTL_DEL, call->fd, NULL);
         }
+        upstream_call_release(call);
+        conn->upstream_active[slot] = false;
+    }
+}
 
-        size_t len = quote_end - quote_start;
-        queries[count] = safe_malloc(len + 1);
-        unescape_json_string(quote_start, quote_end, queries[count], len + 1);
-        count++;
+bool conn_register_upstream(EventLoop *loop, Connection *conn, int slot) {
+    UpstreamCall *call = &conn->scratch.upstream[slot];
+    if (loop->ring) {
+        conn_ring_upstream(loop, conn, slot);
+        return true;
+    }
+    struct epoll_event ev;
+    ev.events = EPOLLIN | EPOLLOUT | EPOLLET;
+    ev.data.ptr = &conn->upstream_tags[slot];
+    if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, call->fd, &ev) < 0) {
+        log_write(LOG_LEVEL_ERROR, "[Event] epoll_ctl upstream failed: %s", strerror(errno));
+        return false;
+    }
+    conn->upstream_generation[slot] = call->generation;
+    return true;
+}
 
-        p = quote_end + 1;
+/* 이 연결이 선두인 검색을 기다리던 연결들을 loop->woken으로 (배치 끝에 처리).
+ * 결과를 내지 못하고 끝났다면 flight를 빈 결과로 닫아 각자 검색하게 함 */
+void conn_collect_followers(EventLoop *loop, Connection *conn) {
+    SearchJob *job = &conn->job;
+    if (!job->flight || !job->flight_leader) return;
+
+    flight_complete(&g_flights, job->flight, NULL);
+    FlightWaiter *waiters = flight_take_waiters(&g_flights, job->flight);
+    while (waiters) {
+        FlightWaiter *next = waiters->next;
+        waiters->next = loop->woken;
+        loop->woken = waiters;
+        waiters = next;
     }
+}
 
-    return count;
+Connection* conn_from_waiter(FlightWaiter *waiter) {
+    return (Connection *)((char *)waiter - offsetof(Connection, job.waiter));
 }
 
-char* normalize_search_query(const char *query, char **queries, int queries_count) {
-    if (queries && queries_count > 0 && queries[0] && strlen(queries[0]) > 0) {
-        char *result = safe_strdup(queries[0]);
-        return trim_string(result);
+/* 슬롯 대기열에서 뺌 (앞에서 꺼내는 게 보통이고 중간은 연결을 닫을 때뿐이라 순회) */
+void event_loop_unqueue_admission(EventLoop *loop, Connection *conn) {
+    Connection *prev = NULL;
+    Connection **link = &loop->admission_head;
+    while (*link && *link != conn) {
+        prev = *link;
+        link = &(*link)->admission_next;
     }
+    if (*link) *link = conn->admission_next;
+    if (loop->admission_tail == conn) loop->admission_tail = prev;
+    conn->admission_next = NULL;
+    conn->admission_queued = false;
+    __atomic_sub_fetch(&g_admission.waiting, 1, __ATOMIC_RELAXED);
+}
 
-    if (!query || strlen(query) == 0) {
-        return safe_strdup("");
+/* 연결 종료 - 같은 배치의 남은 이벤트가 태그를 참조할 수 있으므로 해제는 지연 */
+void conn_close(EventLoop *loop, Connection *conn) {
+    if (conn->closed) return;
+    conn->closed = true;
+
+    if (conn->admission_queued) event_loop_unqueue_admission(loop, conn);
+    for (int i = 0; i < UPSTREAM_SLOTS; i++) {
+        conn_release_upstream(loop, conn, i);
+    }
+    if (conn->job_active) {
+        conn_collect_followers(loop, conn);
+        search_job_free(&conn->job);
+        conn->job_active = false;
+    }
+    for (int k = 0; k < conn->batch_count; k++) {
+        conn_close(loop, conn->batch[k]);
+    }
+    if (conn->fd >= 0 && loop->ring && (conn->recv_armed || conn->send_pending)) {
+        ring_abort_fd(loop->ring, conn->fd);
+    }
+    if (conn->fd >= 0) close(conn->fd);
+    conn->fd = -1;
+
+    if (!conn->batch_parent) {
+        if (conn->prev) conn->prev->next = conn->next;
+        else loop->connections = conn->next;
+        if (conn->next) conn->next->prev = conn->prev;
+        loop->connection_count--;
     }
 
-    char *cleaned = remove_think_tags(query);
-    cleaned = trim_string(cleaned);
+    conn->prev = NULL;
+    conn->next = loop->graveyard;
+    loop->graveyard = conn;
+}
 
-    if (strchr(cleaned, '{') && strstr(cleaned, "queries")) {
-        char *nested_query = extract_first_array_string(cleaned, "queries");
-        if (nested_query && strlen(nested_query) > 0) {
-            free(cleaned);
-            return nested_query;
-        }
-    }
+void connection_free(Connection *conn) {
+    request_scratch_free(&conn->scratch);
+    buffer_free(&conn->held);
+    free(conn);
+}
 
-    if (cleaned[0] == '[') {
-        const char *quote = strchr(cleaned, '"');
-        if (quote) {
-            quote++;
-            const char *quote_end = strchr(quote, '"');
-            if (quote_end) {
-                size_t len = quote_end - quote;
-                char *result = malloc(len + 1);
-                strncpy(result, quote, len);
-                result[len] = '\0';
-                free(cleaned);
-                return result;
-            }
+/* 닫힌 연결은 EPOLL_SPARE_CONNECTIONS개까지 메모리째 보관, 나머지는 해제.
+ * io_uring 요청이 아직 가리키는 연결은 완료가 모두 올 때까지 남겨 둠 */
+void event_loop_reap(EventLoop *loop) {
+    Connection *busy = NULL;
+    while (loop->graveyard) {
+        Connection *conn = loop->graveyard;
+        loop->graveyard = conn->next;
+        if (conn->ring_ops > 0) {
+            conn->next = busy;
+            busy = conn;
+            continue;
         }
-    }
-
-    if (cleaned[0] == '"') {
-        const char *end = strchr(cleaned + 1, '"');
-        if (end) {
-            size_t len = end - (cleaned + 1);
-            char *result = malloc(len + 1);
-            strncpy(result, cleaned + 1, len);
-            result[len] = '\0';
-            free(cleaned);
-            return result;
+        buffer_free(&conn->held);
+        if (loop->spare_count < EPOLL_SPARE_CONNECTIONS && g_running) {
+            buffer_trim(&conn->scratch.in, SCRATCH_RETAIN_SIZE);
+            request_scratch_reset(&conn->scratch);
+            conn->next = loop->spare;
+            loop->spare = conn;
+            loop->spare_count++;
+        } else {
+            connection_free(conn);
         }
     }
+    loop->graveyard = busy;
+}
 
-    if (!strchr(cleaned, '{') && !strchr(cleaned, '[') && !strchr(cleaned, ':')) {
-        char *space = strchr(cleaned, ' ');
-        if (space) {
-            *space = '\0';
-        }
+/* 보관 중인 연결을 꺼내거나 새로 만들어 초기 상태로 */
+Connection* event_loop_new_connection(EventLoop *loop, int client_fd) {
+    Connection *conn = loop->spare;
+    if (conn) {
+        loop->spare = conn->next;
+        loop->spare_count--;
+        RequestScratch scratch = conn->scratch;
+        memset(conn, 0, sizeof(Connection));
+        conn->scratch = scratch;
+    } else {
+        conn = safe_malloc(sizeof(Connection));
+        memset(conn, 0, sizeof(Connection));
+        request_scratch_init(&conn->scratch);
     }
 
-    if (strlen(cleaned) > MAX_QUERY_LEN) {
-        cleaned[MAX_QUERY_LEN] = '\0';
+    conn->fd = client_fd;
+    conn->state = CONN_READING;
+    conn->client_tag.kind = EVENT_CLIENT;
+    conn->client_tag.conn = conn;
+    for (int i = 0; i < UPSTREAM_SLOTS; i++) {
+        conn->upstream_tags[i].kind = EVENT_UPSTREAM;
+        conn->upstream_tags[i].conn = conn;
+        conn->upstream_tags[i].slot = i;
     }
-
-    return cleaned;
+    conn->last_active = time(NULL);
+    return conn;
 }
 
-int parse_search_request(const char *body, SearchRequest *req) {
-    memset(req, 0, sizeof(SearchRequest));
-
-    req->query = extract_json_string_value(body, "query");
-    req->queries_count = parse_queries_array(body, req->queries, MAX_QUERIES);
-
-    const char *count_str = strstr(body, "\"count\"");
-    if (count_str) {
-        const char *colon = strchr(count_str, ':');
-        if (colon) {
-            req->count = atoi(colon + 1);
+/* 응답 전송 (EAGAIN까지), 모두 보냈으면 true */
+bool conn_flush(EventLoop *loop, Connection *conn) {
+    if (loop->ring) return conn_ring_flush(loop, conn);
+
+    size_t total = conn->header_len + conn->body_len;
+    while (conn->out_sent < total) {
+        /* 남은 헤더 + 바디를 sendmsg() 한 번으로 (writev와 같지만 MSG_NOSIGNAL 지정 가능) */
+        struct iovec iov[2];
+        int iovcnt = conn_out_iov(conn, iov);
+        struct msghdr msg = { .msg_iov = iov, .msg_iovlen = iovcnt };
+        ssize_t n = sendmsg(conn->fd, &msg, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return false;  /* EPOLLOUT 대기 */
+            if (errno == EINTR) continue;
+            conn_close(loop, conn);
+            return false;
         }
+        conn->out_sent += n;
+        conn->last_active = time(NULL);
     }
+    return true;
+}
 
-    if (req->count <= 0) {
-        req->count = g_config.search_count;
-    }
-
-    return 0;
+/* 응답 대기열에 - 바디는 복사하지 않고 가리키기만 하므로 전송이 끝날 때까지 유효해야 함 */
+void conn_queue_response(Connection *conn, int status_code, const char *status_text,
+                         const char *content_type, const char *body, size_t body_len) {
+    conn->header_len = build_http_header(conn->header, sizeof(conn->header), status_code,
+                                         status_text, content_type, body_len, conn->keep_alive);
+    conn->body = body;
+    conn->body_len = body_len;
+    conn->out_sent = 0;
+    conn->write_start_us = metrics_now_us();
+    conn->state = CONN_WRITING;
 }
 
-void free_search_request(SearchRequest *req) {
-    if (req->query) free(req->query);
+/* 503 과부하 응답 대기열에 (admission으로 거절한 /search) */
+void conn_queue_overloaded(Connection *conn) {
+    conn->header_len = build_http_overloaded_header(conn->header, sizeof(conn->header), conn->keep_alive);
+    conn->body = OVERLOADED_BODY;
+    conn->body_len = sizeof(OVERLOADED_BODY) - 1;
+    conn->out_sent = 0;
+    conn->write_start_us = metrics_now_us();
+    conn->state = CONN_WRITING;
+}
 
-    for (int i = 0; i < req->queries_count; i++) {
-        if (req->queries[i]) free(req->queries[i]);
+/* 배치의 모든 항목이 끝남 - 항목 응답을 모아 보내고 자식 연결은 닫음 (해제는 배치 끝) */
+void conn_finish_batch(EventLoop *loop, Connection *conn) {
+    const ByteBuffer *responses[MAX_BATCH_SEARCHES];
+    for (int k = 0; k < conn->batch_count; k++) {
+        responses[k] = &conn->batch[k]->scratch.body;
     }
+    buffer_reset(&conn->scratch.body);
+    create_json_batch_response(&conn->scratch.body, responses, conn->batch_count,
+                               search_batch_took_ms(&conn->batch_start));
+    for (int k = 0; k < conn->batch_count; k++) {
+        conn_close(loop, conn->batch[k]);
+    }
+    conn->batch_count = 0;
+    conn_queue_response(conn, 200, "OK", "application/json", conn->scratch.body.data,
+                        conn->scratch.body.len);
 }
 
-/* ============================
- * 파일 I/O 함수
- * ============================ */
+void conn_finish_search(EventLoop *loop, Connection *conn) {
+    const ByteBuffer *json_response = search_job_finish(&conn->job);
+    conn_collect_followers(loop, conn);
+    search_job_free(&conn->job);
+    conn->job_active = false;
 
-char* load_file(const char *filename) {
-    FILE *f = fopen(filename, "r");
-    if (!f) {
-        printf("[Template] Warning: %s not found\n", filename);
-        return NULL;
+    /* 배치 항목: 응답은 scratch.body에 둔 채 마지막 항목이 부모 응답을 만든다 */
+    if (conn->batch_parent) {
+        conn->state = CONN_WRITING;
+        if (--conn->batch_parent->batch_pending == 0) conn_finish_batch(loop, conn->batch_parent);
+        return;
     }
 
-    fseek(f, 0, SEEK_END);
-    long size = ftell(f);
-    if (size < 0) {
-        fprintf(stderr, "[Template] Error: ftell failed for %s\n", filename);
-        fclose(f);
-        return NULL;
-    }
-    fseek(f, 0, SEEK_SET);
+    /* 바디는 scratch.body를 그대로 보내므로 scratch 리셋은 전송 완료 후 conn_drive()에서 */
+    conn_queue_response(conn, 200, "OK", "application/json", json_response->data,
+                        json_response->len);
+}
 
-    char *content = safe_malloc(size + 1);
-    size_t bytes_read = fread(content, 1, size, f);
-    if (bytes_read != (size_t)size) {
-        fprintf(stderr, "[Template] Warning: partial read of %s (%zu/%ld bytes)\n",
-                filename, bytes_read, size);
-    }
-    content[bytes_read] = '\0';
-    fclose(f);
+/* 모든 fan-out 쿼리가 끝났으면 결과 병합 후 응답 대기열에 */
+void conn_maybe_finish_search(EventLoop *loop, Connection *conn) {
+    if (!conn->job_active || conn->job.branches_pending > 0) return;
+    search_job_merge(&conn->job);
+    search_job_release_slot(&conn->job);
+    conn_finish_search(loop, conn);
+}
 
-    return content;
+/* 업스트림 deadline / hedge 시각(0 = 없음)을 루프의 다음 검사 시각에 반영 */
+void event_loop_note_deadline(EventLoop *loop, uint64_t at_us) {
+    if (at_us && (loop->next_deadline_us == 0 || at_us < loop->next_deadline_us)) {
+        loop->next_deadline_us = at_us;
+    }
 }
 
-/* 템플릿 파일 로드 */
-char* load_template(const char *filename) {
-    return load_file(filename);
-}
-
-char* replace_template_vars(const char *template, const char *index_name,
-                            const char *query, int count) {
-    char *result = safe_malloc(BUFFER_SIZE);
-    char *p = result;
-    const char *s = template;
-    size_t remaining = BUFFER_SIZE - 1;
-
-    while (*s && remaining > 0) {
-        if (strncmp(s, "{INDEX_NAME}", 12) == 0) {
-            size_t len = strlen(index_name);
-            if (len > remaining) len = remaining;
-            memcpy(p, index_name, len);
-            p += len;
-            remaining -= len;
-            s += 12;
-        } else if (strncmp(s, "{SEARCH_QUERY}", 14) == 0) {
-            size_t len = strlen(query);
-            if (len > remaining) len = remaining;
-            memcpy(p, query, len);
-            p += len;
-            remaining -= len;
-            s += 14;
-        } else if (strncmp(s, "{RESULT_LIMIT}", 14) == 0) {
-            int written = snprintf(p, remaining, "%d", count);
-            if (written > 0 && (size_t)written < remaining) {
-                p += written;
-                remaining -= written;
+/* epoll 등록을 job이 시작/취소한 호출에 맞춤: 새 호출은 등록, 끝났거나 취소된 호출은 정리.
+ * 등록에 실패한 호출은 실패로 끝내는데 그게 다른 replica로 다시 보낼 수 있어 바뀐 게 없을 때까지 */
+void conn_sync_upstream(EventLoop *loop, Connection *conn) {
+    SearchJob *job = &conn->job;
+    bool changed = true;
+    while (changed) {
+        changed = false;
+        for (int slot = 0; slot < UPSTREAM_SLOTS; slot++) {
+            if (!job->call_active[slot]) {
+                conn_release_upstream(loop, conn, slot);
+                continue;
             }
-            s += 14;
-        } else {
-            *p++ = *s++;
-            remaining--;
+            if (conn->upstream_active[slot]) continue;
+
+            conn->upstream_active[slot] = true;
+            if (conn_register_upstream(loop, conn, slot)) {
+                event_loop_note_deadline(loop, upstream_call_deadline(&conn->scratch.upstream[slot], NULL));
+                continue;
+            }
+            conn_release_upstream(loop, conn, slot);
+            search_job_call_done(job, slot, false);
+            changed = true;
         }
     }
-    *p = '\0';
-
-    return result;
 }
 
-/* ============================
- * HTTP 클라이언트 함수
- * ============================ */
+/* slot의 호출이 끝남 - 결과 정리 후 마지막 쿼리였으면 응답 대기열에 */
+void conn_upstream_done(EventLoop *loop, Connection *conn, int slot, bool ok) {
+    search_job_call_done(&conn->job, slot, ok);
+    conn_sync_upstream(loop, conn);
+    conn_maybe_finish_search(loop, conn);
+}
 
-char* http_post_request(const char *host, int port, const char *path, const char *body) {
-    int sock;
-    struct sockaddr_in server_addr;
-    struct hostent *server;
+/* slot의 업스트림 상태 머신 진행, 끝나면 결과 파싱 */
+void conn_advance_upstream(EventLoop *loop, Connection *conn, int slot) {
+    if (conn->closed || !conn->upstream_active[slot]) return;
 
-    /* 소켓 생성 */
-    sock = socket(AF_INET, SOCK_STREAM, 0);
-    if (sock < 0) {
-        perror("socket creation failed");
-        return NULL;
-    }
+    UpstreamCall *call = &conn->scratch.upstream[slot];
+    UpstreamState state = upstream_call_advance(call);
 
-    /* 호스트 찾기 */
-    server = gethostbyname(host);
-    if (!server) {
-        fprintf(stderr, "Error: No such host %s\n", host);
-        close(sock);
-        return NULL;
+    /* 죽은 풀 연결을 새 연결로 바꿨다면 새 fd를 등록 (닫힌 fd는 자동 해제됨) */
+    if (state != UPSTREAM_FAILED && call->generation != conn->upstream_generation[slot] &&
+        !conn_register_upstream(loop, conn, slot)) {
+        state = UPSTREAM_FAILED;
     }
+    if (state != UPSTREAM_DONE && state != UPSTREAM_FAILED) return;
 
-    /* 서버 주소 설정 */
-    memset(&server_addr, 0, sizeof(server_addr));
-    server_addr.sin_family = AF_INET;
-    memcpy(&server_addr.sin_addr.s_addr, server->h_addr, server->h_length);
-    server_addr.sin_port = htons(port);
+    conn_upstream_done(loop, conn, slot, state == UPSTREAM_DONE);
+}
 
-    /* 연결 */
-    if (connect(sock, (struct sockaddr*)&server_addr, sizeof(server_addr)) < 0) {
-        perror("connection failed");
-        close(sock);
-        return NULL;
+/* 쿼리마다 업스트림 호출을 시작해 같은 루프에서 함께 기다림 */
+void conn_start_upstream(EventLoop *loop, Connection *conn) {
+    conn->state = CONN_WAITING_UPSTREAM;
+    for (int i = 0; i < conn->job.branch_count; i++) {
+        search_job_start_branch(&conn->job, i);
     }
+    conn_sync_upstream(loop, conn);
+    event_loop_note_deadline(loop, search_job_hedge(&conn->job, 0));
 
-    /* HTTP 요청 생성 */
-    size_t body_len = strlen(body);
-    size_t request_size = 256 + strlen(path) + strlen(host) + body_len;
-    char *request = safe_malloc(request_size);
-    snprintf(request, request_size,
-             "POST %s HTTP/1.1\r\n"
-             "Host: %s:%d\r\n"
-             "Content-Type: application/json\r\n"
-             "Content-Length: %zu\r\n"
-             "Connection: close\r\n"
-             "\r\n"
-             "%s",
-             path, host, port, body_len, body);
-
-    /* 요청 전송 */
-    ssize_t written = write(sock, request, strlen(request));
-    free(request);
-    if (written < 0) {
-        perror("write failed");
-        close(sock);
-        return NULL;
+    /* 풀 연결은 바로 보낼 수 있으므로 한 번씩 진행 (마지막 쿼리가 끝나면 응답까지).
+     * io_uring은 등록할 때 이미 send → recv를 링에 올렸음 */
+    for (int slot = 0; slot < UPSTREAM_SLOTS && !loop->ring; slot++) {
+        conn_advance_upstream(loop, conn, slot);
     }
+    conn_maybe_finish_search(loop, conn);
+}
 
-    /* 응답 수신 */
-    char *response = safe_malloc(BUFFER_SIZE);
-    char buffer[4096];
-    int total_read = 0;
-    ssize_t bytes_read;
+/* 슬롯을 받지 못한 검색: ttl이 지난 캐시 결과나 (배치 항목이면) 빈 결과로 응답, /search는 503.
+ * 이 연결을 기다리던 연결은 깨워서 각자 슬롯을 구하게 함 */
+void conn_shed_search(EventLoop *loop, Connection *conn) {
+    conn_collect_followers(loop, conn);
+    if (search_job_shed(&conn->job, conn->scratch.received_us) || conn->batch_parent) {
+        conn_finish_search(loop, conn);
+        return;
+    }
+    search_job_free(&conn->job);
+    conn->job_active = false;
+    conn_queue_overloaded(conn);
+}
 
-    while ((bytes_read = read(sock, buffer, sizeof(buffer) - 1)) > 0) {
-        if (total_read + bytes_read >= BUFFER_SIZE - 1) break;
-        memcpy(response + total_read, buffer, bytes_read);
-        total_read += bytes_read;
+/* admission: 기다리는 연결이 없고 슬롯이 남아 있으면 바로 Manticore 호출을 시작하고,
+ * 아니면 대기열 끝에서 차례를 기다림 (event_loop_admit_waiters) */
+void conn_admit_upstream(EventLoop *loop, Connection *conn) {
+    if (!loop->admission_head && search_job_admit(&conn->job, conn->scratch.received_us, false)) {
+        conn_start_upstream(loop, conn);
+        return;
     }
-    response[total_read] = '\0';
 
-    close(sock);
+    metrics_count(&g_metrics.admission_waited);
+    conn->state = CONN_WAITING_UPSTREAM;
+    conn->admission_queued = true;
+    conn->admission_next = NULL;
+    __atomic_add_fetch(&g_admission.waiting, 1, __ATOMIC_RELAXED);
+    if (loop->admission_tail) loop->admission_tail->admission_next = conn;
+    else loop->admission_head = conn;
+    loop->admission_tail = conn;
+
+    uint64_t deadline = admission_deadline_us(conn->scratch.received_us);
+    if (loop->admission_expire_us == 0 || deadline < loop->admission_expire_us) {
+        loop->admission_expire_us = deadline;
+    }
+    event_loop_note_deadline(loop, deadline);
+}
 
-    /* HTTP 바디 추출 */
-    char *body_start = strstr(response, "\r\n\r\n");
-    if (body_start) {
-        body_start += 4;
-        char *body_copy = safe_strdup(body_start);
-        free(response);
-        return body_copy;
+void conn_start_search(EventLoop *loop, Connection *conn, const char *body) {
+    conn->job_active = true;
+    if (search_job_begin(&conn->job, &conn->scratch, body)) {
+        conn_admit_upstream(loop, conn);
+        return;
     }
 
-    return response;
+    /* 같은 검색을 다른 연결이 진행 중이면 끝날 때까지 대기 목록에 */
+    if (search_job_is_follower(&conn->job)) {
+        int wait_ms = conn->job.config->timeout_ms > 0 ? conn->job.config->timeout_ms : DEFAULT_UPSTREAM_TIMEOUT_MS;
+        conn->job.waiter.deadline_us = metrics_now_us() + (uint64_t)wait_ms * 1000;
+        if (flight_add_waiter(&g_flights, conn->job.flight, &conn->job.waiter)) {
+            conn->state = CONN_WAITING_UPSTREAM;
+            event_loop_note_deadline(loop, conn->job.waiter.deadline_us);
+            return;
+        }
+        if (!search_job_await_flight(&conn->job)) {  /* 그 사이 끝났음 - 기다리지 않음 */
+            conn_admit_upstream(loop, conn);
+            return;
+        }
+    }
+    conn_finish_search(loop, conn);
 }
 
-/* ============================
- * Manticore Search 통합
- * ============================ */
+/* POST /search/batch: 항목마다 소켓 없는 자식 연결을 만들어 /search처럼 시작 - 캐시, 합치기,
+ * replica 선택, hedge를 그대로 쓰고 Manticore 호출은 같은 루프에서 함께 진행.
+ * 마지막 항목이 끝나면 conn_finish_batch() */
+void conn_start_batch(EventLoop *loop, Connection *conn, const char *body) {
+    char *entries[MAX_BATCH_SEARCHES];
+    int count = search_batch_entries(&conn->scratch.arena, body, entries);
+
+    clock_gettime(CLOCK_MONOTONIC, &conn->batch_start);
+    conn->state = CONN_WAITING_UPSTREAM;
+    conn->batch_pending = count;
+    for (int k = 0; k < count; k++) {
+        Connection *child = event_loop_new_connection(loop, -1);
+        child->batch_parent = conn;
+        child->scratch.received_us = conn->scratch.received_us;
+        child->state = CONN_WAITING_UPSTREAM;
+        buffer_append(&child->scratch.in, entries[k], strlen(entries[k]));
+        conn->batch[k] = child;
+    }
+    conn->batch_count = count;
 
-/* Manticore 응답 파싱 */
-int parse_manticore_response(const char *response, int max_results, SearchResult *results) {
-    int result_count = 0;
+    for (int k = 0; k < count && !conn->closed; k++) {
+        Connection *child = conn->batch[k];
+        conn_start_search(loop, child, child->scratch.in.data);
+    }
+    if (count == 0) conn_finish_batch(loop, conn);
+}
 
-    /* hits.hits 배열 찾기 */
-    const char *hits = strstr(response, "\"hits\"");
-    if (!hits) return 0;
+/* 완성된 요청 하나를 라우팅 */
+void conn_dispatch(EventLoop *loop, Connection *conn, size_t request_len) {
+    char *request = conn->scratch.in.data;
 
-    /* 두 번째 "hits" 찾기 (중첩 구조) */
-    hits = strstr(hits + 6, "\"hits\"");
-    if (!hits) return 0;
+    conn->served++;
+    conn->request_len = request_len;
+    conn->scratch.received_us = metrics_now_us();
+    conn->keep_alive = http_request_keep_alive(request, request_len) &&
+                       conn->served < g_config.keepalive_max_requests;
 
-    /* [ 찾기 */
-    const char *array_start = strchr(hits, '[');
-    if (!array_start) return 0;
+    /* 파이프라인된 다음 요청과 분리하기 위해 잠시 NUL 종료 */
+    char saved = request[request_len];
+    request[request_len] = '\0';
 
-    /* 각 결과 파싱 - hits 배열의 각 요소를 순회 */
-    const char *search_pos = array_start;
+#ifdef DEBUG
+    write_raw_request_log(request, request_len);
+#endif
 
-    while (result_count < max_results && result_count < MAX_RESULTS) {
-        /* 다음 _source 찾기 */
-        const char *source = strstr(search_pos, "\"_source\"");
-        if (!source) break;
+    char method[16], path[256];
+    if (sscanf(request, "%15s %255s", method, path) != 2) {
+        log_write(LOG_LEVEL_WARN, "[HTTP] Invalid request format");
+        metrics_count(&g_metrics.requests[ROUTE_NOT_FOUND]);
+        conn_queue_response(conn, 404, "Not Found", "application/json", NOT_FOUND_BODY,
+                            sizeof(NOT_FOUND_BODY) - 1);
+    } else if (strcmp(method, "POST") == 0 && strcmp(path, "/search") == 0) {
+        metrics_count(&g_metrics.requests[ROUTE_SEARCH]);
+        char *body = strstr(request, "\r\n\r\n");
+        capture_request(&g_capture, CAPTURE_SEARCH, body + 4, request + request_len - (body + 4));
+        conn_start_search(loop, conn, body + 4);
+    } else if (strcmp(method, "POST") == 0 && strcmp(path, "/search/batch") == 0) {
+        metrics_count(&g_metrics.requests[ROUTE_BATCH]);
+        char *body = strstr(request, "\r\n\r\n");
+        capture_request(&g_capture, CAPTURE_BATCH, body + 4, request + request_len - (body + 4));
+        conn_start_batch(loop, conn, body + 4);
+    } else if (strcmp(method, "GET") == 0 && strcmp(path, "/") == 0) {
+        metrics_count(&g_metrics.requests[ROUTE_ROOT]);
+        conn_queue_response(conn, 200, "OK", "application/json", ROOT_STATUS_BODY,
+                            sizeof(ROOT_STATUS_BODY) - 1);
+    } else if (strcmp(method, "GET") == 0 && strcmp(path, "/metrics") == 0) {
+        metrics_count(&g_metrics.requests[ROUTE_METRICS]);
+        metrics_render(&conn->scratch.body);
+        conn_queue_response(conn, 200, "OK", METRICS_CONTENT_TYPE, conn->scratch.body.data,
+                            conn->scratch.body.len);
+    } else {
+        metrics_count(&g_metrics.requests[ROUTE_NOT_FOUND]);
+        conn_queue_response(conn, 404, "Not Found", "application/json", NOT_FOUND_BODY,
+                            sizeof(NOT_FOUND_BODY) - 1);
+    }
 
-        /* _source 이후로 검색 위치 이동 (다음 반복을 위해) */
-        search_pos = source + 9;
+    request[request_len] = saved;
+}
 
-        /* page_title 추출 */
-        const char *title_key = strstr(source, "\"page_title\"");
-        char *title = NULL;
-        if (title_key) {
-            title = extract_json_string_value(title_key, "page_title");
+/* 소켓에서 EAGAIN까지 읽기: 1 = 새 데이터, 0 = 없음, -1 = 연결 종료됨.
+ * io_uring은 recv 완료(ring_on_client_recv)가 데이터를 붙이므로 여기서는 recv를 걸어 두기만 */
+int conn_fill(EventLoop *loop, Connection *conn) {
+    if (loop->ring) {
+        if (conn->held.len > 0) {
+            buffer_append(&conn->scratch.in, conn->held.data, conn->held.len);
+            buffer_reset(&conn->held);
+            return 1;
         }
-        if (!title) {
-            title = safe_strdup("Unknown Document");
+        if (conn->peer_eof) {
+            conn_close(loop, conn);
+            return -1;
         }
+        if (!conn->recv_armed) conn_ring_recv(loop, conn);
+        return 0;
+    }
 
-        /* link 생성 - URL 인코딩 적용 */
-        char *encoded_title = url_encode(title);
-        size_t link_size = strlen(g_config.base_url) + strlen(encoded_title) + 1;
-        char *link = safe_malloc(link_size);
-        snprintf(link, link_size, "%s%s", g_config.base_url, encoded_title);
-        free(encoded_title);
-
-        /* old_text에서 snippet 추출 */
-        const char *content_key = strstr(source, "\"old_text\"");
-        char *snippet = NULL;
-        if (content_key) {
-            snippet = extract_json_string_value(content_key, "old_text");
+    int got = 0;
+    for (;;) {
+        if (conn->scratch.in.len > BUFFER_SIZE + MAX_HEADER_SIZE) return got;
+
+        buffer_reserve(&conn->scratch.in, 4096);
+        ssize_t n = recv(conn->fd, conn->scratch.in.data + conn->scratch.in.len,
+                         conn->scratch.in.cap - conn->scratch.in.len - 1, 0);
+        if (n > 0) {
+            conn->scratch.in.len += n;
+            conn->scratch.in.data[conn->scratch.in.len] = '\0';
+            conn->last_active = time(NULL);
+            got = 1;
+            continue;
+        }
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return got;
+        conn_close(loop, conn);  /* EOF 또는 오류 */
+        return -1;
+    }
+}
 
-            if (snippet) {
-                /* 최대 snippet_length 제한 (UTF-8 안전) */
-                if (strlen(snippet) > (size_t)g_config.snippet_length) {
-                    size_t safe_len = utf8_safe_truncate(snippet, g_config.snippet_length);
-                    snippet[safe_len] = '\0';
-                    snippet = safe_realloc(snippet, safe_len + 4);
-                    strcat(snippet, "...");
-                }
+/* 연결에서 지금 할 수 있는 일을 모두 진행: 쓰기 → (keep-alive) 다음 요청 → ... */
+void conn_drive(EventLoop *loop, Connection *conn) {
+    /* 배치 항목은 클라이언트 소켓이 없으므로 요청을 받은 연결을 진행 */
+    if (conn->batch_parent) conn = conn->batch_parent;
+
+    while (!conn->closed) {
+        if (conn->state == CONN_WAITING_UPSTREAM) return;
+
+        if (conn->state == CONN_WRITING) {
+            if (!conn_flush(loop, conn)) return;
+            metrics_observe(STAGE_SOCKET_WRITE, conn->write_start_us);
+            conn->body = NULL;
+            request_scratch_reset(&conn->scratch);  /* 응답 바디(scratch.body) 전송 완료 */
+            if (!conn->keep_alive) {
+                conn_close(loop, conn);
+                return;
             }
-        }
-        if (!snippet) {
-            snippet = safe_strdup("No content available");
+            buffer_consume(&conn->scratch.in, conn->request_len);
+            conn->request_len = 0;
+            conn->state = CONN_READING;
+            continue;
         }
 
-        /* 결과 저장 */
-        results[result_count].link = link;
-        results[result_count].title = title;
-        results[result_count].snippet = snippet;
-        result_count++;
+        /* CONN_READING: 버퍼에 완성된 요청이 있으면 (파이프라이닝) 바로 처리 */
+        long request_len = conn->scratch.in.len ? http_request_length(conn->scratch.in.data, conn->scratch.in.len) : 0;
+        if (request_len < 0) {
+            metrics_count(&g_metrics.requests[ROUTE_TOO_LARGE]);
+            conn->keep_alive = false;
+            conn_queue_response(conn, 413, "Payload Too Large", "application/json", TOO_LARGE_BODY,
+                                sizeof(TOO_LARGE_BODY) - 1);
+        } else if (request_len > 0) {
+            if (loop->ring && conn_ring_draining(conn)) return;
+            conn_dispatch(loop, conn, (size_t)request_len);
+        } else if (conn_fill(loop, conn) <= 0) {
+            return;
+        }
     }
-
-    return result_count;
 }
 
-int search_manticore(const char *query, int count, SearchResult *results) {
-    /* 템플릿 로드 */
-    char *template = load_template("rule_manticore.txt");
-    if (!template) {
-        return 0;
-    }
-
-    /* 템플릿 변수 치환 */
-    char *request_body = replace_template_vars(template, g_config.index_name, query, count);
-    free(template);  /* 템플릿 메모리 해제 */
+/* 클라이언트 소켓 이벤트 */
+void conn_on_client(EventLoop *loop, Connection *conn, uint32_t events) {
+    if (conn->closed) return;
 
-    printf("[Manticore] Connecting to: %s:%d%s\n",
-           g_config.manticore_host, g_config.manticore_port, g_config.manticore_path);
-    printf("[Manticore] Request: %s\n", request_body);
+    if (conn->state == CONN_WAITING_UPSTREAM) {
+        /* 업스트림 대기 중 클라이언트가 끊으면 정리 (파이프라인 데이터는 나중에 읽음) */
+        if (events & (EPOLLHUP | EPOLLERR)) conn_close(loop, conn);
+        return;
+    }
+    conn_drive(loop, conn);
+}
 
-#ifdef DEBUG
-    /* 디버그 로그: 검색 요청 */
-    char log_msg[2048];
-    snprintf(log_msg, sizeof(log_msg), "SEARCH_REQUEST | query=\"%s\" | count=%d | index=%s",
-             query, count, g_config.index_name);
-    write_debug_log("REQUEST", log_msg);
+/* 업스트림 소켓 이벤트 */
+void conn_on_upstream(EventLoop *loop, Connection *conn, int slot) {
+    if (conn->closed) return;
+    conn_advance_upstream(loop, conn, slot);
+    conn_drive(loop, conn);
+}
 
-    snprintf(log_msg, sizeof(log_msg), "MANTICORE_QUERY | %s", request_body);
-    write_debug_log("REQUEST", log_msg);
-#endif
+/* 선두 검색이 끝난 연결들: 나눠 받은 결과로 응답하거나 (선두가 실패했으면) 직접 검색 */
+void event_loop_resume_followers(EventLoop *loop) {
+    while (loop->woken) {
+        Connection *conn = conn_from_waiter(loop->woken);
+        loop->woken = loop->woken->next;
+        if (conn->closed || !conn->job_active) continue;
 
-    /* Manticore Search API 호출 */
-    char *response = http_post_request(g_config.manticore_host, g_config.manticore_port,
-                                      g_config.manticore_path, request_body);
-    free(request_body);
+        if (search_job_await_flight(&conn->job)) {
+            conn_finish_search(loop, conn);
+        } else {
+            conn_admit_upstream(loop, conn);
+        }
+        conn_drive(loop, conn);
+    }
+}
 
-    if (!response) {
-        printf("[Manticore] Error: No response\n");
-#ifdef DEBUG
-        write_debug_log("ERROR", "MANTICORE_NO_RESPONSE");
-#endif
-        return 0;
+/* 슬롯을 기다리는 연결: 앞에서부터 슬롯이 나는 대로 시작하고, admission_expire_us가 지났으면
+ * 도착한 지 queue_timeout_ms가 지난 연결을 거절 (응답하다 같은 배치의 다른 항목이 닫힐 수
+ * 있으므로 먼저 모두 떼어 낸 뒤) */
+void event_loop_admit_waiters(EventLoop *loop) {
+    while (loop->admission_head &&
+           search_job_admit(&loop->admission_head->job, loop->admission_head->scratch.received_us, false)) {
+        Connection *conn = loop->admission_head;
+        event_loop_unqueue_admission(loop, conn);
+        conn_start_upstream(loop, conn);
+        conn_drive(loop, conn);
+    }
+    if (!loop->admission_head) {
+        loop->admission_expire_us = 0;
+        return;
     }
 
-    printf("[Manticore] Response: %s\n", response);
+    uint64_t now = metrics_now_us();
+    if (now >= loop->admission_expire_us) {
+        Connection *expired = NULL;
+        Connection **link = &loop->admission_head;
+        loop->admission_tail = NULL;
+        loop->admission_expire_us = 0;
+        while (*link) {
+            Connection *conn = *link;
+            uint64_t deadline = admission_deadline_us(conn->scratch.received_us);
+            if (deadline <= now) {
+                *link = conn->admission_next;
+                conn->admission_queued = false;
+                __atomic_sub_fetch(&g_admission.waiting, 1, __ATOMIC_RELAXED);
+                conn->admission_next = expired;
+                expired = conn;
+                continue;
+            }
+            if (loop->admission_expire_us == 0 || deadline < loop->admission_expire_us) {
+                loop->admission_expire_us = deadline;
+            }
+            loop->admission_tail = conn;
+            link = &conn->admission_next;
+        }
+        while (expired) {
+            Connection *conn = expired;
+            expired = conn->admission_next;
+            conn->admission_next = NULL;
+            if (conn->closed) continue;
+            conn_shed_search(loop, conn);
+            conn_drive(loop, conn);
+        }
+    }
+    /* expire_upstream이 next_deadline_us를 다시 계산하므로 매번 반영 */
+    event_loop_note_deadline(loop, loop->admission_expire_us);
+}
 
-#ifdef DEBUG
-    /* 디버그 로그: 검색 응답 (요약) */
-    int response_len = strlen(response);
-    if (response_len > 500) {
-        char truncated[550];
-        strncpy(truncated, response, 500);
-        truncated[500] = '\0';
-        snprintf(log_msg, sizeof(log_msg), "MANTICORE_RESPONSE | length=%d | data=%s...",
-                 response_len, truncated);
+/* 선두를 기다리는 연결: deadline이 지났으면 합치기에서 빠져 직접 검색 (선두가 멈췄거나 너무 느림) */
+void event_loop_expire_follower(EventLoop *loop, Connection *conn, uint64_t now) {
+    SearchJob *job = &conn->job;
+    if (now < job->waiter.deadline_us) {
+        event_loop_note_deadline(loop, job->waiter.deadline_us);
+        return;
+    }
+    metrics_count(&g_metrics.search_coalesce_timeouts);
+    log_write(LOG_LEVEL_WARN, "[Search] Coalesced: \"%s\" still in flight after %dms, searching directly",
+              job->clean_query, job->config->timeout_ms > 0 ? job->config->timeout_ms : DEFAULT_UPSTREAM_TIMEOUT_MS);
+    search_job_leave_flight(job);
+    if (search_job_fail_fast(job)) {
+        conn_finish_search(loop, conn);
     } else {
-        snprintf(log_msg, sizeof(log_msg), "MANTICORE_RESPONSE | length=%d | data=%s",
-                 response_len, response);
+        conn_admit_upstream(loop, conn);
+    }
+    conn_drive(loop, conn);
+}
+
+/* 연결 하나의 hedge / deadline 검사 (event_loop_expire_upstream) */
+void event_loop_expire_conn(EventLoop *loop, Connection *conn, uint64_t now) {
+    bool waiting = (conn->state == CONN_WAITING_UPSTREAM);
+    if (waiting && conn->job_active && conn->job.waiter.linked) {
+        event_loop_expire_follower(loop, conn, now);
+        return;
+    }
+    if (waiting && conn->job_active) {
+        event_loop_note_deadline(loop, search_job_hedge(&conn->job, now));
+        conn_sync_upstream(loop, conn);
+        conn_maybe_finish_search(loop, conn);
+    }
+    for (int slot = 0; slot < UPSTREAM_SLOTS && conn->state == CONN_WAITING_UPSTREAM; slot++) {
+        if (!conn->upstream_active[slot]) continue;
+        UpstreamCall *call = &conn->scratch.upstream[slot];
+        if (upstream_call_expire(call, now)) {
+            conn_upstream_done(loop, conn, slot, call->state == UPSTREAM_DONE);
+        } else {
+            event_loop_note_deadline(loop, upstream_call_deadline(call, NULL));
+        }
     }
-    write_debug_log("RESPONSE", log_msg);
-#endif
-
-    /* 응답 파싱 */
-    int result_count = parse_manticore_response(response, count, results);
-    free(response);
-    printf("[Manticore] Found %d results\n", result_count);
-
-#ifdef DEBUG
-    /* 디버그 로그: 검색 결과 요약 */
-    snprintf(log_msg, sizeof(log_msg), "SEARCH_RESULT | found=%d results", result_count);
-    write_debug_log("RESULT", log_msg);
+    if (waiting && conn->state != CONN_WAITING_UPSTREAM) conn_drive(loop, conn);
+}
 
-    for (int i = 0; i < result_count; i++) {
-        snprintf(log_msg, sizeof(log_msg), "RESULT_%d | title=\"%s\" | link=\"%s\"",
-                 i + 1, results[i].title, results[i].link);
-        write_debug_log("RESULT", log_msg);
+/* deadline이 지난 업스트림 호출을 실패로 끝내고, hedge 시각이 된 쿼리는 두 번째 호출을
+ * 보내고, 다음 검사 시각을 다시 계산. 호출이 일찍 끝나도 next_deadline_us는 그대로라
+ * 한 번 헛검사할 뿐 */
+void event_loop_expire_upstream(EventLoop *loop) {
+    uint64_t now = metrics_now_us();
+    if (loop->next_deadline_us == 0 || now < loop->next_deadline_us) return;
+
+    loop->next_deadline_us = 0;
+    Connection *conn = loop->connections;
+    while (conn) {
+        Connection *next = conn->next;
+        /* 배치 항목은 연결 목록에 없으므로 요청을 받은 연결에서 */
+        for (int k = 0; k < conn->batch_count && !conn->closed; k++) {
+            if (!conn->batch[k]->closed) event_loop_expire_conn(loop, conn->batch[k], now);
+        }
+        if (!conn->closed) event_loop_expire_conn(loop, conn, now);
+        conn = next;
     }
-#endif
+}
 
-    return result_count;
+/* epoll_wait 대기 시간 - 유휴 정리를 위해 최대 1초, 업스트림 deadline이 더 이르면 그때까지 */
+int event_loop_timeout_ms(const EventLoop *loop) {
+    if (loop->next_deadline_us == 0) return 1000;
+    uint64_t now = metrics_now_us();
+    if (loop->next_deadline_us <= now) return 0;
+    uint64_t wait_ms = (loop->next_deadline_us - now + 999) / 1000;
+    return wait_ms < 1000 ? (int)wait_ms : 1000;
 }
 
-void free_search_results(SearchResult *results, int count) {
-    for (int i = 0; i < count; i++) {
-        if (results[i].link) free(results[i].link);
-        if (results[i].title) free(results[i].title);
-        if (results[i].snippet) free(results[i].snippet);
+/* 유휴 keep-alive 연결 정리 (요청 대기 중인 연결만) */
+void event_loop_sweep_idle(EventLoop *loop) {
+    time_t now = time(NULL);
+    Connection *conn = loop->connections;
+    while (conn) {
+        Connection *next = conn->next;
+        if (conn->state == CONN_READING && now - conn->last_active >= g_config.keepalive_timeout) {
+            conn_close(loop, conn);
+        }
+        conn = next;
     }
 }
 
-/* ============================
- * JSON 응답 생성
- * ============================ */
+/* 받은 연결을 목록에 추가 (epoll은 등록까지). 상한을 넘었거나 등록에 실패하면 닫고 NULL */
+Connection* event_loop_add_client(EventLoop *loop, int client_fd) {
+    if (loop->connection_count >= g_config.max_connections) {
+        close(client_fd);
+        return NULL;
+    }
 
-/* JSON 문자열 이스케이프 함수 */
-char* json_escape_string(const char *str) {
-    if (!str) return safe_strdup("");
+    Connection *conn = event_loop_new_connection(loop, client_fd);
+
+    if (!loop->ring) {
+        struct epoll_event ev;
+        ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+        ev.data.ptr = &conn->client_tag;
+        if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, client_fd, &ev) < 0) {
+            log_write(LOG_LEVEL_ERROR, "[Event] epoll_ctl client failed: %s", strerror(errno));
+            close(client_fd);
+            connection_free(conn);
+            return NULL;
+        }
+    }
 
-    size_t len = strlen(str);
-    char *escaped = safe_malloc(len * 2 + 1);  /* 최악의 경우 2배 크기 */
-    char *dst = escaped;
+    conn->next = loop->connections;
+    if (loop->connections) loop->connections->prev = conn;
+    loop->connections = conn;
+    loop->connection_count++;
+    return conn;
+}
 
-    for (const char *src = str; *src; src++) {
-        switch (*src) {
-            case '\n': *dst++ = ' '; break;  /* 개행 → 공백 */
-            case '\r': *dst++ = ' '; break;  /* 캐리지 리턴 → 공백 */
-            case '\t': *dst++ = ' '; break;  /* 탭 → 공백 */
-            case '"':  *dst++ = '\\'; *dst++ = '"'; break;   /* " → \" */
-            case '\\': *dst++ = '\\'; *dst++ = '\\'; break;  /* \ → \\ */
-            default:   *dst++ = *src; break;
+void event_loop_accept(EventLoop *loop) {
+    for (;;) {
+        int client_fd = accept4(loop->listen_fd, NULL, NULL, SOCK_NONBLOCK);
+        if (client_fd < 0) {
+            if (errno == EINTR) continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK && g_running) {
+                log_write(LOG_LEVEL_ERROR, "[Event] accept failed: %s", strerror(errno));
+            }
+            return;
         }
+        event_loop_add_client(loop, client_fd);
     }
-    *dst = '\0';
-    return escaped;
 }
 
-char* create_json_response(SearchResult *results, int count, int took_ms) {
-    char *response = safe_malloc(BUFFER_SIZE);
-    size_t offset = 0;
-    size_t remaining = BUFFER_SIZE;
+/* eventfd가 울림: 루프 밖에서 끝난 검색을 기다리던 연결을 loop->woken으로 (이번 배치 끝에 처리) */
+void event_loop_on_wake(EventLoop *loop) {
+    FlightWaiter *waiters = flight_take_remote(&g_flights);
+    while (waiters) {
+        FlightWaiter *next = waiters->next;
+        waiters->next = loop->woken;
+        loop->woken = waiters;
+        waiters = next;
+    }
+}
 
-    int written = snprintf(response + offset, remaining, "{\n  \"results\": [\n");
-    if (written > 0 && (size_t)written < remaining) {
-        offset += written;
-        remaining -= written;
+/* 루프 밖(캐시 갱신 스레드 등)에서 끝난 합치기 검색이 루프를 깨울 eventfd를 g_flights에 등록 */
+void event_loop_open_wake(EventLoop *loop) {
+    loop->wake_tag.kind = EVENT_WAKE;
+    loop->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (loop->wake_fd < 0) {
+        log_write(LOG_LEVEL_WARN, "[Event] eventfd failed (%s): coalesced searches wait for their deadline",
+                  strerror(errno));
+        return;
     }
+    flight_set_loop(&g_flights, loop->wake_fd);
+}
 
-    for (int i = 0; i < count; i++) {
-        char *escaped_link = json_escape_string(results[i].link);
-        char *escaped_title = json_escape_string(results[i].title);
-        char *escaped_snippet = json_escape_string(results[i].snippet);
-
-        written = snprintf(response + offset, remaining,
-                          "    {\n"
-                          "      \"link\": \"%s\",\n"
-                          "      \"title\": \"%s\",\n"
-                          "      \"snippet\": \"%s\"\n"
-                          "    }%s\n",
-                          escaped_link, escaped_title, escaped_snippet,
-                          (i < count - 1) ? "," : "");
-
-        free(escaped_link);
-        free(escaped_title);
-        free(escaped_snippet);
-
-        if (written > 0 && (size_t)written < remaining) {
-            offset += written;
-            remaining -= written;
-        } else {
-            break;  /* 버퍼 초과 */
-        }
+/* 등록을 풀고 그 사이 넘어온 검색의 참조를 반환 (연결은 모두 닫힌 뒤) */
+void event_loop_close_wake(EventLoop *loop) {
+    if (loop->wake_fd < 0) return;
+    flight_set_loop(&g_flights, -1);
+    flight_take_remote(&g_flights);
+    close(loop->wake_fd);
+    loop->wake_fd = -1;
+}
+
+/* 이벤트 배치가 끝날 때마다: deadline/hedge, 기다리던 연결 재개, admission, 유휴 정리, 해제 */
+void event_loop_tick(EventLoop *loop, time_t *last_sweep) {
+    event_loop_expire_upstream(loop);
+    event_loop_resume_followers(loop);
+    event_loop_admit_waiters(loop);
+
+    time_t now = time(NULL);
+    if (now != *last_sweep && g_config.keepalive_timeout > 0) {
+        event_loop_sweep_idle(loop);
+        *last_sweep = now;
     }
+    event_loop_reap(loop);
+}
 
-    written = snprintf(response + offset, remaining,
-                      "  ],\n"
-                      "  \"took_ms\": %d,\n"
-                      "  \"total\": %d,\n"
-                      "  \"engine\": \"manticore\"\n"
-                      "}",
-                      took_ms, count);
+/* 루프 종료: 남은 연결을 모두 닫음 (해제는 event_loop_free_all) */
+void event_loop_close_all(EventLoop *loop) {
+    while (loop->connections) {
+        conn_close(loop, loop->connections);
+    }
+    loop->woken = NULL;  /* 모두 닫혔음 */
+}
 
-    return response;
+void event_loop_free_all(EventLoop *loop) {
+    event_loop_reap(loop);
+    while (loop->spare) {
+        Connection *conn = loop->spare;
+        loop->spare = conn->next;
+        connection_free(conn);
+    }
 }
 
-/* ============================
- * HTTP 서버 함수
- * ============================ */
+#ifdef LKB_IO_URING
 
-void send_http_response(int client_fd, int status_code, const char *status_text,
-                       const char *content_type, const char *body) {
-    char header[2048];
+/* 리스너에 multishot accept - 연결마다 완료가 하나씩 옴 */
+void ring_arm_accept(EventLoop *loop) {
+    ring_reserve(loop->ring, 1);
+    struct io_uring_sqe *sqe = ring_get_sqe(loop->ring, IORING_OP_ACCEPT, loop->listen_fd, NULL, 0,
+                                            ring_tag(&loop->listener_tag, RING_OP_IN));
+    sqe->accept_flags = SOCK_NONBLOCK;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    loop->accept_armed = true;
+}
 
-    snprintf(header, sizeof(header),
-             "HTTP/1.1 %d %s\r\n"
-             "Content-Type: %s\r\n"
-             "Content-Length: %zu\r\n"
-             "Access-Control-Allow-Origin: *\r\n"
-             "Connection: close\r\n"
-             "\r\n",
-             status_code, status_text, content_type, strlen(body));
+/* eventfd에 read를 걸어 둠 - 울릴 때마다 ring_on_wake가 다시 검 */
+void ring_arm_wake(EventLoop *loop) {
+    if (loop->wake_fd < 0) return;
+    ring_reserve(loop->ring, 1);
+    ring_get_sqe(loop->ring, IORING_OP_READ, loop->wake_fd, &loop->wake_value, sizeof(loop->wake_value),
+                 ring_tag(&loop->wake_tag, RING_OP_IN));
+}
 
-    ssize_t header_written = write(client_fd, header, strlen(header));
-    if (header_written < 0) {
-        perror("write header failed");
+void ring_on_wake(EventLoop *loop, const struct io_uring_cqe *cqe) {
+    if (cqe->res < 0 && cqe->res != -EAGAIN && cqe->res != -EINTR) {
+        if (cqe->res != -ECANCELED && g_running) {
+            log_write(LOG_LEVEL_ERROR, "[Event] eventfd read failed: %s", strerror(-cqe->res));
+        }
         return;
     }
+    if (g_running) ring_arm_wake(loop);
+    event_loop_on_wake(loop);
+}
 
-    ssize_t body_written = write(client_fd, body, strlen(body));
-    if (body_written < 0) {
-        perror("write body failed");
+void ring_on_accept(EventLoop *loop, const struct io_uring_cqe *cqe) {
+    if (!(cqe->flags & IORING_CQE_F_MORE)) {
+        /* 오류로 끝났으면 (EMFILE 등) 바로 다시 걸면 같은 오류가 반복되므로 run_ring_loop가 1초 뒤에 */
+        loop->accept_armed = false;
+        if (cqe->res >= 0 && g_running) ring_arm_accept(loop);
+    }
+    if (cqe->res < 0) {
+        if (cqe->res != -ECANCELED && g_running) {
+            log_write(LOG_LEVEL_ERROR, "[Event] accept failed: %s", strerror(-cqe->res));
+        }
+        return;
+    }
+    if (!g_running) {
+        close(cqe->res);
+        return;
     }
+    Connection *conn = event_loop_add_client(loop, cqe->res);
+    if (conn) conn_drive(loop, conn);  /* 요청이 아직 없으므로 recv를 걸어 둠 */
 }
 
-void handle_search_request(int client_fd, const char *body) {
-    struct timespec start, end;
-    clock_gettime(CLOCK_MONOTONIC, &start);
-
-    /* 빈 요청 체크 */
-    if (!body || strlen(body) == 0) {
-        printf("[Search] Warning: Empty request body, ignoring\n");
-        char *empty_response = create_json_response(NULL, 0, 0);
-        send_http_response(client_fd, 200, "OK", "application/json", empty_response);
-        free(empty_response);
+/* 클라이언트 recv 완료 - 데이터를 붙이고 요청을 기다리던 중이면 진행 */
+void ring_on_client_recv(EventLoop *loop, Connection *conn, const struct io_uring_cqe *cqe) {
+    IoRing *ring = loop->ring;
+    if (!(cqe->flags & IORING_CQE_F_MORE)) {
+        conn->recv_armed = false;
+        conn->recv_cancel = false;
+        conn->ring_ops--;
+    }
+    if (cqe->flags & IORING_CQE_F_BUFFER) {
+        unsigned short bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+        if (cqe->res > 0 && !conn->closed) {
+            /* 요청을 처리하는 동안 scratch.in은 그 요청이 가리키고 있으므로 held에 따로 */
+            ByteBuffer *in = (conn->state == CONN_READING) ? &conn->scratch.in : &conn->held;
+            buffer_append(in, ring->buffers + (size_t)bid * RING_BUFFER_SIZE, (size_t)cqe->res);
+            conn->last_active = time(NULL);
+        }
+        ring_buffer_recycle(ring, bid);
+    }
+    if (conn->closed) return;
+
+    if (cqe->res == 0) {
+        conn->peer_eof = true;
+    } else if (cqe->res == -EINVAL && ring->recv_multishot) {
+        log_write(LOG_LEVEL_INFO, "[Event] io_uring: multishot recv not supported, using one-shot recv");
+        ring->recv_multishot = false;
+    } else if (cqe->res < 0 && cqe->res != -ENOBUFS && cqe->res != -ECANCELED) {
+        conn_close(loop, conn);
         return;
     }
 
-#ifdef DEBUG
-    /* Open WebUI로부터 받은 원본 요청 로그 기록 */
-    write_request_log(body);
-#endif
-
-    SearchRequest req;
-    parse_search_request(body, &req);
-
-    char *clean_query = normalize_search_query(req.query, req.queries, req.queries_count);
-
-    printf("[Search] Query: \"%s\" | Count: %d | Engine: manticore\n", clean_query, req.count);
-
-    SearchResult results[MAX_RESULTS];
-    int result_count = 0;
+    /* 받아 둔 바이트가 상한을 넘으면 그만 받음 (다시 읽을 차례가 되면 conn_fill이 다시 검) */
+    if (conn->recv_armed && !conn->recv_cancel &&
+        conn->scratch.in.len + conn->held.len > BUFFER_SIZE + MAX_HEADER_SIZE) {
+        ring_reserve(ring, 1);
+        ring_get_sqe(ring, IORING_OP_ASYNC_CANCEL, -1,
+                     (const void *)(uintptr_t)ring_tag(&conn->client_tag, RING_OP_IN), 0, 0);
+        conn->recv_cancel = true;
+    }
+    if (conn->state == CONN_READING) conn_drive(loop, conn);
+}
 
-    /* 빈 쿼리 처리 */
-    if (strlen(clean_query) == 0) {
-        printf("[Search] Warning: Empty query after normalization\n");
-    } else {
-        /* Manticore Search 호출 */
-        result_count = search_manticore(clean_query, req.count, results);
+/* 응답 sendmsg 완료 - 남았으면 conn_flush가 나머지를 다시 올림 */
+void ring_on_client_send(EventLoop *loop, Connection *conn, const struct io_uring_cqe *cqe) {
+    conn->send_pending = false;
+    conn->ring_ops--;
+    if (conn->closed) return;
+    if (cqe->res < 0) {
+        conn_close(loop, conn);
+        return;
     }
+    conn->out_sent += (size_t)cqe->res;
+    conn->last_active = time(NULL);
+    conn_drive(loop, conn);
+}
 
-    clock_gettime(CLOCK_MONOTONIC, &end);
-    int took_ms = (end.tv_sec - start.tv_sec) * 1000 + (end.tv_nsec - start.tv_nsec) / 1000000;
+/* slot에 걸린 요청이 모두 끝남 - 모아 둔 오류/EOF를 처리하고 (죽은 풀 연결이면 새 연결로 한 번 더)
+ * 남은 단계를 다시 올리거나 호출을 끝냄 */
+void conn_ring_upstream_step(EventLoop *loop, Connection *conn, int slot) {
+    UpstreamCall *call = &conn->scratch.upstream[slot];
+    int err = conn->upstream_error[slot];
+    bool eof = conn->upstream_eof[slot];
+    conn->upstream_error[slot] = 0;
+    conn->upstream_eof[slot] = false;
+
+    if ((err || eof) && call->state != UPSTREAM_DONE && call->state != UPSTREAM_FAILED) {
+        if (upstream_call_retry_fresh(call)) {
+            conn_ring_upstream(loop, conn, slot);
+            return;
+        }
+        if (call->state != UPSTREAM_FAILED) {
+            if (err) upstream_call_fail(call, err);
+            else upstream_call_receive_eof(call);
+        }
+    }
+    if (call->state == UPSTREAM_DONE || call->state == UPSTREAM_FAILED) {
+        conn_upstream_done(loop, conn, slot, call->state == UPSTREAM_DONE);
+        conn_drive(loop, conn);
+        return;
+    }
+    conn_ring_upstream(loop, conn, slot);
+}
 
-    char *json_response = create_json_response(results, result_count, took_ms);
-    send_http_response(client_fd, 200, "OK", "application/json", json_response);
+/* 업스트림 요청 완료 (connect 대기, send, recv 중 하나) */
+void ring_on_upstream(EventLoop *loop, Connection *conn, int slot, int op, const struct io_uring_cqe *cqe) {
+    IoRing *ring = loop->ring;
+    UpstreamCall *call = &conn->scratch.upstream[slot];
+    /* 끊은 호출(conn_release_upstream)이나 닫힌 연결의 완료는 세기만 */
+    bool live = !conn->closed && conn->upstream_active[slot];
+    conn->upstream_ops[slot]--;
+    conn->ring_ops--;
+
+    if (cqe->flags & IORING_CQE_F_BUFFER) {
+        unsigned short bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+        if (live && cqe->res > 0 && call->state == UPSTREAM_RECEIVING) {
+            upstream_call_receive(call, ring->buffers + (size_t)bid * RING_BUFFER_SIZE, (size_t)cqe->res);
+        }
+        ring_buffer_recycle(ring, bid);
+    }
+    if (!live) {
+        /* 이 완료를 기다리던 다음 요청 (conn_ring_draining) */
+        if (!conn->closed && conn->state == CONN_READING && !conn_ring_draining(conn)) conn_drive(loop, conn);
+        return;
+    }
 
-    free(clean_query);
-    free(json_response);
-    free_search_request(&req);
-    free_search_results(results, result_count);
+    int res = cqe->res;
+    int *err = &conn->upstream_error[slot];
+    if (op == RING_OP_CONNECT) {
+        if (res < 0 || (res & (POLLERR | POLLHUP))) {
+            int so_error = 0;
+            socklen_t len = sizeof(so_error);
+            getsockopt(call->fd, SOL_SOCKET, SO_ERROR, &so_error, &len);
+            if (!*err) *err = so_error ? so_error : (res < 0 ? -res : ECONNREFUSED);
+        } else if (call->state == UPSTREAM_CONNECTING) {
+            call->stage_start_us = metrics_observe(STAGE_UPSTREAM_CONNECT, call->stage_start_us);
+            call->state = UPSTREAM_SENDING;
+        }
+    } else if (op == RING_OP_OUT) {
+        if (res < 0) {
+            if (!*err) *err = -res;
+        } else if (call->state == UPSTREAM_SENDING) {
+            call->sent += (size_t)res;
+            if (call->sent >= call->request.len) {
+                call->stage_start_us = metrics_observe(STAGE_UPSTREAM_SEND, call->stage_start_us);
+                call->state = UPSTREAM_RECEIVING;
+            }
+        }
+    } else if (res == 0) {
+        conn->upstream_eof[slot] = true;
+    } else if (res < 0 && res != -ECANCELED && res != -ENOBUFS && !*err) {
+        *err = -res;
+    }
+    if (conn->upstream_ops[slot] == 0) conn_ring_upstream_step(loop, conn, slot);
 }
 
-void handle_root_request(int client_fd) {
-    const char *body = "{\"status\": \"running\", \"service\": \"LocalKnowledgeBase\", \"version\": \"1.0\"}";
-    send_http_response(client_fd, 200, "OK", "application/json", body);
+void ring_dispatch(EventLoop *loop, const struct io_uring_cqe *cqe) {
+    if (cqe->user_data == 0) return;  /* ASYNC_CANCEL 자신의 완료 */
+    EventTag *tag = (EventTag *)(uintptr_t)(cqe->user_data & ~(uint64_t)RING_OP_MASK);
+    int op = (int)(cqe->user_data & RING_OP_MASK);
+    switch (tag->kind) {
+        case EVENT_LISTENER: ring_on_accept(loop, cqe); break;
+        case EVENT_CLIENT:
+            if (op == RING_OP_OUT) ring_on_client_send(loop, tag->conn, cqe);
+            else ring_on_client_recv(loop, tag->conn, cqe);
+            break;
+        case EVENT_UPSTREAM: ring_on_upstream(loop, tag->conn, tag->slot, op, cqe); break;
+        case EVENT_WAKE: ring_on_wake(loop, cqe); break;
+    }
 }
 
-void handle_not_found(int client_fd) {
-    const char *body = "{\"error\": \"Not Found\"}";
-    send_http_response(client_fd, 404, "Not Found", "application/json", body);
+/* 완료된 CQE를 모두 처리 */
+void ring_process(EventLoop *loop) {
+    struct io_uring_cqe cqes[EPOLL_MAX_EVENTS];
+    unsigned n;
+    do {
+        n = ring_reap(loop->ring, cqes, EPOLL_MAX_EVENTS);
+        for (unsigned i = 0; i < n; i++) {
+            ring_dispatch(loop, &cqes[i]);
+        }
+    } while (n == EPOLL_MAX_EVENTS);
 }
 
-void handle_client(int client_fd) {
-    char *buffer = safe_malloc(BUFFER_SIZE);
-    ssize_t bytes_read = read(client_fd, buffer, BUFFER_SIZE - 1);
-
-    if (bytes_read <= 0) {
-        free(buffer);
-        return;
-    }
+/* io_uring 이벤트 루프: 같은 연결 상태 머신을 완료 기반으로 구동. 처리하면서 채운 요청
+ * (응답 send, 업스트림 send → recv, 다음 recv)은 다음 대기와 함께 io_uring_enter 한 번에 제출 */
+int run_ring_loop(EventLoop *loop) {
+    time_t last_sweep = time(NULL);
+    time_t last_accept = last_sweep;
+    int rc = 0;
 
-    buffer[bytes_read] = '\0';
+    ring_arm_accept(loop);
+    ring_arm_wake(loop);
+    while (g_running) {
+        int ret = ring_wait(loop->ring, event_loop_timeout_ms(loop));
+        if (ret < 0) {
+            log_write(LOG_LEVEL_ERROR, "[Event] io_uring_enter failed: %s", strerror(-ret));
+            rc = 1;
+            break;
+        }
+        ring_process(loop);
 
-#ifdef DEBUG
-    /* 전체 HTTP 요청 로그 (디버깅용) */
-    FILE *raw_log = fopen("00_raw_request.log", "a");
-    if (raw_log) {
         time_t now = time(NULL);
-        struct tm *tm_info = localtime(&now);
-        char timestamp[64];
-        strftime(timestamp, sizeof(timestamp), "%Y-%m-%d %H:%M:%S", tm_info);
-        fprintf(raw_log, "\n[%s] === RAW HTTP REQUEST (bytes: %zd) ===\n%s\n=== END ===\n",
-                timestamp, bytes_read, buffer);
-        fclose(raw_log);
+        if (!loop->accept_armed && now != last_accept && g_running) {
+            ring_arm_accept(loop);
+            last_accept = now;
+        }
+        event_loop_tick(loop, &last_sweep);
+    }
+
+    /* 닫은 소켓에 걸린 요청은 shutdown으로 바로 끝나지만 완료가 오기 전에는 연결 메모리를 놓을 수 없음 */
+    event_loop_close_all(loop);
+    uint64_t deadline = metrics_now_us() + (uint64_t)RING_DRAIN_MS * 1000;
+    for (event_loop_reap(loop); loop->graveyard && metrics_now_us() < deadline; event_loop_reap(loop)) {
+        if (ring_wait(loop->ring, 10) < 0) break;
+        ring_process(loop);
     }
+    event_loop_free_all(loop);
+    return rc;
+}
+
+#endif /* LKB_IO_URING */
+
+/* 단일 스레드 이벤트 루프: 클라이언트와 Manticore 소켓을 같은 epoll (또는 io_uring)에서 처리 */
+int run_event_loop(int listen_fd) {
+    EventLoop loop;
+    memset(&loop, 0, sizeof(loop));
+    loop.listen_fd = listen_fd;
+    loop.listener_tag.kind = EVENT_LISTENER;
+    set_nonblocking(listen_fd);
+    event_loop_open_wake(&loop);
+
+    if (strcmp(g_config.io_mode, "io_uring") == 0) {
+#ifdef LKB_IO_URING
+        IoRing ring;
+        if (ring_init(&ring)) {
+            loop.ring = &ring;
+            int rc = run_ring_loop(&loop);
+            ring_destroy(&ring);
+            event_loop_close_wake(&loop);
+            return rc;
+        }
+        log_write(LOG_LEVEL_WARN, "[Event] io_uring unavailable, using epoll");
+#else
+        log_write(LOG_LEVEL_WARN, "[Event] Built without io_uring support, using epoll");
 #endif
+    }
 
-    char method[16], path[256];
-    int parsed = sscanf(buffer, "%15s %255s", method, path);
-    if (parsed != 2) {
-        fprintf(stderr, "[HTTP] Invalid request format\n");
-        free(buffer);
-        handle_not_found(client_fd);
-        return;
+    loop.epoll_fd = epoll_create1(0);
+    if (loop.epoll_fd < 0) {
+        perror("epoll_create1 failed");
+        event_loop_close_wake(&loop);
+        return 1;
     }
 
-    if (strcmp(method, "POST") == 0 && strcmp(path, "/search") == 0) {
-        char *body = strstr(buffer, "\r\n\r\n");
-        if (body) {
-            body += 4;
-            handle_search_request(client_fd, body);
-        } else {
-            handle_not_found(client_fd);
+    struct epoll_event ev;
+    ev.events = EPOLLIN | EPOLLET;
+    ev.data.ptr = &loop.listener_tag;
+    if (epoll_ctl(loop.epoll_fd, EPOLL_CTL_ADD, listen_fd, &ev) < 0) {
+        perror("epoll_ctl listener failed");
+        close(loop.epoll_fd);
+        event_loop_close_wake(&loop);
+        return 1;
+    }
+    if (loop.wake_fd >= 0) {
+        ev.events = EPOLLIN | EPOLLET;
+        ev.data.ptr = &loop.wake_tag;
+        if (epoll_ctl(loop.epoll_fd, EPOLL_CTL_ADD, loop.wake_fd, &ev) < 0) {
+            log_write(LOG_LEVEL_WARN, "[Event] epoll_ctl eventfd failed: %s", strerror(errno));
+            event_loop_close_wake(&loop);
         }
-    } else if (strcmp(method, "GET") == 0 && strcmp(path, "/") == 0) {
-        handle_root_request(client_fd);
-    } else {
-        handle_not_found(client_fd);
     }
 
-    free(buffer);
+    struct epoll_event events[EPOLL_MAX_EVENTS];
+    time_t last_sweep = time(NULL);
+    while (g_running) {
+        int n = epoll_wait(loop.epoll_fd, events, EPOLL_MAX_EVENTS, event_loop_timeout_ms(&loop));
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            log_write(LOG_LEVEL_ERROR, "[Event] epoll_wait failed: %s", strerror(errno));
+            break;
+        }
+
+        for (int i = 0; i < n; i++) {
+            EventTag *tag = events[i].data.ptr;
+            switch (tag->kind) {
+                case EVENT_LISTENER: event_loop_accept(&loop); break;
+                case EVENT_CLIENT:   conn_on_client(&loop, tag->conn, events[i].events); break;
+                case EVENT_UPSTREAM: conn_on_upstream(&loop, tag->conn, tag->slot); break;
+                case EVENT_WAKE: {
+                    uint64_t count;
+                    while (read(loop.wake_fd, &count, sizeof(count)) == sizeof(count)) {}
+                    event_loop_on_wake(&loop);
+                    break;
+                }
+            }
+        }
+        event_loop_tick(&loop, &last_sweep);
+    }
+
+    event_loop_close_all(&loop);
+    event_loop_free_all(&loop);
+    close(loop.epoll_fd);
+    event_loop_close_wake(&loop);
+    return 0;
 }
 
 /* 데몬화 함수 */
@@ -1262,11 +9770,287 @@ void daemonize(const char *working_dir) {
     open("/dev/null", O_WRONLY);  /* stderr */
 }
 
+/* ============================
+ * 다중 프로세스 (lkb.processes, SO_REUSEPORT)
+ * ============================ */
+
+/*
+ * lkb.processes > 1이면 main()의 프로세스는 감독만 한다. 워커 프로세스 N개를 fork하고,
+ * 각 워커는 SO_REUSEPORT 소켓을 따로 열어 같은 포트에 listen 한다. 커널이 새 연결을
+ * 소켓마다 나눠 주므로 프로세스 사이에 공유하는 상태가 없다 (캐시, 연결 풀, 지표는
+ * 프로세스마다 따로). 감독 프로세스는 죽은 워커를 다시 띄우고, SIGHUP은 워커에 전달,
+ * SIGINT/SIGTERM이면 워커를 모두 종료시킨 뒤 끝난다. fork는 스레드를 만들기 전에 한다.
+ */
+
+typedef struct {
+    pid_t pid;            /* 0 = 실행 중 아님 */
+    time_t started;
+    time_t restart_at;    /* pid가 0일 때 다시 띄울 시각 */
+    int restart_delay;    /* 시작하자마자 죽으면 두 배씩 (최대 SUPERVISOR_MAX_RESTART_DELAY) */
+} SupervisedProcess;
+
+/* 워커 프로세스 index의 CPU: 이 프로세스에 허용된 CPU 중 index번째 (넘으면 순환), 없으면 -1 */
+int process_cpu(int index) {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    if (sched_getaffinity(0, sizeof(set), &set) != 0) return -1;
+    int count = CPU_COUNT(&set);
+    if (count <= 0) return -1;
+
+    int nth = index % count;
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+        if (CPU_ISSET(cpu, &set) && nth-- == 0) return cpu;
+    }
+    return -1;
+}
+
+/* 현재 프로세스 (이후 만드는 스레드 포함)를 CPU 하나에 고정, 고정한 CPU 반환 (실패 -1) */
+int process_pin_cpu(int index) {
+    int cpu = process_cpu(index);
+    if (cpu < 0) return -1;
+
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    if (sched_setaffinity(0, sizeof(set), &set) != 0) {
+        log_write(LOG_LEVEL_WARN, "[Server] Cannot pin process %d to CPU %d: %s", index, cpu, strerror(errno));
+        return -1;
+    }
+    return cpu;
+}
+
+/* 워커 프로세스 하나 fork. 자식에서는 true를 반환하고 main()이 서버 시작을 이어간다 */
+bool supervisor_spawn(SupervisedProcess *proc, int index) {
+    pid_t supervisor = getpid();
+    fflush(stdout);
+    fflush(stderr);
+
+    pid_t pid = fork();
+    if (pid < 0) {
+        log_write(LOG_LEVEL_ERROR, "[Supervisor] fork failed for worker %d: %s", index, strerror(errno));
+        proc->restart_at = time(NULL) + SUPERVISOR_MIN_UPTIME;
+        return false;
+    }
+    if (pid == 0) {
+        /* 감독 프로세스가 죽으면 같이 종료 (fork 직후 이미 죽었으면 바로) */
+        prctl(PR_SET_PDEATHSIG, SIGTERM);
+        if (getppid() != supervisor) exit(EXIT_FAILURE);
+        log_close_sinks();  /* 워커는 log_start()에서 다시 염 */
+        g_process_index = index;
+        return true;
+    }
+
+    proc->pid = pid;
+    proc->started = time(NULL);
+    log_write(LOG_LEVEL_INFO, "[Supervisor] Worker %d started (pid %d)", index, (int)pid);
+    return false;
+}
+
+void supervisor_signal_all(const SupervisedProcess *procs, int count, int signum) {
+    for (int i = 0; i < count; i++) {
+        if (procs[i].pid > 0) kill(procs[i].pid, signum);
+    }
+}
+
+/* 끝난 워커를 회수하고 재시작 시각을 정함 */
+void supervisor_reap(SupervisedProcess *procs, int count) {
+    int status;
+    pid_t pid;
+    while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+        for (int i = 0; i < count; i++) {
+            if (procs[i].pid != pid) continue;
+
+            time_t now = time(NULL);
+            SupervisedProcess *proc = &procs[i];
+            if (now - proc->started < SUPERVISOR_MIN_UPTIME) {
+                proc->restart_delay = proc->restart_delay ? proc->restart_delay * 2 : 1;
+                if (proc->restart_delay > SUPERVISOR_MAX_RESTART_DELAY) {
+                    proc->restart_delay = SUPERVISOR_MAX_RESTART_DELAY;
+                }
+            } else {
+                proc->restart_delay = 0;
+            }
+            proc->pid = 0;
+            proc->restart_at = now + proc->restart_delay;
+
+            if (WIFSIGNALED(status)) {
+                log_write(LOG_LEVEL_ERROR, "[Supervisor] Worker %d (pid %d) killed by signal %d, restarting in %ds",
+                          i, (int)pid, WTERMSIG(status), proc->restart_delay);
+            } else {
+                log_write(LOG_LEVEL_WARN, "[Supervisor] Worker %d (pid %d) exited with status %d, restarting in %ds",
+                          i, (int)pid, WEXITSTATUS(status), proc->restart_delay);
+            }
+            break;
+        }
+    }
+}
+
+/* 남은 워커에 SIGTERM, SUPERVISOR_STOP_TIMEOUT 안에 안 끝나면 SIGKILL */
+void supervisor_stop(SupervisedProcess *procs, int count) {
+    supervisor_signal_all(procs, count, SIGTERM);
+    time_t deadline = time(NULL) + SUPERVISOR_STOP_TIMEOUT;
+    bool killed = false;
+
+    for (;;) {
+        int status;
+        pid_t pid;
+        while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+            for (int i = 0; i < count; i++) {
+                if (procs[i].pid == pid) procs[i].pid = 0;
+            }
+        }
+        int running = 0;
+        for (int i = 0; i < count; i++) {
+            if (procs[i].pid > 0) running++;
+        }
+        if (running == 0) break;
+        if (!killed && time(NULL) >= deadline) {
+            log_write(LOG_LEVEL_WARN, "[Supervisor] %d worker%s still running after %ds, killing",
+                      running, running == 1 ? "" : "s", SUPERVISOR_STOP_TIMEOUT);
+            supervisor_signal_all(procs, count, SIGKILL);
+            killed = true;
+        }
+        poll(NULL, 0, SUPERVISOR_POLL_MS);
+    }
+}
+
+/* lkb.processes > 1: 워커 프로세스를 띄우고 감시. 워커(자식)에서만 반환하며 그 번호를 돌려주고,
+ * 감독 프로세스는 종료 신호를 받으면 워커를 모두 멈춘 뒤 여기서 exit 한다 */
+int supervisor_run(int processes) {
+    SupervisedProcess procs[MAX_PROCESSES];
+    memset(procs, 0, sizeof(procs));
+
+    signal(SIGCHLD, SIG_DFL);  /* daemonize()가 무시로 바꿔 둠, waitpid로 회수 */
+    log_open_sinks();
+    log_write(LOG_LEVEL_INFO, "[Supervisor] pid %d starting %d worker processes on port %d",
+              (int)getpid(), processes, g_config.port);
+
+    for (int i = 0; i < processes; i++) {
+        if (supervisor_spawn(&procs[i], i)) return i;
+    }
+
+    while (g_running) {
+        if (g_reload_config) {
+            g_reload_config = 0;
+            supervisor_signal_all(procs, processes, SIGHUP);
+        }
+        if (g_reopen_logs) {
+            g_reopen_logs = 0;
+            log_close_sinks();
+            log_open_sinks();
+        }
+
+        supervisor_reap(procs, processes);
+        time_t now = time(NULL);
+        for (int i = 0; i < processes && g_running; i++) {
+            if (procs[i].pid == 0 && now >= procs[i].restart_at) {
+                if (supervisor_spawn(&procs[i], i)) return i;
+            }
+        }
+        poll(NULL, 0, SUPERVISOR_POLL_MS);
+    }
+
+    log_write(LOG_LEVEL_INFO, "[Supervisor] Stopping worker processes");
+    supervisor_stop(procs, processes);
+    log_write(LOG_LEVEL_INFO, "[Supervisor] All worker processes stopped");
+    log_close_sinks();
+    exit(EXIT_SUCCESS);
+}
+
+/* 시작 시 설정 요약 (다중 프로세스면 워커 0만) */
+void print_banner() {
+    printf("LocalKnowledgeBase C Server\n");
+    printf("✓ Server running on http://%s:%d\n", g_config.listen, g_config.port);
+    printf("✓ Manticore Search integration enabled\n");
+    printf("  - Host%s:", g_config.backend_count > 1 ? "s (least outstanding requests)" : "");
+    for (int i = 0; i < g_config.backend_count; i++) {
+        printf("%s %s:%d", i ? "," : "", g_config.backends[i].host, g_config.backends[i].port);
+    }
+    printf("\n");
+    printf("  - Index: %s\n", g_config.index_name);
+    printf("  - Request template: %s\n", g_config.template_file);
+    printf("  - Base URL: %s\n", g_config.base_url);
+    printf("  - Default search count: %d\n", g_config.search_count);
+    printf("  - Snippet length: %d (%s)\n", g_config.snippet_length, g_config.snippet_mode);
+    if (g_query_rules.max_tokens > 0) {
+        printf("  - Query normalization: up to %d words, %d stopwords\n", g_query_rules.max_tokens,
+               g_query_rules.stopword_count);
+    } else {
+        printf("  - Query normalization: all words, %d stopwords\n", g_query_rules.stopword_count);
+    }
+    printf("  - Text kernels: %s\n", g_text.name);
+    printf("  - Log level: %s (%s)\n", LOG_LEVEL_NAMES[g_config.log_level],
+           g_config.log_file[0] ? g_config.log_file : "stdout/stderr");
+    if (g_capture.fd >= 0) {
+        printf("  - Capture: search requests to %s (1 in %d)\n", g_config.capture_file,
+               g_config.capture_sample_rate);
+    }
+    printf("  - Config reload: on SIGHUP or when config.yaml / the template changes (checked every %ds)\n",
+           CONFIG_CHECK_INTERVAL);
+    printf("  - Upstream deadlines: connect %dms, first byte %dms, total %dms (0 = none)\n",
+           g_config.connect_timeout_ms, g_config.first_byte_timeout_ms, g_config.timeout_ms);
+    if (g_config.breaker_enabled) {
+        printf("  - Circuit breaker: open at %d%% errors (min %d calls / %ds), probe every %ds\n",
+               g_config.breaker_error_rate, g_config.breaker_min_requests, g_config.breaker_window,
+               g_config.breaker_cooldown);
+        if (g_config.health_check_interval > 0) {
+            printf("  - Health checks: every %ds per backend\n", g_config.health_check_interval);
+        }
+    }
+    if (g_config.hedge && g_config.backend_count > 1) {
+        printf("  - Hedging: second backend after the p95 latency (min %dms)\n", g_config.hedge_min_ms);
+    }
+    if (g_config.admission_enabled) {
+        printf("  - Admission: %d-%d concurrent searches (adaptive%s), wait %dms, then 503\n",
+               g_config.admission_min_in_flight, g_config.admission_max_in_flight,
+               g_config.admission_latency_target_ms > 0 ? ", latency target" : "",
+               g_config.admission_queue_timeout_ms);
+    }
+    if (g_config.title_index_file[0]) {
+        printf("  - Title index: %s (%s)\n", g_config.title_index_file,
+               g_config.title_index_prefix ? "exact matches, prefix matches added to Manticore results" : "exact matches");
+    }
+    if (g_config.cache_enabled) {
+        printf("  - Result cache: %zu bytes, ttl %ds (stale %ds), empty results %ds\n", g_config.cache_max_bytes,
+               g_config.cache_ttl, g_config.cache_stale_ttl, g_config.cache_negative_ttl);
+        if (g_config.cache_soft_ttl > 0) {
+            printf("  - Cache refresh: entries older than %ds are served and refreshed in the background\n",
+                   g_config.cache_soft_ttl);
+        }
+    }
+    if (g_config.stream_results) {
+        if (strcmp(g_config.io_mode, "threads") != 0) {
+            printf("  - Streaming: off (lkb.stream_results needs io_mode threads)\n");
+        } else {
+            printf("  - Streaming: chunked results for count >= %d\n", g_config.stream_min_count);
+        }
+    }
+    if (g_config.link_cache_bytes) {
+        printf("  - Link cache: %zu bytes in %d shards\n", g_config.link_cache_bytes, LINK_CACHE_SHARDS);
+    }
+    if (strcmp(g_config.io_mode, "threads") != 0) {
+        printf("  - I/O mode: %s (max connections: %d, backlog: %d)\n",
+               g_config.io_mode, g_config.max_connections, g_config.backlog);
+    } else {
+        printf("  - Workers: %d (queue: %d, backlog: %d)\n",
+               g_config.workers, g_config.queue_size, g_config.backlog);
+    }
+    if (g_config.processes > 1) {
+        printf("  - Processes: %d (SO_REUSEPORT listener each%s, restarted by supervisor pid %d)\n",
+               g_config.processes, g_config.cpu_affinity ? ", pinned to CPUs" : "", (int)getppid());
+    }
+    printf("\nPress Ctrl+C to stop\n\n");
+}
+
+/* bench/처럼 이 파일을 #include 해서 내부 함수를 직접 호출할 때는 LKB_NO_MAIN 정의 */
+#ifndef LKB_NO_MAIN
 int main(int argc, char *argv[]) {
     int client_fd;
     struct sockaddr_in server_addr, client_addr;
     socklen_t client_len = sizeof(client_addr);
     bool daemon_mode = false;
+    int workers_override = 0;
+    int processes_override = 0;
     char cwd[1024];
 
     /* 현재 작업 디렉토리 저장 */
@@ -1279,10 +10063,16 @@ int main(int argc, char *argv[]) {
     for (int i = 1; i < argc; i++) {
         if (strcmp(argv[i], "-d") == 0 || strcmp(argv[i], "--daemon") == 0) {
             daemon_mode = true;
+        } else if ((strcmp(argv[i], "-w") == 0 || strcmp(argv[i], "--workers") == 0) && i + 1 < argc) {
+            workers_override = atoi(argv[++i]);
+        } else if ((strcmp(argv[i], "-p") == 0 || strcmp(argv[i], "--processes") == 0) && i + 1 < argc) {
+            processes_override = atoi(argv[++i]);
         } else if (strcmp(argv[i], "-h") == 0 || strcmp(argv[i], "--help") == 0) {
             printf("Usage: %s [OPTIONS]\n", argv[0]);
             printf("Options:\n");
             printf("  -d, --daemon    Run in daemon mode\n");
+            printf("  -w, --workers N Number of worker threads (overrides lkb.workers)\n");
+            printf("  -p, --processes N Number of worker processes sharing the port (overrides lkb.processes)\n");
             printf("  -h, --help      Show this help message\n");
             return 0;
         }
@@ -1296,21 +10086,31 @@ int main(int argc, char *argv[]) {
     /* 시그널 핸들러 설정 */
     signal(SIGINT, signal_handler);
     signal(SIGTERM, signal_handler);
+    signal(SIGHUP, signal_handler);   /* 설정/템플릿 다시 읽기, 로그 파일 다시 열기 */
+    signal(SIGPIPE, SIG_IGN);  /* 끊긴 클라이언트에 write 시 프로세스 종료 방지 */
     atexit(cleanup_resources);
 
-    /* 설정 파일 로드 */
-    if (!load_config("config.yaml", &g_config)) {
-        /* 기본값으로 초기화 */
-        safe_strncpy(g_config.listen, "0.0.0.0", sizeof(g_config.listen));
-        g_config.port = DEFAULT_PORT;
-        safe_strncpy(g_config.manticore_host, "127.0.0.1", sizeof(g_config.manticore_host));
-        g_config.manticore_port = 29308;
-        safe_strncpy(g_config.manticore_path, "/search", sizeof(g_config.manticore_path));
-        safe_strncpy(g_config.index_name, "wiki_main", sizeof(g_config.index_name));
-        safe_strncpy(g_config.base_url, "http://localhost/mediawiki/index.php/", sizeof(g_config.base_url));
-        g_config.search_count = DEFAULT_SEARCH_COUNT;
-        g_config.snippet_length = MAX_SNIPPET_LEN;
+    text_kernels_init();  /* CPU에 맞는 SIMD 텍스트 커널 선택 */
+
+    /* 설정 파일 로드 (실패 시 load_config가 채운 기본값 사용) */
+    load_config("config.yaml", &g_config);
+    Config file_config = g_config;  /* 다시 읽을 때 비교 기준 (명령행 재정의 전) */
+    if (workers_override > 0) {
+        g_config.workers = workers_override > MAX_WORKERS ? MAX_WORKERS : workers_override;
+    }
+    if (processes_override > 0) {
+        g_config.processes = processes_override > MAX_PROCESSES ? MAX_PROCESSES : processes_override;
+    }
+    query_rules_compile(&g_query_rules, &g_config);  /* query.* (시작 시 설정) */
+    /* 캡처 파일은 fork 전에 열어서 워커 프로세스가 같은 fd에 덧붙임 */
+    if (g_config.capture_file[0]) {
+        capture_open(&g_capture, g_config.capture_file);
+    }
+    /* 다중 프로세스: 여기서 워커 프로세스를 fork (감독 프로세스는 돌아오지 않음) */
+    if (g_config.processes > 1) {
+        supervisor_run(g_config.processes);
     }
+    log_start();  /* 이후 런타임 로그는 기록 스레드가 출력 */
 
     g_server_fd = socket(AF_INET, SOCK_STREAM, 0);
     if (g_server_fd < 0) {
@@ -1320,6 +10120,11 @@ int main(int argc, char *argv[]) {
 
     int opt = 1;
     setsockopt(g_server_fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+    /* 워커 프로세스마다 같은 포트에 listen, 커널이 연결을 나눠 줌 */
+    if (g_config.processes > 1 && setsockopt(g_server_fd, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt)) < 0) {
+        perror("SO_REUSEPORT failed");
+        return 1;
+    }
 
     memset(&server_addr, 0, sizeof(server_addr));
     server_addr.sin_family = AF_INET;
@@ -1341,34 +10146,102 @@ int main(int argc, char *argv[]) {
         return 1;
     }
 
-    if (listen(g_server_fd, 10) < 0) {
+    if (listen(g_server_fd, g_config.backlog) < 0) {
         perror("listen failed");
         return 1;
     }
 
-    printf("LocalKnowledgeBase C Server\n");
-    printf("✓ Server running on http://%s:%d\n", g_config.listen, g_config.port);
-    printf("✓ Manticore Search integration enabled\n");
-    printf("  - Host: %s:%d\n", g_config.manticore_host, g_config.manticore_port);
-    printf("  - Index: %s\n", g_config.index_name);
-    printf("  - Base URL: %s\n", g_config.base_url);
-    printf("  - Default search count: %d\n", g_config.search_count);
-    printf("  - Snippet length: %d\n", g_config.snippet_length);
-    printf("\nPress Ctrl+C to stop\n\n");
+    if (g_process_index == 0) {
+        print_banner();
+    }
+    if (g_config.processes > 1) {
+        int cpu = g_config.cpu_affinity ? process_pin_cpu(g_process_index) : -1;
+        char cpu_text[32] = "";
+        if (cpu >= 0) snprintf(cpu_text, sizeof(cpu_text), ", CPU %d", cpu);
+        log_write(LOG_LEVEL_INFO, "[Server] Worker process %d (pid %d%s) listening on port %d",
+                  g_process_index, (int)getpid(), cpu_text, g_config.port);
+    }
+
+    if (g_config.cache_enabled) {
+        result_cache_init(&g_result_cache, g_config.cache_max_bytes, g_config.cache_ttl,
+                          g_config.cache_stale_ttl, g_config.cache_soft_ttl, g_config.cache_negative_ttl);
+    }
+    link_cache_init(&g_link_cache, g_config.link_cache_bytes);
+    admission_init(&g_admission);
+
+    /* 제목 색인은 시작 시 mmap (못 열면 모든 검색을 Manticore로) */
+    if (g_config.title_index_file[0]) {
+        title_index_open(&g_title_index, g_config.title_index_file);
+    }
+
+    /* 첫 설정 스냅샷: 요청 템플릿 컴파일, Manticore 주소 해석, replica마다 차단기/확인 스레드.
+     * 이후 SIGHUP 또는 config.yaml / 템플릿 변경 시 감시 스레드가 새 스냅샷으로 교체 */
+    config_store_init(&g_configs, "config.yaml", &file_config);
+    cache_refresher_start(&g_cache_refresher);
+
+    if (strcmp(g_config.io_mode, "threads") != 0) {
+        int rc = run_event_loop(g_server_fd);
+        printf("[Server] Shutting down gracefully...\n");
+        cache_refresher_stop(&g_cache_refresher);
+        config_store_destroy(&g_configs);  /* 감시/확인 스레드 종료, Manticore keep-alive 연결 닫기 */
+        capture_shutdown(&g_capture);
+        log_shutdown();
+        result_cache_destroy(&g_result_cache);
+        link_cache_destroy(&g_link_cache);
+        title_index_close(&g_title_index);
+        memory_stats_report();
+        return rc;
+    }
+
+    /* 워커 스레드 시작 */
+    pthread_t workers[MAX_WORKERS];
+    int started = 0;
+    work_queue_init(&g_work_queue, g_config.queue_size);
+    for (int i = 0; i < g_config.workers; i++) {
+        if (pthread_create(&workers[i], NULL, worker_main, NULL) != 0) {
+            perror("pthread_create failed");
+            break;
+        }
+        started++;
+    }
+    if (started == 0) {
+        fprintf(stderr, "[Server] No worker threads could be started\n");
+        return 1;
+    }
 
     while (g_running) {
+        client_len = sizeof(client_addr);
         client_fd = accept(g_server_fd, (struct sockaddr*)&client_addr, &client_len);
         if (client_fd < 0) {
-            if (g_running) {
-                perror("accept failed");
+            if (g_running && errno != EINTR) {
+                log_write(LOG_LEVEL_ERROR, "[Server] accept failed: %s", strerror(errno));
             }
             continue;
         }
 
-        handle_client(client_fd);
-        close(client_fd);
+        if (!work_queue_push(&g_work_queue, client_fd)) {
+            close(client_fd);
+        }
     }
 
     printf("[Server] Shutting down gracefully...\n");
+
+    /* 큐를 닫고 처리 중인 요청이 끝날 때까지 대기 */
+    work_queue_close(&g_work_queue);
+    admission_wake_all(&g_admission);  /* 슬롯을 기다리던 요청은 바로 거절 */
+    for (int i = 0; i < started; i++) {
+        pthread_join(workers[i], NULL);
+    }
+    work_queue_destroy(&g_work_queue);
+    cache_refresher_stop(&g_cache_refresher);
+    config_store_destroy(&g_configs);  /* 감시/확인 스레드 종료, Manticore keep-alive 연결 닫기 */
+    capture_shutdown(&g_capture);
+    log_shutdown();
+    result_cache_destroy(&g_result_cache);
+    link_cache_destroy(&g_link_cache);
+    title_index_close(&g_title_index);
+    memory_stats_report();
+
     return 0;
 }
+#endif /* LKB_NO_MAIN */
@@ -0,0 +1,662 @@
+/*
+ * bench_load - closed-loop HTTP 부하 발생기 + stub Manticore
+ *
+ * 같은 프로세스 안에서 기록된 응답을 돌려주는 stub Manticore를 띄우고,
+ * 연결 N개가 각자 "요청 → 응답 수신 → 다음 요청"을 반복하며 LKB 서버(/search)를
+ * 호출한다. 워밍업 후 측정 구간의 처리량과 지연 분포(p50/p99/p999)를 출력.
+ *
+ * -r 캡처파일: 서버가 log.capture_file에 남긴 요청을 기록된 간격대로 (-x 배속,
+ * 0 = 기다리지 않고 최대 속도) 연결 N개로 나눠 보낸다. 지연은 원래 보낼 시각부터
+ * 재므로 재생이 밀리면 그만큼 지연에 드러난다.
+ *
+ * 사용법: cd bench && ../LocalKnowledgeBase &   (bench/config.yaml 사용)
+ *         ./bench_load [-c 연결수] [-d 초] [-w 워밍업초] [-p LKB포트] [-u stub포트]
+ *                      [-f 응답파일] [-n 쿼리종류] [-D stub지연us] [-K] [-S]
+ *                      [-r 캡처파일] [-x 배속]
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <time.h>
+#include <stdbool.h>
+#include <signal.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <sys/uio.h>
+
+#define LOAD_DEFAULT_CONNECTIONS 16
+#define LOAD_DEFAULT_SECONDS 5
+#define LOAD_DEFAULT_WARMUP 1
+#define LOAD_DEFAULT_PORT 17777
+#define LOAD_DEFAULT_STUB_PORT 39308
+#define LOAD_DEFAULT_PAYLOAD "data/manticore_hits.json"
+#define LOAD_DEFAULT_QUERIES 1000
+#define LOAD_MAX_CONNECTIONS 1024
+#define LOAD_IO_BUFFER 65536
+#define REPLAY_IO_BUFFER (2 * 1024 * 1024) /* 재생: 배치 응답도 받도록 서버 BUFFER_SIZE와 같게 */
+#define REPLAY_LATE_SECONDS 0.01           /* 재생: 예정 시각보다 이만큼 늦게 보내면 late로 셈 */
+
+/* LocalKnowledgeBase.c의 캡처 파일 형식 (CaptureFileHeader, CaptureRecord와 같은 배치) */
+#define CAPTURE_MAGIC "LKBCAP01"
+#define CAPTURE_VERSION 1
+#define CAPTURE_SEARCH 1
+#define CAPTURE_BATCH 2
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t record_size;
+} CaptureFileHeader;
+
+typedef struct {
+    uint64_t time_us;
+    uint32_t len;
+    uint16_t kind;
+    uint16_t reserved;
+} CaptureRecord;
+
+/* 재생할 요청 하나 (본문은 읽어 둔 캡처 파일을 가리킴) */
+typedef struct {
+    const char *body;
+    uint32_t len;
+    uint16_t kind;
+    uint64_t offset_us;   /* 첫 요청부터의 간격 */
+} ReplayRequest;
+
+typedef struct {
+    int connections;
+    double seconds;
+    double warmup;
+    int port;
+    int stub_port;
+    const char *payload_file;
+    int queries;          /* 서로 다른 쿼리 수 (캐시가 켜진 서버에서 히트율 조절) */
+    int stub_delay_us;    /* stub 응답 전 지연 (Manticore 처리 시간 흉내) */
+    bool keep_alive;      /* false = 요청마다 새 연결 */
+    bool stub;            /* false = stub을 띄우지 않고 실제 Manticore 사용 */
+    const char *replay_file; /* 캡처 재생 (NULL = 합성 쿼리로 closed-loop) */
+    double speed;         /* 재생 배속 (0 = 최대 속도) */
+} LoadConfig;
+
+/* 연결(스레드)별 측정 결과 */
+typedef struct {
+    int id;
+    uint32_t *latencies;  /* 마이크로초 */
+    size_t count;
+    size_t cap;
+    long errors;
+    long reconnects;
+    long shed;            /* 재생: 503 (admission이 거절) */
+    long late;            /* 재생: 예정 시각보다 REPLAY_LATE_SECONDS 넘게 늦게 보냄 */
+} LoadWorker;
+
+static LoadConfig g_load;
+static char *g_payload;
+static size_t g_payload_len;
+static volatile int g_measuring = 0;
+static volatile int g_stop = 0;
+static char *g_capture;
+static ReplayRequest *g_replay;
+static size_t g_replay_count;
+static size_t g_replay_next;      /* 다음에 보낼 요청 (워커들이 원자적으로 가져감) */
+static double g_replay_start;
+
+double load_now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+char* load_payload(const char *filename, size_t *len) {
+    FILE *fp = fopen(filename, "rb");
+    if (!fp) return NULL;
+    fseek(fp, 0, SEEK_END);
+    long size = ftell(fp);
+    fseek(fp, 0, SEEK_SET);
+    char *data = malloc(size + 1);
+    if (!data || fread(data, 1, size, fp) != (size_t)size) {
+        free(data);
+        fclose(fp);
+        return NULL;
+    }
+    data[size] = '\0';
+    fclose(fp);
+    *len = size;
+    return data;
+}
+
+bool write_all(int fd, const char *data, size_t len) {
+    while (len > 0) {
+        ssize_t n = send(fd, data, len, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return false;
+        }
+        data += n;
+        len -= n;
+    }
+    return true;
+}
+
+/* 헤더 + Content-Length 바디 하나를 완전히 읽음. 다음 요청 바이트는 buf에 남김 */
+long read_http_message(int fd, char *buf, size_t cap, size_t *have, int *status) {
+    while (1) {
+        buf[*have] = '\0';
+        char *header_end = strstr(buf, "\r\n\r\n");
+        if (header_end) {
+            size_t header_len = header_end + 4 - buf;
+            long body_len = 0;
+            char *cl = strcasestr(buf, "Content-Length:");
+            if (cl && cl < header_end) body_len = atol(cl + 15);
+            if (status) {
+                *status = 0;
+                if (strncmp(buf, "HTTP/", 5) == 0) sscanf(buf, "%*s %d", status);
+            }
+            if (header_len + body_len > cap - 1) return -1;
+            if (*have >= header_len + body_len) return header_len + body_len;
+        }
+        if (*have >= cap - 1) return -1;
+        ssize_t n = recv(fd, buf + *have, cap - 1 - *have, 0);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return -1;
+        *have += n;
+    }
+}
+
+void set_nodelay(int fd) {
+    int opt = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &opt, sizeof(opt));
+}
+
+/* ============================
+ * stub Manticore
+ * ============================ */
+
+void* stub_connection(void *arg) {
+    int fd = (int)(intptr_t)arg;
+    char *buf = malloc(LOAD_IO_BUFFER);
+    size_t have = 0;
+    char header[256];
+    int header_len = snprintf(header, sizeof(header),
+                              "HTTP/1.1 200 OK\r\n"
+                              "Content-Type: application/json; charset=UTF-8\r\n"
+                              "Content-Length: %zu\r\n"
+                              "\r\n", g_payload_len);
+    set_nodelay(fd);
+
+    while (1) {
+        long msg_len = read_http_message(fd, buf, LOAD_IO_BUFFER, &have, NULL);
+        if (msg_len < 0) break;
+        memmove(buf, buf + msg_len, have - msg_len);
+        have -= msg_len;
+
+        if (g_load.stub_delay_us > 0) usleep(g_load.stub_delay_us);
+
+        struct iovec iov[2] = {
+            { .iov_base = header, .iov_len = header_len },
+            { .iov_base = g_payload, .iov_len = g_payload_len },
+        };
+        if (writev(fd, iov, 2) < header_len + (ssize_t)g_payload_len) break;
+    }
+
+    close(fd);
+    free(buf);
+    return NULL;
+}
+
+void* stub_accept_loop(void *arg) {
+    int server_fd = (int)(intptr_t)arg;
+    while (1) {
+        int fd = accept(server_fd, NULL, NULL);
+        if (fd < 0) {
+            if (errno == EINTR) continue;
+            break;
+        }
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, stub_connection, (void *)(intptr_t)fd) != 0) {
+            close(fd);
+            continue;
+        }
+        pthread_detach(thread);
+    }
+    return NULL;
+}
+
+bool stub_start(int port) {
+    int server_fd = socket(AF_INET, SOCK_STREAM, 0);
+    int opt = 1;
+    setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(port);
+    if (bind(server_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(server_fd, 512) < 0) {
+        perror("[Stub] bind/listen failed");
+        close(server_fd);
+        return false;
+    }
+
+    pthread_t thread;
+    pthread_create(&thread, NULL, stub_accept_loop, (void *)(intptr_t)server_fd);
+    pthread_detach(thread);
+    return true;
+}
+
+/* ============================
+ * 부하 발생기
+ * ============================ */
+
+int load_connect(int port) {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(port);
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        close(fd);
+        return -1;
+    }
+    set_nodelay(fd);
+    return fd;
+}
+
+void record_latency(LoadWorker *w, double seconds) {
+    if (w->count == w->cap) {
+        w->cap = w->cap ? w->cap * 2 : 65536;
+        w->latencies = realloc(w->latencies, sizeof(uint32_t) * w->cap);
+    }
+    uint64_t us = (uint64_t)(seconds * 1e6);
+    w->latencies[w->count++] = us > UINT32_MAX ? UINT32_MAX : (uint32_t)us;
+}
+
+void* load_worker(void *arg) {
+    LoadWorker *w = arg;
+    char *buf = malloc(LOAD_IO_BUFFER);
+    char request[512];
+    int fd = -1;
+    unsigned long n = (unsigned long)w->id * 7919;
+
+    while (!g_stop) {
+        if (fd < 0) {
+            fd = load_connect(g_load.port);
+            if (fd < 0) {
+                w->errors++;
+                usleep(10000);
+                continue;
+            }
+        }
+
+        char body[128];
+        int body_len = snprintf(body, sizeof(body), "{\"query\": \"bench query %lu\", \"count\": 5}",
+                                n++ % g_load.queries);
+        int request_len = snprintf(request, sizeof(request),
+                                   "POST /search HTTP/1.1\r\n"
+                                   "Host: 127.0.0.1\r\n"
+                                   "Content-Type: application/json\r\n"
+                                   "Connection: %s\r\n"
+                                   "Content-Length: %d\r\n"
+                                   "\r\n%s",
+                                   g_load.keep_alive ? "keep-alive" : "close", body_len, body);
+
+        double start = load_now();
+        size_t have = 0;
+        int status = 0;
+        bool ok = write_all(fd, request, request_len) &&
+                  read_http_message(fd, buf, LOAD_IO_BUFFER, &have, &status) > 0 &&
+                  status == 200;
+        double elapsed = load_now() - start;
+
+        bool measuring = g_measuring && !g_stop;
+        if (!ok) {
+            if (measuring) w->errors++;
+            close(fd);
+            fd = -1;
+            continue;
+        }
+        if (measuring) record_latency(w, elapsed);
+
+        /* 서버가 닫겠다고 했거나 keep-alive를 쓰지 않으면 다시 연결 (헤더만 확인) */
+        char *header_end = strstr(buf, "\r\n\r\n");
+        if (header_end) *header_end = '\0';
+        if (!g_load.keep_alive || strcasestr(buf, "Connection: close")) {
+            close(fd);
+            fd = -1;
+            if (measuring && g_load.keep_alive) w->reconnects++;
+        }
+    }
+
+    if (fd >= 0) close(fd);
+    free(buf);
+    return NULL;
+}
+
+/* ============================
+ * 캡처 재생
+ * ============================ */
+
+/* 캡처 파일을 읽어 요청 목록으로. 다중 프로세스 서버가 같은 파일을 다시 열면 헤더가
+ * 중간에 다시 나올 수 있어 레코드 경계의 헤더는 건너뜀 */
+bool replay_load(const char *path) {
+    size_t size;
+    g_capture = load_payload(path, &size);
+    if (!g_capture) {
+        fprintf(stderr, "[Replay] Cannot read %s\n", path);
+        return false;
+    }
+
+    size_t pos = 0;
+    size_t cap = 0;
+    uint64_t first_us = 0;
+    while (pos < size) {
+        if (size - pos >= sizeof(CaptureFileHeader) &&
+            memcmp(g_capture + pos, CAPTURE_MAGIC, 8) == 0) {
+            CaptureFileHeader header;
+            memcpy(&header, g_capture + pos, sizeof(header));
+            if (header.version != CAPTURE_VERSION || header.record_size != sizeof(CaptureRecord)) {
+                fprintf(stderr, "[Replay] %s: unsupported capture version %u\n", path, header.version);
+                return false;
+            }
+            pos += sizeof(header);
+            continue;
+        }
+        if (pos == 0) {
+            fprintf(stderr, "[Replay] %s is not a capture file (log.capture_file)\n", path);
+            return false;
+        }
+
+        CaptureRecord record;
+        if (size - pos < sizeof(record)) break;
+        memcpy(&record, g_capture + pos, sizeof(record));
+        if (size - pos - sizeof(record) < record.len) break;
+        pos += sizeof(record);
+
+        if (g_replay_count == cap) {
+            cap = cap ? cap * 2 : 4096;
+            g_replay = realloc(g_replay, sizeof(ReplayRequest) * cap);
+        }
+        if (g_replay_count == 0) first_us = record.time_us;
+        ReplayRequest *r = &g_replay[g_replay_count++];
+        r->body = g_capture + pos;
+        r->len = record.len;
+        r->kind = record.kind;
+        r->offset_us = record.time_us > first_us ? record.time_us - first_us : 0;
+        pos += record.len;
+    }
+    if (pos < size) {
+        fprintf(stderr, "[Replay] %s: ignoring %zu bytes of a truncated last record\n", path, size - pos);
+    }
+    return true;
+}
+
+void* replay_worker(void *arg) {
+    LoadWorker *w = arg;
+    char *buf = malloc(REPLAY_IO_BUFFER);
+    char header[256];
+    int fd = -1;
+
+    while (!g_stop) {
+        size_t i = __atomic_fetch_add(&g_replay_next, 1, __ATOMIC_RELAXED);
+        if (i >= g_replay_count) break;
+        const ReplayRequest *r = &g_replay[i];
+
+        /* 기록된 간격대로: 예정 시각까지 기다리고, 늦었으면 예정 시각부터 지연을 잼 */
+        double start = load_now();
+        if (g_load.speed > 0) {
+            double scheduled = g_replay_start + r->offset_us / 1e6 / g_load.speed;
+            if (scheduled > start) {
+                usleep((useconds_t)((scheduled - start) * 1e6));
+                start = load_now();
+            } else {
+                if (start - scheduled > REPLAY_LATE_SECONDS) w->late++;
+                start = scheduled;
+            }
+        }
+
+        if (fd < 0) {
+            fd = load_connect(g_load.port);
+            if (fd < 0) {
+                w->errors++;
+                continue;
+            }
+        }
+
+        int header_len = snprintf(header, sizeof(header),
+                                  "POST %s HTTP/1.1\r\n"
+                                  "Host: 127.0.0.1\r\n"
+                                  "Content-Type: application/json\r\n"
+                                  "Connection: %s\r\n"
+                                  "Content-Length: %u\r\n"
+                                  "\r\n",
+                                  r->kind == CAPTURE_BATCH ? "/search/batch" : "/search",
+                                  g_load.keep_alive ? "keep-alive" : "close", r->len);
+        size_t have = 0;
+        int status = 0;
+        bool sent = send(fd, header, header_len, MSG_NOSIGNAL | MSG_MORE) == header_len &&
+                    write_all(fd, r->body, r->len);
+        bool ok = sent && read_http_message(fd, buf, REPLAY_IO_BUFFER, &have, &status) > 0;
+        double elapsed = load_now() - start;
+
+        if (!ok) {
+            w->errors++;
+            close(fd);
+            fd = -1;
+            continue;
+        }
+        if (status == 200) {
+            record_latency(w, elapsed);
+        } else if (status == 503) {
+            w->shed++;
+        } else {
+            w->errors++;
+        }
+
+        char *header_end = strstr(buf, "\r\n\r\n");
+        if (header_end) *header_end = '\0';
+        if (!g_load.keep_alive || strcasestr(buf, "Connection: close")) {
+            close(fd);
+            fd = -1;
+            if (g_load.keep_alive) w->reconnects++;
+        }
+    }
+
+    if (fd >= 0) close(fd);
+    free(buf);
+    return NULL;
+}
+
+int compare_u32(const void *a, const void *b) {
+    uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+uint32_t percentile(const uint32_t *sorted, size_t count, double p) {
+    if (count == 0) return 0;
+    size_t index = (size_t)(p * (count - 1) + 0.5);
+    return sorted[index];
+}
+
+void usage(const char *prog) {
+    printf("Usage: %s [OPTIONS]\n", prog);
+    printf("Options:\n");
+    printf("  -c N      Concurrent connections (default %d)\n", LOAD_DEFAULT_CONNECTIONS);
+    printf("  -d SEC    Measured duration (default %d)\n", LOAD_DEFAULT_SECONDS);
+    printf("  -w SEC    Warmup before measuring (default %d)\n", LOAD_DEFAULT_WARMUP);
+    printf("  -p PORT   LKB server port (default %d)\n", LOAD_DEFAULT_PORT);
+    printf("  -u PORT   Stub Manticore port (default %d)\n", LOAD_DEFAULT_STUB_PORT);
+    printf("  -f FILE   Recorded Manticore response served by the stub (default %s)\n", LOAD_DEFAULT_PAYLOAD);
+    printf("  -n N      Distinct queries to cycle through (default %d)\n", LOAD_DEFAULT_QUERIES);
+    printf("  -D USEC   Stub delay before each response (default 0)\n");
+    printf("  -K        New connection per request (no keep-alive)\n");
+    printf("  -S        Do not start the stub (use a real Manticore)\n");
+    printf("  -r FILE   Replay a capture written by the server (log.capture_file) instead\n");
+    printf("  -x SPEED  Replay speed: 1 = as captured, 2 = twice as fast, 0 = as fast as possible (default 1)\n");
+}
+
+int main(int argc, char *argv[]) {
+    g_load.connections = LOAD_DEFAULT_CONNECTIONS;
+    g_load.seconds = LOAD_DEFAULT_SECONDS;
+    g_load.warmup = LOAD_DEFAULT_WARMUP;
+    g_load.port = LOAD_DEFAULT_PORT;
+    g_load.stub_port = LOAD_DEFAULT_STUB_PORT;
+    g_load.payload_file = LOAD_DEFAULT_PAYLOAD;
+    g_load.queries = LOAD_DEFAULT_QUERIES;
+    g_load.keep_alive = true;
+    g_load.stub = true;
+    g_load.speed = 1;
+
+    for (int i = 1; i < argc; i++) {
+        bool has_value = i + 1 < argc;
+        if (strcmp(argv[i], "-c") == 0 && has_value) {
+            g_load.connections = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-d") == 0 && has_value) {
+            g_load.seconds = atof(argv[++i]);
+        } else if (strcmp(argv[i], "-w") == 0 && has_value) {
+            g_load.warmup = atof(argv[++i]);
+        } else if (strcmp(argv[i], "-p") == 0 && has_value) {
+            g_load.port = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-u") == 0 && has_value) {
+            g_load.stub_port = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-f") == 0 && has_value) {
+            g_load.payload_file = argv[++i];
+        } else if (strcmp(argv[i], "-n") == 0 && has_value) {
+            g_load.queries = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-D") == 0 && has_value) {
+            g_load.stub_delay_us = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-K") == 0) {
+            g_load.keep_alive = false;
+        } else if (strcmp(argv[i], "-S") == 0) {
+            g_load.stub = false;
+        } else if (strcmp(argv[i], "-r") == 0 && has_value) {
+            g_load.replay_file = argv[++i];
+        } else if (strcmp(argv[i], "-x") == 0 && has_value) {
+            g_load.speed = atof(argv[++i]);
+        } else {
+            usage(argv[0]);
+            return strcmp(argv[i], "-h") == 0 ? 0 : 1;
+        }
+    }
+    if (g_load.connections < 1) g_load.connections = 1;
+    if (g_load.connections > LOAD_MAX_CONNECTIONS) g_load.connections = LOAD_MAX_CONNECTIONS;
+    if (g_load.queries < 1) g_load.queries = 1;
+    if (g_load.speed < 0) g_load.speed = 0;
+
+    signal(SIGPIPE, SIG_IGN);
+
+    if (g_load.replay_file && !replay_load(g_load.replay_file)) return 1;
+
+    if (g_load.stub) {
+        g_payload = load_payload(g_load.payload_file, &g_payload_len);
+        if (!g_payload) {
+            fprintf(stderr, "[Load] Cannot read %s (run from the bench/ directory)\n", g_load.payload_file);
+            return 1;
+        }
+        if (!stub_start(g_load.stub_port)) return 1;
+        printf("[Stub] Manticore stub on 127.0.0.1:%d serving %s (%zu bytes)\n",
+               g_load.stub_port, g_load.payload_file, g_payload_len);
+    }
+
+    /* 서버가 뜰 때까지 최대 5초 대기 */
+    int probe = -1;
+    for (int i = 0; i < 50 && probe < 0; i++) {
+        probe = load_connect(g_load.port);
+        if (probe < 0) usleep(100000);
+    }
+    if (probe < 0) {
+        fprintf(stderr, "[Load] LKB server not reachable on 127.0.0.1:%d\n", g_load.port);
+        return 1;
+    }
+    close(probe);
+
+    LoadWorker *workers = calloc(g_load.connections, sizeof(LoadWorker));
+    pthread_t *threads = calloc(g_load.connections, sizeof(pthread_t));
+    double start, elapsed;
+
+    if (g_load.replay_file) {
+        /* 캡처를 한 번 끝까지 재생 (워밍업 없음, 모든 요청을 측정) */
+        double captured = g_replay_count ? g_replay[g_replay_count - 1].offset_us / 1e6 : 0;
+        if (g_load.speed > 0) {
+            printf("[Replay] %zu requests over %.1fs from %s, %gx speed (about %.1fs), %d connections\n",
+                   g_replay_count, captured, g_load.replay_file, g_load.speed, captured / g_load.speed,
+                   g_load.connections);
+        } else {
+            printf("[Replay] %zu requests from %s as fast as possible, %d connections\n",
+                   g_replay_count, g_load.replay_file, g_load.connections);
+        }
+        g_replay_start = start = load_now();
+        for (int i = 0; i < g_load.connections; i++) {
+            workers[i].id = i;
+            pthread_create(&threads[i], NULL, replay_worker, &workers[i]);
+        }
+        for (int i = 0; i < g_load.connections; i++) {
+            pthread_join(threads[i], NULL);
+        }
+        elapsed = load_now() - start;
+    } else {
+        for (int i = 0; i < g_load.connections; i++) {
+            workers[i].id = i;
+            pthread_create(&threads[i], NULL, load_worker, &workers[i]);
+        }
+
+        printf("[Load] %d connections, %s, %.1fs warmup + %.1fs measured\n", g_load.connections,
+               g_load.keep_alive ? "keep-alive" : "connection per request", g_load.warmup, g_load.seconds);
+        usleep((useconds_t)(g_load.warmup * 1e6));
+        g_measuring = 1;
+        start = load_now();
+        usleep((useconds_t)(g_load.seconds * 1e6));
+        g_stop = 1;
+        elapsed = load_now() - start;
+        for (int i = 0; i < g_load.connections; i++) {
+            pthread_join(threads[i], NULL);
+        }
+    }
+
+    /* 전체 지연을 모아 정렬 후 백분위 계산 */
+    size_t total = 0;
+    long errors = 0, reconnects = 0, shed = 0, late = 0;
+    for (int i = 0; i < g_load.connections; i++) {
+        total += workers[i].count;
+        errors += workers[i].errors;
+        reconnects += workers[i].reconnects;
+        shed += workers[i].shed;
+        late += workers[i].late;
+    }
+    uint32_t *all = malloc(sizeof(uint32_t) * (total ? total : 1));
+    size_t pos = 0;
+    for (int i = 0; i < g_load.connections; i++) {
+        memcpy(all + pos, workers[i].latencies, sizeof(uint32_t) * workers[i].count);
+        pos += workers[i].count;
+        free(workers[i].latencies);
+    }
+    qsort(all, total, sizeof(uint32_t), compare_u32);
+
+    printf("[Load] requests=%zu errors=%ld reconnects=%ld\n", total, errors, reconnects);
+    if (g_load.replay_file) {
+        printf("[Replay] shed=%ld (503 overloaded) late=%ld (sent over %.0fms behind the capture)\n",
+               shed, late, REPLAY_LATE_SECONDS * 1000);
+    }
+    printf("[Load] throughput: %.1f req/s\n", total / elapsed);
+    printf("[Load] latency (us): p50=%u p90=%u p99=%u p999=%u max=%u\n",
+           percentile(all, total, 0.50), percentile(all, total, 0.90),
+           percentile(all, total, 0.99), percentile(all, total, 0.999),
+           total ? all[total - 1] : 0);
+
+    free(all);
+    free(workers);
+    free(threads);
+    free(g_payload);
+    free(g_replay);
+    free(g_capture);
+    return errors > 0 ? 2 : 0;
+}
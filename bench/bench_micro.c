@@ -0,0 +1,295 @@
+/*
+ * bench_micro - LocalKnowledgeBase 핫 패스 마이크로벤치마크
+ *
+ * 서버 소스를 그대로 include 해서 서버와 같은 코드를 측정한다.
+ * 기록된 Manticore 응답(data/ 아래 JSON)으로 응답 파싱, JSON escape, URL 인코딩,
+ * UTF-8 자르기, 요청 템플릿 렌더링, 결과 JSON 생성을 반복 실행하고
+ * 호출당 시간과 처리량을 출력한다.
+ *
+ * 사용법: cd bench && ./bench_micro [-t 초] [-f 이름필터]
+ */
+
+#define LKB_NO_MAIN
+#include "../LocalKnowledgeBase.c"
+
+#define BENCH_DATA_DIR "data"
+#define BENCH_DEFAULT_SECONDS 0.5
+
+typedef struct {
+    Arena arena;
+    ByteBuffer out;
+    char *hits;              /* 기록된 응답 (UTF-8 그대로) */
+    char *hits_escaped;      /* 같은 응답, 비ASCII를 \uXXXX로 */
+    char *empty;             /* 결과 0건 응답 */
+    SearchResult results[MAX_RESULTS];
+    int result_count;
+    CompiledTemplate *tpl;
+    char *encode_buf;
+} BenchContext;
+
+typedef size_t (*BenchFn)(BenchContext *ctx);  /* 한 번 실행, 처리한 바이트 수 반환 */
+
+typedef struct {
+    const char *name;
+    BenchFn fn;
+} BenchCase;
+
+static volatile size_t g_bench_sink;  /* 결과를 버리지 않게 해서 최적화로 사라지는 것 방지 */
+
+double bench_now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+char* bench_load_data(const char *name) {
+    char path[512];
+    snprintf(path, sizeof(path), "%s/%s", BENCH_DATA_DIR, name);
+    char *data = load_file(path);
+    if (!data) {
+        fprintf(stderr, "[Bench] Cannot read %s (run from the bench/ directory)\n", path);
+        exit(1);
+    }
+    return data;
+}
+
+/* ---- 측정 대상 ---- */
+
+size_t bench_parse_hits(BenchContext *ctx) {
+    SearchResult results[MAX_RESULTS];
+    arena_reset(&ctx->arena);
+    g_bench_sink += parse_manticore_response(&ctx->arena, &g_config, ctx->hits, MAX_RESULTS, NULL, results);
+    return strlen(ctx->hits);
+}
+
+size_t bench_parse_hits_escaped(BenchContext *ctx) {
+    SearchResult results[MAX_RESULTS];
+    arena_reset(&ctx->arena);
+    g_bench_sink += parse_manticore_response(&ctx->arena, &g_config, ctx->hits_escaped, MAX_RESULTS, NULL, results);
+    return strlen(ctx->hits_escaped);
+}
+
+/* snippet_mode: match - 본문 중간 단어 주변 스니펫 / 단어가 없어 앞부분으로 돌아가는 경우 */
+size_t bench_parse_hits_match(BenchContext *ctx) {
+    SearchResult results[MAX_RESULTS];
+    arena_reset(&ctx->arena);
+    g_bench_sink += parse_manticore_response(&ctx->arena, &g_config, ctx->hits, MAX_RESULTS, "VRAM 레지스터", results);
+    return strlen(ctx->hits);
+}
+
+size_t bench_parse_hits_match_miss(BenchContext *ctx) {
+    SearchResult results[MAX_RESULTS];
+    arena_reset(&ctx->arena);
+    g_bench_sink += parse_manticore_response(&ctx->arena, &g_config, ctx->hits, MAX_RESULTS, "nomatchterm", results);
+    return strlen(ctx->hits);
+}
+
+/* 링크 캐시 적중 경로 - 인기 문서처럼 같은 제목이 매번 다시 나오는 경우 */
+size_t bench_parse_hits_link_cache(BenchContext *ctx) {
+    SearchResult results[MAX_RESULTS];
+    arena_reset(&ctx->arena);
+    g_link_cache.enabled = true;
+    g_bench_sink += parse_manticore_response(&ctx->arena, &g_config, ctx->hits, MAX_RESULTS, NULL, results);
+    g_link_cache.enabled = false;
+    return strlen(ctx->hits);
+}
+
+size_t bench_parse_empty(BenchContext *ctx) {
+    SearchResult results[MAX_RESULTS];
+    arena_reset(&ctx->arena);
+    g_bench_sink += parse_manticore_response(&ctx->arena, &g_config, ctx->empty, MAX_RESULTS, NULL, results);
+    return strlen(ctx->empty);
+}
+
+/* 응답 본문용 escape (결과 필드) - 긴 문자열로 응답 전체를 사용 */
+size_t bench_json_append_escaped(BenchContext *ctx) {
+    size_t len = json_escaped_len(ctx->hits);
+    ctx->out.len = 0;
+    json_append_escaped(&ctx->out, ctx->hits, len);
+    g_bench_sink += ctx->out.len;
+    return strlen(ctx->hits);
+}
+
+/* 요청 템플릿용 escape (쿼리/인덱스명) */
+size_t bench_json_string_escape(BenchContext *ctx) {
+    size_t len = json_string_escaped_len(ctx->hits);
+    buffer_reserve(&ctx->out, len);
+    char *end = json_string_escape_into(ctx->out.data, ctx->hits);
+    g_bench_sink += end - ctx->out.data;
+    return strlen(ctx->hits);
+}
+
+size_t bench_url_encode(BenchContext *ctx) {
+    size_t bytes = 0;
+    for (int i = 0; i < ctx->result_count; i++) {
+        g_bench_sink += url_encode_into(ctx->encode_buf, ctx->results[i].title);
+        bytes += strlen(ctx->results[i].title);
+    }
+    return bytes;
+}
+
+/* 결과 link 만들기 (base_url + 인코딩) - 캐시 없이 / 링크 캐시 적중 */
+size_t bench_result_link(BenchContext *ctx, bool cached) {
+    size_t bytes = 0;
+    size_t link_len;
+    arena_reset(&ctx->arena);
+    g_link_cache.enabled = cached;
+    for (int i = 0; i < ctx->result_count; i++) {
+        g_bench_sink += (size_t)search_result_link(&ctx->arena, &g_config, ctx->results[i].title, &link_len);
+        bytes += strlen(ctx->results[i].title);
+    }
+    g_link_cache.enabled = false;
+    return bytes;
+}
+
+size_t bench_result_link_encode(BenchContext *ctx) {
+    return bench_result_link(ctx, false);
+}
+
+size_t bench_result_link_cached(BenchContext *ctx) {
+    return bench_result_link(ctx, true);
+}
+
+/* 스니펫 자르기 - 응답 안의 여러 위치에서 snippet_length 만큼 */
+size_t bench_utf8_truncate(BenchContext *ctx) {
+    size_t len = strlen(ctx->hits);
+    size_t bytes = 0;
+    for (size_t offset = 0; offset + 256 < len; offset += 997) {
+        g_bench_sink += utf8_safe_truncate(ctx->hits + offset, g_config.snippet_length);
+        bytes += g_config.snippet_length;
+    }
+    return bytes;
+}
+
+size_t bench_template_render(BenchContext *ctx) {
+    ctx->out.len = 0;
+    template_render(ctx->tpl, &ctx->out, &g_config, "MSX \"Turbo R\" 사운드 칩", 5);
+    g_bench_sink += ctx->out.len;
+    return ctx->out.len;
+}
+
+/* 쿼리 정규화 - Open WebUI가 보내는 <think> 블록 + JSON으로 감싼 쿼리 */
+size_t bench_normalize_query(BenchContext *ctx) {
+    static const char query[] =
+        "<think>사용자가 MSX 사운드 칩을 묻고 있으니 검색어를 만든다</think>\n"
+        "{\"queries\": [\"MSX Turbo R 사운드 칩\", \"MSX-MUSIC\"]}";
+    char *key;
+    arena_reset(&ctx->arena);
+    g_bench_sink += strlen(normalize_search_query(&ctx->arena, query, NULL, 0, &key));
+    return sizeof(query) - 1;
+}
+
+size_t bench_create_json_results(BenchContext *ctx) {
+    ctx->out.len = 0;
+    create_json_results(&ctx->out, ctx->results, ctx->result_count);
+    g_bench_sink += ctx->out.len;
+    return ctx->out.len;
+}
+
+/* ---- 실행 ---- */
+
+/* 시간 예산을 채울 때까지 반복 횟수를 늘려가며 실행 */
+void bench_run(BenchContext *ctx, const BenchCase *bc, double seconds) {
+    size_t bytes = bc->fn(ctx);  /* 워밍업, 1회당 바이트 */
+    long iterations = 0;
+    long batch = 16;
+    double start = bench_now();
+    double elapsed = 0;
+
+    while (elapsed < seconds) {
+        for (long i = 0; i < batch; i++) {
+            bc->fn(ctx);
+        }
+        iterations += batch;
+        elapsed = bench_now() - start;
+        if (elapsed < seconds / 10) batch *= 2;
+    }
+
+    double ns_per_op = elapsed * 1e9 / iterations;
+    double mb_per_s = (double)bytes * iterations / elapsed / (1024 * 1024);
+    printf("%-28s %12ld ops %12.1f ns/op %10.1f MB/s\n", bc->name, iterations, ns_per_op, mb_per_s);
+}
+
+int main(int argc, char *argv[]) {
+    static const BenchCase cases[] = {
+        { "parse_manticore_response",  bench_parse_hits },
+        { "parse_manticore_escaped",   bench_parse_hits_escaped },
+        { "parse_manticore_match",     bench_parse_hits_match },
+        { "parse_manticore_match_miss", bench_parse_hits_match_miss },
+        { "parse_manticore_link_cache", bench_parse_hits_link_cache },
+        { "parse_manticore_empty",     bench_parse_empty },
+        { "json_append_escaped",       bench_json_append_escaped },
+        { "json_string_escape_into",   bench_json_string_escape },
+        { "url_encode_into",           bench_url_encode },
+        { "result_link_encode",        bench_result_link_encode },
+        { "result_link_cached",        bench_result_link_cached },
+        { "utf8_safe_truncate",        bench_utf8_truncate },
+        { "normalize_search_query",    bench_normalize_query },
+        { "template_render",           bench_template_render },
+        { "create_json_results",       bench_create_json_results },
+    };
+    double seconds = BENCH_DEFAULT_SECONDS;
+    const char *filter = NULL;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-t") == 0 && i + 1 < argc) {
+            seconds = atof(argv[++i]);
+        } else if (strcmp(argv[i], "-f") == 0 && i + 1 < argc) {
+            filter = argv[++i];
+        } else {
+            printf("Usage: %s [-t seconds_per_case] [-f name_filter]\n", argv[0]);
+            return strcmp(argv[i], "-h") == 0 ? 0 : 1;
+        }
+    }
+
+    load_config("config.yaml", &g_config);
+    query_rules_compile(&g_query_rules, &g_config);
+    /* 링크 캐시는 parse_manticore_link_cache에서만 켬 (나머지는 캐시 없이 인코딩 경로) */
+    link_cache_init(&g_link_cache, g_config.link_cache_bytes ? g_config.link_cache_bytes
+                                                             : DEFAULT_LINK_CACHE_BYTES);
+    g_link_cache.enabled = false;
+
+    BenchContext ctx;
+    memset(&ctx, 0, sizeof(ctx));
+    arena_init(&ctx.arena, ARENA_CHUNK_SIZE);
+    buffer_init(&ctx.out);
+    ctx.hits = bench_load_data("manticore_hits.json");
+    ctx.hits_escaped = bench_load_data("manticore_hits_escaped.json");
+    ctx.empty = bench_load_data("manticore_empty.json");
+
+    /* 결과 JSON/URL 인코딩 입력용으로 한 번 파싱해 둠 (별도 arena) */
+    Arena results_arena;
+    arena_init(&results_arena, ARENA_CHUNK_SIZE);
+    ctx.result_count = parse_manticore_response(&results_arena, &g_config, ctx.hits, MAX_RESULTS, NULL, ctx.results);
+    size_t longest_title = 0;
+    for (int i = 0; i < ctx.result_count; i++) {
+        size_t len = strlen(ctx.results[i].title);
+        if (len > longest_title) longest_title = len;
+    }
+    ctx.encode_buf = safe_malloc(longest_title * 3 + 1);
+
+    struct stat st;
+    char *template_text = load_file(g_config.template_file);
+    if (!template_text || stat(g_config.template_file, &st) != 0) {
+        fprintf(stderr, "[Bench] Cannot read template %s\n", g_config.template_file);
+        return 1;
+    }
+    ctx.tpl = template_compile(template_text, &st);
+
+    printf("[Bench] %d results parsed from recorded payload, %.2fs per case\n",
+           ctx.result_count, seconds);
+    for (size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); i++) {
+        if (filter && !strstr(cases[i].name, filter)) continue;
+        bench_run(&ctx, &cases[i], seconds);
+    }
+
+    template_release(ctx.tpl);
+    free(ctx.encode_buf);
+    arena_free(&results_arena);
+    arena_free(&ctx.arena);
+    buffer_free(&ctx.out);
+    free(ctx.hits);
+    free(ctx.hits_escaped);
+    free(ctx.empty);
+    return 0;
+}
@@ -12,6 +12,7 @@ import time
 # 서버 설정
 SERVER_URL = "http://localhost:7777"
 SEARCH_ENDPOINT = f"{SERVER_URL}/search"
+BATCH_ENDPOINT = f"{SERVER_URL}/search/batch"
 
 def test_basic_search():
     """기본 검색 테스트"""
@@ -190,6 +191,71 @@ def test_response_format():
         print(f"✗ 에러: {e}")
         return False
 
+def test_keep_alive():
+    """keep-alive 연결 재사용 테스트"""
+    print("\n" + "=" * 60)
+    print("테스트 6: keep-alive 연결 재사용")
+    print("-" * 60)
+
+    try:
+        with requests.Session() as session:
+            for i in range(3):
+                response = session.post(SEARCH_ENDPOINT, json={"query": "test", "count": 1}, timeout=5)
+                if response.status_code != 200:
+                    print(f"✗ 실패: {response.text}")
+                    return False
+                if response.headers.get('Connection', '').lower() != 'keep-alive':
+                    print(f"✗ Connection 헤더: {response.headers.get('Connection')}")
+                    return False
+                response.json()
+
+        print(f"✓ 한 연결에서 3개 요청 처리")
+        return True
+
+    except Exception as e:
+        print(f"✗ 에러: {e}")
+        return False
+
+def test_batch_search():
+    """배치 검색 테스트"""
+    print("\n" + "=" * 60)
+    print("테스트 7: POST /search/batch")
+    print("-" * 60)
+
+    payload = [
+        {"query": "MSX computer", "count": 2},
+        {"query": "test", "count": 1},
+        {"query": "", "count": 3}
+    ]
+
+    try:
+        response = requests.post(BATCH_ENDPOINT, json=payload, timeout=10)
+        if response.status_code != 200:
+            print(f"✗ 실패: {response.text}")
+            return False
+
+        data = response.json()
+        responses = data.get('responses', [])
+        print(f"  - responses 개수: {len(responses)}")
+        print(f"  - took_ms: {data.get('took_ms')}")
+        if data.get('count') != len(payload) or len(responses) != len(payload):
+            print(f"✗ 항목 수 불일치: {data.get('count')}")
+            return False
+        for entry, result in zip(payload, responses):
+            if 'results' not in result or len(result['results']) > entry['count']:
+                print(f"✗ 잘못된 항목 응답: {result}")
+                return False
+        if responses[2]['results']:
+            print(f"✗ 빈 쿼리 항목에 결과가 있음")
+            return False
+
+        print(f"✓ 항목마다 /search 형식 응답")
+        return True
+
+    except Exception as e:
+        print(f"✗ 에러: {e}")
+        return False
+
 def test_server_health():
     """서버 상태 확인"""
     print("=" * 60)
@@ -228,7 +294,9 @@ def main():
         ("queries 배열", test_queries_array),
         ("JSON 쿼리", test_json_query),
         ("빈 쿼리", test_empty_query),
-        ("응답 형식", test_response_format)
+        ("응답 형식", test_response_format),
+        ("keep-alive", test_keep_alive),
+        ("배치 검색", test_batch_search)
     ]
 
     results = []
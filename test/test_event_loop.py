@@ -0,0 +1,190 @@
+#!/usr/bin/env python3
+"""
+이벤트 루프 회귀 테스트 (stub Manticore + 임시 설정으로 서버를 직접 띄움)
+
+캐시 갱신 스레드와 합치기(single-flight)가 겹치는 순서를 io_mode마다 재현한다:
+  A: 캐시 미스 → Manticore (STUB_DELAY초)
+  B: soft_ttl이 지난 적중 → 바로 응답, 백그라운드 갱신 시작
+  C: ttl이 지난 미스 (갱신이 아직 진행 중)
+epoll/io_uring에서 C가 갱신 스레드를 선두로 기다리다 깨어나지 못하던 문제가 있었다.
+C가 제때 응답하고, 그 뒤에도 설정 다시 읽기(SIGHUP)와 종료가 멈추지 않는지 확인한다.
+
+사용법: make test-event-loop  (또는 python3 test/test_event_loop.py [io_mode ...])
+"""
+
+import http.server
+import json
+import os
+import signal
+import socket
+import subprocess
+import sys
+import tempfile
+import threading
+import time
+import urllib.request
+
+REPO = os.path.dirname(os.path.dirname(os.path.abspath(__file__)))
+SERVER = os.path.join(REPO, "LocalKnowledgeBase")
+HITS = os.path.join(REPO, "bench", "data", "manticore_hits.json")
+TEMPLATE = os.path.join(REPO, "rule_manticore.txt")
+
+STUB_DELAY = 2.5   # Manticore 응답 지연 (초)
+CACHE_TTL = 3
+CACHE_SOFT_TTL = 1
+REPLY_LIMIT = STUB_DELAY + 2.0  # C는 직접 검색해도 이 안에 응답해야 함
+
+CONFIG = """lkb:
+  listen: "127.0.0.1"
+  port: {port}
+  workers: 4
+  io_mode: "{mode}"
+  keepalive_timeout: 5
+
+engine:
+  type: "manticore"
+  url: "http://127.0.0.1:{stub_port}/search"
+  index_name: "wiki_main"
+  template_file: "{template}"
+  replace_return_url: "http://localhost/mediawiki/index.php/"
+  search_count: 5
+  first_byte_timeout_ms: 5000
+  timeout_ms: 8000
+  health_check_interval: 0
+  coalesce: true
+
+cache:
+  enabled: true
+  ttl: {ttl}
+  soft_ttl: {soft_ttl}
+
+log:
+  level: "INFO"
+"""
+
+
+class SlowManticore(http.server.BaseHTTPRequestHandler):
+    """POST마다 STUB_DELAY초 뒤 고정 결과"""
+    protocol_version = "HTTP/1.1"
+    body = b""
+
+    def do_POST(self):
+        self.rfile.read(int(self.headers.get("Content-Length", 0)))
+        time.sleep(STUB_DELAY)
+        self.send_response(200)
+        self.send_header("Content-Type", "application/json")
+        self.send_header("Content-Length", str(len(self.body)))
+        self.end_headers()
+        self.wfile.write(self.body)
+
+    def log_message(self, *args):
+        pass
+
+
+def free_port():
+    with socket.socket() as s:
+        s.bind(("127.0.0.1", 0))
+        return s.getsockname()[1]
+
+
+def search(port, query, timeout):
+    """(status, 걸린 초), 시간 초과면 status None"""
+    data = json.dumps({"query": query, "count": 3}).encode()
+    req = urllib.request.Request(f"http://127.0.0.1:{port}/search", data=data,
+                                 headers={"Content-Type": "application/json"})
+    start = time.monotonic()
+    try:
+        with urllib.request.urlopen(req, timeout=timeout) as resp:
+            resp.read()
+            return resp.status, time.monotonic() - start
+    except Exception:
+        return None, time.monotonic() - start
+
+
+def wait_for_log(path, text, timeout):
+    deadline = time.monotonic() + timeout
+    while time.monotonic() < deadline:
+        with open(path, errors="replace") as f:
+            if text in f.read():
+                return True
+        time.sleep(0.1)
+    return False
+
+
+def run_mode(mode, stub_port):
+    """한 io_mode로 A, B, C 순서를 재현, 실패 이유 목록 반환"""
+    failures = []
+    port = free_port()
+    workdir = tempfile.mkdtemp(prefix="lkb-test-")
+    config_path = os.path.join(workdir, "config.yaml")
+    log_path = os.path.join(workdir, "server.log")
+    with open(config_path, "w") as f:
+        f.write(CONFIG.format(port=port, mode=mode, stub_port=stub_port, template=TEMPLATE,
+                              ttl=CACHE_TTL, soft_ttl=CACHE_SOFT_TTL))
+
+    log = open(log_path, "w")
+    server = subprocess.Popen([SERVER], cwd=workdir, stdout=log, stderr=subprocess.STDOUT)
+    try:
+        if not wait_for_log(log_path, "Press Ctrl+C", 5):
+            return ["server did not start"]
+        time.sleep(0.3)
+
+        query = f"refresh race {mode}"
+        status, _ = search(port, query, STUB_DELAY + 3)      # A: 미스
+        if status != 200:
+            failures.append(f"A: status {status}")
+        time.sleep(CACHE_SOFT_TTL + 0.1)
+        status, took = search(port, query, 1.0)              # B: soft 적중, 갱신 시작
+        if status != 200 or took > 0.5:
+            failures.append(f"B: status {status} after {took:.2f}s (expected an instant cache hit)")
+        time.sleep(CACHE_TTL - CACHE_SOFT_TTL)
+        status, took = search(port, query, REPLY_LIMIT + 5)  # C: ttl 지남, 갱신 진행 중
+        if status != 200 or took > REPLY_LIMIT:
+            failures.append(f"C: status {status} after {took:.2f}s (limit {REPLY_LIMIT:.1f}s)")
+
+        # 기다리다 멈춘 요청이 스냅샷을 잡고 있으면 다시 읽기가 끝나지 않음
+        server.send_signal(signal.SIGHUP)
+        if not wait_for_log(log_path, "generation 2", 3):
+            failures.append("SIGHUP reload did not complete")
+    finally:
+        server.send_signal(signal.SIGINT)
+        try:
+            server.wait(timeout=10)
+        except subprocess.TimeoutExpired:
+            failures.append("server did not exit on SIGINT")
+            server.kill()
+            server.wait()
+        log.close()
+
+    if failures:
+        with open(log_path, errors="replace") as f:
+            print("".join(f.readlines()[-20:]))
+    return failures
+
+
+def main():
+    if not os.path.exists(SERVER):
+        print(f"✗ {SERVER} 가 없습니다 (make 먼저)")
+        sys.exit(1)
+    modes = sys.argv[1:] or ["threads", "epoll", "io_uring"]
+
+    with open(HITS, "rb") as f:
+        SlowManticore.body = f.read()
+    stub = http.server.ThreadingHTTPServer(("127.0.0.1", 0), SlowManticore)
+    stub.daemon_threads = True
+    threading.Thread(target=stub.serve_forever, daemon=True).start()
+
+    failed = 0
+    for mode in modes:
+        failures = run_mode(mode, stub.server_address[1])
+        if failures:
+            failed += 1
+            print(f"✗ {mode}: " + "; ".join(failures))
+        else:
+            print(f"✓ {mode}: refresh + coalesced miss answered, reload and shutdown ok")
+    stub.shutdown()
+    sys.exit(1 if failed else 0)
+
+
+if __name__ == "__main__":
+    main()
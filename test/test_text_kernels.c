@@ -0,0 +1,249 @@
+/*
+ * test_text_kernels - SIMD 텍스트 커널 차등 테스트
+ *
+ * 서버 소스를 include 해서 이 빌드에 들어 있는 커널(scalar/sse2/avx2/neon 중
+ * CPU가 지원하는 것)마다 JSON escape, URL 인코딩, UTF-8 자르기 결과를
+ * 커널 도입 전의 바이트 루프(ref_*)와 비교한다. 입력은 ASCII, escape 대상,
+ * 제어 문자, 한글, 잘못된 UTF-8을 섞은 무작위 문자열과, 특수 바이트 하나를
+ * 벡터 경계 근처 모든 위치에 둔 문자열.
+ *
+ * 사용법: make test-kernels  (또는 ./test/test_text_kernels [반복 횟수])
+ */
+
+#define LKB_NO_MAIN
+#include "../LocalKnowledgeBase.c"
+
+#define TEST_MAX_LEN 300
+
+static int g_failures = 0;
+
+/* ---- 비교 기준: 커널 도입 전 구현 ---- */
+
+size_t ref_url_encode_into(char *dst, const char *str) {
+    char *p = dst;
+    for (const char *s = str; *s; s++) {
+        unsigned char c = (unsigned char)*s;
+        if ((c >= 'A' && c <= 'Z') || (c >= 'a' && c <= 'z') ||
+            (c >= '0' && c <= '9') || c == '-' || c == '_' || c == '.' || c == '~') {
+            *p++ = c;
+        } else if (c == ' ') {
+            *p++ = '_';
+        } else {
+            static const char hex[] = "0123456789ABCDEF";
+            p[0] = '%';
+            p[1] = hex[c >> 4];
+            p[2] = hex[c & 0x0F];
+            p += 3;
+        }
+    }
+    *p = '\0';
+    return p - dst;
+}
+
+/* 이전 구현은 문자열 끝에 걸친 멀티바이트 문자를 NUL 너머까지 셌다.
+ * 새 구현은 잘린 문자로 보므로 기준도 max_bytes를 문자열 길이로 줄여 비교 */
+size_t ref_utf8_safe_truncate(const char *str, size_t max_bytes) {
+    size_t len = strlen(str);
+    if (max_bytes > len) max_bytes = len;
+    size_t pos = 0;
+    while (pos < max_bytes && str[pos] != '\0') {
+        unsigned char c = (unsigned char)str[pos];
+        if (c < 0x80) {
+            pos++;
+        } else if ((c & 0xE0) == 0xC0) {
+            if (pos + 2 <= max_bytes) pos += 2;
+            else break;
+        } else if ((c & 0xF0) == 0xE0) {
+            if (pos + 3 <= max_bytes) pos += 3;
+            else break;
+        } else if ((c & 0xF8) == 0xF0) {
+            if (pos + 4 <= max_bytes) pos += 4;
+            else break;
+        } else {
+            pos++;
+        }
+    }
+    return pos;
+}
+
+size_t ref_json_string_escaped_len(const char *str) {
+    size_t len = 0;
+    for (const unsigned char *p = (const unsigned char *)str; *p; p++) {
+        if (*p == '"' || *p == '\\' || *p == '\n' || *p == '\r' || *p == '\t' ||
+            *p == '\b' || *p == '\f') {
+            len += 2;
+        } else if (*p < 0x20) {
+            len += 6;
+        } else {
+            len++;
+        }
+    }
+    return len;
+}
+
+char* ref_json_string_escape_into(char *dst, const char *str) {
+    static const char hex[] = "0123456789abcdef";
+    for (const unsigned char *p = (const unsigned char *)str; *p; p++) {
+        switch (*p) {
+            case '"':  *dst++ = '\\'; *dst++ = '"'; break;
+            case '\\': *dst++ = '\\'; *dst++ = '\\'; break;
+            case '\n': *dst++ = '\\'; *dst++ = 'n'; break;
+            case '\r': *dst++ = '\\'; *dst++ = 'r'; break;
+            case '\t': *dst++ = '\\'; *dst++ = 't'; break;
+            case '\b': *dst++ = '\\'; *dst++ = 'b'; break;
+            case '\f': *dst++ = '\\'; *dst++ = 'f'; break;
+            default:
+                if (*p < 0x20) {
+                    memcpy(dst, "\\u00", 4);
+                    dst[4] = hex[*p >> 4];
+                    dst[5] = hex[*p & 0x0F];
+                    dst += 6;
+                } else {
+                    *dst++ = *p;
+                }
+                break;
+        }
+    }
+    return dst;
+}
+
+size_t ref_json_escaped_len(const char *str) {
+    size_t len = 0;
+    for (const char *p = str; *p; p++) {
+        len += (*p == '"' || *p == '\\') ? 2 : 1;
+    }
+    return len;
+}
+
+void ref_json_append_escaped(char *dst, const char *str) {
+    for (const char *src = str; *src; src++) {
+        switch (*src) {
+            case '\n': *dst++ = ' '; break;
+            case '\r': *dst++ = ' '; break;
+            case '\t': *dst++ = ' '; break;
+            case '"':  *dst++ = '\\'; *dst++ = '"'; break;
+            case '\\': *dst++ = '\\'; *dst++ = '\\'; break;
+            default:   *dst++ = *src; break;
+        }
+    }
+    *dst = '\0';
+}
+
+/* ---- 입력 생성 ---- */
+
+/* 여러 종류의 바이트를 섞은 문자열 (NUL 없음) */
+void test_random_text(char *buf, size_t len, unsigned int *seed) {
+    static const char *const pieces[] = {
+        "a", "Z", "0", "-", "_", ".", "~", " ", "\"", "\\", "\n", "\t", "\x01", "\x1f",
+        "%", "/", "한", "글", "é", "\xF0\x9F\x98\x80", "\x80", "\xC3", "\xFF",
+    };
+    size_t piece_count = sizeof(pieces) / sizeof(pieces[0]);
+    size_t pos = 0;
+    while (pos < len) {
+        /* 대부분은 평범한 ASCII 구간, 가끔 특수 조각 */
+        const char *piece;
+        char plain[2] = { (char)('a' + rand_r(seed) % 26), '\0' };
+        piece = (rand_r(seed) % 4) ? plain : pieces[rand_r(seed) % piece_count];
+        size_t piece_len = strlen(piece);
+        if (pos + piece_len > len) piece_len = len - pos;
+        memcpy(buf + pos, piece, piece_len);
+        pos += piece_len;
+    }
+    buf[len] = '\0';
+}
+
+/* ---- 비교 ---- */
+
+void test_fail(const char *kernels, const char *what, const char *input) {
+    if (g_failures++ < 10) {
+        fprintf(stderr, "[Test] FAIL %s %s: input \"", kernels, what);
+        for (const unsigned char *p = (const unsigned char *)input; *p; p++) {
+            if (*p >= 0x20 && *p < 0x7F) fputc(*p, stderr);
+            else fprintf(stderr, "\\x%02X", *p);
+        }
+        fprintf(stderr, "\"\n");
+    }
+}
+
+void test_compare(const char *kernels, const char *input, ByteBuffer *out) {
+    size_t len = strlen(input);
+    char *expected = safe_malloc(len * 6 + 1);
+    char *actual = safe_malloc(len * 6 + 1);
+
+    size_t expected_len = ref_url_encode_into(expected, input);
+    if (url_encode_into(actual, input) != expected_len || strcmp(expected, actual) != 0) {
+        test_fail(kernels, "url_encode_into", input);
+    }
+
+    for (size_t max = 0; max <= len + 1; max += (max < 40 ? 1 : 17)) {
+        if (utf8_safe_truncate(input, max) != ref_utf8_safe_truncate(input, max)) {
+            test_fail(kernels, "utf8_safe_truncate", input);
+            break;
+        }
+    }
+
+    if (json_string_escaped_len(input) != ref_json_string_escaped_len(input)) {
+        test_fail(kernels, "json_string_escaped_len", input);
+    }
+    char *expected_end = ref_json_string_escape_into(expected, input);
+    char *actual_end = json_string_escape_into(actual, input);
+    if (expected_end - expected != actual_end - actual ||
+        memcmp(expected, actual, expected_end - expected) != 0) {
+        test_fail(kernels, "json_string_escape_into", input);
+    }
+
+    size_t escaped_len = json_escaped_len(input);
+    if (escaped_len != ref_json_escaped_len(input)) {
+        test_fail(kernels, "json_escaped_len", input);
+    }
+    ref_json_append_escaped(expected, input);
+    out->len = 0;
+    json_append_escaped(out, input, escaped_len);
+    if (out->len != strlen(expected) || strcmp(out->data, expected) != 0) {
+        test_fail(kernels, "json_append_escaped", input);
+    }
+
+    free(expected);
+    free(actual);
+}
+
+int main(int argc, char *argv[]) {
+    int rounds = argc > 1 ? atoi(argv[1]) : 20000;
+    ByteBuffer out;
+    buffer_init(&out);
+    char input[TEST_MAX_LEN + 1];
+    static const char specials[] = "\"\\\n\x01 %\xC3\xED";
+
+    for (size_t k = 0; k < TEXT_KERNEL_SET_COUNT; k++) {
+        const TextKernels *kernels = TEXT_KERNEL_SETS[k];
+        if (!text_kernels_supported(kernels)) {
+            printf("[Test] %-6s skipped (not supported by this CPU)\n", kernels->name);
+            continue;
+        }
+        g_text = *kernels;
+        int failures_before = g_failures;
+
+        /* 특수 바이트 하나를 모든 위치에 (벡터 경계 앞뒤 포함) */
+        for (size_t len = 1; len <= 100; len++) {
+            for (size_t at = 0; at < len; at++) {
+                for (const char *c = specials; *c; c++) {
+                    memset(input, 'x', len);
+                    input[len] = '\0';
+                    input[at] = *c;
+                    test_compare(kernels->name, input, &out);
+                }
+            }
+        }
+
+        unsigned int seed = 12345;
+        for (int i = 0; i < rounds; i++) {
+            test_random_text(input, rand_r(&seed) % (TEST_MAX_LEN + 1), &seed);
+            test_compare(kernels->name, input, &out);
+        }
+
+        printf("[Test] %-6s %s\n", kernels->name, g_failures == failures_before ? "ok" : "FAILED");
+    }
+
+    buffer_free(&out);
+    return g_failures ? 1 : 0;
+}
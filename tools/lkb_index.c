@@ -0,0 +1,239 @@
+/*
+ * lkb-index - 제목 색인 빌드 (title_index.file)
+ *
+ * 서버 소스를 include 해서 서버와 같은 키 정규화(title_index_key)와 URL 인코딩
+ * (url_encode_into)으로 색인을 만든다. 입력은 Manticore에서 내보낸 페이지 제목과 본문,
+ * 한 줄에 하나:
+ *   - 제목만 있는 줄, 또는 탭으로 구분된 줄의 첫 칸 제목과 둘째 칸 본문 (mysql -N -B 출력)
+ *   - JSON 객체 줄의 "page_title"과 "old_text" 값 (JSON lines)
+ * 본문 앞부분 INDEX_SNIPPET_MAX 바이트를 스니펫으로 저장한다. 스니펫이 있는 제목만 서버가
+ * Manticore 없이 답하고, 없으면 Manticore 결과의 순서를 정하는 데만 쓴다.
+ * 키가 같은 제목은 처음 나온 것만 남긴다. 결과는 임시 파일에 쓴 뒤 rename 하므로
+ * 실행 중인 서버가 mmap한 이전 색인은 그대로 유효하다.
+ *
+ * 사용법: lkb-index [-o titles.idx] [내보낸 파일 ...]   (파일이 없으면 stdin)
+ * 예: mysql -h127.0.0.1 -P9306 -N -B \
+ *       -e "SELECT page_title, old_text FROM wiki_main LIMIT 10000000 OPTION max_matches=10000000" \
+ *       | ./lkb-index -o titles.idx
+ */
+
+#define LKB_NO_MAIN
+#include "../LocalKnowledgeBase.c"
+
+#define INDEX_DEFAULT_OUTPUT "titles.idx"
+#define INDEX_SNIPPET_MAX 1024  /* 저장하는 본문 앞부분 (서버는 engine.snippet_length로 다시 자름) */
+
+typedef struct {
+    char *key;
+    char *title;
+    char *snippet;  /* 본문이 없으면 "" */
+    size_t order;  /* 입력 순서 (키가 같으면 먼저 나온 제목) */
+} IndexEntry;
+
+typedef struct {
+    Arena arena;
+    IndexEntry *entries;
+    size_t count;
+    size_t cap;
+    size_t lines;
+} IndexBuilder;
+
+int index_entry_compare(const void *a, const void *b) {
+    const IndexEntry *x = a;
+    const IndexEntry *y = b;
+    int cmp = strcmp(x->key, y->key);
+    if (cmp != 0) return cmp;
+    return x->order < y->order ? -1 : (x->order > y->order);
+}
+
+/* 본문 앞부분을 스니펫으로 (arena): 공백 문자는 한 칸으로, INDEX_SNIPPET_MAX에서 UTF-8 안전하게 자름.
+ * batch_escapes면 mysql -B의 \n, \t, \\ 표기를 풀어 읽음 */
+char* index_snippet(Arena *arena, const char *text, bool batch_escapes) {
+    char *snippet = arena_alloc(arena, INDEX_SNIPPET_MAX + 1);
+    size_t len = 0;
+    bool space = true;  /* 앞 공백은 버림 */
+    for (const char *p = text; *p && len < INDEX_SNIPPET_MAX; p++) {
+        char c = *p;
+        if (batch_escapes && c == '\\' && p[1]) {
+            c = *++p;
+            if (c == 'n' || c == 't' || c == 'r' || c == '0') c = ' ';
+        }
+        if (c == '\n' || c == '\r' || c == '\t' || c == ' ') {
+            if (space) continue;
+            c = ' ';
+            space = true;
+        } else {
+            space = false;
+        }
+        snippet[len++] = c;
+    }
+    snippet[len] = '\0';
+    len = utf8_safe_truncate(snippet, len);
+    while (len > 0 && snippet[len - 1] == ' ') len--;
+    snippet[len] = '\0';
+    return snippet;
+}
+
+/* 내보낸 줄 하나에서 제목과 스니펫 추출 (arena), 제목이 없으면 NULL */
+char* index_line_title(Arena *arena, char *line, char **snippet) {
+    char *trimmed = trim_string(line);
+    *snippet = "";
+    if (trimmed[0] == '{') {
+        char *text = extract_json_string_value(arena, trimmed, "old_text");
+        if (text) *snippet = index_snippet(arena, text, false);
+        return extract_json_string_value(arena, trimmed, "page_title");
+    }
+
+    char *tab = strchr(trimmed, '\t');
+    if (tab) {
+        *tab = '\0';
+        char *end = strchr(tab + 1, '\t');
+        if (end) *end = '\0';
+        *snippet = index_snippet(arena, tab + 1, true);
+    }
+    return arena_strdup(arena, trim_string(trimmed));
+}
+
+void index_add(IndexBuilder *b, char *line) {
+    b->lines++;
+    char *snippet;
+    char *title = index_line_title(&b->arena, line, &snippet);
+    if (!title || title[0] == '\0') return;
+
+    if (b->count == b->cap) {
+        b->cap = b->cap ? b->cap * 2 : 65536;
+        b->entries = safe_realloc(b->entries, sizeof(IndexEntry) * b->cap);
+    }
+    IndexEntry *entry = &b->entries[b->count];
+    entry->title = title;
+    entry->snippet = snippet;
+    entry->key = arena_alloc(&b->arena, strlen(title) + 1);
+    title_index_key(entry->key, title);
+    entry->order = b->count++;
+}
+
+bool index_read(IndexBuilder *b, FILE *f) {
+    char *line = NULL;
+    size_t line_cap = 0;
+    while (getline(&line, &line_cap, f) >= 0) {
+        index_add(b, line);
+    }
+    bool ok = !ferror(f);
+    free(line);
+    return ok;
+}
+
+/* 정렬 + 중복 제거 후 TitleIndexHeader, 항목 위치 표, 문자열 순서로 기록 */
+bool index_write(IndexBuilder *b, const char *path) {
+    qsort(b->entries, b->count, sizeof(IndexEntry), index_entry_compare);
+    size_t unique = 0;
+    for (size_t i = 0; i < b->count; i++) {
+        if (unique > 0 && strcmp(b->entries[unique - 1].key, b->entries[i].key) == 0) continue;
+        b->entries[unique++] = b->entries[i];
+    }
+
+    size_t longest = 0;
+    size_t with_snippet = 0;
+    for (size_t i = 0; i < unique; i++) {
+        size_t len = strlen(b->entries[i].title);
+        if (len > longest) longest = len;
+        if (b->entries[i].snippet[0]) with_snippet++;
+    }
+    char *encoded = safe_malloc(longest * 3 + 1);
+    uint32_t *offsets = safe_malloc(sizeof(uint32_t) * (unique ? unique : 1));
+
+    size_t pos = sizeof(TitleIndexHeader) + sizeof(uint32_t) * unique;
+    for (size_t i = 0; i < unique; i++) {
+        if (pos > UINT32_MAX) {
+            fprintf(stderr, "[Index] Too many titles for one index file (over 4GB)\n");
+            free(encoded);
+            free(offsets);
+            return false;
+        }
+        offsets[i] = (uint32_t)pos;
+        IndexEntry *entry = &b->entries[i];
+        pos += strlen(entry->key) + 1 + strlen(entry->title) + 1 + url_encode_into(encoded, entry->title) + 1 +
+               strlen(entry->snippet) + 1;
+    }
+
+    char tmp_path[512];
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+    FILE *out = fopen(tmp_path, "wb");
+    if (!out) {
+        fprintf(stderr, "[Index] Cannot write %s: %s\n", tmp_path, strerror(errno));
+        free(encoded);
+        free(offsets);
+        return false;
+    }
+
+    TitleIndexHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, TITLE_INDEX_MAGIC, sizeof(header.magic));
+    header.count = (uint32_t)unique;
+    fwrite(&header, sizeof(header), 1, out);
+    fwrite(offsets, sizeof(uint32_t), unique, out);
+    for (size_t i = 0; i < unique; i++) {
+        IndexEntry *entry = &b->entries[i];
+        size_t encoded_len = url_encode_into(encoded, entry->title);
+        fwrite(entry->key, 1, strlen(entry->key) + 1, out);
+        fwrite(entry->title, 1, strlen(entry->title) + 1, out);
+        fwrite(encoded, 1, encoded_len + 1, out);
+        fwrite(entry->snippet, 1, strlen(entry->snippet) + 1, out);
+    }
+    free(encoded);
+    free(offsets);
+
+    if (fclose(out) != 0 || rename(tmp_path, path) != 0) {
+        fprintf(stderr, "[Index] Cannot write %s: %s\n", path, strerror(errno));
+        unlink(tmp_path);
+        return false;
+    }
+
+    printf("[Index] %zu lines, %zu titles (%zu with snippets, %zu duplicates dropped), %zu bytes -> %s\n",
+           b->lines, unique, with_snippet, b->count - unique, pos, path);
+    return true;
+}
+
+int main(int argc, char *argv[]) {
+    const char *output = INDEX_DEFAULT_OUTPUT;
+    int first_input = argc;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-o") == 0 && i + 1 < argc) {
+            output = argv[++i];
+        } else if (strcmp(argv[i], "-h") == 0 || strcmp(argv[i], "--help") == 0) {
+            printf("Usage: %s [-o output.idx] [export files...]\n", argv[0]);
+            printf("Reads one page title and text per line (tab-separated, or JSON lines with \"page_title\" and \"old_text\") from the files or stdin\n");
+            return 0;
+        } else {
+            first_input = i;
+            break;
+        }
+    }
+
+    text_kernels_init();
+
+    IndexBuilder builder;
+    memset(&builder, 0, sizeof(builder));
+    arena_init(&builder.arena, ARENA_CHUNK_SIZE);
+
+    bool ok = true;
+    if (first_input >= argc) {
+        ok = index_read(&builder, stdin);
+    }
+    for (int i = first_input; i < argc && ok; i++) {
+        FILE *f = fopen(argv[i], "r");
+        if (!f) {
+            fprintf(stderr, "[Index] Cannot read %s: %s\n", argv[i], strerror(errno));
+            ok = false;
+            break;
+        }
+        ok = index_read(&builder, f);
+        fclose(f);
+    }
+    if (ok) ok = index_write(&builder, output);
+
+    free(builder.entries);
+    arena_free(&builder.arena);
+    return ok ? 0 : 1;
+}